@@ -0,0 +1,152 @@
+/*
+ * Copyright (2021) Cobalt Speech and Language, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <luna_client.h>
+#include <luna_mock_server.h>
+#include <luna_request_arena.h>
+#include <new>
+#include <string>
+
+/*
+ * Counts the heap allocations made per synthesis request. Request
+ * building is measured both the way the client used to do it (copying
+ * the config into a new request) and with LunaRequestArena. The full
+ * synthesize() and synthesizeStream() calls are then measured against
+ * an in-process mock server. Only operator new calls made by the
+ * calling thread are counted, so the mock server's work is excluded,
+ * as are gRPC core's own C allocations.
+ */
+
+namespace
+{
+
+thread_local uint64_t allocations = 0;
+
+} // namespace
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+struct Result
+{
+    double allocsPerRequest;
+    double microsPerRequest;
+};
+
+// Runs the operation repeatedly, counting allocations and time.
+Result measure(unsigned int iterations, const std::function<void()> &op)
+{
+    // Warm up first so one-time allocations are not counted.
+    for (int i = 0; i < 10; i++)
+    {
+        op();
+    }
+
+    uint64_t start = allocations;
+    Timer timer;
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        op();
+    }
+    double seconds = timer.elapsed();
+    return {double(allocations - start) / iterations,
+            seconds * 1e6 / iterations};
+}
+
+void print(const std::string &name, const Result &r)
+{
+    std::cout << "  " << std::left << std::setw(26) << name << std::right
+              << std::fixed << std::setprecision(1) << std::setw(8)
+              << r.allocsPerRequest << " allocs" << std::setprecision(2)
+              << std::setw(12) << r.microsPerRequest << " us\n";
+}
+
+int main(int argc, char *argv[])
+{
+    size_t textLength = 40;
+    if (argc > 1)
+    {
+        textLength = std::strtoul(argv[1], nullptr, 10);
+    }
+    const unsigned int iterations = 2000;
+
+    // A voice ID long enough that copying it allocates.
+    cobaltspeech::luna::SynthesizerConfig config;
+    config.set_voice_id("en-US-mock-voice-standard");
+    config.set_encoding(cobaltspeech::luna::SynthesizerConfig::RAW_LINEAR16);
+    config.set_n_samples(4096);
+    std::string text(textLength, 'a');
+    size_t serialized = 0;
+
+    std::cout << "text length: " << textLength << "\n\n";
+    std::cout << "request building:\n";
+    print("copied config (before)", measure(iterations, [&]() {
+              cobaltspeech::luna::SynthesizeRequest request;
+              request.mutable_config()->CopyFrom(config);
+              request.set_text(text);
+              serialized += request.ByteSizeLong();
+          }));
+    print("LunaRequestArena (after)", measure(iterations, [&]() {
+              LunaRequestArena arena;
+              serialized += arena.build(config, text).ByteSizeLong();
+          }));
+    std::cout << std::endl;
+
+    // Everything below goes through gRPC, so the request itself is a
+    // small part of the total.
+    LunaMockConfig mockConfig;
+    mockConfig.voices[0].set_id(config.voice_id());
+    mockConfig.speed = 0;
+    LunaMockServer server(mockConfig);
+    LunaClient client(server.address(), false);
+    client.serverInfo();
+
+    std::cout << "per call, against the mock server:\n";
+    std::string audio;
+    print("synthesize()", measure(iterations / 4, [&]() {
+              client.synthesize(config, text, audio);
+          }));
+    print("synthesizeStream()", measure(iterations / 4, [&]() {
+              LunaSynthesizerStream stream =
+                  client.synthesizeStream(config, text);
+              while (stream.receiveAudio(audio))
+              {
+              }
+              stream.close();
+          }));
+    std::cout << std::endl;
+
+    return serialized > 0 ? 0 : 1;
+}
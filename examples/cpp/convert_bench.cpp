@@ -0,0 +1,241 @@
+/*
+ * Copyright (2021) Cobalt Speech and Language, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <luna_audio_converter.h>
+#include <string>
+#include <vector>
+
+/*
+ * Benchmarks the LunaAudioConverter kernels for each instruction set the
+ * CPU supports against the scalar reference, and checks that the
+ * vectorized results agree with the reference.
+ */
+
+const char *isaName(LunaAudioConverter::Isa isa)
+{
+    switch (isa)
+    {
+    case LunaAudioConverter::AVX2:
+        return "avx2";
+    case LunaAudioConverter::SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+// Returns a buffer of synthetic float audio in [-1, 1).
+std::vector<float> makeFloatAudio(size_t count)
+{
+    std::vector<float> audio(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        audio[i] = 0.9f * std::sin(0.01f * i) + 0.05f * std::sin(1.3f * i);
+    }
+
+    // A few out-of-range samples to exercise saturation.
+    audio[count / 3] = 1.5f;
+    audio[count / 2] = -1.5f;
+    return audio;
+}
+
+// Runs the operation repeatedly and returns millions of samples per second.
+double measure(size_t samples, const std::function<void()> &op)
+{
+    // Warm up the caches before timing.
+    op();
+
+    const int iterations = 50;
+    Timer timer;
+    for (int i = 0; i < iterations; i++)
+    {
+        op();
+    }
+    double seconds = timer.elapsed();
+    return samples * iterations / seconds / 1e6;
+}
+
+// Returns the largest absolute difference between two int16 buffers.
+int maxDiff(const std::vector<int16_t> &a, const std::vector<int16_t> &b)
+{
+    int diff = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        diff = std::max(diff, std::abs(int(a[i]) - int(b[i])));
+    }
+    return diff;
+}
+
+struct Result
+{
+    std::string name;
+    double rate;
+    bool ok;
+};
+
+std::vector<Result> runIsa(LunaAudioConverter::Isa isa, size_t count)
+{
+    LunaAudioConverter conv(isa);
+    LunaAudioConverter ref(LunaAudioConverter::SCALAR);
+    std::vector<float> source = makeFloatAudio(count);
+    std::vector<Result> results;
+
+    // float -> int16, no dither. Must match the reference exactly.
+    {
+        std::vector<int16_t> out(count), expected(count);
+        ref.floatToInt16(source.data(), expected.data(), count, false);
+        double rate = measure(count, [&]() {
+            conv.floatToInt16(source.data(), out.data(), count, false);
+        });
+        results.push_back({"float->int16", rate, out == expected});
+    }
+
+    // float -> int16 with TPDF dither. Must stay within 1 LSB of the
+    // undithered value.
+    {
+        std::vector<int16_t> out(count), expected(count);
+        ref.floatToInt16(source.data(), expected.data(), count, false);
+        double rate = measure(count, [&]() {
+            conv.floatToInt16(source.data(), out.data(), count, true);
+        });
+        results.push_back(
+            {"float->int16 dither", rate, maxDiff(out, expected) <= 1});
+    }
+
+    // int16 -> float. Must match the reference exactly.
+    {
+        std::vector<int16_t> pcm(count);
+        ref.floatToInt16(source.data(), pcm.data(), count, false);
+        std::vector<float> out(count), expected(count);
+        ref.int16ToFloat(pcm.data(), expected.data(), count);
+        double rate = measure(count, [&]() {
+            conv.int16ToFloat(pcm.data(), out.data(), count);
+        });
+        results.push_back({"int16->float", rate, out == expected});
+    }
+
+    // Gain on int16, saturating.
+    {
+        std::vector<int16_t> pcm(count);
+        ref.floatToInt16(source.data(), pcm.data(), count, false);
+        std::vector<int16_t> out(pcm), expected(pcm);
+        ref.applyGain(expected.data(), count, 1.7f);
+        conv.applyGain(out.data(), count, 1.7f);
+        bool ok = out == expected;
+        double rate = measure(count, [&]() {
+            out = pcm;
+            conv.applyGain(out.data(), count, 1.7f);
+        });
+        results.push_back({"gain int16", rate, ok});
+    }
+
+    // Gain on float.
+    {
+        std::vector<float> out(source);
+        double rate = measure(count, [&]() {
+            conv.applyGain(out.data(), count, 0.999f);
+        });
+        results.push_back({"gain float", rate, true});
+    }
+
+    // Peak detection.
+    {
+        float peak = 0.0f;
+        double rate = measure(
+            count, [&]() { peak = conv.peak(source.data(), count); });
+        results.push_back(
+            {"peak float", rate, peak == ref.peak(source.data(), count)});
+    }
+
+    // In place on a received chunk, the way an application would use it.
+    {
+        std::string chunk(reinterpret_cast<const char *>(source.data()),
+                          count * sizeof(float));
+        std::vector<int16_t> expected(count);
+        ref.floatToInt16(source.data(), expected.data(), count, false);
+        conv.floatToInt16(chunk, false);
+        bool ok = chunk.size() == count * sizeof(int16_t) &&
+                  std::memcmp(chunk.data(), expected.data(), chunk.size()) ==
+                      0;
+
+        std::string original(chunk);
+        conv.int16ToFloat(chunk);
+        std::vector<float> expectedFloat(count);
+        ref.int16ToFloat(expected.data(), expectedFloat.data(), count);
+        ok = ok && chunk.size() == count * sizeof(float) &&
+             std::memcmp(chunk.data(), expectedFloat.data(), chunk.size()) ==
+                 0;
+
+        double rate = measure(count, [&]() {
+            chunk = original;
+            conv.int16ToFloat(chunk);
+            conv.floatToInt16(chunk, false);
+        });
+        results.push_back({"in-place round trip", rate, ok});
+    }
+
+    return results;
+}
+
+int main(int argc, char *argv[])
+{
+    // An odd count exercises the scalar tails of the vector kernels.
+    size_t count = 1 << 20;
+    if (argc > 1)
+    {
+        count = std::strtoul(argv[1], nullptr, 10);
+    }
+    count = std::max<size_t>(count, 16) + 7;
+
+    LunaAudioConverter::Isa best = LunaAudioConverter::detectIsa();
+    std::cout << "samples per run: " << count << "\n";
+    std::cout << "best supported instruction set: " << isaName(best) << "\n\n";
+
+    std::vector<Result> scalar = runIsa(LunaAudioConverter::SCALAR, count);
+    bool allOk = true;
+    for (int isa = LunaAudioConverter::SCALAR; isa <= best; isa++)
+    {
+        std::vector<Result> results =
+            isa == LunaAudioConverter::SCALAR
+                ? scalar
+                : runIsa(static_cast<LunaAudioConverter::Isa>(isa), count);
+
+        std::cout << isaName(static_cast<LunaAudioConverter::Isa>(isa))
+                  << ":\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const Result &r = results[i];
+            allOk = allOk && r.ok;
+            std::cout << "  " << std::left << std::setw(22) << r.name
+                      << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(10) << r.rate << " Msamples/s"
+                      << std::setprecision(2) << std::setw(8)
+                      << r.rate / scalar[i].rate << "x"
+                      << (r.ok ? "" : "  MISMATCH") << "\n";
+        }
+        std::cout << std::endl;
+    }
+
+    return allOk ? 0 : 1;
+}
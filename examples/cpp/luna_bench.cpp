@@ -0,0 +1,636 @@
+/*
+ * Copyright (2021) Cobalt Speech and Language, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <luna_audio.h>
+#include <luna_client_pool.h>
+#include <luna_mock_server.h>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * luna-bench measures client throughput and latency against a Luna
+ * server. It runs every combination of the configured concurrency
+ * levels, text lengths, encodings and n_samples values, and reports
+ * throughput, time to first audio, latency percentiles and the real
+ * time factor (synthesis time divided by audio duration, so values
+ * below 1 are faster than real time). Results can also be written as
+ * JSON to track regressions between releases.
+ *
+ * With -mock, the benchmark runs against an in-process LunaMockServer
+ * instead, so client performance can be measured offline.
+ */
+
+struct BenchOptions
+{
+    std::string server = "localhost:9001";
+    bool secure = false;
+    std::string voice;
+    unsigned int channels = 1;
+    unsigned int requests = 20;
+    unsigned int warmup = 1;
+    std::vector<unsigned int> concurrency = {1, 4, 16};
+    std::vector<unsigned int> textLengths = {40, 200, 1000};
+    std::vector<cobaltspeech::luna::SynthesizerConfig::AudioEncoding>
+        encodings = {cobaltspeech::luna::SynthesizerConfig::RAW_LINEAR16};
+    std::vector<unsigned int> nSamples = {0};
+    std::string jsonPath;
+    std::string metricsPath;
+    bool mock = false;
+    LunaMockConfig mockConfig;
+};
+
+// The measurements from a single request.
+struct Sample
+{
+    bool ok = false;
+    double ttfa = 0;
+    double latency = 0;
+    size_t audioBytes = 0;
+};
+
+// Summary statistics for one set of measurements.
+struct Distribution
+{
+    double mean = 0;
+    double p50 = 0;
+    double p95 = 0;
+    double p99 = 0;
+};
+
+// The results for one combination of benchmark parameters.
+struct BenchResult
+{
+    unsigned int concurrency;
+    unsigned int textLength;
+    cobaltspeech::luna::SynthesizerConfig::AudioEncoding encoding;
+    unsigned int nSamples;
+    size_t requests;
+    size_t failures;
+    double wallSeconds;
+    double requestsPerSecond;
+    double audioSecondsPerSecond;
+    Distribution ttfaMs;
+    Distribution latencyMs;
+    Distribution rtf;
+};
+
+void printHelp(const char *appName)
+{
+    std::cout
+        << "USAGE: " << appName << " [options]\n\n"
+        << "  -server <addr>        Luna server address "
+           "(Default=\"localhost:9001\")\n"
+           "  -secure               Use a TLS connection\n"
+           "  -voice <id>           Voice to use (Default=first voice)\n"
+           "  -channels <n>         Number of channels (Default=1)\n"
+           "  -requests <n>         Requests per combination "
+           "(Default=20)\n"
+           "  -warmup <n>           Untimed requests per combination "
+           "(Default=1)\n"
+           "  -concurrency <list>   Concurrent requests "
+           "(Default=1,4,16)\n"
+           "  -text-lengths <list>  Text lengths in characters "
+           "(Default=40,200,1000)\n"
+           "  -encodings <list>     linear16 and/or float32 "
+           "(Default=linear16)\n"
+           "  -n-samples <list>     Samples per streamed response "
+           "(Default=0)\n"
+           "  -json <path>          Write the results as JSON\n"
+           "  -metrics <path>       Write the client's request metrics\n"
+           "  -mock                 Run against an in-process mock server\n"
+           "  -mock-speed <x>       Mock synthesis speed, times real time "
+           "(Default=20)\n"
+           "  -mock-first-chunk-ms <ms>\n"
+           "                        Mock delay before the first chunk "
+           "(Default=0)\n"
+           "  --help                show this help message\n"
+        << std::endl;
+}
+
+std::vector<unsigned int> parseList(const std::string &value)
+{
+    std::vector<unsigned int> list;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        list.push_back(std::strtoul(item.c_str(), nullptr, 10));
+    }
+    return list;
+}
+
+std::vector<cobaltspeech::luna::SynthesizerConfig::AudioEncoding>
+parseEncodings(const std::string &value)
+{
+    std::vector<cobaltspeech::luna::SynthesizerConfig::AudioEncoding> list;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (item == "linear16" || item == "RAW_LINEAR16")
+        {
+            list.push_back(
+                cobaltspeech::luna::SynthesizerConfig::RAW_LINEAR16);
+        }
+        else if (item == "float32" || item == "RAW_FLOAT32")
+        {
+            list.push_back(cobaltspeech::luna::SynthesizerConfig::RAW_FLOAT32);
+        }
+        else
+        {
+            throw std::runtime_error("unknown encoding: " + item);
+        }
+    }
+    return list;
+}
+
+/*
+ * Parse the command line arguments. Returns true if parsing was
+ * successful and false if the application should exit.
+ */
+bool parseCLIArgs(int argc, char *argv[], BenchOptions &opts)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--help")
+        {
+            printHelp(argv[0]);
+            return false;
+        }
+        else if (arg == "-secure")
+        {
+            opts.secure = true;
+            continue;
+        }
+        else if (arg == "-mock")
+        {
+            opts.mock = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::cerr << "missing value for " << arg << std::endl;
+            return false;
+        }
+
+        std::string value = argv[++i];
+        if (arg == "-server")
+        {
+            opts.server = value;
+        }
+        else if (arg == "-voice")
+        {
+            opts.voice = value;
+        }
+        else if (arg == "-channels")
+        {
+            opts.channels = std::max(1ul, std::strtoul(value.c_str(), 0, 10));
+        }
+        else if (arg == "-requests")
+        {
+            opts.requests = std::max(1ul, std::strtoul(value.c_str(), 0, 10));
+        }
+        else if (arg == "-warmup")
+        {
+            opts.warmup = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "-concurrency")
+        {
+            opts.concurrency = parseList(value);
+        }
+        else if (arg == "-text-lengths")
+        {
+            opts.textLengths = parseList(value);
+        }
+        else if (arg == "-encodings")
+        {
+            opts.encodings = parseEncodings(value);
+        }
+        else if (arg == "-n-samples")
+        {
+            opts.nSamples = parseList(value);
+        }
+        else if (arg == "-json")
+        {
+            opts.jsonPath = value;
+        }
+        else if (arg == "-metrics")
+        {
+            opts.metricsPath = value;
+        }
+        else if (arg == "-mock-speed")
+        {
+            opts.mockConfig.speed = std::atof(value.c_str());
+        }
+        else if (arg == "-mock-first-chunk-ms")
+        {
+            opts.mockConfig.firstChunkDelayMs =
+                std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else
+        {
+            std::cerr << "unknown argument: " << arg << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Returns text of the given length, made of whole words where possible.
+std::string makeText(unsigned int length)
+{
+    static const std::string sentence =
+        "The quick brown fox jumps over the lazy dog. ";
+    std::string text;
+    while (text.size() < length)
+    {
+        text += sentence;
+    }
+    text.resize(length);
+    return text;
+}
+
+// Summarize a set of values using nearest-rank percentiles.
+Distribution summarize(std::vector<double> values)
+{
+    Distribution d;
+    if (values.empty())
+    {
+        return d;
+    }
+
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (double v : values)
+    {
+        sum += v;
+    }
+    d.mean = sum / values.size();
+
+    auto rank = [&](double p) {
+        size_t n = static_cast<size_t>(p * values.size() + 0.999999);
+        return values[std::min(values.size(), std::max<size_t>(n, 1)) - 1];
+    };
+    d.p50 = rank(0.50);
+    d.p95 = rank(0.95);
+    d.p99 = rank(0.99);
+    return d;
+}
+
+// Run a single streaming request and record its timings.
+Sample runRequest(LunaClientPool &pool,
+                  const cobaltspeech::luna::SynthesizerConfig &config,
+                  const std::string &text)
+{
+    Sample s;
+    Timer timer;
+    try
+    {
+        LunaSynthesizerStream stream = pool.synthesizeStream(config, text);
+        std::string audio;
+        while (stream.receiveAudio(audio))
+        {
+            if (s.audioBytes == 0 && !audio.empty())
+            {
+                s.ttfa = timer.elapsed();
+            }
+            s.audioBytes += audio.size();
+        }
+        stream.close();
+        s.latency = timer.elapsed();
+        s.ok = true;
+    }
+    catch (const std::exception &err)
+    {
+        s.latency = timer.elapsed();
+    }
+    return s;
+}
+
+BenchResult runCombination(LunaClientPool &pool, const BenchOptions &opts,
+                           const std::string &voice, unsigned int sampleRate,
+                           unsigned int concurrency, unsigned int textLength,
+                           cobaltspeech::luna::SynthesizerConfig::AudioEncoding
+                               encoding,
+                           unsigned int nSamples)
+{
+    cobaltspeech::luna::SynthesizerConfig config;
+    config.set_voice_id(voice);
+    config.set_encoding(encoding);
+    config.set_n_samples(nSamples);
+    std::string text = makeText(textLength);
+
+    for (unsigned int i = 0; i < opts.warmup; i++)
+    {
+        runRequest(pool, config, text);
+    }
+
+    // Each worker takes the next request until they have all been sent,
+    // so there are always `concurrency` requests in flight.
+    size_t total = std::max<size_t>(opts.requests, concurrency);
+    std::vector<Sample> samples(total);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+
+    Timer wall;
+    for (unsigned int w = 0; w < concurrency; w++)
+    {
+        workers.emplace_back([&]() {
+            size_t i;
+            while ((i = next++) < total)
+            {
+                samples[i] = runRequest(pool, config, text);
+            }
+        });
+    }
+    for (std::thread &t : workers)
+    {
+        t.join();
+    }
+
+    BenchResult r;
+    r.concurrency = concurrency;
+    r.textLength = textLength;
+    r.encoding = encoding;
+    r.nSamples = nSamples;
+    r.requests = total;
+    r.wallSeconds = wall.elapsed();
+
+    double bytesPerSecond =
+        static_cast<double>(sampleRate) * lunaBytesPerSample(encoding);
+    std::vector<double> ttfa, latency, rtf;
+    double audioSeconds = 0;
+    r.failures = 0;
+    for (const Sample &s : samples)
+    {
+        if (!s.ok)
+        {
+            r.failures++;
+            continue;
+        }
+
+        double duration = s.audioBytes / bytesPerSecond;
+        audioSeconds += duration;
+        ttfa.push_back(s.ttfa * 1000.0);
+        latency.push_back(s.latency * 1000.0);
+        if (duration > 0)
+        {
+            rtf.push_back(s.latency / duration);
+        }
+    }
+
+    r.requestsPerSecond = (total - r.failures) / r.wallSeconds;
+    r.audioSecondsPerSecond = audioSeconds / r.wallSeconds;
+    r.ttfaMs = summarize(ttfa);
+    r.latencyMs = summarize(latency);
+    r.rtf = summarize(rtf);
+    return r;
+}
+
+std::string jsonString(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+    }
+    return out + "\"";
+}
+
+void writeDistribution(std::ostream &out, const char *name,
+                       const Distribution &d)
+{
+    out << "\"" << name << "\": {\"mean\": " << d.mean
+        << ", \"p50\": " << d.p50 << ", \"p95\": " << d.p95
+        << ", \"p99\": " << d.p99 << "}";
+}
+
+void writeJSON(const std::string &path, const BenchOptions &opts,
+               const std::string &version, const std::string &voice,
+               unsigned int sampleRate,
+               const std::vector<BenchResult> &results)
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        throw std::runtime_error("could not open " + path);
+    }
+
+    out << std::setprecision(6);
+    out << "{\n"
+        << "  \"timestamp\": " << std::time(nullptr) << ",\n"
+        << "  \"server\": " << jsonString(opts.server) << ",\n"
+        << "  \"server_version\": " << jsonString(version) << ",\n"
+        << "  \"mock\": " << (opts.mock ? "true" : "false") << ",\n"
+        << "  \"voice\": " << jsonString(voice) << ",\n"
+        << "  \"sample_rate\": " << sampleRate << ",\n"
+        << "  \"channels\": " << opts.channels << ",\n"
+        << "  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"concurrency\": "
+            << r.concurrency << ", \"text_length\": " << r.textLength
+            << ", \"encoding\": "
+            << jsonString(
+                   cobaltspeech::luna::SynthesizerConfig::AudioEncoding_Name(
+                       r.encoding))
+            << ", \"n_samples\": " << r.nSamples
+            << ", \"requests\": " << r.requests
+            << ", \"failures\": " << r.failures
+            << ", \"wall_seconds\": " << r.wallSeconds
+            << ", \"requests_per_second\": " << r.requestsPerSecond
+            << ", \"audio_seconds_per_second\": " << r.audioSecondsPerSecond
+            << ",\n     ";
+        writeDistribution(out, "ttfa_ms", r.ttfaMs);
+        out << ",\n     ";
+        writeDistribution(out, "latency_ms", r.latencyMs);
+        out << ",\n     ";
+        writeDistribution(out, "rtf", r.rtf);
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions opts;
+    try
+    {
+        if (!parseCLIArgs(argc, argv, opts))
+        {
+            return 0;
+        }
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << "error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        std::unique_ptr<LunaMockServer> mock;
+        if (opts.mock)
+        {
+            mock.reset(new LunaMockServer(opts.mockConfig));
+            opts.server = mock->address();
+            opts.secure = false;
+        }
+
+        std::shared_ptr<LunaMetrics> metrics;
+        if (!opts.metricsPath.empty())
+        {
+            metrics = std::make_shared<LunaMetrics>();
+        }
+
+        LunaClientPool pool(opts.server, opts.secure, opts.channels,
+                            LunaClientPool::LEAST_OUTSTANDING, metrics);
+
+        // Connect every channel before measuring, so no sample pays
+        // for a connection handshake.
+        std::shared_ptr<const LunaServerInfo> info = pool.warmUp().get();
+        const std::string &version = info->version();
+
+        // Find the voice and its sample rate, which is needed to turn
+        // audio bytes into durations.
+        const LunaVoice *voice = nullptr;
+        for (const LunaVoice &v : info->voices())
+        {
+            if (opts.voice.empty() || v.id() == opts.voice)
+            {
+                voice = &v;
+                break;
+            }
+        }
+        if (!voice)
+        {
+            std::cerr << "error: voice not found" << std::endl;
+            return 1;
+        }
+
+        std::cout << version << "\n"
+                  << "voice: " << voice->id() << " (" << voice->sampleRate()
+                  << " Hz), channels: " << opts.channels << "\n"
+                  << "times in milliseconds, audio/s in seconds of audio per "
+                     "second\n\n";
+        std::cout << std::left << std::setw(6) << "conc" << std::setw(7)
+                  << "chars" << std::setw(14) << "encoding" << std::setw(8)
+                  << "n_samp" << std::right << std::setw(9) << "req/s"
+                  << std::setw(9) << "audio/s" << std::setw(10) << "ttfa50"
+                  << std::setw(10) << "ttfa99" << std::setw(10) << "lat50"
+                  << std::setw(10) << "lat95" << std::setw(10) << "lat99"
+                  << std::setw(8) << "rtf" << std::setw(6) << "fail"
+                  << std::endl;
+
+        std::vector<BenchResult> results;
+        for (unsigned int concurrency : opts.concurrency)
+        {
+            for (unsigned int length : opts.textLengths)
+            {
+                for (auto encoding : opts.encodings)
+                {
+                    for (unsigned int nSamples : opts.nSamples)
+                    {
+                        BenchResult r = runCombination(
+                            pool, opts, voice->id(), voice->sampleRate(),
+                            concurrency, length, encoding, nSamples);
+                        results.push_back(r);
+
+                        std::cout
+                            << std::left << std::setw(6) << r.concurrency
+                            << std::setw(7) << r.textLength << std::setw(14)
+                            << cobaltspeech::luna::SynthesizerConfig::
+                                   AudioEncoding_Name(r.encoding)
+                            << std::setw(8) << r.nSamples << std::right
+                            << std::fixed << std::setprecision(1)
+                            << std::setw(9) << r.requestsPerSecond
+                            << std::setw(9) << r.audioSecondsPerSecond
+                            << std::setw(10) << r.ttfaMs.p50 << std::setw(10)
+                            << r.ttfaMs.p99 << std::setw(10)
+                            << r.latencyMs.p50 << std::setw(10)
+                            << r.latencyMs.p95 << std::setw(10)
+                            << r.latencyMs.p99 << std::setprecision(3)
+                            << std::setw(8) << r.rtf.mean << std::setw(6)
+                            << r.failures << std::endl;
+                    }
+                }
+            }
+        }
+
+        if (!opts.jsonPath.empty())
+        {
+            writeJSON(opts.jsonPath, opts, version, voice->id(),
+                      voice->sampleRate(), results);
+            std::cout << "\nwrote " << opts.jsonPath << std::endl;
+        }
+
+        if (metrics)
+        {
+            std::ofstream out(opts.metricsPath);
+            out << metrics->exposition();
+            std::cout << "wrote " << opts.metricsPath << std::endl;
+        }
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << "error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
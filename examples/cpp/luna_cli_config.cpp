@@ -55,10 +55,15 @@ LunaCLIConfig LunaCLIConfig::parseFile(const std::string &file)
 
     config.mPlaybackCmd = playApp + " " + playArgs;
 
+    // The read-ahead depth is optional
+    config.mReadAheadMs =
+        toml->get_qualified_as<unsigned int>("Playback.ReadAheadMs")
+            .value_or(200);
+
     return config;
 }
 
-LunaCLIConfig::LunaCLIConfig() {}
+LunaCLIConfig::LunaCLIConfig() : mReadAheadMs(200) {}
 LunaCLIConfig::~LunaCLIConfig() {}
 
 bool LunaCLIConfig::streaming() const { return mStreaming; }
@@ -73,3 +78,5 @@ bool LunaCLIConfig::lunaServerInsecure() const { return mLunaInsecure; }
 const std::string &LunaCLIConfig::voiceID() const { return mVoiceID; }
 
 const std::string &LunaCLIConfig::playbackCmd() const { return mPlaybackCmd; }
+
+unsigned int LunaCLIConfig::readAheadMs() const { return mReadAheadMs; }
@@ -47,12 +47,17 @@ public:
     // Returns the playback command (with args)
     const std::string &playbackCmd() const;
 
+    // Returns how much audio (in milliseconds) to buffer ahead of the
+    // player when streaming
+    unsigned int readAheadMs() const;
+
 private:
     bool mStreaming;
     std::string mLunaAddress;
     bool mLunaInsecure;
     std::string mVoiceID;
     std::string mPlaybackCmd;
+    unsigned int mReadAheadMs;
 };
 
 #endif // LUNA_CLI_CONFIG_H
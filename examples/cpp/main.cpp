@@ -18,10 +18,13 @@
 #include "player.h"
 #include "timer.h"
 
+#include <algorithm>
 #include <exception>
 #include <iostream>
 #include <luna_client.h>
+#include <luna_read_ahead_buffer.h>
 #include <string>
+#include <vector>
 
 // Prints the help message
 void printHelp(const char *appName)
@@ -70,13 +73,14 @@ bool parseCLIArgs(int argc, char *argv[], std::string &configFile)
 
 void synthesizeBatch(const std::string &userInput, LunaClient &client,
                      const cobaltspeech::luna::SynthesizerConfig &synthConfig,
-                     const std::string &playbackCmd)
+                     Player &player, unsigned int bytesPerSecond)
 {
-    Player player(playbackCmd);
     Timer timer;
+    Timer endToEnd;
 
     // Call the batch synthesis method
-    ByteVector audio = client.synthesize(synthConfig, userInput);
+    std::string audio;
+    client.synthesize(synthConfig, userInput, audio);
 
     double synthDuration = timer.elapsed();
     std::cout << "batch synthesis took " << synthDuration << " seconds."
@@ -84,35 +88,47 @@ void synthesizeBatch(const std::string &userInput, LunaClient &client,
 
     // Play the result
     timer.restart();
-    player.batchPlay(audio);
+    player.batchPlay(audio.data(), audio.size());
 
     // Print how long this method took
     double playDuration = timer.elapsed();
     std::cout << "playback took " << playDuration << " seconds.\n";
-
-    double rtf = playDuration / synthDuration;
+    std::cout << "end-to-end latency (until playout finished): "
+              << endToEnd.elapsed() << " seconds.\n";
+
+    // The real time factor is the time it took to synthesize the audio
+    // divided by the duration of the audio, so values below 1 mean
+    // synthesis is faster than real time.
+    double audioDuration = double(audio.size()) / bytesPerSecond;
+    double rtf = synthDuration / audioDuration;
     std::cout << "real time factor: " << rtf << "\n" << std::endl;
 }
 
 void synthesizeStream(const std::string &userInput, LunaClient &client,
                       const cobaltspeech::luna::SynthesizerConfig &synthConfig,
-                      const std::string &playbackCmd)
+                      Player &player, size_t readAheadBytes,
+                      unsigned int bytesPerSecond)
 {
-    Player player(playbackCmd);
     Timer timer;
 
-    // Start the player application
-    player.start();
-
-    // Setup the synthesis stream
-    LunaSynthesizerStream stream =
-        client.synthesizeStream(synthConfig, userInput);
+    // Receive audio on a separate thread so that network reads and
+    // writes to the player don't hold each other up. Playback starts
+    // once the read-ahead depth has been buffered.
+    LunaReadAheadBuffer buffer(std::max<size_t>(4 * readAheadBytes, 65536),
+                               readAheadBytes);
+    buffer.start(client.synthesizeStream(synthConfig, userInput));
 
-    // Write binary data as it comes from the stream to the player
+    // Write binary data as it comes from the buffer to the player, which
+    // is restarted if writing to it failed for an earlier utterance
+    player.start();
     bool firstResponse = true;
-    ByteVector audio;
-    while (stream.receiveAudio(audio))
+    std::vector<char> audio(4096);
+    size_t n = 0;
+    size_t totalBytes = 0;
+    while ((n = buffer.read(audio.data(), audio.size())) > 0)
     {
+        totalBytes += n;
+
         if (firstResponse)
         {
             firstResponse = false;
@@ -124,15 +140,24 @@ void synthesizeStream(const std::string &userInput, LunaClient &client,
         }
 
         // Play the current samples
-        player.pushAudio(audio);
+        player.pushAudio(audio.data(), n);
     }
-    stream.close();
-
-    // Stop the player application
-    player.stop();
+    buffer.close();
 
     // Print how long this method took
-    std::cout << "streaming synthesis took " << timer.elapsed() << " seconds.\n"
+    double synthDuration = timer.elapsed();
+    std::cout << "streaming synthesis took " << synthDuration
+              << " seconds.\n";
+    double audioDuration = double(totalBytes) / bytesPerSecond;
+    std::cout << "real time factor: " << synthDuration / audioDuration
+              << "\n";
+
+    // Wait for the audio to finish playing before showing the prompt again
+    player.waitForPlayout();
+    std::cout << "end-to-end latency (until playout finished): "
+              << timer.elapsed() << " seconds.\n";
+    std::cout << "read-ahead underruns: " << buffer.underruns()
+              << ", overruns: " << buffer.overruns() << "\n"
               << std::endl;
 }
 
@@ -165,15 +190,21 @@ int main(int argc, char *argv[])
     // Setup the Luna client
     LunaClient client(config.lunaServerAddress(), !config.lunaServerInsecure());
 
-    // Get the Luna server version
-    std::cout << client.lunaVersion() << std::endl;
+    // Get the Luna server version and voices
+    std::shared_ptr<const LunaServerInfo> info = client.serverInfo();
+    std::cout << info->version() << std::endl;
     std::cout << "Connected to " << config.lunaServerAddress() << std::endl;
 
-    // Get the list of available voice models
+    // Show the list of available voice models
     std::cout << "Available voices:\n";
-    std::vector<LunaVoice> voices = client.listVoices();
-    for (const LunaVoice &v : voices)
+    unsigned int sampleRate = 16000;
+    for (const LunaVoice &v : info->voices())
     {
+        if (v.id() == config.voiceID())
+        {
+            sampleRate = v.sampleRate();
+        }
+
         std::cout << "  ID: " << v.id() << "  Name: " << v.name()
                   << "  Sample Rate(Hz): " << v.sampleRate()
                   << "  Language: " << v.language() << "\n";
@@ -186,6 +217,18 @@ int main(int argc, char *argv[])
     synthConfig.set_encoding(
         cobaltspeech::luna::SynthesizerConfig::RAW_LINEAR16);
 
+    size_t readAheadBytes = LunaReadAheadBuffer::bytesForDuration(
+        config.readAheadMs(), sampleRate, synthConfig.encoding());
+
+    unsigned int bytesPerSecond =
+        sampleRate *
+        LunaReadAheadBuffer::bytesForSamples(1, synthConfig.encoding());
+
+    // Start the player application once; it stays open for every
+    // utterance.
+    Player player(config.playbackCmd(), bytesPerSecond);
+    player.start();
+
     // Start the main loop
     std::cout << "Enter text to synthesize at the prompt. ";
     std::cout << "To exit, use Ctrl+D.\n" << std::endl;
@@ -208,13 +251,13 @@ int main(int argc, char *argv[])
         // Synthesize the text
         if (config.streaming())
         {
-            synthesizeStream(userInput, client, synthConfig,
-                             config.playbackCmd());
+            synthesizeStream(userInput, client, synthConfig, player,
+                             readAheadBytes, bytesPerSecond);
         }
         else
         {
-            synthesizeBatch(userInput, client, synthConfig,
-                            config.playbackCmd());
+            synthesizeBatch(userInput, client, synthConfig, player,
+                            bytesPerSecond);
         }
     }
 
@@ -0,0 +1,113 @@
+/*
+ * Copyright (2021) Cobalt Speech and Language, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <luna_mock_server.h>
+#include <string>
+
+/*
+ * luna-mock-server runs a LunaMockServer as a standalone process, so
+ * luna-cli, luna-bench or any other client can be pointed at it.
+ */
+
+void printHelp(const char *appName)
+{
+    std::cout << "USAGE: " << appName << " [options]\n\n"
+              << "  -address <addr>       Listening address "
+                 "(Default=\"127.0.0.1:9001\")\n"
+                 "  -speed <x>            Times faster than real time, 0 "
+                 "for instant (Default=20)\n"
+                 "  -first-chunk-ms <ms>  Delay before the first chunk "
+                 "(Default=0)\n"
+                 "  -chunk-samples <n>    Samples per chunk when n_samples "
+                 "is 0 (Default=4096)\n"
+                 "  -sample-rate <hz>     Sample rate of the mock voice "
+                 "(Default=16000)\n"
+                 "  -fail-every <n>       Fail every nth synthesis request "
+                 "(Default=0, never)\n"
+                 "  -fail-after <n>       Chunks sent before a stream fails "
+                 "(Default=0)\n"
+                 "  --help                show this help message\n"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    LunaMockConfig config;
+    std::string address = "127.0.0.1:9001";
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--help" || i + 1 >= argc)
+        {
+            printHelp(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+
+        std::string value = argv[++i];
+        if (arg == "-address")
+        {
+            address = value;
+        }
+        else if (arg == "-speed")
+        {
+            config.speed = std::atof(value.c_str());
+        }
+        else if (arg == "-first-chunk-ms")
+        {
+            config.firstChunkDelayMs = std::atoi(value.c_str());
+        }
+        else if (arg == "-chunk-samples")
+        {
+            config.defaultChunkSamples = std::atoi(value.c_str());
+        }
+        else if (arg == "-sample-rate")
+        {
+            config.voices[0].set_sample_rate(std::atoi(value.c_str()));
+        }
+        else if (arg == "-fail-every")
+        {
+            config.failEvery = std::atoi(value.c_str());
+        }
+        else if (arg == "-fail-after")
+        {
+            config.failAfterChunks = std::atoi(value.c_str());
+        }
+        else
+        {
+            std::cerr << "unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    try
+    {
+        LunaMockServer server(config, address);
+        std::cout << "Luna mock server listening on " << server.address()
+                  << std::endl;
+        server.wait();
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << "error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -16,35 +16,74 @@
 
 #include "player.h"
 
+#include <algorithm>
 #include <sstream>
 #include <stdexcept>
 #include <unistd.h>
 
-Player::Player(const std::string &playCmd) : mCmd(playCmd), mStdin(nullptr) {}
+Player::Player(const std::string &playCmd, unsigned int bytesPerSecond)
+    : mCmd(playCmd), mBytesPerSecond(bytesPerSecond), mStdin(nullptr),
+      mWriting(false), mStopping(false), mPlayoutEnd(Clock::now())
+{
+}
 
 Player::~Player()
 {
     // Make sure the external application was stopped
-    this->stop();
+    try
+    {
+        this->stop();
+    }
+    catch (const std::exception &)
+    {
+        // Errors can't be reported from the destructor.
+    }
 }
 
 void Player::batchPlay(const std::vector<char> &audio)
+{
+    this->batchPlay(audio.data(), audio.size());
+}
+
+void Player::batchPlay(const char *audio, size_t size)
 {
     this->start();
-    this->pushAudio(audio);
-    this->stop();
+    this->pushAudio(audio, size);
+    this->waitForPlayout();
 }
 
 void Player::start()
 {
-    // Ignore if it is already running
+    // Ignore if it is already running, unless writing to it failed, in
+    // which case it is replaced with a new one.
     if (mStdin != nullptr)
     {
-        return;
+        if (!this->failed())
+        {
+            return;
+        }
+
+        try
+        {
+            this->stop();
+        }
+        catch (const std::exception &)
+        {
+            // The error is the reason for the restart.
+        }
     }
 
-    // Start the external process
+    // Start the external process and the thread that writes to it
     mStdin = popen(mCmd.c_str(), "w");
+    if (mStdin == nullptr)
+    {
+        throw std::runtime_error("could not start player application");
+    }
+
+    mStopping = false;
+    mError = nullptr;
+    mPlayoutEnd = Clock::now();
+    mThread = std::thread(&Player::run, this);
 }
 
 void Player::stop()
@@ -55,20 +94,124 @@ void Player::stop()
         return;
     }
 
-    // Close the stdin pipe (and by extension, the application).
+    // Let the writer thread finish the queue, then close the stdin pipe
+    // (and by extension, the application).
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCV.notify_all();
+    mThread.join();
+
     pclose(mStdin);
     mStdin = nullptr;
+
+    // Report the error one last time, and clear it for the next start()
+    std::exception_ptr err;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        err = mError;
+        mError = nullptr;
+    }
+
+    if (err)
+    {
+        std::rethrow_exception(err);
+    }
 }
 
 void Player::pushAudio(const std::vector<char> &audio)
+{
+    this->pushAudio(audio.data(), audio.size());
+}
+
+void Player::pushAudio(const char *audio, size_t size)
 {
     if (mStdin == nullptr)
     {
         throw std::runtime_error("can't push audio - player not started.");
     }
 
+    {
+        // Nothing is written once the writer thread has failed
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mError)
+        {
+            std::rethrow_exception(mError);
+        }
+        mQueue.push_back(std::string(audio, size));
+    }
+    mCV.notify_all();
+}
+
+void Player::waitForPlayout()
+{
+    Clock::time_point playoutEnd;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCV.wait(lock, [this]() {
+            return (mQueue.empty() && !mWriting) || mError;
+        });
+        if (mError)
+        {
+            std::rethrow_exception(mError);
+        }
+        playoutEnd = mPlayoutEnd;
+    }
+
+    std::this_thread::sleep_until(playoutEnd);
+}
+
+void Player::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true)
+    {
+        mCV.wait(lock, [this]() { return !mQueue.empty() || mStopping; });
+        if (mQueue.empty())
+        {
+            // Stopping, and everything has been written
+            return;
+        }
+
+        std::string audio;
+        audio.swap(mQueue.front());
+        mQueue.pop_front();
+        mWriting = true;
+        lock.unlock();
+
+        try
+        {
+            this->write(audio);
+        }
+        catch (...)
+        {
+            lock.lock();
+            mError = std::current_exception();
+            mQueue.clear();
+            mWriting = false;
+            mCV.notify_all();
+            return;
+        }
+
+        lock.lock();
+        mWriting = false;
+        mCV.notify_all();
+    }
+}
+
+void Player::write(const std::string &audio)
+{
+    // Audio written now can't start playing before now, and plays for
+    // its duration after any audio that is still playing.
+    Clock::time_point now = Clock::now();
+    Clock::duration duration = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(audio.size()) /
+                                      mBytesPerSecond));
+
     // Write the data to stdin
     size_t dataWritten = fwrite(audio.data(), 1, audio.size(), mStdin);
+    fflush(mStdin);
     if (dataWritten != audio.size())
     {
         std::ostringstream err;
@@ -76,4 +219,13 @@ void Player::pushAudio(const std::vector<char> &audio)
             << " bytes, played: " << dataWritten << " bytes";
         throw std::runtime_error(err.str());
     }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPlayoutEnd = std::max(mPlayoutEnd, now) + duration;
+}
+
+bool Player::failed()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return static_cast<bool>(mError);
 }
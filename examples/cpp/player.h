@@ -17,19 +17,34 @@
 #ifndef PLAYER_H
 #define PLAYER_H
 
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
-// Player represents an external playback executable with args.
+/*
+ * Player represents an external playback executable with args. The
+ * application is kept running between utterances, so audio can be
+ * queued back to back without paying for a new process (and audio
+ * device) each time. Audio is written to the application from a
+ * background thread.
+ */
 class Player
 {
 public:
     /*
      * Constructs a new player object using the given command, which
-     * will be used to launch the external playback application.
+     * will be used to launch the external playback application. The
+     * bytesPerSecond value is the rate at which the application consumes
+     * audio, and is used to keep track of when queued audio will have
+     * finished playing.
      */
-    Player(const std::string &playCmd);
+    Player(const std::string &playCmd, unsigned int bytesPerSecond);
 
     /*
      * Destroys the player object. If the player has not been already
@@ -38,27 +53,65 @@ public:
     ~Player();
 
     /*
-     * BatchPlay starts the playback application, plays all the
-     * given audio, then closes the playback app. It is a convenience
-     * function when working with a complete set of audio data.
+     * BatchPlay queues all the given audio and waits for it to finish
+     * playing. It is a convenience function when working with a complete
+     * set of audio data. The player is started if it isn't running yet.
      */
     void batchPlay(const std::vector<char> &audio);
+    void batchPlay(const char *audio, size_t size);
 
-    // Start the external playback application.
+    /*
+     * Start the external playback application. If writing to the
+     * running application failed, it is stopped and a new one started.
+     */
     void start();
 
-    // Stop the external playback application.
+    /*
+     * Stop the external playback application, after writing any audio
+     * that is still queued. Throws the error if writing failed.
+     */
     void stop();
 
     /*
-     * Push audio data to the player applicaiton. start() should
-     * be called prior to using this function.
+     * Queue audio data for the player applicaiton. start() should
+     * be called prior to using this function. Once writing to the
+     * application has failed, this throws the error until the player
+     * is restarted.
      */
     void pushAudio(const std::vector<char> &audio);
+    void pushAudio(const char *audio, size_t size);
+
+    /*
+     * Block until all queued audio has been written to the application
+     * and is estimated to have finished playing. The estimate assumes
+     * that the application plays audio in real time from the moment it
+     * receives it, so it is as accurate as the application's own
+     * buffering allows. Throws the error if writing failed.
+     */
+    void waitForPlayout();
 
 private:
+    using Clock = std::chrono::steady_clock;
+
     std::string mCmd;
+    unsigned int mBytesPerSecond;
     FILE *mStdin;
+
+    // The queue of audio waiting to be written, and the writer thread.
+    std::mutex mMutex;
+    std::condition_variable mCV;
+    std::deque<std::string> mQueue;
+    bool mWriting;
+    bool mStopping;
+    std::thread mThread;
+    std::exception_ptr mError;
+
+    // When the audio written so far is expected to finish playing.
+    Clock::time_point mPlayoutEnd;
+
+    void run();
+    void write(const std::string &audio);
+    bool failed();
 };
 
 #endif // PLAYER_H
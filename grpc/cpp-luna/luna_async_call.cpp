@@ -0,0 +1,83 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_async_call.h"
+
+LunaAsyncHandle::LunaAsyncHandle() {}
+
+LunaAsyncHandle::LunaAsyncHandle(
+    const std::shared_ptr<grpc::ClientContext> &ctx)
+    : mCtx(ctx)
+{
+}
+
+LunaAsyncHandle::LunaAsyncHandle(const std::function<void()> &canceller)
+    : mCanceller(canceller)
+{
+}
+
+LunaAsyncHandle::~LunaAsyncHandle() {}
+
+void LunaAsyncHandle::cancel() const
+{
+    // The context keeps the underlying call alive, so this is safe
+    // even if the call already finished.
+    if (mCtx)
+    {
+        mCtx->TryCancel();
+    }
+
+    if (mCanceller)
+    {
+        mCanceller();
+    }
+}
+
+LunaAsyncStreamCall::LunaAsyncStreamCall(const LunaAudioCallback &onAudio,
+                                         const LunaFinishCallback &onFinish)
+    : mState(STARTING), mOnAudio(onAudio), mOnFinish(onFinish)
+{
+}
+
+LunaAsyncStreamCall::~LunaAsyncStreamCall() {}
+
+LunaAsyncHandle LunaAsyncStreamCall::start(Reader reader)
+{
+    LunaAsyncHandle handle(mCtx);
+    mReader = std::move(reader);
+    mState = STARTING;
+    mReader->StartCall(this);
+    return handle;
+}
+
+void LunaAsyncStreamCall::proceed(bool ok)
+{
+    switch (mState)
+    {
+    case STARTING:
+    case READING:
+        if (mState == READING && ok)
+        {
+            mOnAudio(*mResponse.mutable_audio());
+        }
+
+        if (ok)
+        {
+            // Keep reading until the server closes the stream.
+            mState = READING;
+            mReader->Read(&mResponse, this);
+        }
+        else
+        {
+            // The stream is done (or could not be started). Either way
+            // the final status comes from Finish().
+            mState = FINISHING;
+            mReader->Finish(&mStatus, this);
+        }
+        break;
+
+    case FINISHING:
+        mOnFinish(mStatus);
+        delete this;
+        break;
+    }
+}
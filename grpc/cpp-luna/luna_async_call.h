@@ -0,0 +1,132 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_ASYNC_CALL_H
+#define LUNA_ASYNC_CALL_H
+
+#include "luna.grpc.pb.h"
+#include "luna_completion_queue.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+//! Callback for an asynchronous batch synthesis. The audio string
+//! belongs to the response message and may be swapped out by the
+//! callback to take ownership of it without a copy. It is empty if
+//! the status is not ok.
+using LunaSynthesizeCallback =
+    std::function<void(const grpc::Status &status, std::string &audio)>;
+
+//! Callback for each chunk of audio received by an asynchronous
+//! streaming synthesis. As with LunaSynthesizeCallback, the audio
+//! may be swapped out by the callback.
+using LunaAudioCallback = std::function<void(std::string &audio)>;
+
+//! Callback made exactly once when an asynchronous streaming synthesis
+//! is finished, after the last call to the LunaAudioCallback.
+using LunaFinishCallback = std::function<void(const grpc::Status &status)>;
+
+//! LunaAsyncHandle refers to an asynchronous call started by a
+//! LunaClient. It can be used to cancel the call from any thread. Handles
+//! are cheap to copy, and remain safe to use after the call has finished.
+class LunaAsyncHandle
+{
+public:
+    //! Create an empty handle that does not refer to any call.
+    LunaAsyncHandle();
+    LunaAsyncHandle(const std::shared_ptr<grpc::ClientContext> &ctx);
+
+    //! Create a handle for an operation that is not a single gRPC call,
+    //! which cancel() stops by running the given function.
+    LunaAsyncHandle(const std::function<void()> &canceller);
+    ~LunaAsyncHandle();
+
+    //! Cancel the call, if it is still running. The call's callbacks will
+    //! still be run, with a CANCELLED status.
+    void cancel() const;
+
+private:
+    std::shared_ptr<grpc::ClientContext> mCtx;
+    std::function<void()> mCanceller;
+};
+
+//! LunaAsyncUnaryCall runs a single unary RPC on a LunaCompletionQueue
+//! and reports the result to a callback from one of the queue threads.
+//! Callbacks must not throw.
+template <typename Response> class LunaAsyncUnaryCall : public LunaAsyncCall
+{
+public:
+    using Callback =
+        std::function<void(const grpc::Status &status, Response &response)>;
+    using Reader = std::unique_ptr<grpc::ClientAsyncResponseReader<Response>>;
+
+    //! Create a new call. The caller should setup the context, then
+    //! pass the reader returned by the stub's PrepareAsync method to
+    //! start(). The call deletes itself after running the callback.
+    LunaAsyncUnaryCall(const Callback &callback) : mCallback(callback) {}
+
+    //! Start the call and return a handle to it.
+    LunaAsyncHandle start(Reader reader)
+    {
+        LunaAsyncHandle handle(mCtx);
+        mReader = std::move(reader);
+        mReader->StartCall();
+        mReader->Finish(&mResponse, &mStatus, this);
+        return handle;
+    }
+
+    void proceed(bool) override
+    {
+        // Finish always completes with ok == true for unary calls;
+        // errors are reported through the status.
+        mCallback(mStatus, mResponse);
+        delete this;
+    }
+
+private:
+    Response mResponse;
+    grpc::Status mStatus;
+    Reader mReader;
+    Callback mCallback;
+};
+
+//! LunaAsyncStreamCall runs a SynthesizeStream RPC on a
+//! LunaCompletionQueue, reporting each chunk of audio and the final
+//! status to the given callbacks from one of the queue threads.
+//! Callbacks must not throw.
+class LunaAsyncStreamCall : public LunaAsyncCall
+{
+public:
+    using Reader = std::unique_ptr<
+        grpc::ClientAsyncReader<cobaltspeech::luna::SynthesizeResponse>>;
+
+    //! Create a new call. The caller should setup the context, then
+    //! pass the reader returned by the stub's PrepareAsyncSynthesizeStream
+    //! method to start(). The call deletes itself after running the
+    //! finish callback.
+    LunaAsyncStreamCall(const LunaAudioCallback &onAudio,
+                        const LunaFinishCallback &onFinish);
+    ~LunaAsyncStreamCall() override;
+
+    //! Start the call and return a handle to it.
+    LunaAsyncHandle start(Reader reader);
+
+    void proceed(bool ok) override;
+
+private:
+    enum State
+    {
+        STARTING,
+        READING,
+        FINISHING
+    };
+
+    cobaltspeech::luna::SynthesizeResponse mResponse;
+    grpc::Status mStatus;
+    Reader mReader;
+    State mState;
+    LunaAudioCallback mOnAudio;
+    LunaFinishCallback mOnFinish;
+};
+
+#endif // LUNA_ASYNC_CALL_H
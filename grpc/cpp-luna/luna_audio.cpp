@@ -0,0 +1,16 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_audio.h"
+
+size_t lunaBytesPerSample(
+    cobaltspeech::luna::SynthesizerConfig::AudioEncoding encoding)
+{
+    switch (encoding)
+    {
+    case cobaltspeech::luna::SynthesizerConfig::RAW_FLOAT32:
+        return sizeof(float);
+    case cobaltspeech::luna::SynthesizerConfig::RAW_LINEAR16:
+    default:
+        return sizeof(int16_t);
+    }
+}
@@ -0,0 +1,15 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_AUDIO_H
+#define LUNA_AUDIO_H
+
+#include "luna.pb.h"
+
+#include <cstddef>
+
+//! Returns the number of bytes used by a single sample of audio in the
+//! given encoding.
+size_t lunaBytesPerSample(
+    cobaltspeech::luna::SynthesizerConfig::AudioEncoding encoding);
+
+#endif // LUNA_AUDIO_H
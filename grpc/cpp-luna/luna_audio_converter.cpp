@@ -0,0 +1,609 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_audio_converter.h"
+
+#include "luna_exception.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define LUNA_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+// The kernels below take untyped pointers and move samples with memcpy
+// (or unaligned vector loads and stores) so that they are safe when the
+// input and output overlap, as they do for the in-place conversions.
+
+namespace
+{
+
+const float kInt16Scale = 32768.0f;
+const float kInvInt16Scale = 1.0f / 32768.0f;
+const float kInt16Min = -32768.0f;
+const float kInt16Max = 32767.0f;
+
+// Advance a xorshift32 generator.
+inline uint32_t nextRandom(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Returns a uniform float in [0, 1) built from the top 23 bits.
+inline float randomUnit(uint32_t bits)
+{
+    uint32_t mantissa = (bits >> 9) | 0x3f800000u;
+    float f;
+    std::memcpy(&f, &mantissa, sizeof(f));
+    return f - 1.0f;
+}
+
+inline float loadFloat(const char *p)
+{
+    float f;
+    std::memcpy(&f, p, sizeof(f));
+    return f;
+}
+
+inline void storeFloat(char *p, float f) { std::memcpy(p, &f, sizeof(f)); }
+
+inline int16_t loadInt16(const char *p)
+{
+    int16_t s;
+    std::memcpy(&s, p, sizeof(s));
+    return s;
+}
+
+inline void storeInt16(char *p, int16_t s) { std::memcpy(p, &s, sizeof(s)); }
+
+inline int16_t saturateInt16(float f)
+{
+    f = std::min(std::max(f, kInt16Min), kInt16Max);
+    return static_cast<int16_t>(std::lrint(f));
+}
+
+/*
+ * Scalar reference kernels.
+ */
+
+void floatToInt16Scalar(const char *in, char *out, size_t count,
+                        uint32_t *dither)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        float f = loadFloat(in + i * 4) * kInt16Scale;
+        if (dither)
+        {
+            f += randomUnit(nextRandom(*dither)) -
+                 randomUnit(nextRandom(*dither));
+        }
+        storeInt16(out + i * 2, saturateInt16(f));
+    }
+}
+
+// Converts from the end so that out may grow over in.
+void int16ToFloatScalar(const char *in, char *out, size_t count)
+{
+    for (size_t i = count; i > 0; i--)
+    {
+        float f = loadInt16(in + (i - 1) * 2) * kInvInt16Scale;
+        storeFloat(out + (i - 1) * 4, f);
+    }
+}
+
+void gainFloatScalar(char *samples, size_t count, float gain)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        char *p = samples + i * 4;
+        storeFloat(p, loadFloat(p) * gain);
+    }
+}
+
+void gainInt16Scalar(char *samples, size_t count, float gain)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        char *p = samples + i * 2;
+        storeInt16(p, saturateInt16(loadInt16(p) * gain));
+    }
+}
+
+float peakScalar(const char *samples, size_t count)
+{
+    float peak = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        peak = std::max(peak, std::fabs(loadFloat(samples + i * 4)));
+    }
+    return peak;
+}
+
+#ifdef LUNA_HAVE_X86_KERNELS
+
+/*
+ * SSE2 kernels, four samples per step.
+ */
+
+__attribute__((target("sse2"))) inline __m128
+randomUnitSse2(__m128i &state)
+{
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+    state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+    __m128i mantissa = _mm_or_si128(_mm_srli_epi32(state, 9),
+                                    _mm_set1_epi32(0x3f800000));
+    return _mm_sub_ps(_mm_castsi128_ps(mantissa), _mm_set1_ps(1.0f));
+}
+
+// Rounds and saturates eight floats to int16.
+__attribute__((target("sse2"))) inline __m128i
+packInt16Sse2(__m128 lo, __m128 hi)
+{
+    const __m128 minv = _mm_set1_ps(kInt16Min);
+    const __m128 maxv = _mm_set1_ps(kInt16Max);
+    lo = _mm_min_ps(_mm_max_ps(lo, minv), maxv);
+    hi = _mm_min_ps(_mm_max_ps(hi, minv), maxv);
+    return _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+}
+
+__attribute__((target("sse2"))) void
+floatToInt16Sse2(const char *in, char *out, size_t count, uint32_t *dither)
+{
+    const __m128 scale = _mm_set1_ps(kInt16Scale);
+    __m128i state = _mm_setzero_si128();
+    if (dither)
+    {
+        uint32_t seeds[4];
+        for (int i = 0; i < 4; i++)
+        {
+            seeds[i] = nextRandom(*dither);
+        }
+        state = _mm_loadu_si128(reinterpret_cast<const __m128i *>(seeds));
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 lo = _mm_loadu_ps(reinterpret_cast<const float *>(in + i * 4));
+        __m128 hi =
+            _mm_loadu_ps(reinterpret_cast<const float *>(in + i * 4 + 16));
+        lo = _mm_mul_ps(lo, scale);
+        hi = _mm_mul_ps(hi, scale);
+        if (dither)
+        {
+            lo = _mm_add_ps(lo, _mm_sub_ps(randomUnitSse2(state),
+                                           randomUnitSse2(state)));
+            hi = _mm_add_ps(hi, _mm_sub_ps(randomUnitSse2(state),
+                                           randomUnitSse2(state)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2),
+                         packInt16Sse2(lo, hi));
+    }
+
+    if (dither)
+    {
+        *dither ^= static_cast<uint32_t>(_mm_cvtsi128_si32(state));
+        if (*dither == 0)
+        {
+            *dither = 0x9e3779b9u;
+        }
+    }
+    floatToInt16Scalar(in + i * 4, out + i * 2, count - i, dither);
+}
+
+__attribute__((target("sse2"))) void
+int16ToFloatSse2(const char *in, char *out, size_t count)
+{
+    // Convert the tail first, then work backwards in whole blocks so
+    // that out may grow over in.
+    size_t blocks = count / 8 * 8;
+    int16ToFloatScalar(in + blocks * 2, out + blocks * 4, count - blocks);
+
+    const __m128 scale = _mm_set1_ps(kInvInt16Scale);
+    for (size_t i = blocks; i > 0; i -= 8)
+    {
+        size_t j = i - 8;
+        __m128i s =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + j * 2));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(reinterpret_cast<float *>(out + j * 4),
+                      _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(reinterpret_cast<float *>(out + j * 4 + 16),
+                      _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+}
+
+__attribute__((target("sse2"))) void gainFloatSse2(char *samples,
+                                                   size_t count, float gain)
+{
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float *p = reinterpret_cast<float *>(samples + i * 4);
+        _mm_storeu_ps(p, _mm_mul_ps(_mm_loadu_ps(p), g));
+    }
+    gainFloatScalar(samples + i * 4, count - i, gain);
+}
+
+__attribute__((target("sse2"))) void gainInt16Sse2(char *samples,
+                                                   size_t count, float gain)
+{
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i *p = reinterpret_cast<__m128i *>(samples + i * 2);
+        __m128i s = _mm_loadu_si128(p);
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_si128(p, packInt16Sse2(_mm_mul_ps(_mm_cvtepi32_ps(lo), g),
+                                          _mm_mul_ps(_mm_cvtepi32_ps(hi), g)));
+    }
+    gainInt16Scalar(samples + i * 2, count - i, gain);
+}
+
+__attribute__((target("sse2"))) float peakSse2(const char *samples,
+                                               size_t count)
+{
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 peak = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 s =
+            _mm_loadu_ps(reinterpret_cast<const float *>(samples + i * 4));
+        peak = _mm_max_ps(peak, _mm_and_ps(s, absMask));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, peak);
+    float result = std::max(std::max(lanes[0], lanes[1]),
+                            std::max(lanes[2], lanes[3]));
+    return std::max(result, peakScalar(samples + i * 4, count - i));
+}
+
+/*
+ * AVX2 kernels, eight samples per step.
+ */
+
+__attribute__((target("avx2"))) inline __m256
+randomUnitAvx2(__m256i &state)
+{
+    state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+    state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+    state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+    __m256i mantissa = _mm256_or_si256(_mm256_srli_epi32(state, 9),
+                                       _mm256_set1_epi32(0x3f800000));
+    return _mm256_sub_ps(_mm256_castsi256_ps(mantissa), _mm256_set1_ps(1.0f));
+}
+
+// Rounds and saturates sixteen floats to int16, in order.
+__attribute__((target("avx2"))) inline __m256i
+packInt16Avx2(__m256 lo, __m256 hi)
+{
+    const __m256 minv = _mm256_set1_ps(kInt16Min);
+    const __m256 maxv = _mm256_set1_ps(kInt16Max);
+    lo = _mm256_min_ps(_mm256_max_ps(lo, minv), maxv);
+    hi = _mm256_min_ps(_mm256_max_ps(hi, minv), maxv);
+
+    // The pack works within 128-bit lanes, so put the quadwords back in
+    // sample order afterwards.
+    __m256i packed =
+        _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+    return _mm256_permute4x64_epi64(packed, 0xd8);
+}
+
+__attribute__((target("avx2"))) void
+floatToInt16Avx2(const char *in, char *out, size_t count, uint32_t *dither)
+{
+    const __m256 scale = _mm256_set1_ps(kInt16Scale);
+    __m256i state = _mm256_setzero_si256();
+    if (dither)
+    {
+        uint32_t seeds[8];
+        for (int i = 0; i < 8; i++)
+        {
+            seeds[i] = nextRandom(*dither);
+        }
+        state = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(seeds));
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256 lo =
+            _mm256_loadu_ps(reinterpret_cast<const float *>(in + i * 4));
+        __m256 hi =
+            _mm256_loadu_ps(reinterpret_cast<const float *>(in + i * 4 + 32));
+        lo = _mm256_mul_ps(lo, scale);
+        hi = _mm256_mul_ps(hi, scale);
+        if (dither)
+        {
+            lo = _mm256_add_ps(lo, _mm256_sub_ps(randomUnitAvx2(state),
+                                                 randomUnitAvx2(state)));
+            hi = _mm256_add_ps(hi, _mm256_sub_ps(randomUnitAvx2(state),
+                                                 randomUnitAvx2(state)));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 2),
+                            packInt16Avx2(lo, hi));
+    }
+
+    if (dither)
+    {
+        *dither ^= static_cast<uint32_t>(
+            _mm_cvtsi128_si32(_mm256_castsi256_si128(state)));
+        if (*dither == 0)
+        {
+            *dither = 0x9e3779b9u;
+        }
+    }
+    floatToInt16Scalar(in + i * 4, out + i * 2, count - i, dither);
+}
+
+__attribute__((target("avx2"))) void
+int16ToFloatAvx2(const char *in, char *out, size_t count)
+{
+    size_t blocks = count / 8 * 8;
+    int16ToFloatScalar(in + blocks * 2, out + blocks * 4, count - blocks);
+
+    const __m256 scale = _mm256_set1_ps(kInvInt16Scale);
+    for (size_t i = blocks; i > 0; i -= 8)
+    {
+        size_t j = i - 8;
+        __m128i s =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + j * 2));
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(s));
+        _mm256_storeu_ps(reinterpret_cast<float *>(out + j * 4),
+                         _mm256_mul_ps(f, scale));
+    }
+}
+
+__attribute__((target("avx2"))) void gainFloatAvx2(char *samples,
+                                                   size_t count, float gain)
+{
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        float *p = reinterpret_cast<float *>(samples + i * 4);
+        _mm256_storeu_ps(p, _mm256_mul_ps(_mm256_loadu_ps(p), g));
+    }
+    gainFloatScalar(samples + i * 4, count - i, gain);
+}
+
+__attribute__((target("avx2"))) void gainInt16Avx2(char *samples,
+                                                   size_t count, float gain)
+{
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i *p = reinterpret_cast<__m256i *>(samples + i * 2);
+        __m256i s = _mm256_loadu_si256(p);
+        __m256 lo = _mm256_cvtepi32_ps(
+            _mm256_cvtepi16_epi32(_mm256_castsi256_si128(s)));
+        __m256 hi = _mm256_cvtepi32_ps(
+            _mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1)));
+        _mm256_storeu_si256(p, packInt16Avx2(_mm256_mul_ps(lo, g),
+                                             _mm256_mul_ps(hi, g)));
+    }
+    gainInt16Scalar(samples + i * 2, count - i, gain);
+}
+
+__attribute__((target("avx2"))) float peakAvx2(const char *samples,
+                                               size_t count)
+{
+    const __m256 absMask =
+        _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 peak = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 s =
+            _mm256_loadu_ps(reinterpret_cast<const float *>(samples + i * 4));
+        peak = _mm256_max_ps(peak, _mm256_and_ps(s, absMask));
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, peak);
+    float result = *std::max_element(lanes, lanes + 8);
+    return std::max(result, peakScalar(samples + i * 4, count - i));
+}
+
+#endif // LUNA_HAVE_X86_KERNELS
+
+} // namespace
+
+LunaAudioConverter::LunaAudioConverter(Isa maxIsa)
+    : mIsa(std::min(maxIsa, detectIsa())), mDitherState(0x2545f491u)
+{
+}
+
+LunaAudioConverter::~LunaAudioConverter() {}
+
+LunaAudioConverter::Isa LunaAudioConverter::detectIsa()
+{
+#ifdef LUNA_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return AVX2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return SSE2;
+    }
+#endif
+    return SCALAR;
+}
+
+LunaAudioConverter::Isa LunaAudioConverter::isa() const { return mIsa; }
+
+void LunaAudioConverter::floatToInt16(const float *in, int16_t *out,
+                                      size_t count, bool dither)
+{
+    const char *src = reinterpret_cast<const char *>(in);
+    char *dst = reinterpret_cast<char *>(out);
+    uint32_t *state = dither ? &mDitherState : nullptr;
+
+    switch (mIsa)
+    {
+#ifdef LUNA_HAVE_X86_KERNELS
+    case AVX2:
+        floatToInt16Avx2(src, dst, count, state);
+        return;
+    case SSE2:
+        floatToInt16Sse2(src, dst, count, state);
+        return;
+#endif
+    default:
+        floatToInt16Scalar(src, dst, count, state);
+    }
+}
+
+void LunaAudioConverter::int16ToFloat(const int16_t *in, float *out,
+                                      size_t count)
+{
+    const char *src = reinterpret_cast<const char *>(in);
+    char *dst = reinterpret_cast<char *>(out);
+
+    switch (mIsa)
+    {
+#ifdef LUNA_HAVE_X86_KERNELS
+    case AVX2:
+        int16ToFloatAvx2(src, dst, count);
+        return;
+    case SSE2:
+        int16ToFloatSse2(src, dst, count);
+        return;
+#endif
+    default:
+        int16ToFloatScalar(src, dst, count);
+    }
+}
+
+void LunaAudioConverter::applyGain(float *samples, size_t count, float gain)
+{
+    char *p = reinterpret_cast<char *>(samples);
+
+    switch (mIsa)
+    {
+#ifdef LUNA_HAVE_X86_KERNELS
+    case AVX2:
+        gainFloatAvx2(p, count, gain);
+        return;
+    case SSE2:
+        gainFloatSse2(p, count, gain);
+        return;
+#endif
+    default:
+        gainFloatScalar(p, count, gain);
+    }
+}
+
+void LunaAudioConverter::applyGain(int16_t *samples, size_t count,
+                                   float gain)
+{
+    char *p = reinterpret_cast<char *>(samples);
+
+    switch (mIsa)
+    {
+#ifdef LUNA_HAVE_X86_KERNELS
+    case AVX2:
+        gainInt16Avx2(p, count, gain);
+        return;
+    case SSE2:
+        gainInt16Sse2(p, count, gain);
+        return;
+#endif
+    default:
+        gainInt16Scalar(p, count, gain);
+    }
+}
+
+float LunaAudioConverter::peak(const float *samples, size_t count)
+{
+    const char *p = reinterpret_cast<const char *>(samples);
+
+    switch (mIsa)
+    {
+#ifdef LUNA_HAVE_X86_KERNELS
+    case AVX2:
+        return peakAvx2(p, count);
+    case SSE2:
+        return peakSse2(p, count);
+#endif
+    default:
+        return peakScalar(p, count);
+    }
+}
+
+void LunaAudioConverter::normalize(float *samples, size_t count,
+                                   float targetPeak)
+{
+    float current = this->peak(samples, count);
+    if (current > 0.0f)
+    {
+        this->applyGain(samples, count, targetPeak / current);
+    }
+}
+
+void LunaAudioConverter::floatToInt16(std::string &audio, bool dither)
+{
+    if (audio.size() % sizeof(float) != 0)
+    {
+        throw LunaException("float audio buffer is not a whole number of "
+                            "samples");
+    }
+
+    size_t count = audio.size() / sizeof(float);
+    char *data = &audio[0];
+    this->floatToInt16(reinterpret_cast<const float *>(data),
+                       reinterpret_cast<int16_t *>(data), count, dither);
+    audio.resize(count * sizeof(int16_t));
+}
+
+void LunaAudioConverter::int16ToFloat(std::string &audio)
+{
+    if (audio.size() % sizeof(int16_t) != 0)
+    {
+        throw LunaException("int16 audio buffer is not a whole number of "
+                            "samples");
+    }
+
+    size_t count = audio.size() / sizeof(int16_t);
+    audio.resize(count * sizeof(float));
+    char *data = &audio[0];
+    this->int16ToFloat(reinterpret_cast<const int16_t *>(data),
+                       reinterpret_cast<float *>(data), count);
+}
+
+void LunaAudioConverter::applyGain(
+    std::string &audio,
+    cobaltspeech::luna::SynthesizerConfig::AudioEncoding enc, float gain)
+{
+    if (audio.empty())
+    {
+        return;
+    }
+
+    char *data = &audio[0];
+    if (enc == cobaltspeech::luna::SynthesizerConfig::RAW_FLOAT32)
+    {
+        this->applyGain(reinterpret_cast<float *>(data),
+                        audio.size() / sizeof(float), gain);
+    }
+    else
+    {
+        this->applyGain(reinterpret_cast<int16_t *>(data),
+                        audio.size() / sizeof(int16_t), gain);
+    }
+}
@@ -0,0 +1,84 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_AUDIO_CONVERTER_H
+#define LUNA_AUDIO_CONVERTER_H
+
+#include "luna.pb.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//! LunaAudioConverter converts audio between the sample formats produced
+//! by the Luna server (see SynthesizerConfig::AudioEncoding), and applies
+//! gain and normalization. The kernels are vectorized with SSE2 or AVX2
+//! when the CPU supports them, with a scalar fallback that is also used
+//! as the reference implementation.
+//!
+//! Float samples are in the range [-1.0, 1.0), and map to int16 samples
+//! by a scale of 32768. Conversions to int16 saturate.
+//!
+//! A converter holds the state of its dither generator, so each thread
+//! should use its own converter.
+class LunaAudioConverter
+{
+public:
+    //! The instruction sets a converter can use.
+    enum Isa
+    {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    //! Create a converter that uses the best instruction set supported
+    //! by the CPU, but no better than maxIsa.
+    LunaAudioConverter(Isa maxIsa = AVX2);
+    ~LunaAudioConverter();
+
+    //! Returns the best instruction set supported by the CPU.
+    static Isa detectIsa();
+
+    //! Returns the instruction set used by this converter.
+    Isa isa() const;
+
+    //! Convert float samples to int16. If dither is true, triangular
+    //! (TPDF) dither of +/- 1 LSB is added before rounding. The input and
+    //! output may point to the same memory.
+    void floatToInt16(const float *in, int16_t *out, size_t count,
+                      bool dither);
+
+    //! Convert int16 samples to float.
+    void int16ToFloat(const int16_t *in, float *out, size_t count);
+
+    //! Multiply the samples by the given gain.
+    void applyGain(float *samples, size_t count, float gain);
+    void applyGain(int16_t *samples, size_t count, float gain);
+
+    //! Returns the largest absolute sample value.
+    float peak(const float *samples, size_t count);
+
+    //! Scale the samples so that their peak is at the given level.
+    //! Silence is left unchanged.
+    void normalize(float *samples, size_t count, float targetPeak);
+
+    //! Convert a buffer of RAW_FLOAT32 audio (such as a chunk from
+    //! LunaSynthesizerStream::receiveAudio()) to RAW_LINEAR16 in place.
+    //! The buffer shrinks to half its size.
+    void floatToInt16(std::string &audio, bool dither);
+
+    //! Convert a buffer of RAW_LINEAR16 audio to RAW_FLOAT32 in place.
+    //! The buffer grows to twice its size.
+    void int16ToFloat(std::string &audio);
+
+    //! Apply gain in place to a buffer of audio in the given encoding.
+    void applyGain(std::string &audio,
+                   cobaltspeech::luna::SynthesizerConfig::AudioEncoding enc,
+                   float gain);
+
+private:
+    Isa mIsa;
+    uint32_t mDitherState;
+};
+
+#endif // LUNA_AUDIO_CONVERTER_H
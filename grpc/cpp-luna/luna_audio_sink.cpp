@@ -0,0 +1,355 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_audio_sink.h"
+
+#include "luna_audio.h"
+#include "luna_exception.h"
+#include "luna_read_ahead_buffer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+
+// The size of a canonical WAV header, and the offsets of the two sizes
+// that are only known once all the audio has been written.
+const size_t kWavHeaderBytes = 44;
+const off_t kRiffSizeOffset = 4;
+const off_t kDataSizeOffset = 40;
+
+void throwErrno(const std::string &what)
+{
+    throw LunaException(what + ": " + strerror(errno));
+}
+
+// Write every byte of the given chunks, continuing after partial writes
+// and interrupted calls.
+void writeAll(int fd, struct iovec *iov, size_t count)
+{
+    while (count > 0)
+    {
+        int batch = static_cast<int>(std::min<size_t>(count, IOV_MAX));
+        ssize_t n = ::writev(fd, iov, batch);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throwErrno("could not write audio");
+        }
+
+        // Skip past what was written
+        size_t written = static_cast<size_t>(n);
+        while (count > 0 && written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Write the chunks, preceded by an optional header, in batches that
+// fit in a small array on the stack so that writing needs no allocation.
+void writeAll(int fd, const LunaAudioChunk *chunks, size_t count,
+              const char *header = nullptr, size_t headerSize = 0)
+{
+    const size_t kBatch = 16;
+    struct iovec iov[kBatch];
+    size_t n = 0;
+    if (header)
+    {
+        iov[n].iov_base = const_cast<char *>(header);
+        iov[n].iov_len = headerSize;
+        n++;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        iov[n].iov_base = const_cast<char *>(chunks[i].data);
+        iov[n].iov_len = chunks[i].size;
+        if (++n == kBatch)
+        {
+            writeAll(fd, iov, n);
+            n = 0;
+        }
+    }
+
+    writeAll(fd, iov, n);
+}
+
+void putLE(char *out, uint32_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++)
+    {
+        out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+} // namespace
+
+LunaAudioSink::~LunaAudioSink() {}
+
+void LunaAudioSink::begin(const LunaAudioFormat &) {}
+
+void LunaAudioSink::writeChunks(const LunaAudioChunk *chunks, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        this->write(chunks[i].data, chunks[i].size);
+    }
+}
+
+void LunaAudioSink::finish() {}
+
+void LunaAudioSink::abort() {}
+
+LunaFdSink::LunaFdSink(int fd, bool closeWhenDone)
+    : mFd(fd), mClose(closeWhenDone)
+{
+}
+
+LunaFdSink::~LunaFdSink() { this->close(); }
+
+void LunaFdSink::write(const char *data, size_t size)
+{
+    LunaAudioChunk chunk = {data, size};
+    this->writeChunks(&chunk, 1);
+}
+
+void LunaFdSink::writeChunks(const LunaAudioChunk *chunks, size_t count)
+{
+    writeAll(mFd, chunks, count);
+}
+
+void LunaFdSink::finish() { this->close(); }
+
+void LunaFdSink::abort() { this->close(); }
+
+LunaFdSink::LunaFdSink(const LunaFdSink &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy sink objects.
+}
+
+LunaFdSink &LunaFdSink::operator=(const LunaFdSink &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy sink objects.
+    return *this;
+}
+
+void LunaFdSink::close()
+{
+    if (mClose && mFd >= 0)
+    {
+        ::close(mFd);
+        mFd = -1;
+    }
+}
+
+LunaMemorySink::LunaMemorySink(size_t reserveBytes)
+{
+    mAudio.reserve(reserveBytes);
+}
+
+LunaMemorySink::~LunaMemorySink() {}
+
+void LunaMemorySink::write(const char *data, size_t size)
+{
+    mAudio.append(data, size);
+}
+
+void LunaMemorySink::writeChunks(const LunaAudioChunk *chunks, size_t count)
+{
+    // Grow once for the whole batch
+    size_t total = mAudio.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        total += chunks[i].size;
+    }
+    if (total > mAudio.capacity())
+    {
+        mAudio.reserve(std::max(total, 2 * mAudio.capacity()));
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        mAudio.append(chunks[i].data, chunks[i].size);
+    }
+}
+
+std::string &LunaMemorySink::audio() { return mAudio; }
+
+LunaRingSink::LunaRingSink(LunaReadAheadBuffer &buffer) : mBuffer(buffer) {}
+
+LunaRingSink::~LunaRingSink() {}
+
+void LunaRingSink::write(const char *data, size_t size)
+{
+    if (!mBuffer.write(data, size))
+    {
+        throw LunaException("read-ahead buffer was stopped");
+    }
+}
+
+void LunaRingSink::finish() { mBuffer.finishWriting(); }
+
+void LunaRingSink::abort()
+{
+    std::exception_ptr error = std::current_exception();
+    if (!error)
+    {
+        error = std::make_exception_ptr(
+            LunaException("synthesis was aborted"));
+    }
+    mBuffer.abortWriting(error);
+}
+
+LunaWavSink::LunaWavSink(const std::string &path)
+    : mPath(path), mHeaderWritten(false), mDataBytes(0)
+{
+    mFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (mFd < 0)
+    {
+        throwErrno("could not open " + path);
+    }
+}
+
+LunaWavSink::~LunaWavSink() { this->close(); }
+
+void LunaWavSink::begin(const LunaAudioFormat &format) { mFormat = format; }
+
+void LunaWavSink::write(const char *data, size_t size)
+{
+    LunaAudioChunk chunk = {data, size};
+    this->writeChunks(&chunk, 1);
+}
+
+void LunaWavSink::writeChunks(const LunaAudioChunk *chunks, size_t count)
+{
+    if (mFd < 0)
+    {
+        throw LunaException("WAV file " + mPath + " is already closed");
+    }
+
+    // The header goes out with the first audio, in the same call.
+    // Its sizes are placeholders until the file is finished.
+    char header[kWavHeaderBytes];
+    if (!mHeaderWritten)
+    {
+        bool isFloat = mFormat.encoding ==
+                       cobaltspeech::luna::SynthesizerConfig::RAW_FLOAT32;
+        uint32_t width =
+            static_cast<uint32_t>(lunaBytesPerSample(mFormat.encoding));
+
+        memcpy(header, "RIFF", 4);
+        putLE(header + 4, 0, 4);
+        memcpy(header + 8, "WAVEfmt ", 8);
+        putLE(header + 16, 16, 4);
+        putLE(header + 20, isFloat ? 3 : 1, 2);
+        putLE(header + 22, 1, 2);
+        putLE(header + 24, mFormat.sampleRate, 4);
+        putLE(header + 28, mFormat.sampleRate * width, 4);
+        putLE(header + 32, width, 2);
+        putLE(header + 34, 8 * width, 2);
+        memcpy(header + 36, "data", 4);
+        putLE(header + 40, 0, 4);
+    }
+
+    writeAll(mFd, chunks, count, mHeaderWritten ? nullptr : header,
+             kWavHeaderBytes);
+    mHeaderWritten = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        mDataBytes += chunks[i].size;
+    }
+}
+
+void LunaWavSink::finish()
+{
+    // A file with no audio still needs its header
+    if (!mHeaderWritten)
+    {
+        this->writeChunks(nullptr, 0);
+    }
+
+    bool patched = this->patchHeader();
+    int err = errno;
+    this->close();
+    if (!patched)
+    {
+        errno = err;
+        throwErrno("could not finish " + mPath);
+    }
+}
+
+void LunaWavSink::abort() { this->close(); }
+
+LunaWavSink::LunaWavSink(const LunaWavSink &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy sink objects.
+}
+
+LunaWavSink &LunaWavSink::operator=(const LunaWavSink &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy sink objects.
+    return *this;
+}
+
+bool LunaWavSink::patchHeader()
+{
+    if (mFd < 0 || !mHeaderWritten)
+    {
+        return true;
+    }
+
+    // WAV limits the sizes to 32 bits
+    uint32_t dataBytes = static_cast<uint32_t>(
+        std::min<uint64_t>(mDataBytes, UINT32_MAX - 36));
+    char riffSize[4];
+    char dataSize[4];
+    putLE(riffSize, dataBytes + 36, 4);
+    putLE(dataSize, dataBytes, 4);
+    return ::pwrite(mFd, riffSize, 4, kRiffSizeOffset) == 4 &&
+           ::pwrite(mFd, dataSize, 4, kDataSizeOffset) == 4;
+}
+
+void LunaWavSink::close()
+{
+    if (mFd < 0)
+    {
+        return;
+    }
+
+    // Leave a readable file even if synthesis failed part way
+    this->patchHeader();
+    ::close(mFd);
+    mFd = -1;
+}
+
+LunaCallbackSink::LunaCallbackSink(const Callback &callback)
+    : mCallback(callback)
+{
+}
+
+LunaCallbackSink::~LunaCallbackSink() {}
+
+void LunaCallbackSink::write(const char *data, size_t size)
+{
+    mCallback(data, size);
+}
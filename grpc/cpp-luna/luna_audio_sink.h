@@ -0,0 +1,179 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_AUDIO_SINK_H
+#define LUNA_AUDIO_SINK_H
+
+#include "luna.pb.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+class LunaReadAheadBuffer;
+
+//! The format of the audio written to a LunaAudioSink.
+struct LunaAudioFormat
+{
+    //! Samples per second, or zero if the voice's rate is not known.
+    unsigned int sampleRate = 0;
+
+    cobaltspeech::luna::SynthesizerConfig::AudioEncoding encoding =
+        cobaltspeech::luna::SynthesizerConfig::RAW_LINEAR16;
+};
+
+//! A contiguous piece of audio, for vectored writes.
+struct LunaAudioChunk
+{
+    const char *data;
+    size_t size;
+};
+
+//! LunaAudioSink receives synthesized audio as it arrives, so callers of
+//! LunaClient::synthesizeTo() do not have to write their own receive
+//! loop. The audio passed to a sink is only valid for the duration of
+//! the call. Sinks report errors by throwing, which cancels synthesis.
+class LunaAudioSink
+{
+public:
+    virtual ~LunaAudioSink();
+
+    //! Called once, before any audio, with the format of the audio.
+    virtual void begin(const LunaAudioFormat &format);
+
+    //! Write a chunk of audio.
+    virtual void write(const char *data, size_t size) = 0;
+
+    //! Write several chunks, in order. Sinks that can write them in one
+    //! call (e.g., with writev) override this; by default the chunks are
+    //! passed to write() one at a time.
+    virtual void writeChunks(const LunaAudioChunk *chunks, size_t count);
+
+    //! Called once after the last chunk, if synthesis succeeded.
+    virtual void finish();
+
+    //! Called instead of finish() if synthesis failed or was cancelled.
+    //! LunaClient::synthesizeTo() calls it while handling the error, so
+    //! std::current_exception() returns the error.
+    virtual void abort();
+};
+
+//! LunaFdSink writes audio to a file descriptor, such as a pipe, socket
+//! or open file. Vectored writes use a single writev call.
+class LunaFdSink : public LunaAudioSink
+{
+public:
+    //! Write to the given descriptor. If closeWhenDone is true, the
+    //! descriptor is closed by finish(), abort(), or the destructor.
+    LunaFdSink(int fd, bool closeWhenDone = false);
+    ~LunaFdSink() override;
+
+    void write(const char *data, size_t size) override;
+    void writeChunks(const LunaAudioChunk *chunks, size_t count) override;
+    void finish() override;
+    void abort() override;
+
+private:
+    int mFd;
+    bool mClose;
+
+    // Disable copy construction and assignments.
+    LunaFdSink(const LunaFdSink &other);
+    LunaFdSink &operator=(const LunaFdSink &other);
+
+    void close();
+};
+
+//! LunaMemorySink collects the audio in a string.
+class LunaMemorySink : public LunaAudioSink
+{
+public:
+    //! Create an empty sink, reserving room for the given number of
+    //! bytes up front.
+    LunaMemorySink(size_t reserveBytes = 0);
+    ~LunaMemorySink() override;
+
+    void write(const char *data, size_t size) override;
+    void writeChunks(const LunaAudioChunk *chunks, size_t count) override;
+
+    //! Returns the audio written so far. Callers may swap it out.
+    std::string &audio();
+
+private:
+    std::string mAudio;
+};
+
+//! LunaRingSink writes audio into a LunaReadAheadBuffer, to be read by
+//! another thread. The buffer's end of audio is marked when synthesis
+//! finishes or fails, so the reader never waits forever. If synthesis
+//! fails, the reader's read() throws the error once the buffered audio
+//! has been read.
+class LunaRingSink : public LunaAudioSink
+{
+public:
+    LunaRingSink(LunaReadAheadBuffer &buffer);
+    ~LunaRingSink() override;
+
+    //! Blocks while the buffer is full. Throws if the buffer is stopped.
+    void write(const char *data, size_t size) override;
+    void finish() override;
+    void abort() override;
+
+private:
+    LunaReadAheadBuffer &mBuffer;
+};
+
+//! LunaWavSink writes the audio to a WAV file. The header is written
+//! with the first audio and its sizes are filled in when the sink is
+//! finished, so the audio streams straight to disk.
+class LunaWavSink : public LunaAudioSink
+{
+public:
+    //! Create (or truncate) the file at the given path. Throws a
+    //! LunaException if it cannot be opened.
+    LunaWavSink(const std::string &path);
+    ~LunaWavSink() override;
+
+    void begin(const LunaAudioFormat &format) override;
+    void write(const char *data, size_t size) override;
+    void writeChunks(const LunaAudioChunk *chunks, size_t count) override;
+
+    //! Patch the header with the final sizes and close the file.
+    void finish() override;
+
+    //! Patch the header to cover the audio written so far, so the file
+    //! is still readable, and close it.
+    void abort() override;
+
+private:
+    std::string mPath;
+    int mFd;
+    LunaAudioFormat mFormat;
+    bool mHeaderWritten;
+    uint64_t mDataBytes;
+
+    // Disable copy construction and assignments.
+    LunaWavSink(const LunaWavSink &other);
+    LunaWavSink &operator=(const LunaWavSink &other);
+
+    // Fill in the sizes in the header. Returns false if that failed.
+    bool patchHeader();
+    void close();
+};
+
+//! LunaCallbackSink passes each chunk of audio to a function.
+class LunaCallbackSink : public LunaAudioSink
+{
+public:
+    using Callback = std::function<void(const char *data, size_t size)>;
+
+    LunaCallbackSink(const Callback &callback);
+    ~LunaCallbackSink() override;
+
+    void write(const char *data, size_t size) override;
+
+private:
+    Callback mCallback;
+};
+
+#endif // LUNA_AUDIO_SINK_H
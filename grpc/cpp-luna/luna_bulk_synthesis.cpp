@@ -0,0 +1,94 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_bulk_synthesis.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace
+{
+struct BulkResult
+{
+    size_t index;
+    grpc::Status status;
+    std::string audio;
+};
+
+// State shared with the callbacks, which may outlive the call to
+// lunaSynthesizeMany() if the sink throws.
+struct BulkState
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<BulkResult> completed;
+};
+} // namespace
+
+void lunaSynthesizeMany(const LunaBulkLauncher &launcher,
+                        const std::vector<LunaBulkRequest> &requests,
+                        const LunaBulkSink &sink, unsigned int maxInFlight)
+{
+    if (maxInFlight < 1)
+    {
+        maxInFlight = 1;
+    }
+
+    std::shared_ptr<BulkState> state(new BulkState);
+    std::vector<LunaAsyncHandle> handles(requests.size());
+    size_t next = 0;
+    size_t inFlight = 0;
+
+    try
+    {
+        while (next < requests.size() || inFlight > 0)
+        {
+            // Fill the window. Launching is done without the lock because
+            // cached results call back before the launcher returns.
+            while (next < requests.size() && inFlight < maxInFlight)
+            {
+                size_t index = next++;
+                inFlight++;
+                handles[index] = launcher(
+                    requests[index],
+                    [state, index](const grpc::Status &status,
+                                   std::string &audio) {
+                        {
+                            std::lock_guard<std::mutex> lock(state->mutex);
+                            state->completed.push_back(BulkResult());
+                            BulkResult &result = state->completed.back();
+                            result.index = index;
+                            result.status = status;
+                            result.audio.swap(audio);
+                        }
+                        state->cv.notify_one();
+                    });
+            }
+
+            BulkResult result;
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->cv.wait(
+                    lock, [&state]() { return !state->completed.empty(); });
+                result.index = state->completed.front().index;
+                result.status = state->completed.front().status;
+                result.audio.swap(state->completed.front().audio);
+                state->completed.pop_front();
+            }
+
+            // The slot is freed only after the sink has consumed the result
+            sink(result.index, result.status, result.audio);
+            handles[result.index] = LunaAsyncHandle();
+            inFlight--;
+        }
+    }
+    catch (...)
+    {
+        for (const LunaAsyncHandle &handle : handles)
+        {
+            handle.cancel();
+        }
+        throw;
+    }
+}
@@ -0,0 +1,46 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_BULK_SYNTHESIS_H
+#define LUNA_BULK_SYNTHESIS_H
+
+#include "luna.pb.h"
+#include "luna_async_call.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+//! LunaBulkRequest is a single item of a bulk synthesis job.
+struct LunaBulkRequest
+{
+    cobaltspeech::luna::SynthesizerConfig config;
+    std::string text;
+};
+
+//! Called once for each item of a bulk synthesis job, with the index of
+//! the item in the request list, its status and its audio. The audio may
+//! be swapped out by the sink to take ownership of it. A failed item
+//! does not affect the others.
+using LunaBulkSink = std::function<void(
+    size_t index, const grpc::Status &status, std::string &audio)>;
+
+//! Function used to start the batch synthesis of one item, such as
+//! LunaClient::synthesizeAsync().
+using LunaBulkLauncher = std::function<LunaAsyncHandle(
+    const LunaBulkRequest &request, const LunaSynthesizeCallback &callback)>;
+
+//! Synthesize every request with at most maxInFlight requests
+//! outstanding, passing each result to the sink as it completes. The
+//! sink is always called from the calling thread, and this function
+//! returns once every item has been passed to it.
+//!
+//! Results that have not yet been consumed by the sink count against
+//! maxInFlight, so a sink that is slower than the server holds back new
+//! requests instead of letting results pile up in memory. If the sink
+//! throws, the remaining requests are cancelled and the exception is
+//! passed on to the caller.
+void lunaSynthesizeMany(const LunaBulkLauncher &launcher,
+                        const std::vector<LunaBulkRequest> &requests,
+                        const LunaBulkSink &sink, unsigned int maxInFlight);
+
+#endif // LUNA_BULK_SYNTHESIS_H
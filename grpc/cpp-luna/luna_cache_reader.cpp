@@ -0,0 +1,84 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_cache_reader.h"
+
+#include <algorithm>
+
+LunaReplayReader::LunaReplayReader(
+    const std::shared_ptr<const std::string> &audio, size_t chunkBytes)
+    : mAudio(audio), mChunkBytes(chunkBytes), mOffset(0)
+{
+    if (mChunkBytes == 0)
+    {
+        mChunkBytes = mAudio->size();
+    }
+}
+
+LunaReplayReader::~LunaReplayReader() {}
+
+bool LunaReplayReader::Read(cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    if (mOffset >= mAudio->size())
+    {
+        return false;
+    }
+
+    size_t n = std::min(mChunkBytes, mAudio->size() - mOffset);
+    msg->set_audio(mAudio->data() + mOffset, n);
+    mOffset += n;
+    return true;
+}
+
+bool LunaReplayReader::NextMessageSize(uint32_t *sz)
+{
+    *sz = static_cast<uint32_t>(
+        std::min(mChunkBytes, mAudio->size() - mOffset));
+    return true;
+}
+
+grpc::Status LunaReplayReader::Finish() { return grpc::Status::OK; }
+
+void LunaReplayReader::WaitForInitialMetadata() {}
+
+LunaCachingReader::LunaCachingReader(
+    const LunaSynthesizerStream::LunaReader &reader,
+    const std::shared_ptr<LunaSynthesisCache> &cache, const std::string &key)
+    : mReader(reader), mCache(cache), mKey(key)
+{
+}
+
+LunaCachingReader::~LunaCachingReader() {}
+
+bool LunaCachingReader::Read(cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    if (!mReader->Read(msg))
+    {
+        return false;
+    }
+
+    mAudio.append(msg->audio());
+    return true;
+}
+
+bool LunaCachingReader::NextMessageSize(uint32_t *sz)
+{
+    return mReader->NextMessageSize(sz);
+}
+
+grpc::Status LunaCachingReader::Finish()
+{
+    grpc::Status status = mReader->Finish();
+    if (status.ok())
+    {
+        std::shared_ptr<std::string> audio(new std::string);
+        audio->swap(mAudio);
+        mCache->insert(mKey, audio);
+    }
+
+    return status;
+}
+
+void LunaCachingReader::WaitForInitialMetadata()
+{
+    mReader->WaitForInitialMetadata();
+}
@@ -0,0 +1,60 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_CACHE_READER_H
+#define LUNA_CACHE_READER_H
+
+#include "luna.grpc.pb.h"
+#include "luna_synthesis_cache.h"
+#include "luna_synthesizer_stream.h"
+
+#include <memory>
+#include <string>
+
+//! LunaReplayReader plays back cached audio as if it were being
+//! received from a SynthesizeStream call, splitting it into chunks of
+//! the given size. It is used by LunaClient to serve streaming requests
+//! from a LunaSynthesisCache.
+class LunaReplayReader
+    : public grpc::ClientReaderInterface<cobaltspeech::luna::SynthesizeResponse>
+{
+public:
+    LunaReplayReader(const std::shared_ptr<const std::string> &audio,
+                     size_t chunkBytes);
+    ~LunaReplayReader() override;
+
+    bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+    bool NextMessageSize(uint32_t *sz) override;
+    grpc::Status Finish() override;
+    void WaitForInitialMetadata() override;
+
+private:
+    std::shared_ptr<const std::string> mAudio;
+    size_t mChunkBytes;
+    size_t mOffset;
+};
+
+//! LunaCachingReader wraps the reader of a SynthesizeStream call and
+//! records the audio it receives. If the stream finishes successfully,
+//! the recorded audio is added to the cache.
+class LunaCachingReader
+    : public grpc::ClientReaderInterface<cobaltspeech::luna::SynthesizeResponse>
+{
+public:
+    LunaCachingReader(const LunaSynthesizerStream::LunaReader &reader,
+                      const std::shared_ptr<LunaSynthesisCache> &cache,
+                      const std::string &key);
+    ~LunaCachingReader() override;
+
+    bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+    bool NextMessageSize(uint32_t *sz) override;
+    grpc::Status Finish() override;
+    void WaitForInitialMetadata() override;
+
+private:
+    LunaSynthesizerStream::LunaReader mReader;
+    std::shared_ptr<LunaSynthesisCache> mCache;
+    std::string mKey;
+    std::string mAudio;
+};
+
+#endif // LUNA_CACHE_READER_H
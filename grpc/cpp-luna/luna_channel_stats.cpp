@@ -0,0 +1,105 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_channel_stats.h"
+
+LunaChannelCounters::LunaChannelCounters()
+    : mRequests(0), mFailures(0), mOutstanding(0), mBytesReceived(0),
+      mLatencyMicros(0)
+{
+}
+
+LunaChannelCounters::~LunaChannelCounters() {}
+
+void LunaChannelCounters::requestStarted()
+{
+    mRequests.fetch_add(1, std::memory_order_relaxed);
+    mOutstanding.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LunaChannelCounters::requestFinished(bool ok)
+{
+    if (!ok)
+    {
+        mFailures.fetch_add(1, std::memory_order_relaxed);
+    }
+    mOutstanding.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void LunaChannelCounters::addBytes(size_t bytes)
+{
+    mBytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void LunaChannelCounters::recordLatency(uint64_t micros)
+{
+    // An exponentially weighted moving average with a weight of 1/8 for
+    // each new value. The first value seeds the average.
+    uint64_t average = mLatencyMicros.load(std::memory_order_relaxed);
+    uint64_t updated = 0;
+    do
+    {
+        if (average == 0)
+        {
+            updated = micros;
+        }
+        else
+        {
+            int64_t delta = static_cast<int64_t>(micros) -
+                            static_cast<int64_t>(average);
+            updated = static_cast<uint64_t>(
+                static_cast<int64_t>(average) + delta / 8);
+        }
+    } while (!mLatencyMicros.compare_exchange_weak(
+        average, updated, std::memory_order_relaxed));
+}
+
+uint64_t LunaChannelCounters::outstanding() const
+{
+    return mOutstanding.load(std::memory_order_relaxed);
+}
+
+uint64_t LunaChannelCounters::latency() const
+{
+    return mLatencyMicros.load(std::memory_order_relaxed);
+}
+
+LunaChannelStats LunaChannelCounters::snapshot() const
+{
+    LunaChannelStats stats;
+    stats.requests = mRequests.load(std::memory_order_relaxed);
+    stats.failures = mFailures.load(std::memory_order_relaxed);
+    stats.outstanding = mOutstanding.load(std::memory_order_relaxed);
+    stats.bytesReceived = mBytesReceived.load(std::memory_order_relaxed);
+    stats.latencyMicros = mLatencyMicros.load(std::memory_order_relaxed);
+    return stats;
+}
+
+LunaRequestTracker::LunaRequestTracker(
+    const std::shared_ptr<LunaChannelCounters> &counters)
+    : mCounters(counters), mStarted(std::chrono::steady_clock::now()),
+      mFinished(false), mReceived(false)
+{
+    mCounters->requestStarted();
+}
+
+LunaRequestTracker::~LunaRequestTracker() { this->finish(false); }
+
+void LunaRequestTracker::addBytes(size_t bytes)
+{
+    if (!mReceived.exchange(true))
+    {
+        mCounters->recordLatency(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - mStarted)
+                .count());
+    }
+    mCounters->addBytes(bytes);
+}
+
+void LunaRequestTracker::finish(bool ok)
+{
+    if (!mFinished.exchange(true))
+    {
+        mCounters->requestFinished(ok);
+    }
+}
@@ -0,0 +1,97 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_CHANNEL_STATS_H
+#define LUNA_CHANNEL_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+//! LunaChannelStats is a snapshot of the synthesis requests that have
+//! been sent over a single client channel.
+struct LunaChannelStats
+{
+    //! Total number of synthesis requests started.
+    uint64_t requests = 0;
+
+    //! Number of requests that finished with an error.
+    uint64_t failures = 0;
+
+    //! Number of requests that are currently in flight.
+    uint64_t outstanding = 0;
+
+    //! Total number of audio bytes received.
+    uint64_t bytesReceived = 0;
+
+    //! Moving average of the time until the first audio of a request
+    //! arrives, in microseconds. Zero until a request has received audio.
+    uint64_t latencyMicros = 0;
+
+    //! False while a LunaClientPool has ejected the channel because its
+    //! health checks are failing.
+    bool healthy = true;
+};
+
+//! LunaChannelCounters accumulates LunaChannelStats. All methods are
+//! thread-safe and lock-free.
+class LunaChannelCounters
+{
+public:
+    LunaChannelCounters();
+    ~LunaChannelCounters();
+
+    void requestStarted();
+    void requestFinished(bool ok);
+    void addBytes(size_t bytes);
+
+    //! Add a time to first audio to the moving average.
+    void recordLatency(uint64_t micros);
+
+    //! Returns the number of requests currently in flight.
+    uint64_t outstanding() const;
+
+    //! Returns the moving average of the time to first audio.
+    uint64_t latency() const;
+
+    //! Returns a copy of the current counter values.
+    LunaChannelStats snapshot() const;
+
+private:
+    std::atomic<uint64_t> mRequests;
+    std::atomic<uint64_t> mFailures;
+    std::atomic<uint64_t> mOutstanding;
+    std::atomic<uint64_t> mBytesReceived;
+    std::atomic<uint64_t> mLatencyMicros;
+};
+
+//! LunaRequestTracker counts a single request against a set of
+//! LunaChannelCounters. The request is started when the tracker is
+//! created, and finished either by calling finish() or, if that never
+//! happens, as a failure when the tracker is destroyed.
+class LunaRequestTracker
+{
+public:
+    LunaRequestTracker(const std::shared_ptr<LunaChannelCounters> &counters);
+    ~LunaRequestTracker();
+
+    //! Count received audio. The first call also records the time since
+    //! the request started as its latency.
+    void addBytes(size_t bytes);
+
+    //! Mark the request as finished. Only the first call has an effect.
+    void finish(bool ok);
+
+private:
+    std::shared_ptr<LunaChannelCounters> mCounters;
+    std::chrono::steady_clock::time_point mStarted;
+    std::atomic<bool> mFinished;
+    std::atomic<bool> mReceived;
+
+    // Disable copy construction and assignments.
+    LunaRequestTracker(const LunaRequestTracker &other);
+    LunaRequestTracker &operator=(const LunaRequestTracker &other);
+};
+
+#endif // LUNA_CHANNEL_STATS_H
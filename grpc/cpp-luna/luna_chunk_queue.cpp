@@ -0,0 +1,76 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_chunk_queue.h"
+
+LunaChunkQueue::LunaChunkQueue() : mState(new State) {}
+
+LunaChunkQueue::~LunaChunkQueue() {}
+
+LunaAudioCallback LunaChunkQueue::onAudio() const
+{
+    std::shared_ptr<State> state = mState;
+    return [state](std::string &audio) {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->chunks.push_back(std::string());
+            state->chunks.back().swap(audio);
+        }
+        state->cv.notify_all();
+    };
+}
+
+LunaFinishCallback LunaChunkQueue::onFinish() const
+{
+    std::shared_ptr<State> state = mState;
+    return [state](const grpc::Status &status) {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->done = true;
+            state->status = status;
+        }
+        state->cv.notify_all();
+    };
+}
+
+void LunaChunkQueue::takeQueued(std::vector<std::string> &chunks)
+{
+    std::lock_guard<std::mutex> lock(mState->mutex);
+    while (!mState->chunks.empty())
+    {
+        chunks.push_back(std::string());
+        chunks.back().swap(mState->chunks.front());
+        mState->chunks.pop_front();
+    }
+}
+
+bool LunaChunkQueue::Read(cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    std::unique_lock<std::mutex> lock(mState->mutex);
+    mState->cv.wait(lock, [this]() {
+        return !mState->chunks.empty() || mState->done;
+    });
+    if (mState->chunks.empty())
+    {
+        return false;
+    }
+
+    msg->mutable_audio()->swap(mState->chunks.front());
+    mState->chunks.pop_front();
+    return true;
+}
+
+bool LunaChunkQueue::NextMessageSize(uint32_t *sz)
+{
+    // The size of the next chunk isn't known until it arrives.
+    *sz = 0;
+    return true;
+}
+
+grpc::Status LunaChunkQueue::Finish()
+{
+    std::unique_lock<std::mutex> lock(mState->mutex);
+    mState->cv.wait(lock, [this]() { return mState->done; });
+    return mState->status;
+}
+
+void LunaChunkQueue::WaitForInitialMetadata() {}
@@ -0,0 +1,56 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_CHUNK_QUEUE_H
+#define LUNA_CHUNK_QUEUE_H
+
+#include "luna.grpc.pb.h"
+#include "luna_async_call.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//! LunaChunkQueue reads a streaming synthesis started with callbacks,
+//! such as LunaClient::synthesizeStreamAsync(), as if it were the reader
+//! of a SynthesizeStream call. The callbacks queue the chunks as they
+//! arrive. A consumer that falls behind can take every queued chunk at
+//! once with takeQueued(), to write them with a single vectored write.
+class LunaChunkQueue
+    : public grpc::ClientReaderInterface<cobaltspeech::luna::SynthesizeResponse>
+{
+public:
+    LunaChunkQueue();
+    ~LunaChunkQueue() override;
+
+    //! Returns the callbacks to start the request with. They may be
+    //! called after the queue is destroyed.
+    LunaAudioCallback onAudio() const;
+    LunaFinishCallback onFinish() const;
+
+    //! Append the chunks that have already arrived to the given vector,
+    //! without waiting for more.
+    void takeQueued(std::vector<std::string> &chunks);
+
+    bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+    bool NextMessageSize(uint32_t *sz) override;
+    grpc::Status Finish() override;
+    void WaitForInitialMetadata() override;
+
+private:
+    // State shared with the callbacks
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::string> chunks;
+        bool done = false;
+        grpc::Status status;
+    };
+
+    std::shared_ptr<State> mState;
+};
+
+#endif // LUNA_CHUNK_QUEUE_H
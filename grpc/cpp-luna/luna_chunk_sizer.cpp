@@ -0,0 +1,231 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_chunk_sizer.h"
+
+#include <algorithm>
+
+namespace
+{
+
+// The weight given to each new request in the moving averages.
+const double kAverageWeight = 0.125;
+
+void updateAverage(double &average, double value, bool first)
+{
+    average = first ? value : average + kAverageWeight * (value - average);
+}
+
+} // namespace
+
+LunaChunkSizer::LunaChunkSizer(const LunaChunkSizingPolicy &policy)
+    : mPolicy(policy)
+{
+    mPolicy.minSamples = std::max(mPolicy.minSamples, 1u);
+    mPolicy.maxSamples = std::max(mPolicy.maxSamples, mPolicy.minSamples);
+    mStats.nSamples = std::min(
+        std::max(mPolicy.initialSamples, mPolicy.minSamples),
+        mPolicy.maxSamples);
+}
+
+LunaChunkSizer::~LunaChunkSizer() {}
+
+const LunaChunkSizingPolicy &LunaChunkSizer::policy() const
+{
+    return mPolicy;
+}
+
+unsigned int LunaChunkSizer::nSamples() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats.nSamples;
+}
+
+void LunaChunkSizer::recordRequest(unsigned int nSamples,
+                                   std::chrono::microseconds firstChunk,
+                                   uint64_t chunks, uint64_t underruns,
+                                   double samplesPerSecond)
+{
+    if (chunks == 0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    bool first = mStats.requests == 0;
+    mStats.requests++;
+    mStats.chunks += chunks;
+    mStats.underruns += underruns;
+
+    double firstMillis = firstChunk.count() / 1000.0;
+    updateAverage(mStats.firstChunkMillis, firstMillis, first);
+    updateAverage(mStats.underrunRate, double(underruns) / chunks, first);
+    if (samplesPerSecond > 0)
+    {
+        updateAverage(mStats.samplesPerSecond, samplesPerSecond,
+                      mStats.samplesPerSecond == 0);
+    }
+
+    // Whatever of the first chunk's latency is not production time is
+    // taken to be the network
+    if (mStats.samplesPerSecond > 0)
+    {
+        double production = 1000.0 * nSamples / mStats.samplesPerSecond;
+        updateAverage(mStats.rttMillis,
+                      std::max(firstMillis - production, 0.0), first);
+    }
+
+    double target = double(mPolicy.targetFirstChunk.count());
+    unsigned int next = mStats.nSamples;
+    if (mStats.firstChunkMillis > target)
+    {
+        next = mStats.nSamples / 2;
+    }
+    else if (mStats.underrunRate > mPolicy.underrunBudget)
+    {
+        next = mStats.nSamples + mStats.nSamples / 2;
+    }
+    else if (mStats.samplesPerSecond > 0)
+    {
+        unsigned int larger = mStats.nSamples + mStats.nSamples / 8 + 1;
+        double predicted =
+            mStats.rttMillis + 1000.0 * larger / mStats.samplesPerSecond;
+        if (predicted <= target)
+        {
+            next = larger;
+        }
+    }
+
+    next = std::min(std::max(next, mPolicy.minSamples), mPolicy.maxSamples);
+    if (next > mStats.nSamples)
+    {
+        mStats.increases++;
+    }
+    else if (next < mStats.nSamples)
+    {
+        mStats.decreases++;
+    }
+    mStats.nSamples = next;
+}
+
+LunaChunkSizingStats LunaChunkSizer::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+LunaChunkSizer::LunaChunkSizer(const LunaChunkSizer &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy sizer objects.
+}
+
+LunaChunkSizer &LunaChunkSizer::operator=(const LunaChunkSizer &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy sizer objects.
+    return *this;
+}
+
+LunaChunkProbe::LunaChunkProbe(const std::shared_ptr<LunaChunkSizer> &sizer,
+                               unsigned int nSamples, unsigned int sampleRate,
+                               size_t bytesPerSample)
+    : mSizer(sizer), mNSamples(nSamples), mSampleRate(sampleRate),
+      mBytesPerSample(std::max<size_t>(bytesPerSample, 1)),
+      mStart(Clock::now()), mBuffered(0), mChunks(0), mUnderruns(0),
+      mLaterSamples(0), mFinished(false)
+{
+}
+
+LunaChunkProbe::~LunaChunkProbe() {}
+
+void LunaChunkProbe::chunk(size_t bytes)
+{
+    Clock::time_point now = Clock::now();
+    uint64_t samples = bytes / mBytesPerSample;
+    if (mChunks == 0)
+    {
+        mFirstChunk = now;
+        mPlayStart = now;
+    }
+    else
+    {
+        mLaterSamples += samples;
+
+        // The listener ran out before this chunk arrived, and resumes
+        // playing now
+        if (mSampleRate > 0 && now - mPlayStart > mBuffered)
+        {
+            mUnderruns++;
+            mPlayStart = now - std::chrono::duration_cast<Clock::duration>(
+                                   mBuffered);
+        }
+    }
+
+    if (mSampleRate > 0)
+    {
+        mBuffered += std::chrono::duration<double>(double(samples) /
+                                                   mSampleRate);
+    }
+    mLastChunk = now;
+    mChunks++;
+}
+
+void LunaChunkProbe::finish(bool ok)
+{
+    if (mFinished || !ok || mChunks == 0)
+    {
+        mFinished = true;
+        return;
+    }
+    mFinished = true;
+
+    double rate = 0;
+    std::chrono::duration<double> later = mLastChunk - mFirstChunk;
+    if (mChunks > 1 && later.count() > 0)
+    {
+        rate = mLaterSamples / later.count();
+    }
+
+    mSizer->recordRequest(
+        mNSamples,
+        std::chrono::duration_cast<std::chrono::microseconds>(mFirstChunk -
+                                                              mStart),
+        mChunks, mUnderruns, rate);
+}
+
+LunaChunkProbeReader::LunaChunkProbeReader(
+    const LunaSynthesizerStream::LunaReader &reader,
+    const std::shared_ptr<LunaChunkProbe> &probe)
+    : mReader(reader), mProbe(probe)
+{
+}
+
+LunaChunkProbeReader::~LunaChunkProbeReader() {}
+
+bool LunaChunkProbeReader::Read(cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    if (!mReader->Read(msg))
+    {
+        return false;
+    }
+
+    mProbe->chunk(msg->audio().size());
+    return true;
+}
+
+bool LunaChunkProbeReader::NextMessageSize(uint32_t *sz)
+{
+    return mReader->NextMessageSize(sz);
+}
+
+grpc::Status LunaChunkProbeReader::Finish()
+{
+    grpc::Status status = mReader->Finish();
+    mProbe->finish(status.ok());
+    return status;
+}
+
+void LunaChunkProbeReader::WaitForInitialMetadata()
+{
+    mReader->WaitForInitialMetadata();
+}
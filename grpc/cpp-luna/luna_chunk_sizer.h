@@ -0,0 +1,173 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_CHUNK_SIZER_H
+#define LUNA_CHUNK_SIZER_H
+
+#include "luna.grpc.pb.h"
+#include "luna_synthesizer_stream.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+//! LunaChunkSizingPolicy configures a LunaChunkSizer. Small chunks get
+//! audio to the listener sooner but cost a message each; large chunks
+//! are cheaper to send but take longer to arrive and need more buffer.
+struct LunaChunkSizingPolicy
+{
+    //! The target time from sending a request to receiving its first
+    //! chunk of audio.
+    std::chrono::milliseconds targetFirstChunk =
+        std::chrono::milliseconds(200);
+
+    //! The fraction of chunks allowed to underrun, i.e. to arrive after a
+    //! listener playing the audio in real time would have run out.
+    double underrunBudget = 0.02;
+
+    //! Bounds for n_samples, and the value used until there are
+    //! measurements to go on.
+    unsigned int minSamples = 256;
+    unsigned int maxSamples = 32768;
+    unsigned int initialSamples = 2048;
+};
+
+//! The state of a LunaChunkSizer and what it has observed. Rates and
+//! times are moving averages over recent requests.
+struct LunaChunkSizingStats
+{
+    //! The n_samples the next request will use.
+    unsigned int nSamples = 0;
+
+    //! The time to first audio.
+    double firstChunkMillis = 0;
+
+    //! The network round trip time, estimated by taking the time the
+    //! server needs to produce the first chunk from the time to first
+    //! audio.
+    double rttMillis = 0;
+
+    //! The rate audio arrives after the first chunk, in samples per
+    //! second.
+    double samplesPerSecond = 0;
+
+    //! The fraction of chunks that underran.
+    double underrunRate = 0;
+
+    //! Totals over all the observed requests.
+    uint64_t requests = 0;
+    uint64_t chunks = 0;
+    uint64_t underruns = 0;
+
+    //! The number of times n_samples was raised or lowered.
+    uint64_t increases = 0;
+    uint64_t decreases = 0;
+};
+
+//! LunaChunkSizer picks n_samples for streaming requests from how
+//! earlier requests went. It halves n_samples while the time to first
+//! audio is over the target, raises it by half while underruns are over
+//! budget, and otherwise grows it slowly to cut the number of messages,
+//! as long as the predicted time to first audio (the round trip time
+//! plus the time to produce one chunk) stays within the target. When
+//! the two targets conflict, the latency target wins.
+//!
+//! Attach a sizer to a client with LunaClient::setChunkSizer(). All
+//! methods are thread-safe.
+class LunaChunkSizer
+{
+public:
+    LunaChunkSizer(
+        const LunaChunkSizingPolicy &policy = LunaChunkSizingPolicy());
+    ~LunaChunkSizer();
+
+    const LunaChunkSizingPolicy &policy() const;
+
+    //! Returns the n_samples to use for the next request.
+    unsigned int nSamples() const;
+
+    //! Record a finished request that used the given n_samples. The
+    //! arrival rate is zero if the request had only one chunk.
+    void recordRequest(unsigned int nSamples,
+                       std::chrono::microseconds firstChunk, uint64_t chunks,
+                       uint64_t underruns, double samplesPerSecond);
+
+    LunaChunkSizingStats stats() const;
+
+private:
+    LunaChunkSizingPolicy mPolicy;
+
+    mutable std::mutex mMutex;
+    LunaChunkSizingStats mStats;
+
+    // Disable copy construction and assignments.
+    LunaChunkSizer(const LunaChunkSizer &other);
+    LunaChunkSizer &operator=(const LunaChunkSizer &other);
+};
+
+//! LunaChunkProbe times the chunks of one streaming request and reports
+//! them to a LunaChunkSizer when the request finishes. Underruns are
+//! counted by modelling a listener that starts playing the audio in real
+//! time as soon as the first chunk arrives.
+class LunaChunkProbe
+{
+public:
+    //! Create a probe for a request that asked for nSamples per chunk.
+    //! If the sample rate is not known, pass zero and no underruns are
+    //! counted.
+    LunaChunkProbe(const std::shared_ptr<LunaChunkSizer> &sizer,
+                   unsigned int nSamples, unsigned int sampleRate,
+                   size_t bytesPerSample);
+    ~LunaChunkProbe();
+
+    //! Record a chunk of audio as it arrives.
+    void chunk(size_t bytes);
+
+    //! Record the end of the request. Only successful requests that
+    //! received audio are reported to the sizer.
+    void finish(bool ok);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::shared_ptr<LunaChunkSizer> mSizer;
+    unsigned int mNSamples;
+    unsigned int mSampleRate;
+    size_t mBytesPerSample;
+
+    Clock::time_point mStart;
+    Clock::time_point mFirstChunk;
+    Clock::time_point mLastChunk;
+
+    // When the modelled playback started (moved later by underruns), and
+    // how much audio it has been given.
+    Clock::time_point mPlayStart;
+    std::chrono::duration<double> mBuffered;
+
+    uint64_t mChunks;
+    uint64_t mUnderruns;
+    uint64_t mLaterSamples;
+    bool mFinished;
+};
+
+//! LunaChunkProbeReader wraps the reader of a SynthesizeStream call and
+//! reports its chunks to a LunaChunkProbe.
+class LunaChunkProbeReader
+    : public grpc::ClientReaderInterface<cobaltspeech::luna::SynthesizeResponse>
+{
+public:
+    LunaChunkProbeReader(const LunaSynthesizerStream::LunaReader &reader,
+                         const std::shared_ptr<LunaChunkProbe> &probe);
+    ~LunaChunkProbeReader() override;
+
+    bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+    bool NextMessageSize(uint32_t *sz) override;
+    grpc::Status Finish() override;
+    void WaitForInitialMetadata() override;
+
+private:
+    LunaSynthesizerStream::LunaReader mReader;
+    std::shared_ptr<LunaChunkProbe> mProbe;
+};
+
+#endif // LUNA_CHUNK_SIZER_H
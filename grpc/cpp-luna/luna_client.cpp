@@ -2,23 +2,113 @@
 
 #include "luna_client.h"
 
+#include "luna_audio.h"
+#include "luna_cache_reader.h"
+#include "luna_chunk_queue.h"
 #include "luna_exception.h"
+#include "luna_ordered_reader.h"
+#include "luna_request_arena.h"
+#include "luna_text_segmenter.h"
 
+#include <algorithm>
+#include <cassert>
 #include <chrono>
+#include <exception>
 #include <grpc/grpc.h>
 #include <grpcpp/channel.h>
 #include <grpcpp/client_context.h>
 #include <grpcpp/create_channel.h>
 #include <grpcpp/security/credentials.h>
 
+namespace
+{
+
+// Returns the sample rate of the requested voice, or zero if it is not
+// listed in the given metadata (or there is none).
+unsigned int sampleRate(const LunaServerInfo *info,
+                        const cobaltspeech::luna::SynthesizerConfig &config)
+{
+    if (!info)
+    {
+        return 0;
+    }
+
+    const LunaVoice *voice = info->findVoice(config.voice_id());
+    if (!voice && config.voice_id().empty() && !info->voices().empty())
+    {
+        voice = &info->voices().front();
+    }
+    return voice ? voice->sampleRate() : 0;
+}
+
+} // namespace
+
 LunaClient::LunaClient(const std::string &url, bool secureConnection)
-    : mLunaVersion(""), mTimeout(30000)
+    : LunaClient(
+          createChannel(url, secureConnection, grpc::ChannelArguments()))
+{
+}
+
+LunaClient::LunaClient(const std::string &url, bool secureConnection,
+                       const std::shared_ptr<LunaMetrics> &metrics)
+    : LunaClient(createChannel(url, secureConnection, grpc::ChannelArguments(),
+                               metricsInterceptors(metrics)))
+{
+}
+
+LunaClient::LunaClient(const std::shared_ptr<grpc::Channel> &channel)
+    : mChannel(channel), mTimeout(30000), mFirstChunkTimeout(0),
+      mIdleTimeout(0), mLargeResponseThreshold(2 * 1024 * 1024),
+      mCounters(new LunaChannelCounters), mMetadataTTL(0), mStopping(false),
+      mQueueThreads(1)
 {
     // Quick runtime check to verify that the user has linked against
     // a version of protobuf that is compatible with the version used
     // to generate the c++ files.
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 
+    // Create the stub
+    std::unique_ptr<cobaltspeech::luna::Luna::Stub> tmpStub =
+        cobaltspeech::luna::Luna::NewStub(channel);
+    mStub.swap(tmpStub);
+}
+
+LunaClient::~LunaClient()
+{
+    // Stop the warm-up before the stub and channel go away
+    mStopping = true;
+    if (mWarmUpThread.joinable())
+    {
+        mWarmUpThread.join();
+    }
+
+    // Cancel the asynchronous calls so that the completion queue does
+    // not wait for long streams to end on their own. Destroying the
+    // client from one of its callbacks would wait on the calling thread.
+    if (mQueue)
+    {
+        assert(!mQueue->onQueueThread());
+        mQueue->cancelAll();
+    }
+}
+
+std::shared_ptr<grpc::Channel>
+LunaClient::createChannel(const std::string &url, bool secureConnection,
+                          const grpc::ChannelArguments &args)
+{
+    return createChannel(
+        url, secureConnection, args,
+        std::vector<std::unique_ptr<
+            grpc::experimental::ClientInterceptorFactoryInterface>>());
+}
+
+std::shared_ptr<grpc::Channel> LunaClient::createChannel(
+    const std::string &url, bool secureConnection,
+    const grpc::ChannelArguments &args,
+    std::vector<
+        std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>>
+        interceptors)
+{
     // Setup credentials
     std::shared_ptr<grpc::ChannelCredentials> creds;
     if (secureConnection)
@@ -30,107 +120,784 @@ LunaClient::LunaClient(const std::string &url, bool secureConnection)
         creds = grpc::InsecureChannelCredentials();
     }
 
-    // Create the channel and stub
-    std::unique_ptr<cobaltspeech::luna::Luna::Stub> tmpStub =
-        cobaltspeech::luna::Luna::NewStub(grpc::CreateChannel(url, creds));
-    mStub.swap(tmpStub);
+    return grpc::experimental::CreateCustomChannelWithInterceptors(
+        url, creds, args, std::move(interceptors));
 }
 
-LunaClient::~LunaClient() {}
-
-const std::string &LunaClient::lunaVersion()
+std::vector<
+    std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>>
+LunaClient::metricsInterceptors(const std::shared_ptr<LunaMetrics> &metrics)
 {
-    // Check if we have it cached
-    if (mLunaVersion.empty())
+    std::vector<
+        std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>>
+        interceptors;
+    if (metrics)
     {
-        // Send the grpc request to get the version
-        grpc::ClientContext ctx;
-        cobaltspeech::luna::VersionRequest request;
-        cobaltspeech::luna::VersionResponse response;
-
-        this->setContextDeadline(ctx);
-        grpc::Status status = mStub->Version(&ctx, request, &response);
-        if (!status.ok())
-        {
-            throw LunaException(status);
-        }
-
-        mLunaVersion = response.version();
+        interceptors.push_back(LunaMetrics::interceptorFactory(metrics));
     }
-
-    return mLunaVersion;
+    return interceptors;
 }
 
+std::string LunaClient::lunaVersion() { return this->serverInfo()->version(); }
+
 std::vector<LunaVoice> LunaClient::listVoices()
 {
-    // Check if we have them cached
-    if (mVoices.empty())
-    {
-        // Send the grpc request to get the voices
-        grpc::ClientContext ctx;
-        cobaltspeech::luna::ListVoicesRequest request;
-        cobaltspeech::luna::ListVoicesResponse response;
+    return this->serverInfo()->voices();
+}
 
-        this->setContextDeadline(ctx);
-        grpc::Status status = mStub->ListVoices(&ctx, request, &response);
-        if (!status.ok())
+std::shared_ptr<const LunaServerInfo> LunaClient::serverInfo()
+{
+    std::shared_ptr<const LunaServerInfo> info = std::atomic_load(&mServerInfo);
+    if (!info)
+    {
+        // Nothing has been fetched yet, so wait for the first fetch. If
+        // another thread is already doing it, use its result.
+        std::lock_guard<std::mutex> lock(mInfoMutex);
+        info = std::atomic_load(&mServerInfo);
+        if (!info)
         {
-            throw LunaException(status);
+            info = this->fetchServerInfo();
         }
+        return info;
+    }
 
-        // Cache the voices
-        for (int i = 0; i < response.voices_size(); i++)
+    int64_t ttl = mMetadataTTL.load(std::memory_order_relaxed);
+    if (ttl > 0 && std::chrono::steady_clock::now() - info->fetched() >=
+                       std::chrono::seconds(ttl))
+    {
+        // The snapshot is stale. One caller refreshes it while the
+        // others keep using the old one.
+        std::unique_lock<std::mutex> lock(mInfoMutex, std::try_to_lock);
+        if (lock.owns_lock() && std::atomic_load(&mServerInfo) == info)
         {
-            LunaVoice voice(response.voices(i));
-            mVoices.push_back(voice);
+            try
+            {
+                info = this->fetchServerInfo();
+            }
+            catch (const LunaException &)
+            {
+                // Keep serving the stale metadata; the next caller will
+                // try again.
+            }
         }
     }
 
-    return mVoices;
+    return info;
+}
+
+std::shared_ptr<const LunaServerInfo> LunaClient::refreshServerInfo()
+{
+    std::lock_guard<std::mutex> lock(mInfoMutex);
+    return this->fetchServerInfo();
+}
+
+std::shared_ptr<const LunaServerInfo> LunaClient::cachedServerInfo() const
+{
+    return std::atomic_load(&mServerInfo);
+}
+
+LunaAsyncHandle LunaClient::checkHealth(
+    std::chrono::milliseconds timeout,
+    const std::function<void(const grpc::Status &)> &callback)
+{
+    LunaAsyncUnaryCall<cobaltspeech::luna::VersionResponse> *call =
+        new LunaAsyncUnaryCall<cobaltspeech::luna::VersionResponse>(
+            [callback](const grpc::Status &status,
+                       cobaltspeech::luna::VersionResponse &) {
+                callback(status);
+            });
+    call->context().set_deadline(std::chrono::system_clock::now() + timeout);
+
+    cobaltspeech::luna::VersionRequest request;
+    return call->start(mStub->PrepareAsyncVersion(&call->context(), request,
+                                                  this->completionQueue(call)));
+}
+
+void LunaClient::setMetadataTTL(std::chrono::seconds ttl)
+{
+    mMetadataTTL = ttl.count();
+}
+
+std::shared_future<std::shared_ptr<const LunaServerInfo>>
+LunaClient::warmUp(const LunaWarmUpOptions &options)
+{
+    std::lock_guard<std::mutex> lock(mWarmUpMutex);
+    if (mWarmUp.valid())
+    {
+        return mWarmUp;
+    }
+
+    std::shared_ptr<std::promise<std::shared_ptr<const LunaServerInfo>>>
+        promise(new std::promise<std::shared_ptr<const LunaServerInfo>>);
+    mWarmUp = promise->get_future().share();
+    mWarmUpThread =
+        std::thread(&LunaClient::runWarmUp, this, options, promise);
+    return mWarmUp;
 }
 
 ByteVector
 LunaClient::synthesize(const cobaltspeech::luna::SynthesizerConfig &config,
                        const std::string &text)
 {
+    std::string samples;
+    this->synthesize(config, text, samples);
+
+    ByteVector audio(samples.begin(), samples.end());
+
+    return audio;
+}
+
+void LunaClient::synthesize(const cobaltspeech::luna::SynthesizerConfig &config,
+                            const std::string &text, std::string &audio)
+{
+    std::shared_ptr<LunaTracer> tracer = std::atomic_load(&mTracer);
+    LunaTraceSpan span(tracer.get(), "synthesize", LunaTraceScope::current());
+    span.setDetail(config.voice_id());
+
+    // Check the cache first
+    std::shared_ptr<LunaSynthesisCache> cache = std::atomic_load(&mCache);
+    std::shared_ptr<LunaSingleFlight> flights =
+        std::atomic_load(&mSingleFlight);
+    std::string key;
+    if (cache || flights)
+    {
+        key = LunaSynthesisCache::makeKey(config, text);
+    }
+    if (cache)
+    {
+        std::shared_ptr<const std::string> cached = cache->lookup(key);
+        if (cached)
+        {
+            audio.assign(*cached);
+            span.setBytes(audio.size());
+            span.setDetail(config.voice_id() + " (cached)");
+            return;
+        }
+    }
+
+    // Large responses are streamed, which also caches them
+    size_t estimate = this->estimateAudioBytes(config, text);
+    if (estimate >= mLargeResponseThreshold)
+    {
+        this->synthesizeFromStream(config, text, estimate, audio);
+        span.setBytes(audio.size());
+        span.setDetail(config.voice_id() + " (streamed)");
+        return;
+    }
+
+    // Identical requests in flight share one call, which also takes
+    // care of the channel stats and the cache
+    if (flights)
+    {
+        std::promise<grpc::Status> promise;
+        std::future<grpc::Status> result = promise.get_future();
+        this->synthesizeShared(*flights, config, text, cache, key,
+                               [&promise, &audio](const grpc::Status &status,
+                                                  std::string &shared) {
+                                   audio.swap(shared);
+                                   promise.set_value(status);
+                               });
+
+        grpc::Status status = result.get();
+        span.setStatus(status.error_code());
+        if (isTooLarge(status))
+        {
+            this->synthesizeFromStream(config, text, estimate, audio);
+            span.setDetail(config.voice_id() + " (streamed)");
+        }
+        else if (!status.ok())
+        {
+            throw LunaException(status);
+        }
+
+        span.setBytes(audio.size());
+        return;
+    }
+
+    // Wait for a slot, which is held until the response arrives
+    std::chrono::steady_clock::time_point queued =
+        std::chrono::steady_clock::now();
+    std::shared_ptr<LunaSchedulerTicket> ticket = this->admit();
+
     // Setup the request
     grpc::ClientContext ctx;
     this->setContextDeadline(ctx);
+    LunaTraceScope::addMetadata(ctx);
+    LunaMetrics::labelCall(ctx, config, queued);
 
     cobaltspeech::luna::SynthesizeResponse response;
-    cobaltspeech::luna::SynthesizeRequest request;
-    request.mutable_config()->CopyFrom(config);
-    request.set_text(text);
+    LunaRequestArena arena;
+
+    LunaRequestTracker tracker(mCounters);
+    grpc::Status status =
+        mStub->Synthesize(&ctx, arena.build(config, text), &response);
+    tracker.finish(status.ok());
+    span.setStatus(status.error_code());
+
+    // The estimate was too low for the channel's receive limit. The
+    // stream waits for a slot of its own.
+    if (isTooLarge(status))
+    {
+        if (ticket)
+        {
+            ticket->release();
+        }
+        this->synthesizeFromStream(config, text, estimate, audio);
+        span.setBytes(audio.size());
+        span.setDetail(config.voice_id() + " (streamed)");
+        return;
+    }
 
-    grpc::Status status = mStub->Synthesize(&ctx, request, &response);
     if (!status.ok())
     {
         throw LunaException(status);
     }
 
-    ByteVector audio(response.audio().begin(), response.audio().end());
+    tracker.addBytes(response.audio().size());
+    span.setBytes(response.audio().size());
+    response.mutable_audio()->swap(audio);
 
-    return audio;
+    if (cache)
+    {
+        cache->insert(key, std::make_shared<std::string>(audio));
+    }
 }
 
 LunaSynthesizerStream LunaClient::synthesizeStream(
     const cobaltspeech::luna::SynthesizerConfig &config,
     const std::string &text)
 {
+    const std::string &traceId = LunaTraceScope::current();
+    std::shared_ptr<LunaTracer> tracer = std::atomic_load(&mTracer);
+    LunaTraceSpan span(tracer.get(), "synthesizeStream", traceId);
+    span.setDetail(config.voice_id());
+
+    // Replay cached audio if we have it
+    std::shared_ptr<LunaSynthesisCache> cache = std::atomic_load(&mCache);
+    std::shared_ptr<LunaSingleFlight> flights =
+        std::atomic_load(&mSingleFlight);
+    std::string key;
+    if (cache || flights)
+    {
+        key = LunaSynthesisCache::makeKey(config, text);
+    }
+    if (cache)
+    {
+        std::shared_ptr<const std::string> cached = cache->lookup(key);
+        if (cached)
+        {
+            size_t chunkBytes =
+                config.n_samples() * lunaBytesPerSample(config.encoding());
+            LunaSynthesizerStream::LunaReader replay(
+                new LunaReplayReader(cached, chunkBytes));
+            span.setDetail(config.voice_id() + " (cached)");
+
+            LunaSynthesizerStream stream(replay, nullptr);
+            stream.setTracer(tracer, traceId);
+            return stream;
+        }
+    }
+
+    // Identical streams in flight share one call
+    if (flights)
+    {
+        std::shared_ptr<LunaSingleFlight::Reader> shared = flights->subscribe(
+            "stream:" + key,
+            [this, config, text, cache, key](
+                const LunaAudioCallback &onAudio,
+                const LunaFinishCallback &onFinish) {
+                return this->startStreamAsync(config, text, cache, key,
+                                              onAudio, onFinish);
+            });
+
+        LunaSynthesizerStream stream(shared, nullptr);
+        stream.setCanceller([shared]() { shared->cancel(); });
+        stream.setTracer(tracer, traceId);
+        this->applyStreamTimeouts(stream);
+        return stream;
+    }
+
+    // Wait for a slot, which the stream holds until it is closed
+    std::chrono::steady_clock::time_point queued =
+        std::chrono::steady_clock::now();
+    std::shared_ptr<LunaSchedulerTicket> ticket = this->admit();
+
     // We need the context to exist for as long as the stream,
     // so we are creating it as a managed pointer.
     std::shared_ptr<grpc::ClientContext> ctx(new grpc::ClientContext);
     this->setContextDeadline(*ctx);
+    LunaTraceScope::addMetadata(*ctx);
+    LunaMetrics::labelCall(*ctx, config, queued);
+
+    cobaltspeech::luna::SynthesizerConfig sized;
+    std::shared_ptr<LunaChunkProbe> probe = this->sizeChunks(config, sized);
+
+    // Create the grpc reader. The request is sent before the reader is
+    // returned, so it can be built on a local arena.
+    LunaRequestArena arena;
+    std::shared_ptr<LunaRequestTracker> tracker(
+        new LunaRequestTracker(mCounters));
+    LunaSynthesizerStream::LunaReader reader(mStub->SynthesizeStream(
+        ctx.get(), arena.build(probe ? sized : config, text)));
+    if (probe)
+    {
+        reader.reset(new LunaChunkProbeReader(reader, probe));
+    }
+
+    // Record the audio for the cache as it is received
+    if (cache)
+    {
+        reader.reset(new LunaCachingReader(reader, cache, key));
+    }
+
+    if (ticket)
+    {
+        reader.reset(new LunaScheduledReader(reader, ticket));
+    }
+
+    LunaSynthesizerStream stream(reader, ctx, tracker);
+    stream.setTracer(tracer, traceId);
+    this->applyStreamTimeouts(stream);
+    return stream;
+}
+
+void LunaClient::synthesizeTo(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, LunaAudioSink &sink)
+{
+    LunaAudioFormat format;
+    format.sampleRate = this->voiceSampleRate(config);
+    format.encoding = config.encoding();
+    sink.begin(format);
+
+    const std::string &traceId = LunaTraceScope::current();
+    std::shared_ptr<LunaTracer> tracer = std::atomic_load(&mTracer);
+    LunaTraceSpan span(tracer.get(), "synthesizeTo", traceId);
+    span.setDetail(config.voice_id());
+
+    try
+    {
+        // The chunks are queued as they arrive. Whenever the sink falls
+        // behind, every chunk that is waiting goes to it in one call.
+        std::shared_ptr<LunaChunkQueue> queue(new LunaChunkQueue);
+        LunaAsyncHandle handle = this->synthesizeStreamAsync(
+            config, text, queue->onAudio(), queue->onFinish());
+        LunaSynthesizerStream stream(queue, nullptr);
+        stream.setCanceller([handle]() { handle.cancel(); });
+        stream.setTracer(tracer, traceId);
+        this->applyStreamTimeouts(stream);
+
+        std::vector<std::string> chunks(1);
+        std::vector<LunaAudioChunk> pieces;
+        size_t bytes = 0;
+        try
+        {
+            while (stream.receiveAudio(chunks[0]))
+            {
+                chunks.resize(1);
+                queue->takeQueued(chunks);
+
+                pieces.clear();
+                for (const std::string &chunk : chunks)
+                {
+                    LunaAudioChunk piece = {chunk.data(), chunk.size()};
+                    pieces.push_back(piece);
+                    bytes += chunk.size();
+                }
+                sink.writeChunks(pieces.data(), pieces.size());
+            }
+        }
+        catch (...)
+        {
+            // The sink failed, so stop the server from synthesizing more
+            stream.cancel();
+            throw;
+        }
+        stream.close();
+        span.setBytes(bytes);
+    }
+    catch (...)
+    {
+        sink.abort();
+        throw;
+    }
+
+    sink.finish();
+}
+
+LunaSynthesizerStream LunaClient::synthesizeStreamParallel(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, unsigned int maxParallel)
+{
+    // Segments are launched later, from whichever thread reads the
+    // stream, so carry the caller's trace ID and priority over to them.
+    std::string traceId = LunaTraceScope::current();
+    LunaPriority priority = LunaPriorityScope::current();
+    std::shared_ptr<LunaOrderedReader> reader(new LunaOrderedReader(
+        [this, config, traceId, priority](const std::string &segment,
+                                          const LunaAudioCallback &onAudio,
+                                          const LunaFinishCallback &onFinish) {
+            LunaTraceScope scope(traceId);
+            LunaPriorityScope priorityScope(priority);
+            return this->synthesizeStreamAsync(config, segment, onAudio,
+                                               onFinish);
+        },
+        maxParallel));
+
+    for (const std::string &segment : LunaTextSegmenter::split(text))
+    {
+        reader->addSegment(segment);
+    }
+    reader->finishSegments();
+
+    LunaSynthesizerStream stream(reader, nullptr);
+    stream.setCanceller([reader]() { reader->cancel(); });
+    stream.setTracer(std::atomic_load(&mTracer), traceId);
+    this->applyStreamTimeouts(stream);
+    return stream;
+}
+
+std::unique_ptr<LunaSynthesisSession>
+LunaClient::startSession(const cobaltspeech::luna::SynthesizerConfig &config,
+                         unsigned int maxParallel)
+{
+    std::string traceId = LunaTraceScope::current();
+    LunaPriority priority = LunaPriorityScope::current();
+    std::unique_ptr<LunaSynthesisSession> session(new LunaSynthesisSession(
+        [this, config, traceId, priority](const std::string &segment,
+                                          const LunaAudioCallback &onAudio,
+                                          const LunaFinishCallback &onFinish) {
+            LunaTraceScope scope(traceId);
+            LunaPriorityScope priorityScope(priority);
+            return this->synthesizeStreamAsync(config, segment, onAudio,
+                                               onFinish);
+        },
+        maxParallel));
+    session->stream().setTracer(std::atomic_load(&mTracer), traceId);
+    return session;
+}
+
+LunaAsyncHandle LunaClient::synthesizeAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const LunaSynthesizeCallback &callback,
+    bool singleFlight)
+{
+    std::shared_ptr<LunaSynthesisCache> cache = std::atomic_load(&mCache);
+    std::shared_ptr<LunaSingleFlight> flights =
+        std::atomic_load(&mSingleFlight);
+    std::string key;
+    if (cache || flights)
+    {
+        key = LunaSynthesisCache::makeKey(config, text);
+    }
+    if (cache)
+    {
+        std::shared_ptr<const std::string> cached = cache->lookup(key);
+        if (cached)
+        {
+            std::string audio(*cached);
+            callback(grpc::Status::OK, audio);
+            return LunaAsyncHandle();
+        }
+    }
+
+    if (flights && singleFlight)
+    {
+        return this->synthesizeShared(*flights, config, text, cache, key,
+                                      callback);
+    }
+    return this->startSynthesizeAsync(config, text, cache, key, callback);
+}
+
+LunaAsyncHandle LunaClient::startSynthesizeAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const std::shared_ptr<LunaSynthesisCache> &cache,
+    const std::string &key, const LunaSynthesizeCallback &callback)
+{
+    std::chrono::steady_clock::time_point queued =
+        std::chrono::steady_clock::now();
+    std::shared_ptr<LunaScheduler> scheduler = std::atomic_load(&mScheduler);
+    if (!scheduler)
+    {
+        return this->sendSynthesizeAsync(config, text, cache, key, callback,
+                                         queued);
+    }
+
+    // The call may be sent later from the thread that frees a slot, so
+    // carry the caller's trace ID over to it
+    std::string traceId = LunaTraceScope::current();
+    return scheduler->submit(
+        LunaPriorityScope::current(),
+        [this, config, text, cache, key, callback, traceId,
+         queued](const std::shared_ptr<LunaSchedulerTicket> &ticket) {
+            LunaTraceScope scope(traceId);
+            return this->sendSynthesizeAsync(
+                config, text, cache, key,
+                [ticket, callback](const grpc::Status &status,
+                                   std::string &audio) {
+                    ticket->release();
+                    callback(status, audio);
+                },
+                queued);
+        },
+        [callback](const grpc::Status &status) {
+            std::string audio;
+            callback(status, audio);
+        });
+}
+
+LunaAsyncHandle LunaClient::sendSynthesizeAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const std::shared_ptr<LunaSynthesisCache> &cache,
+    const std::string &key, const LunaSynthesizeCallback &callback,
+    std::chrono::steady_clock::time_point queued)
+{
+    // Adapt the user's callback to receive just the audio
+    std::shared_ptr<LunaRequestTracker> tracker(
+        new LunaRequestTracker(mCounters));
+    LunaAsyncUnaryCall<cobaltspeech::luna::SynthesizeResponse> *call =
+        new LunaAsyncUnaryCall<cobaltspeech::luna::SynthesizeResponse>(
+            [callback, tracker, cache, key](
+                const grpc::Status &status,
+                cobaltspeech::luna::SynthesizeResponse &response) {
+                if (status.ok())
+                {
+                    tracker->addBytes(response.audio().size());
+                }
+                tracker->finish(status.ok());
+                if (cache && status.ok())
+                {
+                    cache->insert(key, std::make_shared<std::string>(
+                                           response.audio()));
+                }
+                callback(status, *response.mutable_audio());
+            });
+    this->setContextDeadline(call->context());
+    LunaTraceScope::addMetadata(call->context());
+    LunaMetrics::labelCall(call->context(), config, queued);
+
+    // The request is serialized by PrepareAsync, so it does not need
+    // to outlive this function.
+    LunaRequestArena arena;
+    return call->start(mStub->PrepareAsyncSynthesize(
+        &call->context(), arena.build(config, text),
+        this->completionQueue(call)));
+}
+
+LunaAsyncHandle LunaClient::synthesizeShared(
+    LunaSingleFlight &flights,
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const std::shared_ptr<LunaSynthesisCache> &cache,
+    const std::string &key, const LunaSynthesizeCallback &callback)
+{
+    // The batch response arrives as a single chunk, which each subscriber
+    // gets its own copy of
+    std::shared_ptr<std::string> audio = std::make_shared<std::string>();
+    return flights.subscribe(
+        "batch:" + key,
+        [this, config, text, cache, key](const LunaAudioCallback &onAudio,
+                                         const LunaFinishCallback &onFinish) {
+            return this->startSynthesizeAsync(
+                config, text, cache, key,
+                [onAudio, onFinish](const grpc::Status &status,
+                                    std::string &result) {
+                    if (status.ok())
+                    {
+                        onAudio(result);
+                    }
+                    onFinish(status);
+                });
+        },
+        [audio](std::string &chunk) {
+            if (audio->empty())
+            {
+                audio->swap(chunk);
+            }
+            else
+            {
+                audio->append(chunk);
+            }
+        },
+        [audio, callback](const grpc::Status &status) {
+            if (!status.ok())
+            {
+                audio->clear();
+            }
+            callback(status, *audio);
+        });
+}
+
+std::future<ByteVector>
+LunaClient::synthesizeAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                            const std::string &text)
+{
+    std::shared_ptr<std::promise<ByteVector>> promise(
+        new std::promise<ByteVector>);
+
+    this->synthesizeAsync(
+        config, text,
+        [promise](const grpc::Status &status, std::string &audio) {
+            if (!status.ok())
+            {
+                promise->set_exception(
+                    std::make_exception_ptr(LunaException(status)));
+                return;
+            }
+
+            promise->set_value(ByteVector(audio.begin(), audio.end()));
+        });
+
+    return promise->get_future();
+}
 
-    // Create the grpc reader
-    cobaltspeech::luna::SynthesizeRequest request;
-    request.mutable_config()->CopyFrom(config);
-    request.set_text(text);
+LunaAsyncHandle LunaClient::synthesizeStreamAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const LunaAudioCallback &onAudio,
+    const LunaFinishCallback &onFinish, bool singleFlight)
+{
+    std::shared_ptr<LunaSynthesisCache> cache = std::atomic_load(&mCache);
+    std::shared_ptr<LunaSingleFlight> flights =
+        std::atomic_load(&mSingleFlight);
+    std::string key;
+    if (cache || flights)
+    {
+        key = LunaSynthesisCache::makeKey(config, text);
+    }
+    if (cache)
+    {
+        std::shared_ptr<const std::string> cached = cache->lookup(key);
+        if (cached)
+        {
+            LunaReplayReader replay(cached, config.n_samples() *
+                                                lunaBytesPerSample(
+                                                    config.encoding()));
+            cobaltspeech::luna::SynthesizeResponse response;
+            while (replay.Read(&response))
+            {
+                onAudio(*response.mutable_audio());
+            }
+            onFinish(grpc::Status::OK);
+            return LunaAsyncHandle();
+        }
+    }
 
-    std::shared_ptr<grpc::ClientReader<cobaltspeech::luna::SynthesizeResponse>>
-        reader(mStub->SynthesizeStream(ctx.get(), request));
+    if (flights && singleFlight)
+    {
+        return flights->subscribe(
+            "stream:" + key,
+            [this, config, text, cache, key](const LunaAudioCallback &audio,
+                                             const LunaFinishCallback &finish) {
+                return this->startStreamAsync(config, text, cache, key, audio,
+                                              finish);
+            },
+            onAudio, onFinish);
+    }
+    return this->startStreamAsync(config, text, cache, key, onAudio, onFinish);
+}
 
-    return LunaSynthesizerStream(reader, ctx);
+LunaAsyncHandle LunaClient::startStreamAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const std::shared_ptr<LunaSynthesisCache> &cache,
+    const std::string &key, const LunaAudioCallback &onAudio,
+    const LunaFinishCallback &onFinish)
+{
+    std::chrono::steady_clock::time_point queued =
+        std::chrono::steady_clock::now();
+    std::shared_ptr<LunaScheduler> scheduler = std::atomic_load(&mScheduler);
+    if (!scheduler)
+    {
+        return this->sendStreamAsync(config, text, cache, key, onAudio,
+                                     onFinish, queued);
+    }
+
+    std::string traceId = LunaTraceScope::current();
+    return scheduler->submit(
+        LunaPriorityScope::current(),
+        [this, config, text, cache, key, onAudio, onFinish, traceId,
+         queued](const std::shared_ptr<LunaSchedulerTicket> &ticket) {
+            LunaTraceScope scope(traceId);
+            return this->sendStreamAsync(
+                config, text, cache, key, onAudio,
+                [ticket, onFinish](const grpc::Status &status) {
+                    ticket->release();
+                    onFinish(status);
+                },
+                queued);
+        },
+        onFinish);
+}
+
+LunaAsyncHandle LunaClient::sendStreamAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const std::shared_ptr<LunaSynthesisCache> &cache,
+    const std::string &key, const LunaAudioCallback &onAudio,
+    const LunaFinishCallback &onFinish,
+    std::chrono::steady_clock::time_point queued)
+{
+    // When caching, the audio is recorded as it passes through
+    std::shared_ptr<std::string> recorded;
+    if (cache)
+    {
+        recorded = std::make_shared<std::string>();
+    }
+
+    cobaltspeech::luna::SynthesizerConfig sized;
+    std::shared_ptr<LunaChunkProbe> probe = this->sizeChunks(config, sized);
+
+    std::shared_ptr<LunaRequestTracker> tracker(
+        new LunaRequestTracker(mCounters));
+    LunaAsyncStreamCall *call = new LunaAsyncStreamCall(
+        [onAudio, tracker, recorded, probe](std::string &audio) {
+            tracker->addBytes(audio.size());
+            if (probe)
+            {
+                probe->chunk(audio.size());
+            }
+            if (recorded)
+            {
+                recorded->append(audio);
+            }
+            onAudio(audio);
+        },
+        [onFinish, tracker, cache, key, recorded,
+         probe](const grpc::Status &status) {
+            tracker->finish(status.ok());
+            if (probe)
+            {
+                probe->finish(status.ok());
+            }
+            if (cache && status.ok())
+            {
+                cache->insert(key, recorded);
+            }
+            onFinish(status);
+        });
+    this->setContextDeadline(call->context());
+    LunaTraceScope::addMetadata(call->context());
+    LunaMetrics::labelCall(call->context(), probe ? sized : config, queued);
+
+    LunaRequestArena arena;
+    return call->start(mStub->PrepareAsyncSynthesizeStream(
+        &call->context(), arena.build(probe ? sized : config, text),
+        this->completionQueue(call)));
+}
+
+void LunaClient::setCompletionQueueThreads(unsigned int numThreads)
+{
+    mQueueThreads = numThreads;
+}
+
+void LunaClient::synthesizeMany(const std::vector<LunaBulkRequest> &requests,
+                                const LunaBulkSink &sink,
+                                unsigned int maxInFlight)
+{
+    lunaSynthesizeMany(
+        [this](const LunaBulkRequest &request,
+               const LunaSynthesizeCallback &callback) {
+            return this->synthesizeAsync(request.config, request.text,
+                                         callback);
+        },
+        requests, sink, maxInFlight);
 }
 
 void LunaClient::setRequestTimeout(unsigned int milliseconds)
@@ -138,6 +905,96 @@ void LunaClient::setRequestTimeout(unsigned int milliseconds)
     mTimeout = milliseconds;
 }
 
+void LunaClient::setLargeResponseThreshold(size_t bytes)
+{
+    mLargeResponseThreshold = bytes;
+}
+
+bool LunaClient::isLargeResponse(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text)
+{
+    return this->estimateAudioBytes(config, text) >= mLargeResponseThreshold;
+}
+
+bool LunaClient::isTooLarge(const grpc::Status &status)
+{
+    // The error message says which limit was hit, but it is not part of
+    // gRPC's API, so only the code is checked
+    return status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED;
+}
+
+void LunaClient::setStreamTimeouts(unsigned int firstChunkMilliseconds,
+                                   unsigned int idleMilliseconds)
+{
+    mFirstChunkTimeout = firstChunkMilliseconds;
+    mIdleTimeout = idleMilliseconds;
+}
+
+void LunaClient::applyStreamTimeouts(LunaSynthesizerStream &stream)
+{
+    std::chrono::milliseconds firstChunk(mFirstChunkTimeout.load());
+    std::chrono::milliseconds idle(mIdleTimeout.load());
+    if (firstChunk.count() == 0 && idle.count() == 0)
+    {
+        return;
+    }
+
+    std::call_once(mWatchdogOnce,
+                   [this]() { mWatchdog.reset(new LunaStreamWatchdog); });
+    stream.setTimeouts(mWatchdog, firstChunk, idle);
+}
+
+void LunaClient::applyTracer(LunaSynthesizerStream &stream,
+                             const std::string &traceId)
+{
+    stream.setTracer(std::atomic_load(&mTracer), traceId);
+}
+
+void LunaClient::setCache(const std::shared_ptr<LunaSynthesisCache> &cache)
+{
+    std::atomic_store(&mCache, cache);
+}
+
+void LunaClient::setSingleFlight(
+    const std::shared_ptr<LunaSingleFlight> &flights)
+{
+    std::atomic_store(&mSingleFlight, flights);
+}
+
+void LunaClient::setChunkSizer(const std::shared_ptr<LunaChunkSizer> &sizer)
+{
+    std::atomic_store(&mChunkSizer, sizer);
+}
+
+void LunaClient::setScheduler(const std::shared_ptr<LunaScheduler> &scheduler)
+{
+    std::atomic_store(&mScheduler, scheduler);
+}
+
+std::shared_ptr<LunaSchedulerTicket> LunaClient::admit()
+{
+    std::shared_ptr<LunaScheduler> scheduler = std::atomic_load(&mScheduler);
+    if (!scheduler)
+    {
+        return nullptr;
+    }
+
+    return scheduler->acquire(LunaPriorityScope::current());
+}
+
+void LunaClient::setTracer(const std::shared_ptr<LunaTracer> &tracer)
+{
+    std::atomic_store(&mTracer, tracer);
+}
+
+uint64_t LunaClient::outstandingRequests() const
+{
+    return mCounters->outstanding();
+}
+
+LunaChannelStats LunaClient::stats() const { return mCounters->snapshot(); }
+
 LunaClient::LunaClient(const LunaClient &)
 {
     // Do nothing. This copy constructor is intentionally private
@@ -151,9 +1008,320 @@ LunaClient &LunaClient::operator=(const LunaClient &)
     return *this;
 }
 
+std::shared_ptr<const LunaServerInfo> LunaClient::fetchServerInfo()
+{
+    // Send the version and voices requests together, so fetching the
+    // metadata costs one round trip instead of two. They run on their
+    // own queue rather than the client's, so this is safe to call from
+    // an asynchronous callback.
+    grpc::CompletionQueue cq;
+
+    grpc::ClientContext versionCtx;
+    cobaltspeech::luna::VersionRequest versionRequest;
+    cobaltspeech::luna::VersionResponse versionResponse;
+    grpc::Status versionStatus;
+
+    this->setContextDeadline(versionCtx);
+    LunaTraceScope::addMetadata(versionCtx);
+    std::unique_ptr<grpc::ClientAsyncResponseReader<
+        cobaltspeech::luna::VersionResponse>>
+        versionReader(
+            mStub->PrepareAsyncVersion(&versionCtx, versionRequest, &cq));
+    versionReader->StartCall();
+    versionReader->Finish(&versionResponse, &versionStatus, &versionCtx);
+
+    grpc::ClientContext voicesCtx;
+    cobaltspeech::luna::ListVoicesRequest voicesRequest;
+    cobaltspeech::luna::ListVoicesResponse voicesResponse;
+    grpc::Status voicesStatus;
+
+    this->setContextDeadline(voicesCtx);
+    LunaTraceScope::addMetadata(voicesCtx);
+    std::unique_ptr<grpc::ClientAsyncResponseReader<
+        cobaltspeech::luna::ListVoicesResponse>>
+        voicesReader(
+            mStub->PrepareAsyncListVoices(&voicesCtx, voicesRequest, &cq));
+    voicesReader->StartCall();
+    voicesReader->Finish(&voicesResponse, &voicesStatus, &voicesCtx);
+
+    std::vector<grpc::ClientContext *> contexts;
+    contexts.push_back(&versionCtx);
+    contexts.push_back(&voicesCtx);
+    this->waitForCalls(cq, contexts);
+
+    if (!versionStatus.ok())
+    {
+        throw LunaException(versionStatus);
+    }
+    if (!voicesStatus.ok())
+    {
+        throw LunaException(voicesStatus);
+    }
+
+    std::vector<LunaVoice> voices;
+    for (int i = 0; i < voicesResponse.voices_size(); i++)
+    {
+        voices.push_back(LunaVoice(voicesResponse.voices(i)));
+    }
+
+    std::shared_ptr<const LunaServerInfo> info =
+        std::make_shared<LunaServerInfo>(versionResponse.version(), voices);
+    std::atomic_store(&mServerInfo, info);
+    return info;
+}
+
+void LunaClient::runWarmUp(
+    const LunaWarmUpOptions &options,
+    std::shared_ptr<std::promise<std::shared_ptr<const LunaServerInfo>>>
+        promise)
+{
+    try
+    {
+        this->waitForConnected(options.connectTimeout);
+
+        std::shared_ptr<const LunaServerInfo> info;
+        {
+            std::lock_guard<std::mutex> lock(mInfoMutex);
+            info = this->fetchServerInfo();
+        }
+
+        if (options.primeVoices)
+        {
+            std::vector<std::string> voices = options.voices;
+            if (voices.empty())
+            {
+                for (const LunaVoice &voice : info->voices())
+                {
+                    voices.push_back(voice.id());
+                }
+            }
+            this->sendPrimingRequests(voices, options.primingText);
+        }
+
+        promise->set_value(info);
+    }
+    catch (...)
+    {
+        promise->set_exception(std::current_exception());
+    }
+}
+
+void LunaClient::waitForConnected(std::chrono::milliseconds timeout)
+{
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + timeout;
+
+    // Wait in short slices so a client destroyed during warm-up
+    // does not have to wait out the whole timeout.
+    grpc_connectivity_state state = mChannel->GetState(true);
+    while (state != GRPC_CHANNEL_READY)
+    {
+        if (mStopping)
+        {
+            throw LunaException("client destroyed during warm-up");
+        }
+
+        std::chrono::system_clock::time_point now =
+            std::chrono::system_clock::now();
+        if (now >= deadline)
+        {
+            throw LunaException("timed out connecting to the Luna server");
+        }
+
+        std::chrono::system_clock::time_point wake =
+            std::min(deadline, now + std::chrono::milliseconds(100));
+        mChannel->WaitForStateChange(state, wake);
+        state = mChannel->GetState(true);
+    }
+}
+
+void LunaClient::sendPrimingRequests(const std::vector<std::string> &voices,
+                                     const std::string &text)
+{
+    // Priming requests bypass the cache and the request counters; they
+    // are not real traffic.
+    struct PrimingCall
+    {
+        grpc::ClientContext ctx;
+        cobaltspeech::luna::SynthesizeResponse response;
+        grpc::Status status;
+        std::unique_ptr<grpc::ClientAsyncResponseReader<
+            cobaltspeech::luna::SynthesizeResponse>>
+            reader;
+    };
+
+    grpc::CompletionQueue cq;
+    std::vector<std::unique_ptr<PrimingCall>> calls;
+    std::vector<grpc::ClientContext *> contexts;
+    for (const std::string &voice : voices)
+    {
+        std::unique_ptr<PrimingCall> call(new PrimingCall);
+        this->setContextDeadline(call->ctx);
+        LunaTraceScope::addMetadata(call->ctx);
+
+        cobaltspeech::luna::SynthesizeRequest request;
+        request.mutable_config()->set_voice_id(voice);
+        request.set_text(text);
+        LunaMetrics::labelCall(call->ctx, request.config(),
+                               std::chrono::steady_clock::now());
+
+        call->reader =
+            mStub->PrepareAsyncSynthesize(&call->ctx, request, &cq);
+        call->reader->StartCall();
+        call->reader->Finish(&call->response, &call->status, call.get());
+
+        contexts.push_back(&call->ctx);
+        calls.push_back(std::move(call));
+    }
+
+    this->waitForCalls(cq, contexts);
+
+    for (const std::unique_ptr<PrimingCall> &call : calls)
+    {
+        if (!call->status.ok())
+        {
+            throw LunaException(call->status);
+        }
+    }
+}
+
+void LunaClient::waitForCalls(
+    grpc::CompletionQueue &cq,
+    const std::vector<grpc::ClientContext *> &contexts)
+{
+    size_t remaining = contexts.size();
+    bool cancelled = false;
+    while (remaining > 0)
+    {
+        void *tag = nullptr;
+        bool ok = false;
+        std::chrono::system_clock::time_point wake =
+            std::chrono::system_clock::now() + std::chrono::milliseconds(100);
+        grpc::CompletionQueue::NextStatus next = cq.AsyncNext(&tag, &ok, wake);
+        if (next == grpc::CompletionQueue::GOT_EVENT)
+        {
+            remaining--;
+        }
+        else if (next == grpc::CompletionQueue::SHUTDOWN)
+        {
+            break;
+        }
+
+        // Cancelled calls still complete, so keep waiting for them
+        if (mStopping && !cancelled)
+        {
+            for (grpc::ClientContext *ctx : contexts)
+            {
+                ctx->TryCancel();
+            }
+            cancelled = true;
+        }
+    }
+
+    cq.Shutdown();
+    void *tag = nullptr;
+    bool ok = false;
+    while (cq.Next(&tag, &ok))
+    {
+    }
+}
+
+unsigned int
+LunaClient::voiceSampleRate(const cobaltspeech::luna::SynthesizerConfig &config)
+{
+    try
+    {
+        return sampleRate(this->serverInfo().get(), config);
+    }
+    catch (const LunaException &)
+    {
+        // The synthesis request will report the problem
+    }
+
+    return 0;
+}
+
+unsigned int LunaClient::cachedSampleRate(
+    const cobaltspeech::luna::SynthesizerConfig &config) const
+{
+    return sampleRate(this->cachedServerInfo().get(), config);
+}
+
+std::shared_ptr<LunaChunkProbe>
+LunaClient::sizeChunks(const cobaltspeech::luna::SynthesizerConfig &config,
+                       cobaltspeech::luna::SynthesizerConfig &sized)
+{
+    std::shared_ptr<LunaChunkSizer> sizer = std::atomic_load(&mChunkSizer);
+    if (!sizer || config.n_samples() != 0)
+    {
+        return nullptr;
+    }
+
+    sized = config;
+    sized.set_n_samples(sizer->nSamples());
+    return std::make_shared<LunaChunkProbe>(
+        sizer, sized.n_samples(), this->cachedSampleRate(config),
+        lunaBytesPerSample(config.encoding()));
+}
+
+size_t LunaClient::estimateAudioBytes(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text)
+{
+    // Speech runs at roughly 13 characters per second. Voices differ,
+    // but the sample rate matters far more to the size of the audio.
+    const double kSecondsPerChar = 0.075;
+    const unsigned int kDefaultSampleRate = 22050;
+
+    // This is on the path of every batch request, so it must not wait for
+    // the metadata to be fetched
+    unsigned int rate = this->cachedSampleRate(config);
+    if (rate == 0)
+    {
+        rate = kDefaultSampleRate;
+    }
+
+    double samples = text.size() * kSecondsPerChar * rate;
+    return static_cast<size_t>(samples) *
+           lunaBytesPerSample(config.encoding());
+}
+
+void LunaClient::synthesizeFromStream(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, size_t estimate, std::string &audio)
+{
+    // Leave some headroom over the estimate, so that a slightly slower
+    // voice does not force the buffer to be reallocated and copied.
+    audio.clear();
+    audio.reserve(estimate + estimate / 4);
+
+    LunaSynthesizerStream stream = this->synthesizeStream(config, text);
+    std::string chunk;
+    while (stream.receiveAudio(chunk))
+    {
+        audio.append(chunk);
+    }
+    stream.close();
+}
+
 void LunaClient::setContextDeadline(grpc::ClientContext &ctx)
 {
+    unsigned int timeout = mTimeout.load();
+    if (timeout == 0)
+    {
+        return;
+    }
+
     std::chrono::system_clock::time_point deadline =
-        std::chrono::system_clock::now() + std::chrono::milliseconds(mTimeout);
+        std::chrono::system_clock::now() + std::chrono::milliseconds(timeout);
     ctx.set_deadline(deadline);
 }
+
+grpc::CompletionQueue *LunaClient::completionQueue(LunaAsyncCall *call)
+{
+    std::call_once(mQueueOnce, [this]() {
+        mQueue.reset(new LunaCompletionQueue(mQueueThreads));
+    });
+
+    return mQueue->cq(call);
+}
@@ -4,15 +4,60 @@
 #define LUNA_CLIENT_H
 
 #include "luna.grpc.pb.h"
+#include "luna_async_call.h"
+#include "luna_audio_sink.h"
+#include "luna_bulk_synthesis.h"
+#include "luna_channel_stats.h"
+#include "luna_chunk_sizer.h"
+#include "luna_completion_queue.h"
+#include "luna_metrics.h"
+#include "luna_scheduler.h"
+#include "luna_server_info.h"
+#include "luna_single_flight.h"
+#include "luna_stream_watchdog.h"
+#include "luna_synthesis_cache.h"
+#include "luna_synthesis_session.h"
 #include "luna_synthesizer_stream.h"
 #include "luna_voice.h"
 
+#include <grpcpp/channel.h>
+#include <grpcpp/support/channel_arguments.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+//! Options for LunaClient::warmUp().
+struct LunaWarmUpOptions
+{
+    //! How long to wait for the channel to connect before giving up.
+    std::chrono::milliseconds connectTimeout = std::chrono::milliseconds(10000);
+
+    //! If true, send a short synthesis request to each voice so the server
+    //! has loaded its models (and the channel is carrying traffic) before
+    //! real requests arrive.
+    bool primeVoices = false;
+
+    //! The voices to prime. If empty, every voice the server lists is
+    //! primed.
+    std::vector<std::string> voices;
+
+    //! The text used for priming requests.
+    std::string primingText = "Hello.";
+};
+
 //! LunaClient represents a single client connection to a running
 //! Luna server instance.
+//!
+//! A client is thread-safe: one client can be shared by any number of
+//! threads, which may make requests and change settings concurrently.
+//! Settings changes apply to requests started afterwards.
 class LunaClient
 {
 public:
@@ -23,20 +68,120 @@ public:
     //! Note that the server must also be running with TLS/SSL for the
     //! secure connection to succeed.
     LunaClient(const std::string &url, bool secureConnection);
+
+    //! Create a new client as above, recording the latency of every
+    //! request into the given metrics.
+    LunaClient(const std::string &url, bool secureConnection,
+               const std::shared_ptr<LunaMetrics> &metrics);
+
+    //! Create a new client that uses an existing gRPC channel. This allows
+    //! callers to customize the channel (e.g., with channel arguments)
+    //! before giving it to the client.
+    LunaClient(const std::shared_ptr<grpc::Channel> &channel);
+
+    //! Cancel the asynchronous requests that are still running and wait
+    //! for their callbacks to finish. The client must not be destroyed
+    //! from one of its own callbacks.
     ~LunaClient();
 
+    //! Create a gRPC channel to the Luna server at the given url, using
+    //! the given channel arguments. See the LunaClient constructor for a
+    //! description of the url and secureConnection parameters.
+    static std::shared_ptr<grpc::Channel>
+    createChannel(const std::string &url, bool secureConnection,
+                  const grpc::ChannelArguments &args);
+
+    //! Create a gRPC channel as above that runs every call through the
+    //! given interceptors (e.g., LunaMetrics::interceptorFactory()).
+    static std::shared_ptr<grpc::Channel> createChannel(
+        const std::string &url, bool secureConnection,
+        const grpc::ChannelArguments &args,
+        std::vector<std::unique_ptr<
+            grpc::experimental::ClientInterceptorFactoryInterface>>
+            interceptors);
+
     //! Returns the version of Luna used by the server.
-    const std::string &lunaVersion();
+    std::string lunaVersion();
 
     //! Returns a list of Luna TTS voice models that the server is currently
-    //! configured to use.
+    //! configured to use. This copies the list; serverInfo() gives access
+    //! to it without copying.
     std::vector<LunaVoice> listVoices();
 
+    //! Returns the server's version and voices. The metadata is fetched
+    //! on first use and cached in an immutable snapshot, which callers
+    //! read without locking or copying. Once the snapshot is older than
+    //! the metadata TTL (see setMetadataTTL()), the next caller refreshes
+    //! it; if that fails, the old snapshot keeps being used.
+    std::shared_ptr<const LunaServerInfo> serverInfo();
+
+    //! Fetch the server's version and voices now, replacing the cached
+    //! snapshot. Returns the new snapshot.
+    std::shared_ptr<const LunaServerInfo> refreshServerInfo();
+
+    //! Returns the cached server metadata without fetching it, or nullptr
+    //! if it has not been fetched yet.
+    std::shared_ptr<const LunaServerInfo> cachedServerInfo() const;
+
+    //! Check that the server is up with a Version request that bypasses
+    //! the metadata cache. The callback receives the result from one of
+    //! the completion queue threads.
+    LunaAsyncHandle
+    checkHealth(std::chrono::milliseconds timeout,
+                const std::function<void(const grpc::Status &)> &callback);
+
+    //! Set how long the server metadata is cached before it is fetched
+    //! again. Zero (the default) caches it for the life of the client.
+    void setMetadataTTL(std::chrono::seconds ttl);
+
+    //! Connect to the server and fetch its metadata in the background,
+    //! optionally priming the voices (see LunaWarmUpOptions). Returns a
+    //! future that becomes ready with the server metadata once the client
+    //! is warm, or holds a LunaException if warm-up failed. Only the
+    //! first call starts a warm-up; later calls return the same future
+    //! and ignore their options. Requests may be made at any time, but
+    //! callers that want to take traffic only when the client is at full
+    //! speed can wait on the future first.
+    std::shared_future<std::shared_ptr<const LunaServerInfo>>
+    warmUp(const LunaWarmUpOptions &options = LunaWarmUpOptions());
+
     //! Run batch synthesis using the given config and text. Returns
     //! the raw audio samples.
     ByteVector synthesize(const cobaltspeech::luna::SynthesizerConfig &config,
                           const std::string &text);
 
+    //! Run batch synthesis using the given config and text. The audio
+    //! buffer of the response is moved into the given string instead of
+    //! being copied.
+    //!
+    //! Responses expected to be larger than the large response threshold
+    //! (see setLargeResponseThreshold()) are streamed instead and
+    //! assembled into a buffer presized from the voice's sample rate, so
+    //! batch synthesis has no message size limit. A unary response that
+    //! turns out to exceed the channel's receive limit is also retried
+    //! this way.
+    void synthesize(const cobaltspeech::luna::SynthesizerConfig &config,
+                    const std::string &text, std::string &audio);
+
+    //! Set the estimated response size, in bytes, above which batch
+    //! synthesis is streamed. The default is 2 MB, half of gRPC's
+    //! default receive limit. Zero streams every batch request.
+    void setLargeResponseThreshold(size_t bytes);
+
+    //! Returns true if synthesize() would stream the given request
+    //! because its response is expected to exceed the large response
+    //! threshold. Only metadata that has already been fetched is used to
+    //! estimate the size.
+    bool isLargeResponse(const cobaltspeech::luna::SynthesizerConfig &config,
+                         const std::string &text);
+
+    //! Returns true if a batch request may have failed because its
+    //! response was larger than the channel's receive limit. Such
+    //! requests succeed when they are streamed instead. Any
+    //! RESOURCE_EXHAUSTED status counts, so a server that is out of
+    //! resources costs one more (streamed) attempt.
+    static bool isTooLarge(const grpc::Status &status);
+
     //! Run voice synthesis using the given config and text. Returns a
     //! stream that receives audio samples as they are generated by
     //! the server.
@@ -44,14 +189,190 @@ public:
     synthesizeStream(const cobaltspeech::luna::SynthesizerConfig &config,
                      const std::string &text);
 
-    //! Set the timeout for requests to the server.
+    //! Run streaming synthesis, writing the audio into the given sink as
+    //! it arrives. The sink is begun with the audio format, and finished
+    //! (or aborted, if synthesis fails) before this returns. Throws a
+    //! LunaException if synthesis fails, or the sink's error if the sink
+    //! fails, in which case the request is cancelled. Chunks that arrive
+    //! while the sink is busy are passed to its writeChunks() together.
+    void synthesizeTo(const cobaltspeech::luna::SynthesizerConfig &config,
+                      const std::string &text, LunaAudioSink &sink);
+
+    //! Run voice synthesis on long text by splitting it at sentence and
+    //! clause boundaries (see LunaTextSegmenter) and synthesizing up to
+    //! maxParallel segments at once. The returned stream delivers the
+    //! audio in the original order. The client must outlive the stream.
+    LunaSynthesizerStream synthesizeStreamParallel(
+        const cobaltspeech::luna::SynthesizerConfig &config,
+        const std::string &text, unsigned int maxParallel);
+
+    //! Start a session that synthesizes text as it is appended, such as
+    //! a reply streamed from a language model. Each segment is synthesized
+    //! as soon as it is complete, with up to maxParallel segments at once,
+    //! and the audio is read from the session's stream. Stream timeouts
+    //! are not applied, since the audio may be waiting on the text. The
+    //! client must outlive the session.
+    std::unique_ptr<LunaSynthesisSession>
+    startSession(const cobaltspeech::luna::SynthesizerConfig &config,
+                 unsigned int maxParallel = 2);
+
+    //! Run batch synthesis asynchronously. Returns immediately with a
+    //! handle that may be used to cancel the request; the callback is
+    //! called from one of the client's completion queue threads when
+    //! synthesis is done. If singleFlight is false the request does not
+    //! join an identical one in flight (see setSingleFlight()), as a
+    //! hedged request must not join the request it hedges.
+    LunaAsyncHandle
+    synthesizeAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                    const std::string &text,
+                    const LunaSynthesizeCallback &callback,
+                    bool singleFlight = true);
+
+    //! Run batch synthesis asynchronously. Returns a future that
+    //! receives the raw audio samples, or a LunaException if the
+    //! synthesis failed.
+    std::future<ByteVector>
+    synthesizeAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                    const std::string &text);
+
+    //! Run streaming synthesis asynchronously. Returns immediately with a
+    //! handle that may be used to cancel the stream; onAudio is called
+    //! for each chunk of audio as it is received, and onFinish is called
+    //! once with the final status of the stream. All callbacks come from
+    //! the client's completion queue threads, and callbacks for a single
+    //! stream never run concurrently. singleFlight is as for
+    //! synthesizeAsync().
+    LunaAsyncHandle synthesizeStreamAsync(
+        const cobaltspeech::luna::SynthesizerConfig &config,
+        const std::string &text, const LunaAudioCallback &onAudio,
+        const LunaFinishCallback &onFinish, bool singleFlight = true);
+
+    //! Set the number of threads used to drive asynchronous requests.
+    //! This must be called before the first asynchronous request is
+    //! made; afterwards it has no effect. The default is one thread.
+    void setCompletionQueueThreads(unsigned int numThreads);
+
+    //! Synthesize a list of requests with at most maxInFlight requests
+    //! outstanding at a time, passing each result to the sink from the
+    //! calling thread as it completes. Returns when every item has been
+    //! passed to the sink. See lunaSynthesizeMany() for details.
+    void synthesizeMany(const std::vector<LunaBulkRequest> &requests,
+                        const LunaBulkSink &sink, unsigned int maxInFlight);
+
+    //! Set the timeout for requests to the server. For streaming
+    //! requests this is a deadline for the whole stream. Zero means
+    //! requests have no deadline, which suits long streams when
+    //! setStreamTimeouts() is used instead.
     void setRequestTimeout(unsigned int milliseconds);
 
+    //! Cancel streams whose first chunk of audio takes longer than
+    //! firstChunkMilliseconds to arrive, or that go longer than
+    //! idleMilliseconds between chunks. Zero (the default) disables the
+    //! corresponding timeout. Applies to streams started afterwards.
+    //! See LunaSynthesizerStream::setTimeouts().
+    void setStreamTimeouts(unsigned int firstChunkMilliseconds,
+                           unsigned int idleMilliseconds);
+
+    //! Apply this client's stream timeouts to a stream built from its
+    //! requests by other means, such as LunaClientPool's hedged streams.
+    void applyStreamTimeouts(LunaSynthesizerStream &stream);
+
+    //! Record tracing spans for a stream built from this client's
+    //! requests by other means with this client's tracer, if it has one,
+    //! tagged with the given trace ID.
+    void applyTracer(LunaSynthesizerStream &stream, const std::string &traceId);
+
+    //! Use the given cache for batch and streaming synthesis. Requests
+    //! that hit the cache are answered without contacting the server,
+    //! and successful responses are added to it. Cached audio is
+    //! replayed to streams in chunks of the requested n_samples.
+    //! Asynchronous requests that hit the cache run their callbacks
+    //! before returning. Pass nullptr to disable caching.
+    void setCache(const std::shared_ptr<LunaSynthesisCache> &cache);
+
+    //! Record tracing spans for synthesize(), synthesizeStream(), and
+    //! the receiveAudio() and close() calls of the streams it returns.
+    //! Spans are tagged with the trace ID of the LunaTraceScope active
+    //! when the request was made. The ID is sent to the server as
+    //! metadata whether or not a tracer is set. Pass nullptr to disable
+    //! tracing.
+    void setTracer(const std::shared_ptr<LunaTracer> &tracer);
+
+    //! Merge identical requests that are in flight at the same time into
+    //! one server call. Requests are identical if they have the same
+    //! voice, encoding, n_samples and text. Streams that join a call late
+    //! replay the audio they missed. A LunaSingleFlight may be shared by
+    //! several clients, in which case the call is sent by the client that
+    //! made the first request. Pass nullptr to send every request.
+    void setSingleFlight(const std::shared_ptr<LunaSingleFlight> &flights);
+
+    //! Let the given sizer choose n_samples for streaming requests whose
+    //! config leaves it at zero, and report to it how each request went.
+    //! A sizer may be shared by several clients. Playback underruns are
+    //! only measured once the server metadata has been fetched (see
+    //! serverInfo() and warmUp()), since they depend on the voice's
+    //! sample rate. Pass nullptr to stop sizing requests.
+    void setChunkSizer(const std::shared_ptr<LunaChunkSizer> &sizer);
+
+    //! Send requests through the given scheduler, which limits how many
+    //! are sent at once and admits them by the priority of the
+    //! LunaPriorityScope active when they were made. Blocking requests
+    //! wait for a slot and throw a LunaException if they are shed;
+    //! asynchronous requests are queued and report a shed request to
+    //! their callback with a DEADLINE_EXCEEDED status. Streams hold their
+    //! slot until they are closed. Requests answered from the cache or
+    //! by joining a single-flight call do not need a slot. A scheduler
+    //! may be shared by several clients, which must outlive the requests
+    //! waiting in it. Pass nullptr to send requests immediately.
+    void setScheduler(const std::shared_ptr<LunaScheduler> &scheduler);
+
+    //! Returns the number of synthesis requests currently in flight
+    //! on this client's channel.
+    uint64_t outstandingRequests() const;
+
+    //! Returns statistics for the synthesis requests sent by this client.
+    LunaChannelStats stats() const;
+
 private:
+    std::shared_ptr<grpc::Channel> mChannel;
     std::unique_ptr<cobaltspeech::luna::Luna::Stub> mStub;
-    std::string mLunaVersion;
-    std::vector<LunaVoice> mVoices;
-    unsigned int mTimeout;
+    std::atomic<unsigned int> mTimeout;
+    std::atomic<unsigned int> mFirstChunkTimeout;
+    std::atomic<unsigned int> mIdleTimeout;
+    std::atomic<size_t> mLargeResponseThreshold;
+    std::shared_ptr<LunaChannelCounters> mCounters;
+
+    // These are replaced as a whole and read with std::atomic_load, so
+    // requests never see a partially updated value.
+    std::shared_ptr<const LunaServerInfo> mServerInfo;
+    std::shared_ptr<LunaSynthesisCache> mCache;
+    std::shared_ptr<LunaTracer> mTracer;
+    std::shared_ptr<LunaChunkSizer> mChunkSizer;
+    std::shared_ptr<LunaSingleFlight> mSingleFlight;
+    std::shared_ptr<LunaScheduler> mScheduler;
+
+    // Serializes fetches of the server metadata.
+    std::mutex mInfoMutex;
+    std::atomic<int64_t> mMetadataTTL;
+
+    // The background warm-up, started by the first call to warmUp().
+    // mStopping tells it to give up when the client is destroyed.
+    std::mutex mWarmUpMutex;
+    std::shared_future<std::shared_ptr<const LunaServerInfo>> mWarmUp;
+    std::thread mWarmUpThread;
+    std::atomic<bool> mStopping;
+
+    // The completion queue is started on the first asynchronous request.
+    // It is declared after the stub so that it is destroyed (and all
+    // outstanding calls are finished) before the stub goes away.
+    std::atomic<unsigned int> mQueueThreads;
+    std::once_flag mQueueOnce;
+    std::unique_ptr<LunaCompletionQueue> mQueue;
+
+    // The watchdog is started with the first stream that has timeouts.
+    // Streams share ownership, so it may outlive the client.
+    std::once_flag mWatchdogOnce;
+    std::shared_ptr<LunaStreamWatchdog> mWatchdog;
 
     // Disable copy construction and assignments. Given the nature of the
     // client, it's a bad idea to try to copy an existing connection.
@@ -60,6 +381,113 @@ private:
 
     // Convenience functions
     void setContextDeadline(grpc::ClientContext &ctx);
+
+    // Returns the sample rate of the requested voice, or zero if it is
+    // not known.
+    unsigned int
+    voiceSampleRate(const cobaltspeech::luna::SynthesizerConfig &config);
+
+    // As voiceSampleRate(), but only looks at the metadata that has
+    // already been fetched, so it never blocks.
+    unsigned int
+    cachedSampleRate(const cobaltspeech::luna::SynthesizerConfig &config) const;
+
+    // Wait for the scheduler (if any) to admit a blocking request with
+    // the current thread's priority. Returns nullptr without a scheduler.
+    std::shared_ptr<LunaSchedulerTicket> admit();
+
+    // Start a batch or streaming call to the server once the scheduler
+    // (if any) admits it, adding the result to the cache (if any) under
+    // the given key.
+    LunaAsyncHandle
+    startSynthesizeAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                         const std::string &text,
+                         const std::shared_ptr<LunaSynthesisCache> &cache,
+                         const std::string &key,
+                         const LunaSynthesizeCallback &callback);
+    LunaAsyncHandle
+    startStreamAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                     const std::string &text,
+                     const std::shared_ptr<LunaSynthesisCache> &cache,
+                     const std::string &key, const LunaAudioCallback &onAudio,
+                     const LunaFinishCallback &onFinish);
+
+    // Send a batch or streaming call to the server immediately. The
+    // queued time is when the request was made, for the metrics.
+    LunaAsyncHandle
+    sendSynthesizeAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                        const std::string &text,
+                        const std::shared_ptr<LunaSynthesisCache> &cache,
+                        const std::string &key,
+                        const LunaSynthesizeCallback &callback,
+                        std::chrono::steady_clock::time_point queued);
+    LunaAsyncHandle
+    sendStreamAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                    const std::string &text,
+                    const std::shared_ptr<LunaSynthesisCache> &cache,
+                    const std::string &key, const LunaAudioCallback &onAudio,
+                    const LunaFinishCallback &onFinish,
+                    std::chrono::steady_clock::time_point queued);
+
+    // Run batch synthesis through the given single-flight, joining an
+    // identical request if one is in flight.
+    LunaAsyncHandle
+    synthesizeShared(LunaSingleFlight &flights,
+                     const cobaltspeech::luna::SynthesizerConfig &config,
+                     const std::string &text,
+                     const std::shared_ptr<LunaSynthesisCache> &cache,
+                     const std::string &key,
+                     const LunaSynthesizeCallback &callback);
+
+    // If a chunk sizer is set and the config leaves n_samples to the
+    // server, copy the config into sized with the sizer's n_samples and
+    // return a probe for the request. Otherwise returns nullptr. This may
+    // run on a completion queue thread, so it never fetches metadata.
+    std::shared_ptr<LunaChunkProbe>
+    sizeChunks(const cobaltspeech::luna::SynthesizerConfig &config,
+               cobaltspeech::luna::SynthesizerConfig &sized);
+
+    // Estimate the size of the audio for the given request.
+    size_t estimateAudioBytes(
+        const cobaltspeech::luna::SynthesizerConfig &config,
+        const std::string &text);
+
+    // Run batch synthesis over a stream, appending each chunk to audio.
+    void synthesizeFromStream(
+        const cobaltspeech::luna::SynthesizerConfig &config,
+        const std::string &text, size_t estimate, std::string &audio);
+
+    // Fetch the server metadata. Must be called with mInfoMutex held.
+    std::shared_ptr<const LunaServerInfo> fetchServerInfo();
+
+    // The body of the warm-up thread.
+    void runWarmUp(
+        const LunaWarmUpOptions &options,
+        std::shared_ptr<std::promise<std::shared_ptr<const LunaServerInfo>>>
+            promise);
+
+    // Wait for the channel to be ready, throwing if it is not by the
+    // timeout or the client is being destroyed.
+    void waitForConnected(std::chrono::milliseconds timeout);
+
+    // Send one short synthesis request to each of the given voices at
+    // once, throwing if any of them fails.
+    void sendPrimingRequests(const std::vector<std::string> &voices,
+                             const std::string &text);
+
+    // Wait for the calls started on a private completion queue, then shut
+    // the queue down. The calls are cancelled if the client is destroyed.
+    void waitForCalls(grpc::CompletionQueue &cq,
+                      const std::vector<grpc::ClientContext *> &contexts);
+
+    // Returns the interceptors that record into the given metrics, if any.
+    static std::vector<
+        std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>>
+    metricsInterceptors(const std::shared_ptr<LunaMetrics> &metrics);
+
+    // Returns the completion queue for the given call, starting the
+    // queue threads the first time it is used.
+    grpc::CompletionQueue *completionQueue(LunaAsyncCall *call);
 };
 
 #endif // LUNA_CLIENT_H
@@ -0,0 +1,882 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_client_pool.h"
+
+#include "luna_exception.h"
+#include "luna_hedged_reader.h"
+#include "luna_ordered_reader.h"
+#include "luna_text_segmenter.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <grpc/grpc.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+LunaClientPool::LunaClientPool(const std::string &url, bool secureConnection,
+                               unsigned int numChannels, Policy policy,
+                               const std::shared_ptr<LunaMetrics> &metrics)
+    : LunaClientPool(std::vector<std::string>(1, url), secureConnection,
+                     numChannels, policy, metrics)
+{
+}
+
+LunaClientPool::LunaClientPool(const std::vector<std::string> &urls,
+                               bool secureConnection,
+                               unsigned int channelsPerUrl, Policy policy,
+                               const std::shared_ptr<LunaMetrics> &metrics)
+    : mNumEndpoints(urls.size()), mPolicy(policy), mNext(0),
+      mHealthStopping(false)
+{
+    if (urls.empty() || channelsPerUrl == 0)
+    {
+        throw LunaException("client pool requires at least one channel");
+    }
+
+    // Interleave the urls, so that round robin alternates between them
+    for (unsigned int i = 0; i < channelsPerUrl; i++)
+    {
+        for (size_t endpoint = 0; endpoint < urls.size(); endpoint++)
+        {
+            // Channels with identical arguments share their underlying
+            // connection, which would defeat the purpose of the pool. Give
+            // each channel its own subchannel pool so that it gets its own
+            // HTTP/2 connection.
+            grpc::ChannelArguments args;
+            args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+            args.SetInt("luna.channel_index",
+                        static_cast<int>(mClients.size()));
+
+            std::vector<std::unique_ptr<
+                grpc::experimental::ClientInterceptorFactoryInterface>>
+                interceptors;
+            if (metrics)
+            {
+                interceptors.push_back(
+                    LunaMetrics::interceptorFactory(metrics));
+            }
+
+            mClients.push_back(std::unique_ptr<LunaClient>(
+                new LunaClient(LunaClient::createChannel(
+                    urls[endpoint], secureConnection, args,
+                    std::move(interceptors)))));
+            mEndpoints.push_back(endpoint);
+            mHealth.push_back(
+                std::unique_ptr<ChannelHealth>(new ChannelHealth));
+        }
+    }
+}
+
+LunaClientPool::~LunaClientPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mHealthMutex);
+        mHealthStopping = true;
+    }
+    mHealthCV.notify_all();
+    if (mHealthThread.joinable())
+    {
+        mHealthThread.join();
+    }
+
+    // Destroying the clients stops their warm-ups, which lets ours finish
+    mClients.clear();
+    if (mWarmUpThread.joinable())
+    {
+        mWarmUpThread.join();
+    }
+}
+
+std::string LunaClientPool::lunaVersion()
+{
+    return mClients.front()->lunaVersion();
+}
+
+std::vector<LunaVoice> LunaClientPool::listVoices()
+{
+    return mClients.front()->listVoices();
+}
+
+std::shared_ptr<const LunaServerInfo> LunaClientPool::serverInfo()
+{
+    return mClients.front()->serverInfo();
+}
+
+std::vector<std::string> LunaClientPool::resolve(const std::string &url)
+{
+    // Split the port off the end. IPv6 hosts may be in brackets.
+    size_t colon = url.rfind(':');
+    if (colon == std::string::npos)
+    {
+        throw LunaException("url must include a port: " + url);
+    }
+    std::string host = url.substr(0, colon);
+    std::string port = url.substr(colon + 1);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+    {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses = nullptr;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (err != 0)
+    {
+        throw LunaException("could not resolve " + url + ": " +
+                            gai_strerror(err));
+    }
+
+    std::vector<std::string> urls;
+    for (struct addrinfo *a = addresses; a != nullptr; a = a->ai_next)
+    {
+        char name[INET6_ADDRSTRLEN];
+        const void *addr = nullptr;
+        if (a->ai_family == AF_INET)
+        {
+            addr = &reinterpret_cast<struct sockaddr_in *>(a->ai_addr)
+                        ->sin_addr;
+        }
+        else if (a->ai_family == AF_INET6)
+        {
+            addr = &reinterpret_cast<struct sockaddr_in6 *>(a->ai_addr)
+                        ->sin6_addr;
+        }
+        if (!addr || !inet_ntop(a->ai_family, addr, name, sizeof(name)))
+        {
+            continue;
+        }
+
+        std::string resolved = a->ai_family == AF_INET6
+                                   ? "[" + std::string(name) + "]:" + port
+                                   : std::string(name) + ":" + port;
+        if (std::find(urls.begin(), urls.end(), resolved) == urls.end())
+        {
+            urls.push_back(resolved);
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (urls.empty())
+    {
+        throw LunaException("no addresses found for " + url);
+    }
+    return urls;
+}
+
+std::shared_future<std::shared_ptr<const LunaServerInfo>>
+LunaClientPool::warmUp(const LunaWarmUpOptions &options)
+{
+    std::lock_guard<std::mutex> lock(mWarmUpMutex);
+    if (mWarmUp.valid())
+    {
+        return mWarmUp;
+    }
+
+    LunaWarmUpOptions connectOnly = options;
+    connectOnly.primeVoices = false;
+
+    std::vector<std::shared_future<std::shared_ptr<const LunaServerInfo>>>
+        channels;
+    for (size_t i = 0; i < mClients.size(); i++)
+    {
+        channels.push_back(mClients[i]->warmUp(i == 0 ? options : connectOnly));
+    }
+
+    std::shared_ptr<std::promise<std::shared_ptr<const LunaServerInfo>>>
+        promise(new std::promise<std::shared_ptr<const LunaServerInfo>>);
+    mWarmUp = promise->get_future().share();
+    mWarmUpThread = std::thread([channels, promise]() {
+        try
+        {
+            for (size_t i = 1; i < channels.size(); i++)
+            {
+                channels[i].get();
+            }
+            promise->set_value(channels.front().get());
+        }
+        catch (...)
+        {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return mWarmUp;
+}
+
+ByteVector
+LunaClientPool::synthesize(const cobaltspeech::luna::SynthesizerConfig &config,
+                           const std::string &text)
+{
+    std::string samples;
+    this->synthesize(config, text, samples);
+
+    return ByteVector(samples.begin(), samples.end());
+}
+
+void LunaClientPool::synthesize(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, std::string &audio)
+{
+    std::shared_ptr<LunaHedger> hedger = std::atomic_load(&mHedger);
+    if (!hedger)
+    {
+        this->pick(config.voice_id()).synthesize(config, text, audio);
+        return;
+    }
+
+    // Large responses are streamed, as LunaClient::synthesize() does, and
+    // the stream is hedged instead of the unary call. The channel is only
+    // picked once, so that round robin moves on by one request.
+    size_t original = this->pickIndex(config.voice_id());
+    if (mClients[original]->isLargeResponse(config, text) ||
+        !this->hedgedSynthesize(hedger, original, config, text, audio))
+    {
+        audio.clear();
+        LunaSynthesizerStream stream = this->synthesizeStream(config, text);
+        std::string chunk;
+        while (stream.receiveAudio(chunk))
+        {
+            audio.append(chunk);
+        }
+        stream.close();
+    }
+}
+
+LunaSynthesizerStream LunaClientPool::synthesizeStream(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text)
+{
+    std::shared_ptr<LunaHedger> hedger = std::atomic_load(&mHedger);
+    if (!hedger)
+    {
+        return this->pick(config.voice_id()).synthesizeStream(config, text);
+    }
+
+    // The hedge is launched from whichever thread reads the stream, so
+    // carry the caller's trace ID and priority over to it
+    std::string traceId = LunaTraceScope::current();
+    LunaPriority priority = LunaPriorityScope::current();
+    size_t original = this->pickIndex(config.voice_id());
+    std::shared_ptr<LunaHedgedReader> reader(new LunaHedgedReader(
+        [this, config, text, original, traceId,
+         priority](unsigned int attempt, const LunaAudioCallback &onAudio,
+                   const LunaFinishCallback &onFinish) {
+            LunaTraceScope scope(traceId);
+            LunaPriorityScope priorityScope(priority);
+            // The hedge must not join the request it hedges
+            if (attempt == 0)
+            {
+                return mClients[original]->synthesizeStreamAsync(
+                    config, text, onAudio, onFinish);
+            }
+            size_t index = this->pickHedge(original, config.voice_id());
+            return mClients[index]->synthesizeStreamAsync(
+                config, text, onAudio, onFinish, false);
+        },
+        hedger));
+
+    LunaSynthesizerStream stream(reader, nullptr);
+    stream.setCanceller([reader]() { reader->cancel(); });
+    mClients[original]->applyTracer(stream, traceId);
+    mClients[original]->applyStreamTimeouts(stream);
+    return stream;
+}
+
+void LunaClientPool::synthesizeTo(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, LunaAudioSink &sink)
+{
+    this->pick(config.voice_id()).synthesizeTo(config, text, sink);
+}
+
+LunaSynthesizerStream LunaClientPool::synthesizeStreamParallel(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, unsigned int maxParallel)
+{
+    // Segments are launched later, from whichever thread reads the
+    // stream, so carry the caller's trace ID and priority over to them.
+    std::string traceId = LunaTraceScope::current();
+    LunaPriority priority = LunaPriorityScope::current();
+    std::shared_ptr<LunaOrderedReader> reader(new LunaOrderedReader(
+        [this, config, traceId, priority](const std::string &segment,
+                                          const LunaAudioCallback &onAudio,
+                                          const LunaFinishCallback &onFinish) {
+            LunaTraceScope scope(traceId);
+            LunaPriorityScope priorityScope(priority);
+            return this->pick(config.voice_id())
+                .synthesizeStreamAsync(config, segment, onAudio, onFinish);
+        },
+        maxParallel));
+
+    for (const std::string &segment : LunaTextSegmenter::split(text))
+    {
+        reader->addSegment(segment);
+    }
+    reader->finishSegments();
+
+    // The clients share their settings, so any of them can set up the
+    // stream
+    LunaSynthesizerStream stream(reader, nullptr);
+    stream.setCanceller([reader]() { reader->cancel(); });
+    mClients.front()->applyTracer(stream, traceId);
+    mClients.front()->applyStreamTimeouts(stream);
+    return stream;
+}
+
+std::unique_ptr<LunaSynthesisSession> LunaClientPool::startSession(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    unsigned int maxParallel)
+{
+    // Segments are launched from whichever thread appends the text
+    std::string traceId = LunaTraceScope::current();
+    LunaPriority priority = LunaPriorityScope::current();
+    std::unique_ptr<LunaSynthesisSession> session(new LunaSynthesisSession(
+        [this, config, traceId, priority](const std::string &segment,
+                                          const LunaAudioCallback &onAudio,
+                                          const LunaFinishCallback &onFinish) {
+            LunaTraceScope scope(traceId);
+            LunaPriorityScope priorityScope(priority);
+            return this->pick(config.voice_id())
+                .synthesizeStreamAsync(config, segment, onAudio, onFinish);
+        },
+        maxParallel));
+    mClients.front()->applyTracer(session->stream(), traceId);
+    return session;
+}
+
+LunaAsyncHandle LunaClientPool::synthesizeAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const LunaSynthesizeCallback &callback)
+{
+    return this->pick(config.voice_id())
+        .synthesizeAsync(config, text, callback);
+}
+
+std::future<ByteVector> LunaClientPool::synthesizeAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text)
+{
+    return this->pick(config.voice_id()).synthesizeAsync(config, text);
+}
+
+LunaAsyncHandle LunaClientPool::synthesizeStreamAsync(
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, const LunaAudioCallback &onAudio,
+    const LunaFinishCallback &onFinish)
+{
+    return this->pick(config.voice_id())
+        .synthesizeStreamAsync(config, text, onAudio, onFinish);
+}
+
+void LunaClientPool::synthesizeMany(
+    const std::vector<LunaBulkRequest> &requests, const LunaBulkSink &sink,
+    unsigned int maxInFlight)
+{
+    lunaSynthesizeMany(
+        [this](const LunaBulkRequest &request,
+               const LunaSynthesizeCallback &callback) {
+            return this->pick(request.config.voice_id())
+                .synthesizeAsync(request.config, request.text, callback);
+        },
+        requests, sink, maxInFlight);
+}
+
+void LunaClientPool::setRequestTimeout(unsigned int milliseconds)
+{
+    for (std::unique_ptr<LunaClient> &client : mClients)
+    {
+        client->setRequestTimeout(milliseconds);
+    }
+}
+
+void LunaClientPool::setStreamTimeouts(unsigned int firstChunkMilliseconds,
+                                       unsigned int idleMilliseconds)
+{
+    for (std::unique_ptr<LunaClient> &client : mClients)
+    {
+        client->setStreamTimeouts(firstChunkMilliseconds, idleMilliseconds);
+    }
+}
+
+void LunaClientPool::setCache(
+    const std::shared_ptr<LunaSynthesisCache> &cache)
+{
+    for (std::unique_ptr<LunaClient> &client : mClients)
+    {
+        client->setCache(cache);
+    }
+}
+
+void LunaClientPool::setTracer(const std::shared_ptr<LunaTracer> &tracer)
+{
+    for (std::unique_ptr<LunaClient> &client : mClients)
+    {
+        client->setTracer(tracer);
+    }
+}
+
+void LunaClientPool::setSingleFlight(
+    const std::shared_ptr<LunaSingleFlight> &flights)
+{
+    for (std::unique_ptr<LunaClient> &client : mClients)
+    {
+        client->setSingleFlight(flights);
+    }
+}
+
+void LunaClientPool::setChunkSizer(
+    const std::shared_ptr<LunaChunkSizer> &sizer)
+{
+    for (std::unique_ptr<LunaClient> &client : mClients)
+    {
+        client->setChunkSizer(sizer);
+    }
+}
+
+void LunaClientPool::setScheduler(
+    const std::shared_ptr<LunaScheduler> &scheduler)
+{
+    for (std::unique_ptr<LunaClient> &client : mClients)
+    {
+        client->setScheduler(scheduler);
+    }
+}
+
+void LunaClientPool::enableHealthChecks(const LunaHealthCheckPolicy &policy)
+{
+    std::lock_guard<std::mutex> lock(mHealthMutex);
+    if (mHealthThread.joinable())
+    {
+        return;
+    }
+
+    mHealthThread =
+        std::thread(&LunaClientPool::runHealthChecks, this, policy);
+}
+
+void LunaClientPool::setHedgingPolicy(const LunaHedgingPolicy &policy)
+{
+    std::atomic_store(&mHedger, std::make_shared<LunaHedger>(policy));
+}
+
+void LunaClientPool::disableHedging()
+{
+    std::atomic_store(&mHedger, std::shared_ptr<LunaHedger>());
+}
+
+LunaHedgingStats LunaClientPool::hedgingStats() const
+{
+    std::shared_ptr<LunaHedger> hedger = std::atomic_load(&mHedger);
+    return hedger ? hedger->stats() : LunaHedgingStats();
+}
+
+size_t LunaClientPool::size() const { return mClients.size(); }
+
+LunaClient &LunaClientPool::client(size_t index)
+{
+    return *mClients.at(index);
+}
+
+std::vector<LunaChannelStats> LunaClientPool::stats() const
+{
+    std::vector<LunaChannelStats> result;
+    for (const std::unique_ptr<LunaClient> &client : mClients)
+    {
+        result.push_back(client->stats());
+        result.back().healthy = mHealth[result.size() - 1]->healthy;
+    }
+
+    return result;
+}
+
+LunaClientPool::LunaClientPool(const LunaClientPool &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy pool objects.
+}
+
+LunaClientPool &LunaClientPool::operator=(const LunaClientPool &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy pool objects.
+    return *this;
+}
+
+LunaClient &LunaClientPool::pick(const std::string &voice)
+{
+    return *mClients[this->pickIndex(voice)];
+}
+
+size_t LunaClientPool::pickIndex(const std::string &voice)
+{
+    // Rotating the starting point keeps the scan from always favoring
+    // the first channel when they are tied.
+    size_t start = mNext.fetch_add(1, std::memory_order_relaxed);
+    size_t n = mClients.size();
+
+    // A channel that has not received audio yet has no latency, so it is
+    // assumed to be as fast as the average of the others rather than the
+    // fastest of all.
+    std::vector<LunaChannelStats> stats;
+    uint64_t defaultLatency = 1;
+    if (mPolicy == WEIGHTED_LATENCY)
+    {
+        uint64_t total = 0;
+        uint64_t measured = 0;
+        for (const std::unique_ptr<LunaClient> &client : mClients)
+        {
+            stats.push_back(client->stats());
+            if (stats.back().latencyMicros > 0)
+            {
+                total += stats.back().latencyMicros;
+                measured++;
+            }
+        }
+        if (measured > 0)
+        {
+            defaultLatency = total / measured;
+        }
+    }
+
+    for (int level = 0; level < 3; level++)
+    {
+        size_t best = n;
+        uint64_t bestScore = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t idx = (start + i) % n;
+            if (!this->admits(idx, voice, level))
+            {
+                continue;
+            }
+            if (mPolicy == ROUND_ROBIN)
+            {
+                return idx;
+            }
+
+            uint64_t score = 0;
+            if (mPolicy == WEIGHTED_LATENCY)
+            {
+                score = this->latencyScore(stats[idx], defaultLatency);
+            }
+            else
+            {
+                score = mClients[idx]->outstandingRequests();
+            }
+
+            if (best == n || score < bestScore)
+            {
+                best = idx;
+                bestScore = score;
+                if (score == 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (best < n)
+        {
+            return best;
+        }
+    }
+
+    return start % n;
+}
+
+uint64_t LunaClientPool::latencyScore(const LunaChannelStats &stats,
+                                      uint64_t defaultLatency)
+{
+    // A replica that fails fast never receives audio and has few
+    // requests in flight, so without a penalty for its failures it would
+    // look like the best channel until the health checks eject it.
+    const uint64_t kFailurePenalty = 8;
+
+    uint64_t latency =
+        stats.latencyMicros > 0 ? stats.latencyMicros : defaultLatency;
+    uint64_t score = (latency + 1) * (stats.outstanding + 1);
+    if (stats.failures > 0)
+    {
+        score += score * kFailurePenalty * stats.failures / stats.requests;
+    }
+    return score;
+}
+
+size_t LunaClientPool::pickHedge(size_t original, const std::string &voice)
+{
+    // A hedge to the same replica would likely be just as slow, so only
+    // fall back to another channel to it when there is no other url.
+    bool otherUrl = mNumEndpoints > 1;
+    size_t n = mClients.size();
+    for (int level = 0; level < 3; level++)
+    {
+        size_t best = original;
+        uint64_t bestCount = 0;
+        for (size_t i = 1; i < n; i++)
+        {
+            size_t idx = (original + i) % n;
+            if ((otherUrl && mEndpoints[idx] == mEndpoints[original]) ||
+                !this->admits(idx, voice, level))
+            {
+                continue;
+            }
+
+            uint64_t count = mClients[idx]->outstandingRequests();
+            if (best == original || count < bestCount)
+            {
+                best = idx;
+                bestCount = count;
+            }
+        }
+
+        if (best != original)
+        {
+            return best;
+        }
+    }
+
+    return original;
+}
+
+bool LunaClientPool::admits(size_t index, const std::string &voice,
+                            int level) const
+{
+    if (level >= 2)
+    {
+        return true;
+    }
+    if (!mHealth[index]->healthy)
+    {
+        return false;
+    }
+    if (level == 1 || voice.empty())
+    {
+        return true;
+    }
+
+    // Until the server's voices are known, assume it has the voice
+    std::shared_ptr<const LunaServerInfo> info =
+        mClients[index]->cachedServerInfo();
+    return !info || info->findVoice(voice) != nullptr;
+}
+
+void LunaClientPool::runHealthChecks(LunaHealthCheckPolicy policy)
+{
+    std::unique_lock<std::mutex> lock(mHealthMutex);
+    while (!mHealthStopping)
+    {
+        lock.unlock();
+        this->checkHealth(policy);
+        lock.lock();
+
+        mHealthCV.wait_for(lock, policy.interval,
+                           [this]() { return mHealthStopping; });
+    }
+}
+
+void LunaClientPool::checkHealth(const LunaHealthCheckPolicy &policy)
+{
+    // Probe every channel at once, so a dead server costs one timeout
+    // per round rather than one per channel.
+    struct Round
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t remaining;
+        std::vector<bool> ok;
+    };
+    std::shared_ptr<Round> round = std::make_shared<Round>();
+    round->remaining = mClients.size();
+    round->ok.resize(mClients.size(), false);
+
+    for (size_t i = 0; i < mClients.size(); i++)
+    {
+        mClients[i]->checkHealth(
+            policy.timeout, [round, i](const grpc::Status &status) {
+                {
+                    std::lock_guard<std::mutex> lock(round->mutex);
+                    round->ok[i] = status.ok();
+                    round->remaining--;
+                }
+                round->cv.notify_all();
+            });
+    }
+
+    std::vector<bool> ok;
+    {
+        std::unique_lock<std::mutex> lock(round->mutex);
+        round->cv.wait(lock, [&round]() { return round->remaining == 0; });
+        ok = round->ok;
+    }
+
+    for (size_t i = 0; i < mClients.size(); i++)
+    {
+        ChannelHealth &health = *mHealth[i];
+        if (!ok[i])
+        {
+            health.successes = 0;
+            if (++health.failures >= policy.ejectAfter)
+            {
+                health.healthy = false;
+            }
+            continue;
+        }
+
+        health.failures = 0;
+        if (!health.healthy && ++health.successes >= policy.readmitAfter)
+        {
+            health.healthy = true;
+            health.successes = 0;
+        }
+
+        // Learn the voices of servers that have come up, for routing
+        if (health.healthy && !mClients[i]->cachedServerInfo())
+        {
+            try
+            {
+                mClients[i]->serverInfo();
+            }
+            catch (const LunaException &)
+            {
+                // Try again on the next round
+            }
+        }
+    }
+}
+
+bool LunaClientPool::hedgedSynthesize(
+    const std::shared_ptr<LunaHedger> &hedger, size_t original,
+    const cobaltspeech::luna::SynthesizerConfig &config,
+    const std::string &text, std::string &audio)
+{
+    using Clock = std::chrono::steady_clock;
+
+    // State shared with the callbacks, which may run after we return
+    struct Attempt
+    {
+        bool done = false;
+        grpc::Status status;
+        LunaAsyncHandle handle;
+    };
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        Clock::time_point started;
+        Attempt attempts[2];
+        int winner = -1;
+        std::string audio;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+
+    size_t channels[2];
+    channels[0] = original;
+
+    // Only the original request may join an identical one in flight. The
+    // hedge would otherwise join the original and wait on the same call.
+    auto launch = [&](int attempt) {
+        LunaAsyncHandle handle = mClients[channels[attempt]]->synthesizeAsync(
+            config, text,
+            [state, hedger, attempt](const grpc::Status &status,
+                                     std::string &result) {
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    Attempt &current = state->attempts[attempt];
+                    current.done = true;
+                    current.status = status;
+                    if (state->winner < 0 && status.ok())
+                    {
+                        // The latency is that of the whole request, not
+                        // just the winning attempt
+                        state->winner = attempt;
+                        state->audio.swap(result);
+                        hedger->recordLatency(
+                            false,
+                            std::chrono::duration_cast<
+                                std::chrono::microseconds>(Clock::now() -
+                                                           state->started),
+                            attempt == 1);
+                    }
+                }
+                state->cv.notify_all();
+            },
+            attempt == 0);
+
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->attempts[attempt].handle = handle;
+    };
+
+    hedger->requestStarted();
+    state->started = Clock::now();
+    Clock::time_point hedgeAt = state->started + hedger->delay(false);
+    launch(0);
+
+    // Wait for the hedging delay, then hedge if there is budget for it.
+    // Hedging is not retrying: an early failure is reported as is.
+    int launched = 1;
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait_until(lock, hedgeAt,
+                             [&]() { return state->attempts[0].done; });
+    }
+    bool pending = false;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        pending = !state->attempts[0].done;
+    }
+    if (pending && hedger->tryHedge())
+    {
+        channels[1] = this->pickHedge(channels[0], config.voice_id());
+        launch(1);
+        launched = 2;
+    }
+
+    // Take the first success, or wait for every attempt to fail
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&]() {
+        if (state->winner >= 0)
+        {
+            return true;
+        }
+        for (int i = 0; i < launched; i++)
+        {
+            if (!state->attempts[i].done)
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    if (state->winner < 0)
+    {
+        if (LunaClient::isTooLarge(state->attempts[0].status))
+        {
+            return false;
+        }
+        throw LunaException(state->attempts[0].status);
+    }
+
+    // Cancel the loser, if it is still running. That is done without the
+    // lock, since cancelling a request still waiting for a scheduler slot
+    // runs its callback right away.
+    audio.swap(state->audio);
+    bool cancelLoser =
+        launched == 2 && !state->attempts[1 - state->winner].done;
+    LunaAsyncHandle loser = state->attempts[1 - state->winner].handle;
+    lock.unlock();
+
+    if (cancelLoser)
+    {
+        loser.cancel();
+    }
+    return true;
+}
@@ -0,0 +1,289 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_CLIENT_POOL_H
+#define LUNA_CLIENT_POOL_H
+
+#include "luna_client.h"
+#include "luna_hedging.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//! Options for LunaClientPool::enableHealthChecks().
+struct LunaHealthCheckPolicy
+{
+    //! How often every channel is probed with a Version request.
+    std::chrono::milliseconds interval = std::chrono::milliseconds(5000);
+
+    //! How long a probe may take before it counts as failed.
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(1000);
+
+    //! Eject a channel after this many consecutive failed probes.
+    unsigned int ejectAfter = 2;
+
+    //! Re-admit an ejected channel after this many consecutive
+    //! successful probes.
+    unsigned int readmitAfter = 2;
+};
+
+//! LunaClientPool spreads requests over several independent connections
+//! to the same Luna server, or to several replicas of it. A single
+//! channel is limited by the number of concurrent HTTP/2 streams and by
+//! its I/O thread; using several channels lets a busy client scale
+//! across cores. The pool has the same synthesis API as LunaClient, so
+//! it can be used in its place, and like LunaClient it is thread-safe.
+//!
+//! Requests are balanced per request, rather than per connection as an
+//! L4 balancer would. They are only sent to channels whose server lists
+//! the requested voice (once its voices are known) and, with health
+//! checks enabled, whose server is answering. If no channel qualifies,
+//! the pool falls back to the healthy channels, then to all of them.
+class LunaClientPool
+{
+public:
+    //! The strategy used to choose a channel for each request.
+    enum Policy
+    {
+        //! Cycle through the channels in order.
+        ROUND_ROBIN,
+
+        //! Use the channel with the fewest requests in flight.
+        LEAST_OUTSTANDING,
+
+        //! Use the channel with the lowest expected wait: its average
+        //! time to first audio, scaled by the requests in flight and
+        //! penalized by the fraction of requests that failed. This
+        //! favors faster replicas when they differ. Channels that have
+        //! not yet received audio are assumed to have the pool average.
+        WEIGHTED_LATENCY
+    };
+
+    //! Create a pool of numChannels connections to the Luna server
+    //! running at the given url. See LunaClient for a description of
+    //! the url and secureConnection parameters. If metrics is given,
+    //! every channel records the latency of its requests into it.
+    LunaClientPool(const std::string &url, bool secureConnection,
+                   unsigned int numChannels,
+                   Policy policy = LEAST_OUTSTANDING,
+                   const std::shared_ptr<LunaMetrics> &metrics = nullptr);
+
+    //! Create a pool with channelsPerUrl connections to each of the
+    //! given urls, which should be replicas of the same Luna server.
+    LunaClientPool(const std::vector<std::string> &urls,
+                   bool secureConnection, unsigned int channelsPerUrl,
+                   Policy policy = LEAST_OUTSTANDING,
+                   const std::shared_ptr<LunaMetrics> &metrics = nullptr);
+
+    ~LunaClientPool();
+
+    //! Resolve a host:port url to one url per address, for use with the
+    //! multi-url constructor. A DNS name for a set of replicas then
+    //! becomes a pool that balances across them. The addresses are
+    //! resolved once; health checks take care of replicas that go away.
+    static std::vector<std::string> resolve(const std::string &url);
+
+    //! Returns the version of Luna used by the server.
+    std::string lunaVersion();
+
+    //! Returns a list of Luna TTS voice models that the server is currently
+    //! configured to use.
+    std::vector<LunaVoice> listVoices();
+
+    //! Returns the server's version and voices without copying them.
+    //! See LunaClient::serverInfo().
+    std::shared_ptr<const LunaServerInfo> serverInfo();
+
+    //! Warm up every channel in the pool at once. Voices are primed
+    //! through the first channel only, since priming warms the server
+    //! rather than the connection. The future becomes ready when every
+    //! channel is warm, or holds the first failure. See
+    //! LunaClient::warmUp().
+    std::shared_future<std::shared_ptr<const LunaServerInfo>>
+    warmUp(const LunaWarmUpOptions &options = LunaWarmUpOptions());
+
+    //! Run batch synthesis on one of the pool's channels.
+    //! See LunaClient::synthesize().
+    ByteVector synthesize(const cobaltspeech::luna::SynthesizerConfig &config,
+                          const std::string &text);
+
+    //! Run batch synthesis on one of the pool's channels, moving the
+    //! audio into the given string. See LunaClient::synthesize().
+    void synthesize(const cobaltspeech::luna::SynthesizerConfig &config,
+                    const std::string &text, std::string &audio);
+
+    //! Run streaming synthesis on one of the pool's channels.
+    //! See LunaClient::synthesizeStream().
+    LunaSynthesizerStream
+    synthesizeStream(const cobaltspeech::luna::SynthesizerConfig &config,
+                     const std::string &text);
+
+    //! Run streaming synthesis on one of the pool's channels into the
+    //! given sink. See LunaClient::synthesizeTo().
+    void synthesizeTo(const cobaltspeech::luna::SynthesizerConfig &config,
+                      const std::string &text, LunaAudioSink &sink);
+
+    //! Run parallel streaming synthesis, spreading the segments over the
+    //! pool's channels. See LunaClient::synthesizeStreamParallel().
+    LunaSynthesizerStream synthesizeStreamParallel(
+        const cobaltspeech::luna::SynthesizerConfig &config,
+        const std::string &text, unsigned int maxParallel);
+
+    //! Start an incremental synthesis session, spreading the segments
+    //! over the pool's channels. See LunaClient::startSession().
+    std::unique_ptr<LunaSynthesisSession>
+    startSession(const cobaltspeech::luna::SynthesizerConfig &config,
+                 unsigned int maxParallel = 2);
+
+    //! See LunaClient::synthesizeAsync().
+    LunaAsyncHandle
+    synthesizeAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                    const std::string &text,
+                    const LunaSynthesizeCallback &callback);
+
+    //! See LunaClient::synthesizeAsync().
+    std::future<ByteVector>
+    synthesizeAsync(const cobaltspeech::luna::SynthesizerConfig &config,
+                    const std::string &text);
+
+    //! See LunaClient::synthesizeStreamAsync().
+    LunaAsyncHandle synthesizeStreamAsync(
+        const cobaltspeech::luna::SynthesizerConfig &config,
+        const std::string &text, const LunaAudioCallback &onAudio,
+        const LunaFinishCallback &onFinish);
+
+    //! Synthesize a list of requests, spreading them over the pool's
+    //! channels. See LunaClient::synthesizeMany().
+    void synthesizeMany(const std::vector<LunaBulkRequest> &requests,
+                        const LunaBulkSink &sink, unsigned int maxInFlight);
+
+    //! Set the timeout for requests to the server on every channel.
+    void setRequestTimeout(unsigned int milliseconds);
+
+    //! Set the stream timeouts on every channel.
+    //! See LunaClient::setStreamTimeouts().
+    void setStreamTimeouts(unsigned int firstChunkMilliseconds,
+                           unsigned int idleMilliseconds);
+
+    //! Use the given cache on every channel. See LunaClient::setCache().
+    void setCache(const std::shared_ptr<LunaSynthesisCache> &cache);
+
+    //! Use the given tracer on every channel. See LunaClient::setTracer().
+    void setTracer(const std::shared_ptr<LunaTracer> &tracer);
+
+    //! Merge identical requests in flight on any of the pool's channels.
+    //! See LunaClient::setSingleFlight().
+    void setSingleFlight(const std::shared_ptr<LunaSingleFlight> &flights);
+
+    //! Use the given chunk sizer on every channel, so they all learn from
+    //! each other's requests. See LunaClient::setChunkSizer().
+    void setChunkSizer(const std::shared_ptr<LunaChunkSizer> &sizer);
+
+    //! Admit requests on every channel through the given scheduler, so
+    //! its limits apply to the pool as a whole. See
+    //! LunaClient::setScheduler().
+    void setScheduler(const std::shared_ptr<LunaScheduler> &scheduler);
+
+    //! Hedge synthesize() and synthesizeStream() requests with the given
+    //! policy (see LunaHedgingPolicy). Hedges are sent to a different
+    //! url than the original request when the pool has more than one.
+    //! Replaces the previous policy and its latency history.
+    void setHedgingPolicy(const LunaHedgingPolicy &policy);
+
+    //! Start probing every channel in the background, and stop sending
+    //! requests to channels whose probes fail until they recover. Does
+    //! nothing if health checks are already running.
+    void enableHealthChecks(
+        const LunaHealthCheckPolicy &policy = LunaHealthCheckPolicy());
+
+    //! Stop hedging requests.
+    void disableHedging();
+
+    //! Returns the counters of the current hedging policy.
+    LunaHedgingStats hedgingStats() const;
+
+    //! Returns the number of channels in the pool.
+    size_t size() const;
+
+    //! Returns the client for the channel at the given index.
+    LunaClient &client(size_t index);
+
+    //! Returns statistics for each channel, in channel order, including
+    //! whether it is currently healthy.
+    std::vector<LunaChannelStats> stats() const;
+
+private:
+    // Health check state of a channel. Only the health check thread
+    // updates the probe counts.
+    struct ChannelHealth
+    {
+        std::atomic<bool> healthy;
+        unsigned int failures;
+        unsigned int successes;
+
+        ChannelHealth() : healthy(true), failures(0), successes(0) {}
+    };
+
+    std::vector<std::unique_ptr<LunaClient>> mClients;
+    std::vector<std::unique_ptr<ChannelHealth>> mHealth;
+    std::vector<size_t> mEndpoints;
+    size_t mNumEndpoints;
+    Policy mPolicy;
+    std::atomic<size_t> mNext;
+
+    // Waits for the channels' warm-ups to finish.
+    std::mutex mWarmUpMutex;
+    std::shared_future<std::shared_ptr<const LunaServerInfo>> mWarmUp;
+    std::thread mWarmUpThread;
+
+    // Replaced as a whole and read with std::atomic_load.
+    std::shared_ptr<LunaHedger> mHedger;
+
+    // The health check thread, which sleeps on the condition variable
+    // between rounds.
+    std::mutex mHealthMutex;
+    std::condition_variable mHealthCV;
+    bool mHealthStopping;
+    std::thread mHealthThread;
+
+    // Disable copy construction and assignments.
+    LunaClientPool(const LunaClientPool &other);
+    LunaClientPool &operator=(const LunaClientPool &other);
+
+    // Choose the client to use for the next request for the given voice.
+    LunaClient &pick(const std::string &voice);
+    size_t pickIndex(const std::string &voice);
+
+    // Returns the WEIGHTED_LATENCY score of a channel (lower is better),
+    // using the given latency if the channel has not measured its own.
+    static uint64_t latencyScore(const LunaChannelStats &stats,
+                                 uint64_t defaultLatency);
+
+    // Choose the client for a hedge of a request sent on the given
+    // channel, preferring the least busy channel to another url.
+    size_t pickHedge(size_t original, const std::string &voice);
+
+    // Returns true if the channel may serve the voice. The level relaxes
+    // the requirements: 0 needs a healthy channel with the voice, 1 any
+    // healthy channel, and 2 accepts every channel.
+    bool admits(size_t index, const std::string &voice, int level) const;
+
+    void runHealthChecks(LunaHealthCheckPolicy policy);
+    void checkHealth(const LunaHealthCheckPolicy &policy);
+
+    // Run a hedged unary call, first sent to the given channel. Returns
+    // false if the response was too large for the channel, in which case
+    // it must be streamed instead.
+    bool hedgedSynthesize(const std::shared_ptr<LunaHedger> &hedger,
+                          size_t original,
+                          const cobaltspeech::luna::SynthesizerConfig &config,
+                          const std::string &text, std::string &audio);
+};
+
+#endif // LUNA_CLIENT_POOL_H
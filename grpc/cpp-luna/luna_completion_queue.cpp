@@ -0,0 +1,100 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_completion_queue.h"
+
+LunaAsyncCall::LunaAsyncCall()
+    : mCtx(new grpc::ClientContext), mQueue(nullptr)
+{
+}
+
+LunaAsyncCall::~LunaAsyncCall()
+{
+    if (mQueue)
+    {
+        mQueue->release(this);
+    }
+}
+
+grpc::ClientContext &LunaAsyncCall::context() { return *mCtx; }
+
+LunaCompletionQueue::LunaCompletionQueue(unsigned int numThreads)
+{
+    if (numThreads == 0)
+    {
+        numThreads = 1;
+    }
+
+    for (unsigned int i = 0; i < numThreads; i++)
+    {
+        mThreads.push_back(std::thread(&LunaCompletionQueue::run, this));
+    }
+}
+
+LunaCompletionQueue::~LunaCompletionQueue()
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCV.wait(lock, [this]() { return mOutstanding.empty(); });
+    }
+
+    // Shutdown lets the threads drain the remaining events before
+    // Next() finally returns false.
+    mCQ.Shutdown();
+    for (std::thread &t : mThreads)
+    {
+        t.join();
+    }
+}
+
+grpc::CompletionQueue *LunaCompletionQueue::cq() { return &mCQ; }
+
+grpc::CompletionQueue *LunaCompletionQueue::cq(LunaAsyncCall *call)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mOutstanding.insert(call);
+    call->mQueue = this;
+    return &mCQ;
+}
+
+void LunaCompletionQueue::cancelAll()
+{
+    // A call removes itself under the lock before its context is
+    // destroyed, so every context in the set is still valid here.
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (LunaAsyncCall *call : mOutstanding)
+    {
+        call->mCtx->TryCancel();
+    }
+}
+
+bool LunaCompletionQueue::onQueueThread() const
+{
+    for (const std::thread &t : mThreads)
+    {
+        if (t.get_id() == std::this_thread::get_id())
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void LunaCompletionQueue::run()
+{
+    void *tag = nullptr;
+    bool ok = false;
+    while (mCQ.Next(&tag, &ok))
+    {
+        static_cast<LunaAsyncCall *>(tag)->proceed(ok);
+    }
+}
+
+void LunaCompletionQueue::release(LunaAsyncCall *call)
+{
+    // Notify while holding the lock, since the destructor may be waiting
+    // to destroy the condition variable.
+    std::lock_guard<std::mutex> lock(mMutex);
+    mOutstanding.erase(call);
+    mCV.notify_all();
+}
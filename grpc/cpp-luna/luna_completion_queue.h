@@ -0,0 +1,102 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_COMPLETION_QUEUE_H
+#define LUNA_COMPLETION_QUEUE_H
+
+#include <grpcpp/client_context.h>
+#include <grpcpp/completion_queue.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+class LunaCompletionQueue;
+
+//! LunaAsyncCall is the base class for all operations that are driven
+//! by a LunaCompletionQueue. Each call uses its own address as the tag
+//! for the gRPC operations it starts, and proceed() is called from one
+//! of the queue threads when an operation completes.
+class LunaAsyncCall
+{
+public:
+    LunaAsyncCall();
+    virtual ~LunaAsyncCall();
+
+    //! Returns the context of the call, to be set up before it starts.
+    grpc::ClientContext &context();
+
+    //! Advance the call after one of its operations completed. The ok
+    //! flag is the value returned by grpc::CompletionQueue::Next().
+    //! Implementations are responsible for deleting themselves once
+    //! they have no more pending operations.
+    virtual void proceed(bool ok) = 0;
+
+protected:
+    // Kept in the base class so that the queue can cancel the call
+    // until the moment it is deleted.
+    std::shared_ptr<grpc::ClientContext> mCtx;
+
+private:
+    friend class LunaCompletionQueue;
+
+    // The queue that counts this call as outstanding, if any.
+    LunaCompletionQueue *mQueue;
+};
+
+//! LunaCompletionQueue owns a grpc::CompletionQueue and the threads
+//! that poll it. A handful of threads can service any number of
+//! outstanding asynchronous calls.
+class LunaCompletionQueue
+{
+public:
+    //! Create the queue and start the given number of polling threads
+    //! (at least one thread is always started).
+    LunaCompletionQueue(unsigned int numThreads);
+
+    //! Shut down the queue and wait for the polling threads to exit.
+    //! This blocks until every outstanding call has completed, so it
+    //! must not be called from one of the polling threads; call
+    //! cancelAll() first to avoid waiting for long streams.
+    ~LunaCompletionQueue();
+
+    //! Returns the underlying gRPC completion queue.
+    grpc::CompletionQueue *cq();
+
+    //! Returns the underlying gRPC completion queue, to be used by the
+    //! given call. The call is counted as outstanding until it is
+    //! deleted, and the queue is not shut down before then: a streaming
+    //! call keeps starting operations, and starting one on a queue that
+    //! is shutting down is an error.
+    grpc::CompletionQueue *cq(LunaAsyncCall *call);
+
+    //! Cancel every outstanding call. Their callbacks are still run, with
+    //! a CANCELLED status.
+    void cancelAll();
+
+    //! Returns true if this is one of the polling threads.
+    bool onQueueThread() const;
+
+private:
+    grpc::CompletionQueue mCQ;
+    std::vector<std::thread> mThreads;
+
+    std::mutex mMutex;
+    std::condition_variable mCV;
+    std::unordered_set<LunaAsyncCall *> mOutstanding;
+
+    // Disable copy construction and assignments.
+    LunaCompletionQueue(const LunaCompletionQueue &other);
+    LunaCompletionQueue &operator=(const LunaCompletionQueue &other);
+
+    friend class LunaAsyncCall;
+
+    void run();
+
+    // Called when an outstanding call is deleted.
+    void release(LunaAsyncCall *call);
+};
+
+#endif // LUNA_COMPLETION_QUEUE_H
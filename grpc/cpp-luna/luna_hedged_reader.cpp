@@ -0,0 +1,220 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_hedged_reader.h"
+
+#include <vector>
+
+LunaHedgedReader::LunaHedgedReader(const Launcher &launcher,
+                                   const std::shared_ptr<LunaHedger> &hedger)
+    : mLauncher(launcher), mHedger(hedger), mState(new State)
+{
+    mHedger->requestStarted();
+    mState->started = Clock::now();
+    mHedgeAt = mState->started + mHedger->delay(true);
+    this->launch(0);
+}
+
+LunaHedgedReader::~LunaHedgedReader() { this->cancel(); }
+
+void LunaHedgedReader::cancel()
+{
+    std::vector<LunaAsyncHandle> running;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        mState->cancelled = true;
+        for (unsigned int i = 0; i < mState->launched; i++)
+        {
+            if (!mState->attempts[i].done)
+            {
+                running.push_back(mState->attempts[i].handle);
+            }
+        }
+    }
+
+    mState->cv.notify_all();
+    for (const LunaAsyncHandle &handle : running)
+    {
+        handle.cancel();
+    }
+}
+
+bool LunaHedgedReader::Read(cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    std::unique_lock<std::mutex> lock(mState->mutex);
+    while (!mState->cancelled)
+    {
+        if (mState->winner >= 0)
+        {
+            // Stop the slower request now that we know which one won
+            if (mState->launched == 2 && !mState->loserCancelled)
+            {
+                mState->loserCancelled = true;
+                LunaAsyncHandle loser =
+                    mState->attempts[1 - mState->winner].handle;
+                lock.unlock();
+                loser.cancel();
+                lock.lock();
+                continue;
+            }
+
+            Attempt &winner = mState->attempts[mState->winner];
+            if (!winner.chunks.empty())
+            {
+                msg->mutable_audio()->swap(winner.chunks.front());
+                winner.chunks.pop_front();
+                return true;
+            }
+
+            if (winner.done)
+            {
+                return false;
+            }
+
+            mState->cv.wait(lock);
+            continue;
+        }
+
+        // Hedging is not retrying: if the original request fails before
+        // the hedge is sent, the stream fails.
+        bool failed = mState->attempts[0].done;
+        if (mState->launched == 2)
+        {
+            failed = failed && mState->attempts[1].done;
+        }
+        if (failed)
+        {
+            return false;
+        }
+
+        if (mState->hedgeDecided)
+        {
+            mState->cv.wait(lock);
+            continue;
+        }
+
+        if (Clock::now() < mHedgeAt)
+        {
+            mState->cv.wait_until(lock, mHedgeAt);
+            continue;
+        }
+
+        mState->hedgeDecided = true;
+        if (mHedger->tryHedge())
+        {
+            lock.unlock();
+            this->launch(1);
+            lock.lock();
+        }
+    }
+
+    return false;
+}
+
+bool LunaHedgedReader::NextMessageSize(uint32_t *sz)
+{
+    // The size of the next chunk isn't known until it arrives.
+    *sz = 0;
+    return true;
+}
+
+grpc::Status LunaHedgedReader::Finish()
+{
+    std::lock_guard<std::mutex> lock(mState->mutex);
+    if (mState->cancelled)
+    {
+        return grpc::Status(grpc::StatusCode::CANCELLED, "stream cancelled");
+    }
+
+    if (mState->winner >= 0)
+    {
+        const Attempt &winner = mState->attempts[mState->winner];
+        if (!winner.done || !winner.chunks.empty())
+        {
+            return grpc::Status(grpc::StatusCode::CANCELLED,
+                                "stream finished before all audio was read");
+        }
+        return winner.status;
+    }
+
+    // Neither request succeeded. Report the original request's error.
+    if (!mState->attempts[0].done)
+    {
+        return grpc::Status(grpc::StatusCode::CANCELLED,
+                            "stream finished before any audio was read");
+    }
+    return mState->attempts[0].status;
+}
+
+void LunaHedgedReader::WaitForInitialMetadata() {}
+
+void LunaHedgedReader::launch(unsigned int attempt)
+{
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        mState->launched = attempt + 1;
+    }
+
+    std::shared_ptr<State> state = mState;
+    std::shared_ptr<LunaHedger> hedger = mHedger;
+    int self = static_cast<int>(attempt);
+
+    // The first request to deliver audio (or to finish successfully
+    // without any) wins. Audio from the other is dropped.
+    LunaAudioCallback onAudio = [state, hedger, self](std::string &audio) {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->winner < 0)
+            {
+                state->winner = self;
+                hedger->recordLatency(
+                    true,
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        Clock::now() - state->started),
+                    self == 1);
+            }
+            if (state->winner != self)
+            {
+                return;
+            }
+
+            Attempt &current = state->attempts[self];
+            current.chunks.push_back(std::string());
+            current.chunks.back().swap(audio);
+        }
+        state->cv.notify_all();
+    };
+
+    LunaFinishCallback onFinish = [state, hedger,
+                                   self](const grpc::Status &status) {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            Attempt &current = state->attempts[self];
+            current.done = true;
+            current.status = status;
+            if (state->winner < 0 && status.ok())
+            {
+                state->winner = self;
+                hedger->recordLatency(
+                    true,
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        Clock::now() - state->started),
+                    self == 1);
+            }
+        }
+        state->cv.notify_all();
+    };
+
+    LunaAsyncHandle handle = mLauncher(attempt, onAudio, onFinish);
+
+    // The reader may have been cancelled while the request was starting
+    bool cancelled = false;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        mState->attempts[attempt].handle = handle;
+        cancelled = mState->cancelled;
+    }
+    if (cancelled)
+    {
+        handle.cancel();
+    }
+}
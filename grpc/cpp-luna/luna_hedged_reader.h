@@ -0,0 +1,90 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_HEDGED_READER_H
+#define LUNA_HEDGED_READER_H
+
+#include "luna.grpc.pb.h"
+#include "luna_async_call.h"
+#include "luna_hedging.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+//! LunaHedgedReader reads a streaming synthesis that is hedged. The
+//! request is started when the reader is created; if its first chunk of
+//! audio has not arrived by the hedging delay, a duplicate request is
+//! started. Whichever delivers audio first is read, and the other is
+//! cancelled. Only the start of the stream is hedged: once a request has
+//! won, its failures are reported as usual.
+//!
+//! Like LunaOrderedReader, the hedge is started from the thread that
+//! reads audio, never from the completion queue threads.
+class LunaHedgedReader
+    : public grpc::ClientReaderInterface<cobaltspeech::luna::SynthesizeResponse>
+{
+public:
+    //! Function used to start one attempt at the stream. The attempt is
+    //! 0 for the original request and 1 for the hedge.
+    using Launcher = std::function<LunaAsyncHandle(
+        unsigned int attempt, const LunaAudioCallback &onAudio,
+        const LunaFinishCallback &onFinish)>;
+
+    //! Start the original request.
+    LunaHedgedReader(const Launcher &launcher,
+                     const std::shared_ptr<LunaHedger> &hedger);
+
+    //! Cancels any requests that are still running.
+    ~LunaHedgedReader() override;
+
+    //! Cancel both requests. Read() returns false, and Finish() returns
+    //! CANCELLED. Safe to call from any thread.
+    void cancel();
+
+    bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+    bool NextMessageSize(uint32_t *sz) override;
+    grpc::Status Finish() override;
+    void WaitForInitialMetadata() override;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Attempt
+    {
+        std::deque<std::string> chunks;
+        bool done = false;
+        grpc::Status status;
+        LunaAsyncHandle handle;
+    };
+
+    // State shared with the callbacks of the running requests, which may
+    // outlive the reader.
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        // When the first attempt started, which is when the request did
+        Clock::time_point started;
+        Attempt attempts[2];
+        unsigned int launched = 0;
+        int winner = -1;
+        bool hedgeDecided = false;
+        bool loserCancelled = false;
+        bool cancelled = false;
+    };
+
+    Launcher mLauncher;
+    std::shared_ptr<LunaHedger> mHedger;
+    std::shared_ptr<State> mState;
+    Clock::time_point mHedgeAt;
+
+    // Start the given attempt. Must be called without holding the lock.
+    void launch(unsigned int attempt);
+};
+
+#endif // LUNA_HEDGED_READER_H
@@ -0,0 +1,127 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_hedging.h"
+
+#include <algorithm>
+
+namespace
+{
+
+// How often the hedging delay is recomputed, in recorded latencies.
+const uint64_t kDelayUpdateInterval = 32;
+
+} // namespace
+
+LunaHedger::LunaHedger(const LunaHedgingPolicy &policy)
+    : mPolicy(policy), mRequests(0), mHedges(0), mHedgesWon(0),
+      mBudgetExhausted(0)
+{
+    int64_t initial =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            policy.initialDelay)
+            .count();
+    mDelayMicros[0] = initial;
+    mDelayMicros[1] = initial;
+    mRecorded[0] = 0;
+    mRecorded[1] = 0;
+
+    // Start with a full budget, so the first slow requests can be hedged
+    mBudget = static_cast<int64_t>(policy.budgetBurst * 1000);
+}
+
+LunaHedger::~LunaHedger() {}
+
+const LunaHedgingPolicy &LunaHedger::policy() const { return mPolicy; }
+
+std::chrono::microseconds LunaHedger::delay(bool stream) const
+{
+    return std::chrono::microseconds(
+        mDelayMicros[stream ? 1 : 0].load(std::memory_order_relaxed));
+}
+
+void LunaHedger::requestStarted()
+{
+    mRequests.fetch_add(1, std::memory_order_relaxed);
+
+    int64_t earned = static_cast<int64_t>(mPolicy.budgetRatio * 1000);
+    int64_t limit = static_cast<int64_t>(mPolicy.budgetBurst * 1000);
+    int64_t budget = mBudget.load(std::memory_order_relaxed);
+    while (budget < limit &&
+           !mBudget.compare_exchange_weak(budget,
+                                          std::min(budget + earned, limit),
+                                          std::memory_order_relaxed))
+    {
+    }
+}
+
+bool LunaHedger::tryHedge()
+{
+    int64_t budget = mBudget.load(std::memory_order_relaxed);
+    while (budget >= 1000)
+    {
+        if (mBudget.compare_exchange_weak(budget, budget - 1000,
+                                          std::memory_order_relaxed))
+        {
+            mHedges.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    mBudgetExhausted.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void LunaHedger::recordLatency(bool stream,
+                               std::chrono::microseconds latency,
+                               bool hedgeWon)
+{
+    if (hedgeWon)
+    {
+        mHedgesWon.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    LunaHistogram &histogram = mLatency[stream ? 1 : 0];
+    histogram.record(static_cast<uint64_t>(latency.count()));
+
+    uint64_t recorded =
+        mRecorded[stream ? 1 : 0].fetch_add(1, std::memory_order_relaxed) + 1;
+    if (recorded < mPolicy.minSamples || recorded % kDelayUpdateInterval != 0)
+    {
+        return;
+    }
+
+    LunaHistogramSnapshot snapshot = histogram.snapshot();
+    int64_t micros =
+        static_cast<int64_t>(snapshot.percentile(mPolicy.percentile) * 1e6);
+    int64_t lower =
+        std::chrono::duration_cast<std::chrono::microseconds>(mPolicy.minDelay)
+            .count();
+    int64_t upper =
+        std::chrono::duration_cast<std::chrono::microseconds>(mPolicy.maxDelay)
+            .count();
+    micros = std::max(lower, std::min(micros, upper));
+    mDelayMicros[stream ? 1 : 0].store(micros, std::memory_order_relaxed);
+}
+
+LunaHedgingStats LunaHedger::stats() const
+{
+    LunaHedgingStats stats;
+    stats.requests = mRequests.load(std::memory_order_relaxed);
+    stats.hedges = mHedges.load(std::memory_order_relaxed);
+    stats.hedgesWon = mHedgesWon.load(std::memory_order_relaxed);
+    stats.budgetExhausted = mBudgetExhausted.load(std::memory_order_relaxed);
+    return stats;
+}
+
+LunaHedger::LunaHedger(const LunaHedger &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy hedger objects.
+}
+
+LunaHedger &LunaHedger::operator=(const LunaHedger &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy hedger objects.
+    return *this;
+}
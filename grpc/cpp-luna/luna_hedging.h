@@ -0,0 +1,110 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_HEDGING_H
+#define LUNA_HEDGING_H
+
+#include "luna_histogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+//! LunaHedgingPolicy configures hedged requests. A hedged request is
+//! sent to one replica, and if it has not answered (or, for streams,
+//! delivered its first chunk) within the hedging delay, a duplicate is
+//! sent to another replica. The first to answer wins and the other is
+//! cancelled.
+struct LunaHedgingPolicy
+{
+    //! The hedging delay is this percentile (0-100) of the observed
+    //! latency, so only the slowest requests are hedged.
+    double percentile = 95.0;
+
+    //! The delay used until minSamples latencies have been observed.
+    std::chrono::milliseconds initialDelay = std::chrono::milliseconds(50);
+
+    //! Bounds for the delay computed from the observed latency.
+    std::chrono::milliseconds minDelay = std::chrono::milliseconds(5);
+    std::chrono::milliseconds maxDelay = std::chrono::milliseconds(5000);
+
+    //! The number of latencies to observe before using the percentile.
+    uint64_t minSamples = 100;
+
+    //! The number of hedges allowed per request. Each request earns this
+    //! much budget and each hedge spends one, so hedging can add at most
+    //! this fraction of extra load, even when every request is slow
+    //! because the servers are overloaded.
+    double budgetRatio = 0.1;
+
+    //! The most budget that can be saved up for a burst of hedges.
+    double budgetBurst = 10.0;
+};
+
+//! Counters for hedged requests.
+struct LunaHedgingStats
+{
+    //! Requests sent under the hedging policy.
+    uint64_t requests = 0;
+
+    //! Duplicate requests sent because the first was too slow.
+    uint64_t hedges = 0;
+
+    //! Hedges that answered before the request they duplicated.
+    uint64_t hedgesWon = 0;
+
+    //! Hedges that were not sent because the budget was used up.
+    uint64_t budgetExhausted = 0;
+};
+
+//! LunaHedger holds the state of a hedging policy: the latency
+//! histograms that the hedging delay comes from, and the hedging budget.
+//! Batch requests and the first chunk of streams are tracked separately
+//! since their latencies differ. All methods are thread-safe.
+class LunaHedger
+{
+public:
+    LunaHedger(const LunaHedgingPolicy &policy);
+    ~LunaHedger();
+
+    const LunaHedgingPolicy &policy() const;
+
+    //! Returns how long to wait before hedging a request.
+    std::chrono::microseconds delay(bool stream) const;
+
+    //! Count a new request and add its share to the budget.
+    void requestStarted();
+
+    //! Take one hedge from the budget. Returns false if the budget is
+    //! used up, in which case the request must not be hedged.
+    bool tryHedge();
+
+    //! Record the latency of a request (or the first chunk of a stream)
+    //! that succeeded, and whether it was a hedge that won.
+    void recordLatency(bool stream, std::chrono::microseconds latency,
+                       bool hedgeWon);
+
+    LunaHedgingStats stats() const;
+
+private:
+    LunaHedgingPolicy mPolicy;
+    LunaHistogram mLatency[2];
+    std::atomic<uint64_t> mRecorded[2];
+
+    // The delays are recomputed from the histograms every few requests
+    // rather than on every request.
+    std::atomic<int64_t> mDelayMicros[2];
+
+    // The budget, in thousandths of a hedge.
+    std::atomic<int64_t> mBudget;
+
+    std::atomic<uint64_t> mRequests;
+    std::atomic<uint64_t> mHedges;
+    std::atomic<uint64_t> mHedgesWon;
+    std::atomic<uint64_t> mBudgetExhausted;
+
+    // Disable copy construction and assignments.
+    LunaHedger(const LunaHedger &other);
+    LunaHedger &operator=(const LunaHedger &other);
+};
+
+#endif // LUNA_HEDGING_H
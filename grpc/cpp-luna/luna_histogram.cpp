@@ -0,0 +1,113 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_histogram.h"
+
+namespace
+{
+
+// The upper bound of the first bucket.
+const uint64_t kFirstBoundMicros = 50;
+
+} // namespace
+
+double LunaHistogramSnapshot::mean() const
+{
+    return count ? sum / count : 0.0;
+}
+
+double LunaHistogramSnapshot::percentile(double p) const
+{
+    if (count == 0)
+    {
+        return 0.0;
+    }
+
+    double rank = p / 100.0 * count;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        if (counts[i] == 0 || seen + counts[i] < rank)
+        {
+            seen += counts[i];
+            continue;
+        }
+
+        // The last bucket has no upper bound, so report its lower one.
+        double lower = i == 0 ? 0.0 : bounds[i - 1];
+        if (i >= bounds.size())
+        {
+            return lower;
+        }
+
+        double fraction = (rank - seen) / counts[i];
+        return lower + (bounds[i] - lower) * fraction;
+    }
+
+    return bounds.empty() ? 0.0 : bounds.back();
+}
+
+LunaHistogram::LunaHistogram() : mCount(0), mSumMicros(0)
+{
+    for (size_t i = 0; i < kBuckets; i++)
+    {
+        mCounts[i] = 0;
+    }
+}
+
+LunaHistogram::~LunaHistogram() {}
+
+void LunaHistogram::record(uint64_t micros)
+{
+    // Find the smallest bucket whose bound is at least micros. Bounds
+    // double each bucket, so this is the bit length of the quotient.
+    uint64_t q = (micros + kFirstBoundMicros - 1) / kFirstBoundMicros;
+    size_t bucket = 0;
+    while (q > 1 && bucket < kBuckets - 1)
+    {
+        q = (q + 1) >> 1;
+        bucket++;
+    }
+
+    mCounts[bucket].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSumMicros.fetch_add(micros, std::memory_order_relaxed);
+}
+
+uint64_t LunaHistogram::upperBoundMicros(size_t bucket)
+{
+    return kFirstBoundMicros << bucket;
+}
+
+LunaHistogramSnapshot LunaHistogram::snapshot() const
+{
+    LunaHistogramSnapshot s;
+    s.bounds.reserve(kBuckets - 1);
+    s.counts.reserve(kBuckets);
+    for (size_t i = 0; i < kBuckets; i++)
+    {
+        if (i < kBuckets - 1)
+        {
+            s.bounds.push_back(upperBoundMicros(i) / 1e6);
+        }
+
+        uint64_t n = mCounts[i].load(std::memory_order_relaxed);
+        s.counts.push_back(n);
+        s.count += n;
+    }
+
+    s.sum = mSumMicros.load(std::memory_order_relaxed) / 1e6;
+    return s;
+}
+
+LunaHistogram::LunaHistogram(const LunaHistogram &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy histogram objects.
+}
+
+LunaHistogram &LunaHistogram::operator=(const LunaHistogram &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy histogram objects.
+    return *this;
+}
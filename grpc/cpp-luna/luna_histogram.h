@@ -0,0 +1,68 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_HISTOGRAM_H
+#define LUNA_HISTOGRAM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//! LunaHistogramSnapshot is a copy of the contents of a LunaHistogram.
+struct LunaHistogramSnapshot
+{
+    //! The upper bound of each bucket, in seconds. The last bucket has
+    //! no upper bound and is not listed, so counts has one more entry.
+    std::vector<double> bounds;
+
+    //! The number of values in each bucket (not cumulative).
+    std::vector<uint64_t> counts;
+
+    //! The number of values recorded.
+    uint64_t count = 0;
+
+    //! The sum of the values recorded, in seconds.
+    double sum = 0;
+
+    //! Returns the mean of the recorded values.
+    double mean() const;
+
+    //! Estimate the given percentile (0-100) by interpolating within
+    //! the bucket that contains it.
+    double percentile(double p) const;
+};
+
+//! LunaHistogram records durations into exponentially sized buckets.
+//! Bucket boundaries double from 50 microseconds to several minutes.
+//! Recording is lock-free and wait-free, so it can be done on the hot
+//! path of every request from any thread.
+class LunaHistogram
+{
+public:
+    //! The number of buckets, including the unbounded last one.
+    static const size_t kBuckets = 24;
+
+    LunaHistogram();
+    ~LunaHistogram();
+
+    //! Record a duration, in microseconds.
+    void record(uint64_t micros);
+
+    //! Returns the upper bound of the given bucket, in microseconds.
+    static uint64_t upperBoundMicros(size_t bucket);
+
+    //! Returns a copy of the current contents. Values recorded while
+    //! the snapshot is taken may or may not be included.
+    LunaHistogramSnapshot snapshot() const;
+
+private:
+    std::atomic<uint64_t> mCounts[kBuckets];
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mSumMicros;
+
+    // Disable copy construction and assignments.
+    LunaHistogram(const LunaHistogram &other);
+    LunaHistogram &operator=(const LunaHistogram &other);
+};
+
+#endif // LUNA_HISTOGRAM_H
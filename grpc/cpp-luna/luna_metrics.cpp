@@ -0,0 +1,461 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_metrics.h"
+
+#include "luna.pb.h"
+#include "luna_audio.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+using Encoding = cobaltspeech::luna::SynthesizerConfig::AudioEncoding;
+
+// Metadata keys used to pass the labels of a call to its interceptor.
+// The interceptor removes them before the call is sent.
+const char *const kVoiceKey = "luna-metrics-voice";
+const char *const kEncodingKey = "luna-metrics-encoding";
+const char *const kQueuedKey = "luna-metrics-queued";
+
+uint64_t microsBetween(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+        .count();
+}
+
+// The RPCs that carry audio in their responses.
+enum RpcKind
+{
+    RPC_OTHER,
+    RPC_SYNTHESIZE,
+    RPC_SYNTHESIZE_STREAM
+};
+
+// The interceptor created for each call. It collects timestamps as the
+// call progresses and records them when the final status arrives.
+class MetricsInterceptor : public grpc::experimental::Interceptor
+{
+public:
+    MetricsInterceptor(const std::shared_ptr<LunaMetrics> &metrics,
+                       const char *method)
+        : mMetrics(metrics), mKind(RPC_OTHER), mBytesPerSample(2),
+          mSeries(nullptr), mLabelled(false), mStarted(Clock::now()),
+          mResponses(0), mBytes(0)
+    {
+        // Keep only the method name from "/package.Service/Method".
+        const char *slash = method ? std::strrchr(method, '/') : nullptr;
+        mRpc = slash ? slash + 1 : (method ? method : "");
+        if (mRpc == "Synthesize")
+        {
+            mKind = RPC_SYNTHESIZE;
+        }
+        else if (mRpc == "SynthesizeStream")
+        {
+            mKind = RPC_SYNTHESIZE_STREAM;
+        }
+    }
+
+    void Intercept(grpc::experimental::InterceptorBatchMethods *methods)
+        override
+    {
+        using grpc::experimental::InterceptionHookPoints;
+
+        if (methods->QueryInterceptionHookPoint(
+                InterceptionHookPoints::PRE_SEND_INITIAL_METADATA))
+        {
+            mStarted = Clock::now();
+            this->readLabels(methods->GetSendInitialMetadata());
+        }
+
+        if (methods->QueryInterceptionHookPoint(
+                InterceptionHookPoints::PRE_SEND_MESSAGE))
+        {
+            this->onRequest(methods);
+        }
+
+        if (methods->QueryInterceptionHookPoint(
+                InterceptionHookPoints::POST_RECV_MESSAGE))
+        {
+            this->onResponse(methods->GetRecvMessage());
+        }
+
+        if (methods->QueryInterceptionHookPoint(
+                InterceptionHookPoints::POST_RECV_STATUS))
+        {
+            this->onStatus(methods->GetRecvStatus());
+        }
+
+        methods->Proceed();
+    }
+
+private:
+    std::shared_ptr<LunaMetrics> mMetrics;
+    std::string mRpc;
+    RpcKind mKind;
+    size_t mBytesPerSample;
+    LunaRpcMetrics *mSeries;
+
+    // Set from the labels added by LunaMetrics::labelCall()
+    bool mLabelled;
+    std::string mVoice;
+    Clock::time_point mQueued;
+
+    Clock::time_point mStarted;
+    Clock::time_point mLastResponse;
+    uint64_t mResponses;
+    uint64_t mBytes;
+
+    void readLabels(std::multimap<std::string, std::string> *metadata)
+    {
+        if (!metadata)
+        {
+            return;
+        }
+
+        std::multimap<std::string, std::string>::iterator it =
+            metadata->find(kQueuedKey);
+        if (it == metadata->end())
+        {
+            return;
+        }
+
+        mLabelled = true;
+        mQueued = Clock::time_point(std::chrono::microseconds(
+            std::strtoll(it->second.c_str(), nullptr, 10)));
+        metadata->erase(it);
+
+        it = metadata->find(kVoiceKey);
+        if (it != metadata->end())
+        {
+            mVoice.swap(it->second);
+            metadata->erase(it);
+        }
+
+        it = metadata->find(kEncodingKey);
+        if (it != metadata->end())
+        {
+            mBytesPerSample = lunaBytesPerSample(
+                static_cast<Encoding>(std::atoi(it->second.c_str())));
+            metadata->erase(it);
+        }
+    }
+
+    void onRequest(grpc::experimental::InterceptorBatchMethods *methods)
+    {
+        // Calls that weren't labelled by a LunaClient can still be read
+        // if they are synchronous, since those expose the request message.
+        // Async calls only have the serialized bytes, which aren't worth
+        // parsing again.
+        const void *message = methods->GetSendMessage();
+        if (!mLabelled && mKind != RPC_OTHER && message)
+        {
+            const cobaltspeech::luna::SynthesizerConfig &config =
+                static_cast<const cobaltspeech::luna::SynthesizeRequest *>(
+                    message)
+                    ->config();
+            mVoice = config.voice_id();
+            mBytesPerSample = lunaBytesPerSample(config.encoding());
+        }
+
+        mSeries = &mMetrics->series(mRpc, mVoice);
+        if (mLabelled)
+        {
+            mSeries->queue.record(microsBetween(mQueued, mStarted));
+        }
+    }
+
+    void onResponse(void *message)
+    {
+        // A null message means the stream ended without a response.
+        if (!message)
+        {
+            return;
+        }
+
+        Clock::time_point now = Clock::now();
+        if (mResponses == 0)
+        {
+            this->series().firstChunk.record(microsBetween(mStarted, now));
+        }
+        else
+        {
+            this->series().chunkGap.record(microsBetween(mLastResponse, now));
+        }
+        mLastResponse = now;
+        mResponses++;
+
+        if (mKind != RPC_OTHER)
+        {
+            mBytes += static_cast<cobaltspeech::luna::SynthesizeResponse *>(
+                          message)
+                          ->audio()
+                          .size();
+        }
+    }
+
+    void onStatus(const grpc::Status *status)
+    {
+        LunaRpcMetrics &series = this->series();
+        series.duration.record(microsBetween(mStarted, Clock::now()));
+        series.requests.fetch_add(1, std::memory_order_relaxed);
+        series.bytesReceived.fetch_add(mBytes, std::memory_order_relaxed);
+        series.samplesReceived.fetch_add(mBytes / mBytesPerSample,
+                                         std::memory_order_relaxed);
+
+        size_t code = status ? static_cast<size_t>(status->error_code())
+                             : static_cast<size_t>(grpc::StatusCode::UNKNOWN);
+        if (code >= LunaRpcMetrics::kStatusCodes)
+        {
+            code = grpc::StatusCode::UNKNOWN;
+        }
+        series.statusCodes[code].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Returns the series for this call. Calls that fail before sending
+    // their request are recorded without a voice.
+    LunaRpcMetrics &series()
+    {
+        if (!mSeries)
+        {
+            mSeries = &mMetrics->series(mRpc, "");
+        }
+        return *mSeries;
+    }
+};
+
+class MetricsInterceptorFactory
+    : public grpc::experimental::ClientInterceptorFactoryInterface
+{
+public:
+    MetricsInterceptorFactory(const std::shared_ptr<LunaMetrics> &metrics)
+        : mMetrics(metrics)
+    {
+    }
+
+    grpc::experimental::Interceptor *
+    CreateClientInterceptor(grpc::experimental::ClientRpcInfo *info) override
+    {
+        return new MetricsInterceptor(mMetrics, info->method());
+    }
+
+private:
+    std::shared_ptr<LunaMetrics> mMetrics;
+};
+
+// Returns the labels for a series, escaped for the exposition format.
+std::string seriesLabels(const LunaRpcMetricsSnapshot &s)
+{
+    std::string voice;
+    for (char c : s.voice)
+    {
+        if (c == '"' || c == '\\' || c == '\n')
+        {
+            voice += '\\';
+        }
+        voice += c == '\n' ? 'n' : c;
+    }
+    return "rpc=\"" + s.rpc + "\",voice=\"" + voice + "\"";
+}
+
+// Write one histogram in the exposition format.
+void writeHistogram(std::ostream &out, const std::string &name,
+                    const std::string &labels, const LunaHistogramSnapshot &h)
+{
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < h.counts.size(); i++)
+    {
+        cumulative += h.counts[i];
+        out << name << "_bucket{" << labels << ",le=\"";
+        if (i < h.bounds.size())
+        {
+            out << h.bounds[i];
+        }
+        else
+        {
+            out << "+Inf";
+        }
+        out << "\"} " << cumulative << "\n";
+    }
+    out << name << "_sum{" << labels << "} " << h.sum << "\n";
+    out << name << "_count{" << labels << "} " << h.count << "\n";
+}
+
+} // namespace
+
+LunaRpcMetrics::LunaRpcMetrics()
+    : requests(0), bytesReceived(0), samplesReceived(0)
+{
+    for (size_t i = 0; i < kStatusCodes; i++)
+    {
+        statusCodes[i] = 0;
+    }
+}
+
+LunaRpcMetrics::~LunaRpcMetrics() {}
+
+LunaRpcMetrics::LunaRpcMetrics(const LunaRpcMetrics &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy metrics objects.
+}
+
+LunaRpcMetrics &LunaRpcMetrics::operator=(const LunaRpcMetrics &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy metrics objects.
+    return *this;
+}
+
+LunaMetrics::LunaMetrics() : mSeries(std::make_shared<SeriesMap>()) {}
+
+LunaMetrics::~LunaMetrics() {}
+
+std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>
+LunaMetrics::interceptorFactory(const std::shared_ptr<LunaMetrics> &metrics)
+{
+    return std::unique_ptr<
+        grpc::experimental::ClientInterceptorFactoryInterface>(
+        new MetricsInterceptorFactory(metrics));
+}
+
+void LunaMetrics::labelCall(grpc::ClientContext &ctx,
+                            const cobaltspeech::luna::SynthesizerConfig &config,
+                            std::chrono::steady_clock::time_point queued)
+{
+    int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                         queued.time_since_epoch())
+                         .count();
+    ctx.AddMetadata(kQueuedKey, std::to_string(micros));
+    ctx.AddMetadata(kVoiceKey, config.voice_id());
+    ctx.AddMetadata(kEncodingKey, std::to_string(config.encoding()));
+}
+
+LunaRpcMetrics &LunaMetrics::series(const std::string &rpc,
+                                    const std::string &voice)
+{
+    Key key(rpc, voice);
+    std::shared_ptr<const SeriesMap> current = std::atomic_load(&mSeries);
+    SeriesMap::const_iterator it = current->find(key);
+    if (it != current->end())
+    {
+        return *it->second;
+    }
+
+    // Copy the map with the new series added. Another thread may have
+    // added it since the lookup above, so check again under the lock.
+    std::lock_guard<std::mutex> lock(mMutex);
+    current = std::atomic_load(&mSeries);
+    it = current->find(key);
+    if (it != current->end())
+    {
+        return *it->second;
+    }
+
+    std::shared_ptr<SeriesMap> next = std::make_shared<SeriesMap>(*current);
+    std::shared_ptr<LunaRpcMetrics> series = std::make_shared<LunaRpcMetrics>();
+    (*next)[key] = series;
+    std::atomic_store(&mSeries,
+                      std::shared_ptr<const SeriesMap>(std::move(next)));
+    return *series;
+}
+
+std::vector<LunaRpcMetricsSnapshot> LunaMetrics::snapshot() const
+{
+    std::shared_ptr<const SeriesMap> current = std::atomic_load(&mSeries);
+    std::vector<LunaRpcMetricsSnapshot> result;
+    result.reserve(current->size());
+    for (const SeriesMap::value_type &entry : *current)
+    {
+        const LunaRpcMetrics &m = *entry.second;
+        LunaRpcMetricsSnapshot s;
+        s.rpc = entry.first.first;
+        s.voice = entry.first.second;
+        s.requests = m.requests.load(std::memory_order_relaxed);
+        s.bytesReceived = m.bytesReceived.load(std::memory_order_relaxed);
+        s.samplesReceived = m.samplesReceived.load(std::memory_order_relaxed);
+        for (size_t code = 0; code < LunaRpcMetrics::kStatusCodes; code++)
+        {
+            uint64_t n = m.statusCodes[code].load(std::memory_order_relaxed);
+            if (n > 0)
+            {
+                s.statusCodes[static_cast<int>(code)] = n;
+            }
+        }
+        s.queue = m.queue.snapshot();
+        s.firstChunk = m.firstChunk.snapshot();
+        s.chunkGap = m.chunkGap.snapshot();
+        s.duration = m.duration.snapshot();
+        result.push_back(s);
+    }
+    return result;
+}
+
+std::string LunaMetrics::exposition() const
+{
+    std::vector<LunaRpcMetricsSnapshot> series = this->snapshot();
+    std::ostringstream out;
+
+    out << "# TYPE luna_client_requests_total counter\n";
+    for (const LunaRpcMetricsSnapshot &s : series)
+    {
+        for (const std::pair<const int, uint64_t> &code : s.statusCodes)
+        {
+            out << "luna_client_requests_total{" << seriesLabels(s)
+                << ",code=\"" << code.first << "\"} " << code.second << "\n";
+        }
+    }
+
+    out << "# TYPE luna_client_received_bytes_total counter\n";
+    for (const LunaRpcMetricsSnapshot &s : series)
+    {
+        out << "luna_client_received_bytes_total{" << seriesLabels(s)
+            << "} " << s.bytesReceived << "\n";
+    }
+
+    out << "# TYPE luna_client_received_samples_total counter\n";
+    for (const LunaRpcMetricsSnapshot &s : series)
+    {
+        out << "luna_client_received_samples_total{" << seriesLabels(s)
+            << "} " << s.samplesReceived << "\n";
+    }
+
+    const struct
+    {
+        const char *name;
+        LunaHistogramSnapshot LunaRpcMetricsSnapshot::*member;
+    } histograms[] = {
+        {"luna_client_queue_seconds", &LunaRpcMetricsSnapshot::queue},
+        {"luna_client_first_chunk_seconds",
+         &LunaRpcMetricsSnapshot::firstChunk},
+        {"luna_client_chunk_gap_seconds", &LunaRpcMetricsSnapshot::chunkGap},
+        {"luna_client_duration_seconds", &LunaRpcMetricsSnapshot::duration},
+    };
+    for (const auto &h : histograms)
+    {
+        out << "# TYPE " << h.name << " histogram\n";
+        for (const LunaRpcMetricsSnapshot &s : series)
+        {
+            writeHistogram(out, h.name, seriesLabels(s), s.*h.member);
+        }
+    }
+
+    return out.str();
+}
+
+LunaMetrics::LunaMetrics(const LunaMetrics &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy metrics objects.
+}
+
+LunaMetrics &LunaMetrics::operator=(const LunaMetrics &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy metrics objects.
+    return *this;
+}
@@ -0,0 +1,131 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_METRICS_H
+#define LUNA_METRICS_H
+
+#include "luna.pb.h"
+#include "luna_histogram.h"
+
+#include <grpcpp/client_context.h>
+#include <grpcpp/support/client_interceptor.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+//! LunaRpcMetrics accumulates measurements for the requests of a single
+//! RPC method and voice. All durations are measured on the client:
+//!   - queue: from when the request was made until the call is started,
+//!     including any wait for a scheduler slot. Only recorded for calls
+//!     labelled with LunaMetrics::labelCall().
+//!   - firstChunk: from the start of the call to the first response.
+//!   - chunkGap: between consecutive responses of a stream.
+//!   - duration: from the start of the call to its final status.
+class LunaRpcMetrics
+{
+public:
+    //! The number of gRPC status codes.
+    static const size_t kStatusCodes = 17;
+
+    LunaRpcMetrics();
+    ~LunaRpcMetrics();
+
+    LunaHistogram queue;
+    LunaHistogram firstChunk;
+    LunaHistogram chunkGap;
+    LunaHistogram duration;
+
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> bytesReceived;
+    std::atomic<uint64_t> samplesReceived;
+    std::atomic<uint64_t> statusCodes[kStatusCodes];
+
+private:
+    // Disable copy construction and assignments.
+    LunaRpcMetrics(const LunaRpcMetrics &other);
+    LunaRpcMetrics &operator=(const LunaRpcMetrics &other);
+};
+
+//! LunaRpcMetricsSnapshot is a copy of a LunaRpcMetrics.
+struct LunaRpcMetricsSnapshot
+{
+    //! The name of the RPC method (e.g., "SynthesizeStream").
+    std::string rpc;
+
+    //! The voice requested, or empty for RPCs without a voice.
+    std::string voice;
+
+    uint64_t requests = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t samplesReceived = 0;
+
+    //! The number of requests that finished with each status code.
+    std::map<int, uint64_t> statusCodes;
+
+    LunaHistogramSnapshot queue;
+    LunaHistogramSnapshot firstChunk;
+    LunaHistogramSnapshot chunkGap;
+    LunaHistogramSnapshot duration;
+};
+
+//! LunaMetrics collects per-request latency metrics for every RPC made
+//! on the channels it is attached to, grouped by RPC method and voice.
+//! It is attached to a channel with a gRPC client interceptor (see
+//! interceptorFactory() and LunaClient::createChannel()), so it sees
+//! every request, including the ones made by the async and parallel
+//! APIs.
+//!
+//! Recording is lock-free: each request looks up its series once, and
+//! then only updates atomic counters.
+class LunaMetrics
+{
+public:
+    LunaMetrics();
+    ~LunaMetrics();
+
+    //! Create an interceptor factory that records into the given
+    //! metrics. The factory keeps the metrics alive.
+    static std::unique_ptr<
+        grpc::experimental::ClientInterceptorFactoryInterface>
+    interceptorFactory(const std::shared_ptr<LunaMetrics> &metrics);
+
+    //! Label a Synthesize or SynthesizeStream call with the voice and
+    //! encoding of its request, and the time the request was made. The
+    //! labels are passed to the interceptor as metadata, which it removes
+    //! before the call is sent. Unlabelled async calls are recorded
+    //! without a voice, since their request is already serialized.
+    static void labelCall(grpc::ClientContext &ctx,
+                          const cobaltspeech::luna::SynthesizerConfig &config,
+                          std::chrono::steady_clock::time_point queued);
+
+    //! Returns the series for the given RPC and voice, creating it if
+    //! necessary.
+    LunaRpcMetrics &series(const std::string &rpc, const std::string &voice);
+
+    //! Returns a copy of every series, ordered by RPC and voice.
+    std::vector<LunaRpcMetricsSnapshot> snapshot() const;
+
+    //! Returns the metrics in the Prometheus text exposition format.
+    std::string exposition() const;
+
+private:
+    using Key = std::pair<std::string, std::string>;
+    using SeriesMap = std::map<Key, std::shared_ptr<LunaRpcMetrics>>;
+
+    // The map is replaced, never modified, so that lookups can read it
+    // without taking the lock. The lock serializes writers.
+    std::shared_ptr<const SeriesMap> mSeries;
+    std::mutex mMutex;
+
+    // Disable copy construction and assignments.
+    LunaMetrics(const LunaMetrics &other);
+    LunaMetrics &operator=(const LunaMetrics &other);
+};
+
+#endif // LUNA_METRICS_H
@@ -0,0 +1,382 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_mock_server.h"
+
+#include "luna_audio.h"
+#include "luna_exception.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Sleep until the deadline, waking periodically to check whether the
+// client has cancelled the request. Returns false if it was cancelled.
+bool sleepUntil(Clock::time_point deadline, grpc::ServerContext *context)
+{
+    const std::chrono::milliseconds slice(10);
+    while (true)
+    {
+        if (context->IsCancelled())
+        {
+            return false;
+        }
+
+        Clock::time_point now = Clock::now();
+        if (now >= deadline)
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(
+            std::min<Clock::duration>(deadline - now, slice));
+    }
+}
+
+// Returns how long it takes the mock to produce the given samples.
+Clock::duration productionTime(const LunaMockConfig &config,
+                               uint64_t samples, unsigned int sampleRate)
+{
+    if (config.speed <= 0 || sampleRate == 0)
+    {
+        return Clock::duration::zero();
+    }
+
+    double seconds = double(samples) / sampleRate / config.speed;
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(seconds));
+}
+
+} // namespace
+
+LunaMockConfig::LunaMockConfig()
+{
+    cobaltspeech::luna::Voice voice;
+    voice.set_id("mock");
+    voice.set_name("Mock Voice");
+    voice.set_sample_rate(16000);
+    voice.set_language("en-US");
+    voices.push_back(voice);
+}
+
+class LunaMockServer::Service : public cobaltspeech::luna::Luna::Service
+{
+public:
+    Service(const LunaMockConfig &config)
+        : mConfig(std::make_shared<LunaMockConfig>(config)), mRequests(0),
+          mVersionCalls(0), mListVoicesCalls(0), mSynthesizeCalls(0),
+          mStreamCalls(0), mFailures(0), mCancellations(0), mBytesSent(0)
+    {
+    }
+
+    void setConfig(const LunaMockConfig &config)
+    {
+        std::shared_ptr<const LunaMockConfig> next =
+            std::make_shared<LunaMockConfig>(config);
+        std::lock_guard<std::mutex> lock(mMutex);
+        mConfig = next;
+    }
+
+    std::shared_ptr<const LunaMockConfig> config() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mConfig;
+    }
+
+    LunaMockStats stats() const
+    {
+        LunaMockStats s;
+        s.versionCalls = mVersionCalls;
+        s.listVoicesCalls = mListVoicesCalls;
+        s.synthesizeCalls = mSynthesizeCalls;
+        s.streamCalls = mStreamCalls;
+        s.failures = mFailures;
+        s.cancellations = mCancellations;
+        s.bytesSent = mBytesSent;
+        return s;
+    }
+
+    grpc::Status Version(grpc::ServerContext *,
+                         const cobaltspeech::luna::VersionRequest *,
+                         cobaltspeech::luna::VersionResponse *response) override
+    {
+        mVersionCalls++;
+        response->set_version(this->config()->version);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status
+    ListVoices(grpc::ServerContext *,
+               const cobaltspeech::luna::ListVoicesRequest *,
+               cobaltspeech::luna::ListVoicesResponse *response) override
+    {
+        mListVoicesCalls++;
+        for (const cobaltspeech::luna::Voice &v : this->config()->voices)
+        {
+            *response->add_voices() = v;
+        }
+        return grpc::Status::OK;
+    }
+
+    grpc::Status
+    Synthesize(grpc::ServerContext *context,
+               const cobaltspeech::luna::SynthesizeRequest *request,
+               cobaltspeech::luna::SynthesizeResponse *response) override
+    {
+        mSynthesizeCalls++;
+        std::shared_ptr<const LunaMockConfig> config = this->config();
+
+        const cobaltspeech::luna::Voice *voice = nullptr;
+        grpc::Status status = this->prepare(*config, *request, voice);
+        if (!status.ok())
+        {
+            return status;
+        }
+
+        uint64_t samples = this->totalSamples(*config, *request, *voice);
+        Clock::time_point deadline =
+            Clock::now() +
+            std::chrono::milliseconds(config->firstChunkDelayMs) +
+            productionTime(*config, samples, voice->sample_rate());
+        if (!sleepUntil(deadline, context))
+        {
+            mCancellations++;
+            return grpc::Status::CANCELLED;
+        }
+
+        LunaMockServer::syntheticAudio(0, samples, voice->sample_rate(),
+                                       config->toneHz,
+                                       request->config().encoding(),
+                                       *response->mutable_audio());
+        mBytesSent += response->audio().size();
+        return grpc::Status::OK;
+    }
+
+    grpc::Status SynthesizeStream(
+        grpc::ServerContext *context,
+        const cobaltspeech::luna::SynthesizeRequest *request,
+        grpc::ServerWriter<cobaltspeech::luna::SynthesizeResponse> *writer)
+        override
+    {
+        mStreamCalls++;
+        std::shared_ptr<const LunaMockConfig> config = this->config();
+
+        // Failing streams may send some chunks first, so decide whether
+        // this request fails before checking anything else.
+        bool fail = this->shouldFail(*config);
+        const cobaltspeech::luna::Voice *voice = nullptr;
+        grpc::Status status = this->findVoice(*config, *request, voice);
+        if (!status.ok())
+        {
+            mFailures++;
+            return status;
+        }
+
+        uint64_t total = this->totalSamples(*config, *request, *voice);
+        uint64_t chunk = request->config().n_samples();
+        if (chunk == 0)
+        {
+            chunk = std::max<uint64_t>(config->defaultChunkSamples, 1);
+        }
+
+        // Pace the chunks against a running deadline so that the
+        // overall rate stays steady even if individual writes are slow.
+        Clock::time_point deadline =
+            Clock::now() + std::chrono::milliseconds(config->firstChunkDelayMs);
+        cobaltspeech::luna::SynthesizeResponse response;
+        unsigned int sent = 0;
+        for (uint64_t offset = 0; offset < total; offset += chunk)
+        {
+            if (fail && sent >= config->failAfterChunks)
+            {
+                break;
+            }
+
+            uint64_t count = std::min(chunk, total - offset);
+            deadline += productionTime(*config, count, voice->sample_rate());
+            if (!sleepUntil(deadline, context))
+            {
+                mCancellations++;
+                return grpc::Status::CANCELLED;
+            }
+
+            LunaMockServer::syntheticAudio(offset, count, voice->sample_rate(),
+                                           config->toneHz,
+                                           request->config().encoding(),
+                                           *response.mutable_audio());
+            if (!writer->Write(response))
+            {
+                mCancellations++;
+                return grpc::Status::CANCELLED;
+            }
+            mBytesSent += response.audio().size();
+            sent++;
+        }
+
+        if (fail)
+        {
+            mFailures++;
+            return grpc::Status(config->errorCode, "injected failure");
+        }
+        return grpc::Status::OK;
+    }
+
+private:
+    mutable std::mutex mMutex;
+    std::shared_ptr<const LunaMockConfig> mConfig;
+    std::atomic<uint64_t> mRequests;
+
+    std::atomic<uint64_t> mVersionCalls;
+    std::atomic<uint64_t> mListVoicesCalls;
+    std::atomic<uint64_t> mSynthesizeCalls;
+    std::atomic<uint64_t> mStreamCalls;
+    std::atomic<uint64_t> mFailures;
+    std::atomic<uint64_t> mCancellations;
+    std::atomic<uint64_t> mBytesSent;
+
+    // Returns true if the next synthesis request should fail.
+    bool shouldFail(const LunaMockConfig &config)
+    {
+        uint64_t n = ++mRequests;
+        return config.failEvery != 0 && n % config.failEvery == 0;
+    }
+
+    grpc::Status findVoice(const LunaMockConfig &config,
+                           const cobaltspeech::luna::SynthesizeRequest &request,
+                           const cobaltspeech::luna::Voice *&voice)
+    {
+        const std::string &id = request.config().voice_id();
+        for (const cobaltspeech::luna::Voice &v : config.voices)
+        {
+            if (id.empty() || v.id() == id)
+            {
+                voice = &v;
+                return grpc::Status::OK;
+            }
+        }
+        return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                            "unknown voice: " + id);
+    }
+
+    // Decide whether a batch request fails, and find its voice.
+    grpc::Status prepare(const LunaMockConfig &config,
+                         const cobaltspeech::luna::SynthesizeRequest &request,
+                         const cobaltspeech::luna::Voice *&voice)
+    {
+        grpc::Status status = this->findVoice(config, request, voice);
+        if (status.ok() && this->shouldFail(config))
+        {
+            status = grpc::Status(config.errorCode, "injected failure");
+        }
+
+        if (!status.ok())
+        {
+            mFailures++;
+        }
+        return status;
+    }
+
+    uint64_t totalSamples(const LunaMockConfig &config,
+                          const cobaltspeech::luna::SynthesizeRequest &request,
+                          const cobaltspeech::luna::Voice &voice)
+    {
+        double seconds = request.text().size() * config.secondsPerChar;
+        return static_cast<uint64_t>(seconds * voice.sample_rate());
+    }
+};
+
+LunaMockServer::LunaMockServer(const LunaMockConfig &config,
+                               const std::string &address)
+    : mService(new Service(config)), mPort(0)
+{
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials(),
+                             &mPort);
+    builder.RegisterService(mService.get());
+    mServer = builder.BuildAndStart();
+    if (!mServer || mPort == 0)
+    {
+        throw LunaException("could not start mock server on " + address);
+    }
+
+    mHost = address.substr(0, address.rfind(':'));
+    if (mHost.empty() || mHost == "0.0.0.0" || mHost == "[::]")
+    {
+        mHost = "localhost";
+    }
+}
+
+LunaMockServer::~LunaMockServer() { this->shutdown(); }
+
+std::string LunaMockServer::address() const
+{
+    return mHost + ":" + std::to_string(mPort);
+}
+
+int LunaMockServer::port() const { return mPort; }
+
+void LunaMockServer::setConfig(const LunaMockConfig &config)
+{
+    mService->setConfig(config);
+}
+
+LunaMockConfig LunaMockServer::config() const { return *mService->config(); }
+
+LunaMockStats LunaMockServer::stats() const { return mService->stats(); }
+
+void LunaMockServer::wait() { mServer->Wait(); }
+
+void LunaMockServer::shutdown()
+{
+    // Use an immediate deadline so requests in progress are cancelled
+    // rather than waited for.
+    mServer->Shutdown(std::chrono::system_clock::now());
+}
+
+void LunaMockServer::syntheticAudio(
+    uint64_t offset, uint64_t samples, unsigned int sampleRate,
+    double toneHz,
+    cobaltspeech::luna::SynthesizerConfig::AudioEncoding encoding,
+    std::string &audio)
+{
+    const double amplitude = 0.25;
+    const double twoPi = 6.283185307179586;
+    double step = sampleRate ? twoPi * toneHz / sampleRate : 0.0;
+    double phase = std::fmod(step * offset, twoPi);
+
+    size_t width = lunaBytesPerSample(encoding);
+    audio.resize(samples * width);
+    char *out = samples ? &audio[0] : nullptr;
+    for (uint64_t i = 0; i < samples; i++, phase += step)
+    {
+        double value = amplitude * std::sin(phase);
+        if (encoding == cobaltspeech::luna::SynthesizerConfig::RAW_FLOAT32)
+        {
+            float f = static_cast<float>(value);
+            std::memcpy(out + i * width, &f, width);
+        }
+        else
+        {
+            int16_t s = static_cast<int16_t>(std::lrint(value * 32767.0));
+            std::memcpy(out + i * width, &s, width);
+        }
+    }
+}
+
+LunaMockServer::LunaMockServer(const LunaMockServer &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy server objects.
+}
+
+LunaMockServer &LunaMockServer::operator=(const LunaMockServer &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy server objects.
+    return *this;
+}
@@ -0,0 +1,133 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_MOCK_SERVER_H
+#define LUNA_MOCK_SERVER_H
+
+#include "luna.grpc.pb.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//! LunaMockConfig describes how a LunaMockServer behaves. The defaults
+//! produce a fast, well-behaved server with a single 16 kHz voice.
+struct LunaMockConfig
+{
+    //! The version string returned by the Version RPC.
+    std::string version = "Luna mock server";
+
+    //! The voices returned by the ListVoices RPC. Requests for a voice
+    //! that isn't in this list fail with NOT_FOUND. Requests that leave
+    //! the voice empty use the first voice.
+    std::vector<cobaltspeech::luna::Voice> voices;
+
+    //! Seconds of audio produced for each character of input text.
+    double secondsPerChar = 0.06;
+
+    //! How many times faster than real time audio is produced. A value
+    //! of zero produces audio instantly.
+    double speed = 20.0;
+
+    //! Extra delay, in milliseconds, before the first chunk of a stream
+    //! (or the response of a batch request) is sent.
+    unsigned int firstChunkDelayMs = 0;
+
+    //! Samples per streamed response when the request's n_samples is
+    //! zero.
+    uint64_t defaultChunkSamples = 4096;
+
+    //! If non-zero, every failEvery-th synthesis request fails with
+    //! errorCode.
+    unsigned int failEvery = 0;
+
+    //! If non-zero, failing streams send this many chunks before the
+    //! error instead of failing immediately.
+    unsigned int failAfterChunks = 0;
+
+    //! The status code returned by injected failures.
+    grpc::StatusCode errorCode = grpc::StatusCode::UNAVAILABLE;
+
+    //! Frequency of the synthetic tone, in Hz.
+    double toneHz = 220.0;
+
+    LunaMockConfig();
+};
+
+//! Counters for the requests handled by a LunaMockServer.
+struct LunaMockStats
+{
+    uint64_t versionCalls = 0;
+    uint64_t listVoicesCalls = 0;
+    uint64_t synthesizeCalls = 0;
+    uint64_t streamCalls = 0;
+    uint64_t failures = 0;
+    uint64_t cancellations = 0;
+    uint64_t bytesSent = 0;
+};
+
+//! LunaMockServer is an in-process stand-in for a Luna server. It
+//! implements every RPC in luna.proto with synthetic audio, so client
+//! throughput and latency can be measured and tested without a real
+//! server or voice models. Synthesis speed, chunking, first-chunk
+//! delay and failures are all configurable, and deterministic.
+class LunaMockServer
+{
+public:
+    //! Start a server listening on the given address. The default
+    //! address picks a free port on the loopback interface.
+    LunaMockServer(const LunaMockConfig &config = LunaMockConfig(),
+                   const std::string &address = "127.0.0.1:0");
+
+    //! Shuts down the server, cancelling any requests in progress.
+    ~LunaMockServer();
+
+    //! Returns the address clients should connect to.
+    std::string address() const;
+
+    //! Returns the port the server is listening on.
+    int port() const;
+
+    //! Replace the server's configuration. Requests that have already
+    //! started keep using the old configuration.
+    void setConfig(const LunaMockConfig &config);
+
+    //! Returns the server's current configuration.
+    LunaMockConfig config() const;
+
+    //! Returns counters for the requests handled so far.
+    LunaMockStats stats() const;
+
+    //! Block until the server is shut down.
+    void wait();
+
+    //! Stop the server.
+    void shutdown();
+
+    //! Fill audio with the given number of samples of a synthetic tone
+    //! in the given encoding. The offset is the index of the first
+    //! sample, so consecutive chunks join up.
+    static void syntheticAudio(
+        uint64_t offset, uint64_t samples, unsigned int sampleRate,
+        double toneHz,
+        cobaltspeech::luna::SynthesizerConfig::AudioEncoding encoding,
+        std::string &audio);
+
+private:
+    class Service;
+
+    std::unique_ptr<Service> mService;
+    std::unique_ptr<grpc::Server> mServer;
+    std::string mHost;
+    int mPort;
+
+    // Disable copy construction and assignments.
+    LunaMockServer(const LunaMockServer &other);
+    LunaMockServer &operator=(const LunaMockServer &other);
+};
+
+#endif // LUNA_MOCK_SERVER_H
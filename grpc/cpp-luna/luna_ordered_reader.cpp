@@ -0,0 +1,218 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_ordered_reader.h"
+
+LunaOrderedReader::LunaOrderedReader(const Launcher &launcher,
+                                     unsigned int maxParallel)
+    : mLauncher(launcher), mMaxParallel(maxParallel < 1 ? 1 : maxParallel),
+      mState(new State), mNoMoreSegments(false), mFailed(false)
+{
+}
+
+LunaOrderedReader::~LunaOrderedReader() { this->cancel(); }
+
+void LunaOrderedReader::addSegment(const std::string &text)
+{
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        std::shared_ptr<Segment> segment(new Segment);
+        segment->text = text;
+        mSegments.push_back(segment);
+    }
+
+    mState->cv.notify_all();
+    this->launch();
+}
+
+void LunaOrderedReader::finishSegments()
+{
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        mNoMoreSegments = true;
+    }
+
+    mState->cv.notify_all();
+}
+
+void LunaOrderedReader::cancel()
+{
+    std::vector<LunaAsyncHandle> running;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        if (!mFailed)
+        {
+            mFailed = true;
+            mStatus = grpc::Status(grpc::StatusCode::CANCELLED,
+                                   "stream cancelled");
+        }
+
+        running = this->runningHandles();
+    }
+
+    mState->cv.notify_all();
+    for (const LunaAsyncHandle &handle : running)
+    {
+        handle.cancel();
+    }
+}
+
+bool LunaOrderedReader::Read(cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    std::unique_lock<std::mutex> lock(mState->mutex);
+    while (true)
+    {
+        if (mFailed)
+        {
+            return false;
+        }
+
+        if (mSegments.empty())
+        {
+            if (mNoMoreSegments)
+            {
+                return false;
+            }
+
+            mState->cv.wait(lock);
+            continue;
+        }
+
+        Segment &current = *mSegments.front();
+        if (!current.chunks.empty())
+        {
+            msg->mutable_audio()->swap(current.chunks.front());
+            current.chunks.pop_front();
+            return true;
+        }
+
+        if (current.done)
+        {
+            if (!current.status.ok())
+            {
+                // Stop at the first failure. Audio for later segments
+                // would leave a gap in the stream, so their requests
+                // are cancelled.
+                mFailed = true;
+                mStatus = current.status;
+                std::vector<LunaAsyncHandle> running =
+                    this->runningHandles();
+                lock.unlock();
+                for (const LunaAsyncHandle &handle : running)
+                {
+                    handle.cancel();
+                }
+                return false;
+            }
+
+            // Move on to the next segment, which frees a slot in the window
+            mSegments.pop_front();
+            lock.unlock();
+            this->launch();
+            lock.lock();
+            continue;
+        }
+
+        mState->cv.wait(lock);
+    }
+}
+
+bool LunaOrderedReader::NextMessageSize(uint32_t *sz)
+{
+    // The size of the next chunk isn't known until it arrives.
+    *sz = 0;
+    return true;
+}
+
+grpc::Status LunaOrderedReader::Finish()
+{
+    std::lock_guard<std::mutex> lock(mState->mutex);
+    if (mFailed)
+    {
+        return mStatus;
+    }
+
+    if (!mSegments.empty() || !mNoMoreSegments)
+    {
+        return grpc::Status(grpc::StatusCode::CANCELLED,
+                            "stream finished before all audio was read");
+    }
+
+    return grpc::Status::OK;
+}
+
+void LunaOrderedReader::WaitForInitialMetadata() {}
+
+std::vector<LunaAsyncHandle> LunaOrderedReader::runningHandles() const
+{
+    std::vector<LunaAsyncHandle> running;
+    for (const std::shared_ptr<Segment> &segment : mSegments)
+    {
+        if (segment->started && !segment->done)
+        {
+            running.push_back(segment->handle);
+        }
+    }
+
+    return running;
+}
+
+void LunaOrderedReader::launch()
+{
+    // Collect the segments to start while holding the lock, but start
+    // them without it: a launcher may run callbacks before returning.
+    std::vector<std::shared_ptr<Segment>> toStart;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        unsigned int window = 0;
+        for (const std::shared_ptr<Segment> &segment : mSegments)
+        {
+            if (window == mMaxParallel || mFailed)
+            {
+                break;
+            }
+
+            if (!segment->started)
+            {
+                segment->started = true;
+                toStart.push_back(segment);
+            }
+            window++;
+        }
+    }
+
+    for (const std::shared_ptr<Segment> &segment : toStart)
+    {
+        std::shared_ptr<State> state = mState;
+        LunaAsyncHandle handle = mLauncher(
+            segment->text,
+            [state, segment](std::string &audio) {
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    segment->chunks.push_back(std::string());
+                    segment->chunks.back().swap(audio);
+                }
+                state->cv.notify_all();
+            },
+            [state, segment](const grpc::Status &status) {
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    segment->done = true;
+                    segment->status = status;
+                }
+                state->cv.notify_all();
+            });
+
+        // A request launched while the reader was being cancelled
+        // would otherwise keep running
+        bool cancelled = false;
+        {
+            std::lock_guard<std::mutex> lock(mState->mutex);
+            segment->handle = handle;
+            cancelled = mFailed;
+        }
+        if (cancelled)
+        {
+            handle.cancel();
+        }
+    }
+}
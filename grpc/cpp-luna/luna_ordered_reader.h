@@ -0,0 +1,98 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_ORDERED_READER_H
+#define LUNA_ORDERED_READER_H
+
+#include "luna.grpc.pb.h"
+#include "luna_async_call.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//! LunaOrderedReader synthesizes a sequence of text segments with
+//! several concurrent streaming requests, and reads back the audio as a
+//! single stream in the original segment order. At most maxParallel
+//! segments are in flight or holding unread audio at any time, which
+//! bounds both the load on the server and the memory used to reorder
+//! the audio.
+//!
+//! Segments may be added while the stream is being read. Requests are
+//! only started from the threads that add segments or read audio, never
+//! from the completion queue threads.
+class LunaOrderedReader
+    : public grpc::ClientReaderInterface<cobaltspeech::luna::SynthesizeResponse>
+{
+public:
+    //! Function used to start the streaming synthesis of one segment,
+    //! such as LunaClient::synthesizeStreamAsync() with a fixed config.
+    using Launcher = std::function<LunaAsyncHandle(
+        const std::string &text, const LunaAudioCallback &onAudio,
+        const LunaFinishCallback &onFinish)>;
+
+    LunaOrderedReader(const Launcher &launcher, unsigned int maxParallel);
+
+    //! Cancels any requests that are still running.
+    ~LunaOrderedReader() override;
+
+    //! Add a segment to the end of the sequence.
+    void addSegment(const std::string &text);
+
+    //! Signal that no more segments will be added. Read() returns false
+    //! once all the audio for the existing segments has been read.
+    void finishSegments();
+
+    //! Cancel the running requests and start no more. Read() returns
+    //! false, and Finish() returns CANCELLED. Safe to call from any
+    //! thread.
+    void cancel();
+
+    bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+    bool NextMessageSize(uint32_t *sz) override;
+    grpc::Status Finish() override;
+    void WaitForInitialMetadata() override;
+
+private:
+    struct Segment
+    {
+        std::string text;
+        std::deque<std::string> chunks;
+        bool started = false;
+        bool done = false;
+        grpc::Status status;
+        LunaAsyncHandle handle;
+    };
+
+    // State shared with the callbacks of the running requests, which may
+    // outlive the reader.
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    Launcher mLauncher;
+    unsigned int mMaxParallel;
+    std::shared_ptr<State> mState;
+
+    // These members are protected by the state's mutex. Segments are
+    // removed from the front of the queue once all their audio is read.
+    std::deque<std::shared_ptr<Segment>> mSegments;
+    bool mNoMoreSegments;
+    bool mFailed;
+    grpc::Status mStatus;
+
+    // Returns the handles of the requests that are still running. Must
+    // be called while holding the lock.
+    std::vector<LunaAsyncHandle> runningHandles() const;
+
+    // Start requests for segments within the window. Must be called
+    // without holding the lock.
+    void launch();
+};
+
+#endif // LUNA_ORDERED_READER_H
@@ -0,0 +1,243 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_read_ahead_buffer.h"
+
+#include "luna_audio.h"
+#include "luna_exception.h"
+
+#include <algorithm>
+#include <cstring>
+
+LunaReadAheadBuffer::LunaReadAheadBuffer(size_t capacityBytes,
+                                         size_t prefillBytes)
+    : mHead(0), mTail(0), mEnded(false), mStopped(false), mPrefilled(false),
+      mUnderruns(0), mOverruns(0), mReaderWaiting(false),
+      mWriterWaiting(false)
+{
+    size_t capacity = 1;
+    while (capacity < capacityBytes)
+    {
+        capacity <<= 1;
+    }
+
+    mRing.resize(capacity);
+    mMask = capacity - 1;
+    mPrefill = std::min(prefillBytes, capacity);
+}
+
+LunaReadAheadBuffer::~LunaReadAheadBuffer()
+{
+    mStopped = true;
+    this->wake(mWriterWaiting);
+    if (mStream)
+    {
+        mStream->cancel();
+    }
+    if (mThread.joinable())
+    {
+        mThread.join();
+    }
+}
+
+size_t LunaReadAheadBuffer::bytesForDuration(
+    unsigned int milliseconds, unsigned int sampleRate,
+    cobaltspeech::luna::SynthesizerConfig::AudioEncoding enc)
+{
+    size_t samples = static_cast<size_t>(milliseconds) * sampleRate / 1000;
+    return bytesForSamples(samples, enc);
+}
+
+size_t LunaReadAheadBuffer::bytesForSamples(
+    size_t samples, cobaltspeech::luna::SynthesizerConfig::AudioEncoding enc)
+{
+    return samples * lunaBytesPerSample(enc);
+}
+
+void LunaReadAheadBuffer::start(const LunaSynthesizerStream &stream)
+{
+    if (mThread.joinable())
+    {
+        throw LunaException("read-ahead buffer has already been started");
+    }
+
+    mStream.reset(new LunaSynthesizerStream(stream));
+    mThread = std::thread(&LunaReadAheadBuffer::run, this, stream);
+}
+
+size_t LunaReadAheadBuffer::read(char *data, size_t size)
+{
+    size_t wanted = size;
+    if (!mPrefilled)
+    {
+        wanted = std::max(size, mPrefill);
+    }
+    wanted = std::min(wanted, mRing.size());
+
+    uint64_t tail = mTail.load(std::memory_order_relaxed);
+    uint64_t head = mHead.load(std::memory_order_acquire);
+    if (head - tail < wanted && !mEnded.load())
+    {
+        if (mPrefilled)
+        {
+            mUnderruns.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mReaderWaiting = true;
+        mCV.wait(lock, [this, tail, wanted]() {
+            return mHead.load() - tail >= wanted || mEnded.load();
+        });
+        mReaderWaiting = false;
+        head = mHead.load(std::memory_order_acquire);
+    }
+    mPrefilled = true;
+
+    // The end of the audio of a failed producer is reported as its error.
+    // The head is loaded again after seeing the end, so that audio written
+    // just before it isn't missed.
+    if (size > 0 && mEnded.load() && mWriteError && mHead.load() == tail)
+    {
+        std::rethrow_exception(mWriteError);
+    }
+
+    // Copy out of the ring, which may wrap around the end
+    size_t n = static_cast<size_t>(std::min<uint64_t>(size, head - tail));
+    size_t offset = static_cast<size_t>(tail) & mMask;
+    size_t first = std::min(n, mRing.size() - offset);
+    memcpy(data, &mRing[offset], first);
+    memcpy(data + first, &mRing[0], n - first);
+
+    mTail.store(tail + n);
+    this->wake(mWriterWaiting);
+    return n;
+}
+
+void LunaReadAheadBuffer::close()
+{
+    if (mThread.joinable())
+    {
+        mThread.join();
+    }
+
+    if (mError)
+    {
+        std::exception_ptr err = mError;
+        mError = nullptr;
+        std::rethrow_exception(err);
+    }
+}
+
+bool LunaReadAheadBuffer::write(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        uint64_t head = mHead.load(std::memory_order_relaxed);
+        uint64_t tail = mTail.load(std::memory_order_acquire);
+        size_t space = mRing.size() - static_cast<size_t>(head - tail);
+        if (space == 0)
+        {
+            mOverruns.fetch_add(1, std::memory_order_relaxed);
+
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWriterWaiting = true;
+            mCV.wait(lock, [this, head]() {
+                return head - mTail.load() < mRing.size() || mStopped.load();
+            });
+            mWriterWaiting = false;
+            if (mStopped)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        // Copy into the ring, which may wrap around the end
+        size_t n = std::min(size, space);
+        size_t offset = static_cast<size_t>(head) & mMask;
+        size_t first = std::min(n, mRing.size() - offset);
+        memcpy(&mRing[offset], data, first);
+        memcpy(&mRing[0], data + first, n - first);
+
+        mHead.store(head + n);
+        this->wake(mReaderWaiting);
+
+        data += n;
+        size -= n;
+    }
+
+    return !mStopped;
+}
+
+void LunaReadAheadBuffer::finishWriting()
+{
+    mEnded = true;
+    this->wake(mReaderWaiting);
+}
+
+void LunaReadAheadBuffer::abortWriting(std::exception_ptr error)
+{
+    mWriteError = error;
+    this->finishWriting();
+}
+
+size_t LunaReadAheadBuffer::available() const
+{
+    return static_cast<size_t>(mHead.load() - mTail.load());
+}
+
+uint64_t LunaReadAheadBuffer::underruns() const { return mUnderruns.load(); }
+
+uint64_t LunaReadAheadBuffer::overruns() const { return mOverruns.load(); }
+
+LunaReadAheadBuffer::LunaReadAheadBuffer(const LunaReadAheadBuffer &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy buffer objects.
+}
+
+LunaReadAheadBuffer &
+LunaReadAheadBuffer::operator=(const LunaReadAheadBuffer &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy buffer objects.
+    return *this;
+}
+
+void LunaReadAheadBuffer::run(LunaSynthesizerStream stream)
+{
+    try
+    {
+        std::string audio;
+        while (!mStopped && stream.receiveAudio(audio))
+        {
+            if (!this->write(audio.data(), audio.size()))
+            {
+                break;
+            }
+        }
+
+        if (!mStopped)
+        {
+            stream.close();
+        }
+    }
+    catch (...)
+    {
+        mError = std::current_exception();
+    }
+
+    this->finishWriting();
+}
+
+void LunaReadAheadBuffer::wake(std::atomic<bool> &waiting)
+{
+    // Only take the lock if the other side is (about to be) asleep. The
+    // waiting flag is set while holding the lock and before checking the
+    // wait condition, and the ring indices are updated with sequentially
+    // consistent stores, so a wake-up cannot be missed.
+    if (waiting.load())
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCV.notify_all();
+    }
+}
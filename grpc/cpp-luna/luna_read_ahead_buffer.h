@@ -0,0 +1,131 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_READ_AHEAD_BUFFER_H
+#define LUNA_READ_AHEAD_BUFFER_H
+
+#include "luna.pb.h"
+#include "luna_synthesizer_stream.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! LunaReadAheadBuffer decouples reading audio from the network and
+//! consuming it. A reader thread pulls audio from a LunaSynthesizerStream
+//! into a single-producer/single-consumer ring buffer, so a slow consumer
+//! no longer stalls gRPC reads and a slow network chunk is absorbed by the
+//! audio already buffered.
+//!
+//! The ring buffer itself is lock-free. A mutex is only taken to put a
+//! side to sleep when it has to wait (and to wake it up again).
+//!
+//! The producer side (write() and finishWriting()) can also be used
+//! directly instead of start(), with any single producer thread.
+class LunaReadAheadBuffer
+{
+public:
+    //! Create a buffer that holds up to capacityBytes of audio (rounded up
+    //! to a power of two). The first read waits until prefillBytes have
+    //! been buffered, or until the stream ends.
+    LunaReadAheadBuffer(size_t capacityBytes, size_t prefillBytes = 0);
+
+    //! Stops the reader thread, if it is still running, cancelling the
+    //! stream so the thread does not wait for the server's next chunk.
+    ~LunaReadAheadBuffer();
+
+    //! Returns the number of bytes needed to hold the given duration of
+    //! audio for a voice with the given sample rate.
+    static size_t
+    bytesForDuration(unsigned int milliseconds, unsigned int sampleRate,
+                     cobaltspeech::luna::SynthesizerConfig::AudioEncoding enc);
+
+    //! Returns the number of bytes needed to hold the given number of
+    //! samples.
+    static size_t
+    bytesForSamples(size_t samples,
+                    cobaltspeech::luna::SynthesizerConfig::AudioEncoding enc);
+
+    //! Start a reader thread that fills the buffer from the given stream.
+    //! The stream is closed by the reader thread once all audio has been
+    //! received.
+    void start(const LunaSynthesizerStream &stream);
+
+    //! Read up to size bytes, blocking until that many bytes are buffered
+    //! or the stream has ended. Returns the number of bytes read, which is
+    //! only less than size at the end of the stream (0 once all audio has
+    //! been read). Must only be called from one thread at a time.
+    size_t read(char *data, size_t size);
+
+    //! Wait for the reader thread to finish. Throws any error that
+    //! occurred while receiving audio from the stream.
+    void close();
+
+    //! Add audio to the buffer, blocking while it is full. Returns false
+    //! if the buffer was stopped before all the audio could be written.
+    bool write(const char *data, size_t size);
+
+    //! Mark the end of the audio. Readers receive the remaining buffered
+    //! audio and then 0.
+    void finishWriting();
+
+    //! Mark the end of the audio because producing it failed with the
+    //! given error. Readers receive the remaining buffered audio, and then
+    //! read() throws the error instead of returning 0.
+    void abortWriting(std::exception_ptr error);
+
+    //! Returns the number of bytes currently buffered.
+    size_t available() const;
+
+    //! Returns the number of times a read had to wait for audio after the
+    //! buffer ran dry (not counting the initial prefill).
+    uint64_t underruns() const;
+
+    //! Returns the number of times a write had to wait because the buffer
+    //! was full.
+    uint64_t overruns() const;
+
+private:
+    std::vector<char> mRing;
+    size_t mMask;
+    size_t mPrefill;
+
+    // Total bytes ever written and read. The producer only writes mHead
+    // and the consumer only writes mTail.
+    std::atomic<uint64_t> mHead;
+    std::atomic<uint64_t> mTail;
+    std::atomic<bool> mEnded;
+    std::atomic<bool> mStopped;
+    bool mPrefilled;
+
+    std::atomic<uint64_t> mUnderruns;
+    std::atomic<uint64_t> mOverruns;
+
+    // Used only to sleep and wake up.
+    std::mutex mMutex;
+    std::condition_variable mCV;
+    std::atomic<bool> mReaderWaiting;
+    std::atomic<bool> mWriterWaiting;
+
+    std::thread mThread;
+    std::exception_ptr mError;
+
+    // Set by abortWriting() before the end is marked.
+    std::exception_ptr mWriteError;
+
+    // A copy of the stream being read, so that it can be cancelled.
+    std::unique_ptr<LunaSynthesizerStream> mStream;
+
+    // Disable copy construction and assignments.
+    LunaReadAheadBuffer(const LunaReadAheadBuffer &other);
+    LunaReadAheadBuffer &operator=(const LunaReadAheadBuffer &other);
+
+    void run(LunaSynthesizerStream stream);
+    void wake(std::atomic<bool> &waiting);
+};
+
+#endif // LUNA_READ_AHEAD_BUFFER_H
@@ -0,0 +1,60 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_request_arena.h"
+
+namespace
+{
+
+google::protobuf::ArenaOptions blockOptions(char *block, size_t size)
+{
+    google::protobuf::ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = size;
+    return options;
+}
+
+} // namespace
+
+LunaRequestArena::LunaRequestArena()
+    : mArena(blockOptions(mBlock, kBlockSize)),
+      mRequest(google::protobuf::Arena::CreateMessage<
+               cobaltspeech::luna::SynthesizeRequest>(&mArena))
+{
+}
+
+LunaRequestArena::~LunaRequestArena() { this->releaseConfig(); }
+
+const cobaltspeech::luna::SynthesizeRequest &
+LunaRequestArena::build(const cobaltspeech::luna::SynthesizerConfig &config,
+                        const std::string &text)
+{
+    this->releaseConfig();
+
+    // The request never modifies the config, and releaseConfig() takes
+    // it back before the arena could free it, so it is safe to borrow.
+    mRequest->unsafe_arena_set_allocated_config(
+        const_cast<cobaltspeech::luna::SynthesizerConfig *>(&config));
+    mRequest->set_text(text);
+    return *mRequest;
+}
+
+void LunaRequestArena::releaseConfig()
+{
+    if (mRequest->has_config())
+    {
+        mRequest->unsafe_arena_release_config();
+    }
+}
+
+LunaRequestArena::LunaRequestArena(const LunaRequestArena &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy arena objects.
+}
+
+LunaRequestArena &LunaRequestArena::operator=(const LunaRequestArena &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy arena objects.
+    return *this;
+}
@@ -0,0 +1,52 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_REQUEST_ARENA_H
+#define LUNA_REQUEST_ARENA_H
+
+#include "luna.pb.h"
+
+#include <cstddef>
+#include <google/protobuf/arena.h>
+#include <string>
+
+//! LunaRequestArena builds a SynthesizeRequest on a protobuf arena whose
+//! first block is stored inside the LunaRequestArena itself, so building
+//! a request makes no heap allocations beyond copying the text. The
+//! config is borrowed rather than copied, so the same config can be
+//! reused for every request without being copied into each one. It must
+//! outlive the request.
+//!
+//! The request is only needed until the stub has serialized it, so a
+//! LunaRequestArena is usually a local variable in the calling function.
+class LunaRequestArena
+{
+public:
+    LunaRequestArena();
+    ~LunaRequestArena();
+
+    //! Build a request for the given config and text. The returned
+    //! request is valid until the next call to build(), or until this
+    //! object is destroyed.
+    const cobaltspeech::luna::SynthesizeRequest &
+    build(const cobaltspeech::luna::SynthesizerConfig &config,
+          const std::string &text);
+
+private:
+    // Large enough for the arena's own bookkeeping plus the request and
+    // its text string object.
+    static const size_t kBlockSize = 1024;
+
+    alignas(std::max_align_t) char mBlock[kBlockSize];
+    google::protobuf::Arena mArena;
+    cobaltspeech::luna::SynthesizeRequest *mRequest;
+
+    // Disable copy construction and assignments.
+    LunaRequestArena(const LunaRequestArena &other);
+    LunaRequestArena &operator=(const LunaRequestArena &other);
+
+    // Give the borrowed config back before the request is reused or
+    // freed.
+    void releaseConfig();
+};
+
+#endif // LUNA_REQUEST_ARENA_H
@@ -0,0 +1,605 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_scheduler.h"
+
+#include "luna_exception.h"
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <utility>
+
+const unsigned int LunaSchedulerPolicy::kInteractive;
+const unsigned int LunaSchedulerPolicy::kBulk;
+const unsigned int LunaPriority::kDefaultClass;
+
+namespace
+{
+
+// The priority of the innermost LunaPriorityScope on this thread.
+thread_local LunaPriority currentPriority;
+
+// The amount a class's pass advances for each request admitted at
+// weight 1. Heavier classes advance by a proportionally smaller amount,
+// so they are picked more often.
+const uint64_t kStride = 1 << 20;
+
+// A request that is waiting for a slot, or has been given one.
+struct Entry
+{
+    unsigned int priorityClass = 0;
+    LunaScheduler::Clock::time_point queued;
+    LunaScheduler::Run run;
+    LunaScheduler::Reject reject;
+
+    // The watchdog alarm that sheds the request, if it has a deadline.
+    uint64_t alarm = 0;
+
+    // Protected by the state's mutex.
+    bool waiting = false;
+    bool cancelled = false;
+    LunaAsyncHandle handle;
+};
+
+struct ClassState
+{
+    LunaPriorityClass config;
+    std::deque<std::shared_ptr<Entry>> queue;
+    unsigned int running = 0;
+
+    // The most requests that may run at once, from the class's
+    // maxConcurrent and maxShare, or zero for no limit.
+    unsigned int limit = 0;
+
+    // The virtual time at which the class is next due a slot.
+    uint64_t pass = 0;
+
+    uint64_t admitted = 0;
+    uint64_t shed = 0;
+    uint64_t cancelled = 0;
+
+    // Moving average of the time requests hold their slot, and whether
+    // any request has been measured yet.
+    double serviceMicros = 0;
+    bool measured = false;
+
+    LunaHistogram wait;
+};
+
+using Admission =
+    std::pair<std::shared_ptr<Entry>, std::shared_ptr<LunaSchedulerTicket>>;
+
+} // namespace
+
+struct LunaScheduler::State
+{
+    LunaSchedulerPolicy policy;
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ClassState>> classes;
+    unsigned int running = 0;
+
+    // The pass of the class most recently given a slot. A class that
+    // starts waiting again after being idle resumes from here, so it
+    // cannot claim the slots it did not use while idle.
+    uint64_t virtualTime = 0;
+
+    // Null once the scheduler is being destroyed.
+    LunaStreamWatchdog *watchdog = nullptr;
+};
+
+namespace
+{
+
+using State = LunaScheduler::State;
+
+bool hasSlot(const State &state, const ClassState &c)
+{
+    return state.running < state.policy.maxConcurrent &&
+           (c.limit == 0 || c.running < c.limit);
+}
+
+// Returns the latest time a request of the class may be admitted and
+// still be expected to finish by the deadline.
+LunaScheduler::Clock::time_point
+latestStart(const ClassState &c, LunaScheduler::Clock::time_point deadline)
+{
+    if (deadline == LunaScheduler::Clock::time_point::max())
+    {
+        return deadline;
+    }
+
+    return deadline - std::chrono::microseconds(
+                          static_cast<int64_t>(c.serviceMicros));
+}
+
+// Count a request of the class as running and advance its pass. Must be
+// called with the state's mutex held.
+void admit(State &state, ClassState &c, Entry &entry,
+           LunaScheduler::Clock::time_point now)
+{
+    state.running++;
+    c.running++;
+    c.admitted++;
+    c.wait.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                      now - entry.queued)
+                      .count());
+
+    state.virtualTime = std::max(state.virtualTime, c.pass);
+    c.pass += kStride / c.config.weight;
+    entry.waiting = false;
+}
+
+// Give the free slots to waiting requests, picking each time the class
+// with the smallest pass that is under its limit. Must be called with the
+// state's mutex held; the requests must be started after it is released.
+std::vector<Admission> admitWaiting(const std::shared_ptr<State> &state)
+{
+    std::vector<Admission> admitted;
+    LunaScheduler::Clock::time_point now = LunaScheduler::Clock::now();
+    while (state->running < state->policy.maxConcurrent)
+    {
+        ClassState *next = nullptr;
+        unsigned int nextIndex = 0;
+        for (unsigned int i = 0; i < state->classes.size(); i++)
+        {
+            ClassState &c = *state->classes[i];
+            if (!c.queue.empty() && hasSlot(*state, c) &&
+                (!next || c.pass < next->pass))
+            {
+                next = &c;
+                nextIndex = i;
+            }
+        }
+        if (!next)
+        {
+            break;
+        }
+
+        std::shared_ptr<Entry> entry = next->queue.front();
+        next->queue.pop_front();
+        if (entry->alarm != 0 && state->watchdog)
+        {
+            state->watchdog->disarm(entry->alarm);
+        }
+
+        admit(*state, *next, *entry, now);
+        admitted.push_back(Admission(
+            entry, std::make_shared<LunaSchedulerTicket>(state, nextIndex)));
+    }
+    return admitted;
+}
+
+// Run the admitted requests. Must be called without the state's mutex.
+void start(const std::shared_ptr<State> &state,
+           const std::vector<Admission> &admitted)
+{
+    for (const Admission &a : admitted)
+    {
+        LunaAsyncHandle handle;
+        try
+        {
+            handle = a.first->run(a.second);
+        }
+        catch (const std::exception &e)
+        {
+            a.second->release();
+            a.first->reject(grpc::Status(grpc::StatusCode::UNKNOWN, e.what()));
+            continue;
+        }
+
+        // The request may have been cancelled while it was starting
+        bool cancelled = false;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            a.first->handle = handle;
+            cancelled = a.first->cancelled;
+        }
+        if (cancelled)
+        {
+            handle.cancel();
+        }
+    }
+}
+
+// Take a waiting request out of its queue and reject it with the given
+// status. Running requests are cancelled instead if cancelRunning is set.
+void remove(const std::weak_ptr<State> &weakState,
+            const std::shared_ptr<Entry> &entry, const grpc::Status &status,
+            bool cancelRunning)
+{
+    std::shared_ptr<State> state = weakState.lock();
+    if (!state)
+    {
+        return;
+    }
+
+    bool rejected = false;
+    LunaAsyncHandle handle;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        ClassState &c = *state->classes[entry->priorityClass];
+        if (entry->waiting)
+        {
+            c.queue.erase(std::find(c.queue.begin(), c.queue.end(), entry));
+            entry->waiting = false;
+            rejected = true;
+            if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED)
+            {
+                c.shed++;
+            }
+            else
+            {
+                c.cancelled++;
+                if (entry->alarm != 0 && state->watchdog)
+                {
+                    state->watchdog->disarm(entry->alarm);
+                }
+            }
+        }
+        else if (cancelRunning)
+        {
+            entry->cancelled = true;
+            handle = entry->handle;
+        }
+    }
+
+    if (rejected)
+    {
+        entry->reject(status);
+    }
+    else
+    {
+        handle.cancel();
+    }
+}
+
+} // namespace
+
+LunaSchedulerPolicy::LunaSchedulerPolicy()
+{
+    LunaPriorityClass interactive;
+    interactive.name = "interactive";
+    interactive.weight = 8;
+    classes.push_back(interactive);
+
+    LunaPriorityClass bulk;
+    bulk.name = "bulk";
+    bulk.weight = 1;
+    bulk.maxShare = 0.5;
+    classes.push_back(bulk);
+}
+
+LunaPriorityScope::LunaPriorityScope(const LunaPriority &priority)
+    : mPrevious(currentPriority)
+{
+    currentPriority = priority;
+}
+
+LunaPriorityScope::LunaPriorityScope(
+    unsigned int priorityClass, std::chrono::steady_clock::time_point deadline)
+    : mPrevious(currentPriority)
+{
+    currentPriority.priorityClass = priorityClass;
+    currentPriority.deadline = deadline;
+}
+
+LunaPriorityScope::~LunaPriorityScope() { currentPriority = mPrevious; }
+
+const LunaPriority &LunaPriorityScope::current() { return currentPriority; }
+
+LunaPriorityScope::LunaPriorityScope(const LunaPriorityScope &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy scope objects.
+}
+
+LunaPriorityScope &LunaPriorityScope::operator=(const LunaPriorityScope &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy scope objects.
+    return *this;
+}
+
+LunaScheduler::LunaScheduler(const LunaSchedulerPolicy &policy)
+    : mState(new State), mWatchdog(new LunaStreamWatchdog)
+{
+    if (policy.maxConcurrent == 0 || policy.classes.empty())
+    {
+        throw LunaException("the scheduler must allow at least one request");
+    }
+    if (policy.defaultClass >= policy.classes.size())
+    {
+        throw LunaException("the default priority class does not exist");
+    }
+
+    mState->policy = policy;
+    for (const LunaPriorityClass &config : policy.classes)
+    {
+        if (config.weight == 0)
+        {
+            throw LunaException("priority class " + config.name +
+                                " must have a weight of at least one");
+        }
+        if (config.maxShare < 0 || config.maxShare > 1)
+        {
+            throw LunaException("priority class " + config.name +
+                                " must have a share between zero and one");
+        }
+
+        std::unique_ptr<ClassState> c(new ClassState);
+        c->config = config;
+        c->limit = config.maxConcurrent;
+        if (config.maxShare > 0)
+        {
+            unsigned int share = std::max(
+                1u, static_cast<unsigned int>(config.maxShare *
+                                              policy.maxConcurrent));
+            if (c->limit == 0 || share < c->limit)
+            {
+                c->limit = share;
+            }
+        }
+        mState->classes.push_back(std::move(c));
+    }
+    mState->watchdog = mWatchdog.get();
+}
+
+LunaScheduler::~LunaScheduler()
+{
+    std::vector<std::shared_ptr<Entry>> waiting;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        mState->watchdog = nullptr;
+        for (std::unique_ptr<ClassState> &c : mState->classes)
+        {
+            for (const std::shared_ptr<Entry> &entry : c->queue)
+            {
+                entry->waiting = false;
+                waiting.push_back(entry);
+            }
+            c->cancelled += c->queue.size();
+            c->queue.clear();
+        }
+    }
+
+    for (const std::shared_ptr<Entry> &entry : waiting)
+    {
+        entry->reject(grpc::Status(grpc::StatusCode::CANCELLED,
+                                   "the scheduler was destroyed"));
+    }
+
+    // Wait for any shedding in progress before the state can go away
+    mWatchdog.reset();
+}
+
+const LunaSchedulerPolicy &LunaScheduler::policy() const
+{
+    return mState->policy;
+}
+
+std::shared_ptr<LunaSchedulerTicket>
+LunaScheduler::acquire(const LunaPriority &priority)
+{
+    std::shared_ptr<std::promise<std::shared_ptr<LunaSchedulerTicket>>>
+        promise(new std::promise<std::shared_ptr<LunaSchedulerTicket>>);
+    std::future<std::shared_ptr<LunaSchedulerTicket>> ticket =
+        promise->get_future();
+
+    this->submit(
+        priority,
+        [promise](const std::shared_ptr<LunaSchedulerTicket> &t) {
+            promise->set_value(t);
+            return LunaAsyncHandle();
+        },
+        [promise](const grpc::Status &status) {
+            promise->set_exception(
+                std::make_exception_ptr(LunaException(status)));
+        });
+
+    return ticket.get();
+}
+
+LunaAsyncHandle LunaScheduler::submit(const LunaPriority &priority,
+                                      const Run &run, const Reject &reject)
+{
+    unsigned int index = priority.priorityClass;
+    if (index == LunaPriority::kDefaultClass)
+    {
+        index = mState->policy.defaultClass;
+    }
+    if (index >= mState->classes.size())
+    {
+        throw LunaException("unknown priority class");
+    }
+
+    std::shared_ptr<Entry> entry(new Entry);
+    entry->priorityClass = index;
+    entry->queued = Clock::now();
+    entry->run = run;
+    entry->reject = reject;
+
+    std::weak_ptr<State> weakState = mState;
+    std::vector<Admission> admitted;
+    bool shed = false;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        ClassState &c = *mState->classes[index];
+        if (c.queue.empty())
+        {
+            c.pass = std::max(c.pass, mState->virtualTime);
+        }
+
+        Clock::time_point latest = latestStart(c, priority.deadline);
+        if (c.queue.empty() && hasSlot(*mState, c))
+        {
+            admit(*mState, c, *entry, entry->queued);
+            admitted.push_back(Admission(
+                entry, std::make_shared<LunaSchedulerTicket>(mState, index)));
+        }
+        else if (latest <= entry->queued)
+        {
+            c.shed++;
+            shed = true;
+        }
+        else
+        {
+            entry->waiting = true;
+            c.queue.push_back(entry);
+            if (latest != Clock::time_point::max())
+            {
+                entry->alarm = mWatchdog->arm(latest, [weakState, entry]() {
+                    remove(weakState, entry,
+                           grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                                        "request shed: it could not be "
+                                        "admitted in time to meet its "
+                                        "deadline"),
+                           false);
+                });
+            }
+        }
+    }
+
+    if (shed)
+    {
+        reject(grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                            "request shed: it could not be admitted in time "
+                            "to meet its deadline"));
+        return LunaAsyncHandle();
+    }
+
+    start(mState, admitted);
+    return LunaAsyncHandle([weakState, entry]() {
+        remove(weakState, entry,
+               grpc::Status(grpc::StatusCode::CANCELLED,
+                            "request cancelled while waiting for a slot"),
+               true);
+    });
+}
+
+std::vector<LunaSchedulerClassStats> LunaScheduler::stats() const
+{
+    std::lock_guard<std::mutex> lock(mState->mutex);
+    std::vector<LunaSchedulerClassStats> stats;
+    for (const std::unique_ptr<ClassState> &c : mState->classes)
+    {
+        LunaSchedulerClassStats s;
+        s.name = c->config.name;
+        s.queued = c->queue.size();
+        s.running = c->running;
+        s.admitted = c->admitted;
+        s.shed = c->shed;
+        s.cancelled = c->cancelled;
+        s.serviceTime = std::chrono::microseconds(
+            static_cast<int64_t>(c->serviceMicros));
+        s.wait = c->wait.snapshot();
+        stats.push_back(s);
+    }
+    return stats;
+}
+
+LunaScheduler::LunaScheduler(const LunaScheduler &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy scheduler objects.
+}
+
+LunaScheduler &LunaScheduler::operator=(const LunaScheduler &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy scheduler objects.
+    return *this;
+}
+
+LunaSchedulerTicket::LunaSchedulerTicket(
+    const std::shared_ptr<LunaScheduler::State> &state,
+    unsigned int priorityClass)
+    : mState(state), mClass(priorityClass),
+      mAdmitted(LunaScheduler::Clock::now()), mReleased(false)
+{
+}
+
+LunaSchedulerTicket::~LunaSchedulerTicket() { this->release(); }
+
+void LunaSchedulerTicket::release()
+{
+    if (mReleased.exchange(true))
+    {
+        return;
+    }
+
+    double micros =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            LunaScheduler::Clock::now() - mAdmitted)
+            .count();
+
+    std::vector<Admission> admitted;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        ClassState &c = *mState->classes[mClass];
+        mState->running--;
+        c.running--;
+
+        // Weight recent requests more, so the estimate follows changes
+        // in load without jumping on a single slow request
+        if (c.measured)
+        {
+            c.serviceMicros += (micros - c.serviceMicros) / 8;
+        }
+        else
+        {
+            c.serviceMicros = micros;
+            c.measured = true;
+        }
+
+        admitted = admitWaiting(mState);
+    }
+
+    start(mState, admitted);
+}
+
+LunaSchedulerTicket::LunaSchedulerTicket(const LunaSchedulerTicket &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy ticket objects.
+}
+
+LunaSchedulerTicket &
+LunaSchedulerTicket::operator=(const LunaSchedulerTicket &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy ticket objects.
+    return *this;
+}
+
+LunaScheduledReader::LunaScheduledReader(
+    const LunaSynthesizerStream::LunaReader &reader,
+    const std::shared_ptr<LunaSchedulerTicket> &ticket)
+    : mReader(reader), mTicket(ticket)
+{
+}
+
+LunaScheduledReader::~LunaScheduledReader() {}
+
+bool LunaScheduledReader::Read(cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    return mReader->Read(msg);
+}
+
+bool LunaScheduledReader::NextMessageSize(uint32_t *sz)
+{
+    return mReader->NextMessageSize(sz);
+}
+
+grpc::Status LunaScheduledReader::Finish()
+{
+    grpc::Status status = mReader->Finish();
+    mTicket->release();
+    return status;
+}
+
+void LunaScheduledReader::WaitForInitialMetadata()
+{
+    mReader->WaitForInitialMetadata();
+}
@@ -0,0 +1,253 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_SCHEDULER_H
+#define LUNA_SCHEDULER_H
+
+#include "luna.grpc.pb.h"
+#include "luna_async_call.h"
+#include "luna_histogram.h"
+#include "luna_stream_watchdog.h"
+#include "luna_synthesizer_stream.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+//! LunaPriorityClass describes one class of requests handled by a
+//! LunaScheduler.
+struct LunaPriorityClass
+{
+    //! The name reported in the stats.
+    std::string name;
+
+    //! The share of the free slots the class gets while several classes
+    //! are waiting. A class with weight 4 is admitted four times as
+    //! often as a class with weight 1.
+    unsigned int weight = 1;
+
+    //! The most requests of the class that may run at once, or zero for
+    //! no limit other than the scheduler's.
+    unsigned int maxConcurrent = 0;
+
+    //! The most requests of the class that may run at once, as a share
+    //! (0-1) of the policy's maxConcurrent, or zero for no such limit.
+    //! The limit is worked out when the scheduler is created, so it
+    //! follows maxConcurrent, and is at least one request. If
+    //! maxConcurrent is also set, the lower limit applies.
+    double maxShare = 0;
+};
+
+//! LunaSchedulerPolicy configures a LunaScheduler. The default policy
+//! has an "interactive" class (kInteractive) with weight 8, and a "bulk"
+//! class (kBulk) with weight 1 that may use at most half of the slots
+//! (a maxShare of 0.5).
+struct LunaSchedulerPolicy
+{
+    //! Indexes of the classes in the default policy.
+    static const unsigned int kInteractive = 0;
+    static const unsigned int kBulk = 1;
+
+    LunaSchedulerPolicy();
+
+    //! The most requests that may run at once, across all classes.
+    unsigned int maxConcurrent = 16;
+
+    //! The priority classes, referred to by their index.
+    std::vector<LunaPriorityClass> classes;
+
+    //! The class of requests made outside any LunaPriorityScope.
+    unsigned int defaultClass = kInteractive;
+};
+
+//! LunaPriority is the class and deadline of a request.
+struct LunaPriority
+{
+    //! The value of priorityClass that selects the scheduler's default.
+    static const unsigned int kDefaultClass =
+        std::numeric_limits<unsigned int>::max();
+
+    //! The index of the request's class in the scheduler's policy.
+    unsigned int priorityClass = kDefaultClass;
+
+    //! The time by which the request must be finished. A queued request
+    //! that can no longer finish by then is shed.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+};
+
+//! LunaPriorityScope sets the priority of requests made on the current
+//! thread while the scope exists, in the same way as LunaTraceScope sets
+//! their trace ID. Scopes may be nested; the previous priority is
+//! restored when a scope ends.
+class LunaPriorityScope
+{
+public:
+    explicit LunaPriorityScope(const LunaPriority &priority);
+
+    //! Set the class and deadline of requests made in the scope.
+    LunaPriorityScope(unsigned int priorityClass,
+                      std::chrono::steady_clock::time_point deadline =
+                          std::chrono::steady_clock::time_point::max());
+    ~LunaPriorityScope();
+
+    //! Returns the priority for the current thread. It has the default
+    //! class and no deadline if there is no scope.
+    static const LunaPriority &current();
+
+private:
+    LunaPriority mPrevious;
+
+    // Disable copy construction and assignments.
+    LunaPriorityScope(const LunaPriorityScope &other);
+    LunaPriorityScope &operator=(const LunaPriorityScope &other);
+};
+
+//! LunaSchedulerClassStats is a snapshot of the counters kept by a
+//! LunaScheduler for one priority class.
+struct LunaSchedulerClassStats
+{
+    std::string name;
+
+    //! Requests waiting for a slot.
+    uint64_t queued = 0;
+
+    //! Requests holding a slot.
+    uint64_t running = 0;
+
+    //! Requests given a slot since the scheduler was created.
+    uint64_t admitted = 0;
+
+    //! Requests rejected because they could not be admitted in time to
+    //! finish by their deadline.
+    uint64_t shed = 0;
+
+    //! Requests cancelled while they were waiting.
+    uint64_t cancelled = 0;
+
+    //! The average time the class's requests hold their slot, used to
+    //! decide when a queued request must be shed.
+    std::chrono::microseconds serviceTime = std::chrono::microseconds(0);
+
+    //! How long admitted requests waited for their slot.
+    LunaHistogramSnapshot wait;
+};
+
+class LunaSchedulerTicket;
+
+//! LunaScheduler limits the number of requests sent at once and decides
+//! which waiting request is sent next. Each request belongs to a
+//! priority class, which may have its own limit. When a slot is freed,
+//! it goes to the waiting class that has had the smallest share of the
+//! slots relative to its weight (weighted fair queueing, implemented by
+//! stride scheduling), so bulk work keeps making progress under a steady
+//! stream of interactive requests without delaying them much. Requests
+//! of the same class are admitted in the order they arrived.
+//!
+//! A request with a deadline is shed, rather than left waiting, as soon
+//! as it can no longer be admitted in time to finish by its deadline,
+//! judged by how long requests of its class usually hold their slot.
+//! Requests are never shed once admitted. The object is thread-safe and
+//! may be shared by several clients.
+class LunaScheduler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    //! Function run when a request is admitted. It should start the
+    //! request and keep the ticket until the request is finished.
+    using Run = std::function<LunaAsyncHandle(
+        const std::shared_ptr<LunaSchedulerTicket> &ticket)>;
+
+    //! Function run instead of Run if the request is shed (with a
+    //! DEADLINE_EXCEEDED status) or cancelled while it is waiting.
+    using Reject = std::function<void(const grpc::Status &status)>;
+
+    LunaScheduler(const LunaSchedulerPolicy &policy = LunaSchedulerPolicy());
+
+    //! Requests that are still waiting are rejected with a CANCELLED
+    //! status. Tickets that are still held remain safe to release.
+    ~LunaScheduler();
+
+    const LunaSchedulerPolicy &policy() const;
+
+    //! Wait for a slot for a request with the given priority. Throws a
+    //! LunaException if the request is shed.
+    std::shared_ptr<LunaSchedulerTicket> acquire(const LunaPriority &priority);
+
+    //! Queue a request with the given priority without waiting. If a slot
+    //! is free, run is called before this returns; otherwise it is called
+    //! later from the thread that frees a slot, and must not block. The
+    //! returned handle cancels the request whether it is waiting or
+    //! running.
+    LunaAsyncHandle submit(const LunaPriority &priority, const Run &run,
+                           const Reject &reject);
+
+    //! Returns the stats of each class, in the order of the policy.
+    std::vector<LunaSchedulerClassStats> stats() const;
+
+    //! The state shared with the tickets.
+    struct State;
+
+private:
+    std::shared_ptr<State> mState;
+
+    // Sheds queued requests when their deadlines can no longer be met.
+    std::unique_ptr<LunaStreamWatchdog> mWatchdog;
+
+    // Disable copy construction and assignments.
+    LunaScheduler(const LunaScheduler &other);
+    LunaScheduler &operator=(const LunaScheduler &other);
+};
+
+//! LunaSchedulerTicket is a slot given to an admitted request. The slot
+//! is freed when the ticket is released or destroyed.
+class LunaSchedulerTicket
+{
+public:
+    LunaSchedulerTicket(const std::shared_ptr<LunaScheduler::State> &state,
+                        unsigned int priorityClass);
+
+    //! Releases the slot, if release() has not been called.
+    ~LunaSchedulerTicket();
+
+    //! Free the slot, admitting the next waiting request (if any) from
+    //! this thread. Only the first call has any effect.
+    void release();
+
+private:
+    std::shared_ptr<LunaScheduler::State> mState;
+    unsigned int mClass;
+    LunaScheduler::Clock::time_point mAdmitted;
+    std::atomic<bool> mReleased;
+
+    // Disable copy construction and assignments.
+    LunaSchedulerTicket(const LunaSchedulerTicket &other);
+    LunaSchedulerTicket &operator=(const LunaSchedulerTicket &other);
+};
+
+//! LunaScheduledReader wraps the reader of a SynthesizeStream call and
+//! holds the stream's ticket until the stream is finished.
+class LunaScheduledReader
+    : public grpc::ClientReaderInterface<cobaltspeech::luna::SynthesizeResponse>
+{
+public:
+    LunaScheduledReader(const LunaSynthesizerStream::LunaReader &reader,
+                        const std::shared_ptr<LunaSchedulerTicket> &ticket);
+    ~LunaScheduledReader() override;
+
+    bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+    bool NextMessageSize(uint32_t *sz) override;
+    grpc::Status Finish() override;
+    void WaitForInitialMetadata() override;
+
+private:
+    LunaSynthesizerStream::LunaReader mReader;
+    std::shared_ptr<LunaSchedulerTicket> mTicket;
+};
+
+#endif // LUNA_SCHEDULER_H
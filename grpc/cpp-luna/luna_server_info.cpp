@@ -0,0 +1,37 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_server_info.h"
+
+LunaServerInfo::LunaServerInfo(const std::string &version,
+                               const std::vector<LunaVoice> &voices)
+    : mVersion(version), mVoices(voices),
+      mFetched(std::chrono::steady_clock::now())
+{
+}
+
+LunaServerInfo::~LunaServerInfo() {}
+
+const std::string &LunaServerInfo::version() const { return mVersion; }
+
+const std::vector<LunaVoice> &LunaServerInfo::voices() const
+{
+    return mVoices;
+}
+
+const LunaVoice *LunaServerInfo::findVoice(const std::string &id) const
+{
+    for (const LunaVoice &voice : mVoices)
+    {
+        if (voice.id() == id)
+        {
+            return &voice;
+        }
+    }
+
+    return nullptr;
+}
+
+std::chrono::steady_clock::time_point LunaServerInfo::fetched() const
+{
+    return mFetched;
+}
@@ -0,0 +1,42 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_SERVER_INFO_H
+#define LUNA_SERVER_INFO_H
+
+#include "luna_voice.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+//! LunaServerInfo is an immutable snapshot of the metadata a Luna
+//! server reports about itself: its version and the voices it serves.
+//! LunaClient shares snapshots between threads, so a snapshot never
+//! changes once created; refreshing the metadata creates a new one.
+class LunaServerInfo
+{
+public:
+    LunaServerInfo(const std::string &version,
+                   const std::vector<LunaVoice> &voices);
+    ~LunaServerInfo();
+
+    //! Returns the version of Luna used by the server.
+    const std::string &version() const;
+
+    //! Returns the voices the server is configured to use.
+    const std::vector<LunaVoice> &voices() const;
+
+    //! Returns the voice with the given id, or nullptr if the server
+    //! does not have it.
+    const LunaVoice *findVoice(const std::string &id) const;
+
+    //! Returns when the metadata was fetched from the server.
+    std::chrono::steady_clock::time_point fetched() const;
+
+private:
+    std::string mVersion;
+    std::vector<LunaVoice> mVoices;
+    std::chrono::steady_clock::time_point mFetched;
+};
+
+#endif // LUNA_SERVER_INFO_H
@@ -0,0 +1,390 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_single_flight.h"
+
+#include <condition_variable>
+#include <vector>
+
+struct LunaSingleFlight::Table
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+    uint64_t started = 0;
+    uint64_t joined = 0;
+    uint64_t abandoned = 0;
+};
+
+namespace
+{
+
+// A subscriber that receives the chunks through callbacks.
+struct CallbackSubscriber
+{
+    LunaAudioCallback onAudio;
+    LunaFinishCallback onFinish;
+    size_t next = 0;
+
+    // Set while a thread is delivering to this subscriber, so that
+    // chunks are delivered in order and callbacks never overlap.
+    bool delivering = false;
+    bool cancelled = false;
+    bool finished = false;
+};
+
+} // namespace
+
+struct LunaSingleFlight::Flight
+{
+    std::string key;
+    std::weak_ptr<Table> table;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // The chunks received so far. They are never modified once added,
+    // so subscribers copy them without holding the lock.
+    std::vector<std::shared_ptr<const std::string>> chunks;
+    bool done = false;
+    grpc::Status status;
+
+    LunaAsyncHandle handle;
+    unsigned int subscribers = 0;
+    bool abandoned = false;
+    std::vector<std::shared_ptr<CallbackSubscriber>> callbacks;
+};
+
+namespace
+{
+
+using Flight = LunaSingleFlight::Flight;
+
+// Remove one subscriber from the flight, cancelling the call if it was
+// the last one and the call is still running.
+void leave(const std::shared_ptr<Flight> &flight)
+{
+    bool abandon = false;
+    std::shared_ptr<LunaSingleFlight::Table> table = flight->table.lock();
+    {
+        std::unique_lock<std::mutex> tableLock;
+        if (table)
+        {
+            tableLock = std::unique_lock<std::mutex>(table->mutex);
+        }
+
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        flight->subscribers--;
+        abandon = flight->subscribers == 0 && !flight->done;
+        if (abandon)
+        {
+            // Later requests must start a new call rather than join
+            // this one
+            flight->abandoned = true;
+            if (table)
+            {
+                table->abandoned++;
+                auto it = table->flights.find(flight->key);
+                if (it != table->flights.end() && it->second == flight)
+                {
+                    table->flights.erase(it);
+                }
+            }
+        }
+    }
+
+    if (abandon)
+    {
+        flight->handle.cancel();
+    }
+}
+
+// Deliver whatever the subscriber has not yet received. Callbacks are
+// run without holding the lock; a thread that finds another already
+// delivering leaves the new chunks to it.
+void deliver(const std::shared_ptr<Flight> &flight,
+             const std::shared_ptr<CallbackSubscriber> &subscriber)
+{
+    std::unique_lock<std::mutex> lock(flight->mutex);
+    if (subscriber->delivering || subscriber->finished)
+    {
+        return;
+    }
+    subscriber->delivering = true;
+
+    while (true)
+    {
+        if (!subscriber->cancelled &&
+            subscriber->next < flight->chunks.size())
+        {
+            std::shared_ptr<const std::string> chunk =
+                flight->chunks[subscriber->next++];
+            lock.unlock();
+            std::string audio(*chunk);
+            subscriber->onAudio(audio);
+            lock.lock();
+            continue;
+        }
+
+        if (subscriber->cancelled || flight->done)
+        {
+            grpc::Status status =
+                subscriber->cancelled
+                    ? grpc::Status(grpc::StatusCode::CANCELLED,
+                                   "subscriber cancelled")
+                    : flight->status;
+            subscriber->finished = true;
+            subscriber->delivering = false;
+            lock.unlock();
+            subscriber->onFinish(status);
+            leave(flight);
+            return;
+        }
+
+        break;
+    }
+
+    subscriber->delivering = false;
+}
+
+} // namespace
+
+LunaSingleFlight::LunaSingleFlight() : mTable(new Table) {}
+
+LunaSingleFlight::~LunaSingleFlight() {}
+
+std::shared_ptr<LunaSingleFlight::Reader>
+LunaSingleFlight::subscribe(const std::string &key, const Launcher &launcher)
+{
+    bool started = false;
+    std::shared_ptr<Flight> flight = this->join(key, started);
+    std::shared_ptr<Reader> reader(new Reader(flight));
+    if (started)
+    {
+        this->launch(flight, launcher);
+    }
+    return reader;
+}
+
+LunaAsyncHandle LunaSingleFlight::subscribe(const std::string &key,
+                                            const Launcher &launcher,
+                                            const LunaAudioCallback &onAudio,
+                                            const LunaFinishCallback &onFinish)
+{
+    bool started = false;
+    std::shared_ptr<Flight> flight = this->join(key, started);
+
+    std::shared_ptr<CallbackSubscriber> subscriber(new CallbackSubscriber);
+    subscriber->onAudio = onAudio;
+    subscriber->onFinish = onFinish;
+    {
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        flight->callbacks.push_back(subscriber);
+    }
+
+    if (started)
+    {
+        this->launch(flight, launcher);
+    }
+
+    // Replay the chunks received before this subscriber joined
+    deliver(flight, subscriber);
+
+    return LunaAsyncHandle([flight, subscriber]() {
+        {
+            std::lock_guard<std::mutex> lock(flight->mutex);
+            if (subscriber->finished)
+            {
+                return;
+            }
+            subscriber->cancelled = true;
+        }
+        deliver(flight, subscriber);
+    });
+}
+
+LunaSingleFlightStats LunaSingleFlight::stats() const
+{
+    std::lock_guard<std::mutex> lock(mTable->mutex);
+    LunaSingleFlightStats s;
+    s.flights = mTable->started;
+    s.joined = mTable->joined;
+    s.abandoned = mTable->abandoned;
+    s.inFlight = mTable->flights.size();
+    return s;
+}
+
+std::shared_ptr<LunaSingleFlight::Flight>
+LunaSingleFlight::join(const std::string &key, bool &started)
+{
+    std::lock_guard<std::mutex> tableLock(mTable->mutex);
+    std::shared_ptr<Flight> &flight = mTable->flights[key];
+    started = !flight;
+    if (started)
+    {
+        flight.reset(new Flight);
+        flight->key = key;
+        flight->table = mTable;
+        mTable->started++;
+    }
+    else
+    {
+        mTable->joined++;
+    }
+
+    std::lock_guard<std::mutex> lock(flight->mutex);
+    flight->subscribers++;
+    return flight;
+}
+
+void LunaSingleFlight::launch(const std::shared_ptr<Flight> &flight,
+                              const Launcher &launcher)
+{
+    LunaAsyncHandle handle = launcher(
+        [flight](std::string &audio) {
+            std::shared_ptr<std::string> chunk(new std::string);
+            chunk->swap(audio);
+
+            std::vector<std::shared_ptr<CallbackSubscriber>> callbacks;
+            {
+                std::lock_guard<std::mutex> lock(flight->mutex);
+                flight->chunks.push_back(chunk);
+                callbacks = flight->callbacks;
+            }
+
+            flight->cv.notify_all();
+            for (const std::shared_ptr<CallbackSubscriber> &s : callbacks)
+            {
+                deliver(flight, s);
+            }
+        },
+        [flight](const grpc::Status &status) {
+            // Take the flight out of the table first, so that requests
+            // from now on start a new call
+            std::shared_ptr<Table> table = flight->table.lock();
+            if (table)
+            {
+                std::lock_guard<std::mutex> tableLock(table->mutex);
+                auto it = table->flights.find(flight->key);
+                if (it != table->flights.end() && it->second == flight)
+                {
+                    table->flights.erase(it);
+                }
+            }
+
+            std::vector<std::shared_ptr<CallbackSubscriber>> callbacks;
+            {
+                std::lock_guard<std::mutex> lock(flight->mutex);
+                flight->done = true;
+                flight->status = status;
+                callbacks.swap(flight->callbacks);
+            }
+
+            flight->cv.notify_all();
+            for (const std::shared_ptr<CallbackSubscriber> &s : callbacks)
+            {
+                deliver(flight, s);
+            }
+        });
+
+    // Everyone may have left while the call was being started
+    bool abandoned = false;
+    {
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        flight->handle = handle;
+        abandoned = flight->abandoned;
+    }
+    if (abandoned)
+    {
+        handle.cancel();
+    }
+}
+
+LunaSingleFlight::LunaSingleFlight(const LunaSingleFlight &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy flight objects.
+}
+
+LunaSingleFlight &LunaSingleFlight::operator=(const LunaSingleFlight &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy flight objects.
+    return *this;
+}
+
+LunaSingleFlight::Reader::Reader(const std::shared_ptr<Flight> &flight)
+    : mFlight(flight), mNext(0), mCancelled(false), mLeft(false)
+{
+}
+
+LunaSingleFlight::Reader::~Reader() { this->cancel(); }
+
+void LunaSingleFlight::Reader::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(mFlight->mutex);
+        if (mLeft)
+        {
+            return;
+        }
+        mLeft = true;
+        mCancelled = !mFlight->done || mNext < mFlight->chunks.size();
+    }
+
+    mFlight->cv.notify_all();
+    leave(mFlight);
+}
+
+bool LunaSingleFlight::Reader::Read(
+    cobaltspeech::luna::SynthesizeResponse *msg)
+{
+    std::shared_ptr<const std::string> chunk;
+    {
+        std::unique_lock<std::mutex> lock(mFlight->mutex);
+        mFlight->cv.wait(lock, [this]() {
+            return mCancelled || mNext < mFlight->chunks.size() ||
+                   mFlight->done;
+        });
+
+        if (mCancelled || mNext == mFlight->chunks.size())
+        {
+            return false;
+        }
+        chunk = mFlight->chunks[mNext++];
+    }
+
+    msg->mutable_audio()->assign(*chunk);
+    return true;
+}
+
+bool LunaSingleFlight::Reader::NextMessageSize(uint32_t *sz)
+{
+    // The size of the next chunk isn't known until it arrives.
+    *sz = 0;
+    return true;
+}
+
+grpc::Status LunaSingleFlight::Reader::Finish()
+{
+    grpc::Status status;
+    {
+        std::lock_guard<std::mutex> lock(mFlight->mutex);
+        if (mCancelled)
+        {
+            return grpc::Status(grpc::StatusCode::CANCELLED,
+                                "subscriber cancelled");
+        }
+
+        if (!mFlight->done || mNext < mFlight->chunks.size())
+        {
+            return grpc::Status(grpc::StatusCode::CANCELLED,
+                                "stream finished before all audio was read");
+        }
+        status = mFlight->status;
+    }
+
+    // The subscriber has everything, so it no longer holds the call
+    this->cancel();
+    return status;
+}
+
+void LunaSingleFlight::Reader::WaitForInitialMetadata() {}
@@ -0,0 +1,132 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_SINGLE_FLIGHT_H
+#define LUNA_SINGLE_FLIGHT_H
+
+#include "luna.grpc.pb.h"
+#include "luna_async_call.h"
+#include "luna_synthesizer_stream.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+//! LunaSingleFlightStats is a snapshot of the counters kept by a
+//! LunaSingleFlight.
+struct LunaSingleFlightStats
+{
+    //! Server calls started.
+    uint64_t flights = 0;
+
+    //! Subscribers that joined a call that was already in flight, and
+    //! so did not need one of their own.
+    uint64_t joined = 0;
+
+    //! Calls cancelled because all their subscribers left.
+    uint64_t abandoned = 0;
+
+    //! Calls currently in flight.
+    uint64_t inFlight = 0;
+};
+
+//! LunaSingleFlight merges concurrent identical requests into one server
+//! call. The first request for a key starts the call; requests for the
+//! same key that arrive while it is running subscribe to it instead.
+//! Every chunk the call receives is kept in a list shared by all the
+//! subscribers, so a subscriber that joins late first replays the chunks
+//! it missed and then receives the rest as they arrive. Once the call
+//! finishes, the next request for the key starts a new call (completed
+//! audio can be kept with a LunaSynthesisCache).
+//!
+//! A subscriber may leave at any time without affecting the others. When
+//! the last one leaves, the call is cancelled. The object is thread-safe
+//! and may be shared by several clients.
+class LunaSingleFlight
+{
+public:
+    //! Function used to start the server call for a key, which must run
+    //! onAudio for each chunk and then onFinish exactly once.
+    using Launcher = std::function<LunaAsyncHandle(
+        const LunaAudioCallback &onAudio, const LunaFinishCallback &onFinish)>;
+
+    class Reader;
+
+    LunaSingleFlight();
+
+    //! Subscribers that are still reading keep their calls alive.
+    ~LunaSingleFlight();
+
+    //! Subscribe to the call for the given key, starting it with the
+    //! launcher if it is not in flight. The returned reader delivers every
+    //! chunk of the call from the beginning.
+    std::shared_ptr<Reader> subscribe(const std::string &key,
+                                      const Launcher &launcher);
+
+    //! Subscribe to the call for the given key, starting it with the
+    //! launcher if it is not in flight. Chunks already received are
+    //! replayed to onAudio before this returns; later chunks are
+    //! delivered from the thread that receives them. onFinish is called
+    //! exactly once. The returned handle leaves the call, running
+    //! onFinish with a CANCELLED status.
+    LunaAsyncHandle subscribe(const std::string &key, const Launcher &launcher,
+                              const LunaAudioCallback &onAudio,
+                              const LunaFinishCallback &onFinish);
+
+    LunaSingleFlightStats stats() const;
+
+    //! The state of one call, shared by its subscribers.
+    struct Flight;
+
+    //! The calls in flight, shared with the calls' callbacks.
+    struct Table;
+
+    //! Reader delivers the chunks of a call to one subscriber, as if it
+    //! were the reader of its own SynthesizeStream call. Each subscriber
+    //! gets its own copy of every chunk.
+    class Reader : public grpc::ClientReaderInterface<
+                       cobaltspeech::luna::SynthesizeResponse>
+    {
+    public:
+        Reader(const std::shared_ptr<Flight> &flight);
+
+        //! Leaves the call if it is still being read.
+        ~Reader() override;
+
+        //! Stop reading and leave the call. Read() returns false and
+        //! Finish() returns CANCELLED. Safe to call from any thread.
+        void cancel();
+
+        bool Read(cobaltspeech::luna::SynthesizeResponse *msg) override;
+        bool NextMessageSize(uint32_t *sz) override;
+        grpc::Status Finish() override;
+        void WaitForInitialMetadata() override;
+
+    private:
+        std::shared_ptr<Flight> mFlight;
+        size_t mNext;
+
+        // Protected by the flight's mutex.
+        bool mCancelled;
+        bool mLeft;
+    };
+
+private:
+    std::shared_ptr<Table> mTable;
+
+    // Disable copy construction and assignments.
+    LunaSingleFlight(const LunaSingleFlight &other);
+    LunaSingleFlight &operator=(const LunaSingleFlight &other);
+
+    // Find the call for the key and join it, or create one. Returns true
+    // in started if the caller must launch the new call.
+    std::shared_ptr<Flight> join(const std::string &key, bool &started);
+
+    // Start the server call for a new flight.
+    void launch(const std::shared_ptr<Flight> &flight,
+                const Launcher &launcher);
+};
+
+#endif // LUNA_SINGLE_FLIGHT_H
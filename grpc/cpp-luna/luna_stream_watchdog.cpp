@@ -0,0 +1,101 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_stream_watchdog.h"
+
+LunaStreamWatchdog::LunaStreamWatchdog() : mNextId(1), mStopping(false)
+{
+    mThread = std::thread(&LunaStreamWatchdog::run, this);
+}
+
+LunaStreamWatchdog::~LunaStreamWatchdog()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+
+    mCV.notify_all();
+    mThread.join();
+}
+
+uint64_t LunaStreamWatchdog::arm(Clock::time_point deadline,
+                                 const std::function<void()> &onExpired)
+{
+    bool earliest = false;
+    uint64_t id = 0;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        id = mNextId++;
+        mDeadlines[Key(deadline, id)] = onExpired;
+        mArmed[id] = deadline;
+        earliest = mDeadlines.begin()->first.second == id;
+    }
+
+    // The thread only needs to wake up if it is now sleeping too long
+    if (earliest)
+    {
+        mCV.notify_all();
+    }
+
+    return id;
+}
+
+bool LunaStreamWatchdog::disarm(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::map<uint64_t, Clock::time_point>::iterator it = mArmed.find(id);
+    if (it == mArmed.end())
+    {
+        return false;
+    }
+
+    mDeadlines.erase(Key(it->second, id));
+    mArmed.erase(it);
+    return true;
+}
+
+LunaStreamWatchdog::LunaStreamWatchdog(const LunaStreamWatchdog &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy watchdog objects.
+}
+
+LunaStreamWatchdog &
+LunaStreamWatchdog::operator=(const LunaStreamWatchdog &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy watchdog objects.
+    return *this;
+}
+
+void LunaStreamWatchdog::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mStopping)
+    {
+        if (mDeadlines.empty())
+        {
+            mCV.wait(lock);
+            continue;
+        }
+
+        std::map<Key, std::function<void()>>::iterator next =
+            mDeadlines.begin();
+        if (Clock::now() < next->first.first)
+        {
+            mCV.wait_until(lock, next->first.first);
+            continue;
+        }
+
+        // Run the expiry function without the lock, so that it may
+        // block (cancelling a call does) without holding up arm().
+        std::function<void()> onExpired;
+        onExpired.swap(next->second);
+        mArmed.erase(next->first.second);
+        mDeadlines.erase(next);
+
+        lock.unlock();
+        onExpired();
+        lock.lock();
+    }
+}
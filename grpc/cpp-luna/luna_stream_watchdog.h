@@ -0,0 +1,63 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_STREAM_WATCHDOG_H
+#define LUNA_STREAM_WATCHDOG_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+//! LunaStreamWatchdog enforces deadlines on blocking stream reads. A
+//! blocked gRPC read can only be interrupted from another thread, so a
+//! single watchdog thread keeps the deadlines of every armed read and
+//! runs the expiry function (usually a cancellation) of any read whose
+//! deadline passes first.
+class LunaStreamWatchdog
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    //! Start the watchdog thread.
+    LunaStreamWatchdog();
+
+    //! Stop the watchdog thread. Deadlines that are still armed are
+    //! dropped without running their expiry functions.
+    ~LunaStreamWatchdog();
+
+    //! Run onExpired from the watchdog thread at the given deadline,
+    //! unless disarm() is called first. Returns the ID to pass to
+    //! disarm().
+    uint64_t arm(Clock::time_point deadline,
+                 const std::function<void()> &onExpired);
+
+    //! Disarm the deadline with the given ID. Returns false if it has
+    //! already expired.
+    bool disarm(uint64_t id);
+
+private:
+    using Key = std::pair<Clock::time_point, uint64_t>;
+
+    std::mutex mMutex;
+    std::condition_variable mCV;
+
+    // Armed deadlines in the order they expire, and the deadline of each
+    // armed ID so that it can be found again.
+    std::map<Key, std::function<void()>> mDeadlines;
+    std::map<uint64_t, Clock::time_point> mArmed;
+    uint64_t mNextId;
+    bool mStopping;
+    std::thread mThread;
+
+    // Disable copy construction and assignments.
+    LunaStreamWatchdog(const LunaStreamWatchdog &other);
+    LunaStreamWatchdog &operator=(const LunaStreamWatchdog &other);
+
+    void run();
+};
+
+#endif // LUNA_STREAM_WATCHDOG_H
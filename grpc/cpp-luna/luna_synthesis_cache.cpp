@@ -0,0 +1,277 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_synthesis_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+// Every file in the on-disk tier starts with this header, followed by the
+// key and then the audio. The key is stored so that hash collisions in the
+// file name can be detected.
+const char kDiskMagic[8] = {'L', 'U', 'N', 'A', 'C', '0', '0', '1'};
+
+struct DiskHeader
+{
+    char magic[8];
+    uint64_t keySize;
+    uint64_t audioSize;
+};
+
+// 64-bit FNV-1a, used to derive file names from cache keys.
+uint64_t hashKey(const std::string &key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0)
+        {
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+} // namespace
+
+LunaSynthesisCache::LunaSynthesisCache(size_t memoryBudget,
+                                       const std::string &diskDirectory)
+    : mMemoryBudget(memoryBudget), mDiskDirectory(diskDirectory),
+      mMemoryBytes(0), mTmpCounter(0)
+{
+}
+
+LunaSynthesisCache::~LunaSynthesisCache() {}
+
+std::string
+LunaSynthesisCache::makeKey(const cobaltspeech::luna::SynthesizerConfig &config,
+                            const std::string &text)
+{
+    // The voice id is length-prefixed so that no combination of voice id
+    // and text can produce the same key as another.
+    std::ostringstream key;
+    key << config.voice_id().size() << ':' << config.voice_id() << ':'
+        << static_cast<int>(config.encoding()) << ':' << config.n_samples()
+        << ':' << text;
+    return key.str();
+}
+
+std::shared_ptr<const std::string>
+LunaSynthesisCache::lookup(const std::string &key)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mIndex.find(key);
+        if (it != mIndex.end())
+        {
+            // Move the entry to the front of the LRU list
+            mEntries.splice(mEntries.begin(), mEntries, it->second);
+            mStats.hits++;
+            return it->second->second;
+        }
+    }
+
+    // Check the disk without holding the lock; it may be slow.
+    std::shared_ptr<const std::string> audio;
+    if (!mDiskDirectory.empty())
+    {
+        audio = this->readDisk(key);
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!audio)
+    {
+        mStats.misses++;
+        return audio;
+    }
+
+    mStats.diskHits++;
+    this->insertMemory(key, audio);
+    return audio;
+}
+
+void LunaSynthesisCache::insert(const std::string &key,
+                                const std::shared_ptr<const std::string> &audio)
+{
+    unsigned int tmpID = 0;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStats.insertions++;
+        this->insertMemory(key, audio);
+        tmpID = mTmpCounter++;
+    }
+
+    if (!mDiskDirectory.empty())
+    {
+        this->writeDisk(key, *audio, tmpID);
+    }
+}
+
+void LunaSynthesisCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.clear();
+    mIndex.clear();
+    mMemoryBytes = 0;
+}
+
+LunaCacheStats LunaSynthesisCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    LunaCacheStats stats = mStats;
+    stats.memoryEntries = mEntries.size();
+    stats.memoryBytes = mMemoryBytes;
+    return stats;
+}
+
+LunaSynthesisCache::LunaSynthesisCache(const LunaSynthesisCache &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy cache objects.
+}
+
+LunaSynthesisCache &LunaSynthesisCache::operator=(const LunaSynthesisCache &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy cache objects.
+    return *this;
+}
+
+void LunaSynthesisCache::insertMemory(
+    const std::string &key, const std::shared_ptr<const std::string> &audio)
+{
+    // Entries that could never fit are not worth evicting everything else
+    size_t cost = key.size() + audio->size();
+    if (cost > mMemoryBudget)
+    {
+        return;
+    }
+
+    auto it = mIndex.find(key);
+    if (it != mIndex.end())
+    {
+        mMemoryBytes -= it->first.size() + it->second->second->size();
+        mEntries.erase(it->second);
+        mIndex.erase(it);
+    }
+
+    mEntries.push_front(Entry(key, audio));
+    mIndex[key] = mEntries.begin();
+    mMemoryBytes += cost;
+    this->evict();
+}
+
+void LunaSynthesisCache::evict()
+{
+    while (mMemoryBytes > mMemoryBudget && !mEntries.empty())
+    {
+        const Entry &oldest = mEntries.back();
+        mMemoryBytes -= oldest.first.size() + oldest.second->size();
+        mIndex.erase(oldest.first);
+        mEntries.pop_back();
+        mStats.evictions++;
+    }
+}
+
+std::string LunaSynthesisCache::diskPath(const std::string &key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.luna",
+             static_cast<unsigned long long>(hashKey(key)));
+    return mDiskDirectory + "/" + name;
+}
+
+std::shared_ptr<const std::string>
+LunaSynthesisCache::readDisk(const std::string &key)
+{
+    std::shared_ptr<const std::string> result;
+    int fd = ::open(this->diskPath(key).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return result;
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0 ||
+        static_cast<size_t>(info.st_size) < sizeof(DiskHeader))
+    {
+        ::close(fd);
+        return result;
+    }
+
+    size_t fileSize = static_cast<size_t>(info.st_size);
+    void *mapped = ::mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        return result;
+    }
+
+    // Validate the header and the stored key before trusting the audio
+    const char *data = static_cast<const char *>(mapped);
+    DiskHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, kDiskMagic, sizeof(kDiskMagic)) == 0 &&
+        header.keySize == key.size() &&
+        sizeof(header) + header.keySize + header.audioSize == fileSize &&
+        key.compare(0, key.size(), data + sizeof(header), key.size()) == 0)
+    {
+        result.reset(new std::string(data + sizeof(header) + key.size(),
+                                     header.audioSize));
+    }
+
+    ::munmap(mapped, fileSize);
+    return result;
+}
+
+void LunaSynthesisCache::writeDisk(const std::string &key,
+                                   const std::string &audio,
+                                   unsigned int tmpID)
+{
+    // Write to a temporary file and rename it into place so that readers
+    // (including other processes) never see a partial entry.
+    std::string path = this->diskPath(key);
+    std::ostringstream tmpPath;
+    tmpPath << path << ".tmp." << ::getpid() << "." << tmpID;
+
+    int fd = ::open(tmpPath.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    DiskHeader header;
+    memcpy(header.magic, kDiskMagic, sizeof(kDiskMagic));
+    header.keySize = key.size();
+    header.audioSize = audio.size();
+
+    bool ok = writeAll(fd, reinterpret_cast<const char *>(&header),
+                       sizeof(header)) &&
+              writeAll(fd, key.data(), key.size()) &&
+              writeAll(fd, audio.data(), audio.size());
+    ok = (::close(fd) == 0) && ok;
+
+    // The disk tier is best-effort; failures only cost a future miss.
+    if (!ok || ::rename(tmpPath.str().c_str(), path.c_str()) != 0)
+    {
+        ::unlink(tmpPath.str().c_str());
+    }
+}
@@ -0,0 +1,107 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_SYNTHESIS_CACHE_H
+#define LUNA_SYNTHESIS_CACHE_H
+
+#include "luna.pb.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+//! LunaCacheStats is a snapshot of the counters kept by a
+//! LunaSynthesisCache.
+struct LunaCacheStats
+{
+    //! Lookups served from memory.
+    uint64_t hits = 0;
+
+    //! Lookups served from the on-disk tier.
+    uint64_t diskHits = 0;
+
+    //! Lookups that found nothing.
+    uint64_t misses = 0;
+
+    //! Entries added to the cache.
+    uint64_t insertions = 0;
+
+    //! Entries removed from memory to stay within the memory budget.
+    uint64_t evictions = 0;
+
+    //! Number of entries and bytes currently held in memory.
+    uint64_t memoryEntries = 0;
+    uint64_t memoryBytes = 0;
+};
+
+//! LunaSynthesisCache stores synthesized audio so that repeated requests
+//! for the same text can be served without contacting the server.
+//! Entries are keyed on the voice, encoding, chunk size and text of the
+//! request. The in-memory tier is limited to a byte budget and evicts the
+//! least recently used entries first. If a directory is given, every entry
+//! is also written to disk, where it survives restarts; disk entries are
+//! memory-mapped when read and promoted back into memory. The cache is
+//! thread-safe and may be shared by several clients.
+class LunaSynthesisCache
+{
+public:
+    //! Create a new cache that keeps at most memoryBudget bytes of audio
+    //! in memory. If diskDirectory is not empty, it must be an existing
+    //! directory, which will hold the on-disk tier. The size of the
+    //! on-disk tier is not limited by the cache.
+    LunaSynthesisCache(size_t memoryBudget,
+                       const std::string &diskDirectory = "");
+    ~LunaSynthesisCache();
+
+    //! Build the cache key for the given synthesis request.
+    static std::string
+    makeKey(const cobaltspeech::luna::SynthesizerConfig &config,
+            const std::string &text);
+
+    //! Returns the audio stored for the given key, or nullptr if there
+    //! is none.
+    std::shared_ptr<const std::string> lookup(const std::string &key);
+
+    //! Add audio to the cache under the given key.
+    void insert(const std::string &key,
+                const std::shared_ptr<const std::string> &audio);
+
+    //! Remove all entries from the in-memory tier.
+    void clear();
+
+    //! Returns the current cache counters.
+    LunaCacheStats stats() const;
+
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const std::string>>;
+    using EntryList = std::list<Entry>;
+
+    size_t mMemoryBudget;
+    std::string mDiskDirectory;
+
+    // Entries are kept in most to least recently used order.
+    mutable std::mutex mMutex;
+    EntryList mEntries;
+    std::unordered_map<std::string, EntryList::iterator> mIndex;
+    size_t mMemoryBytes;
+    unsigned int mTmpCounter;
+    LunaCacheStats mStats;
+
+    // Disable copy construction and assignments.
+    LunaSynthesisCache(const LunaSynthesisCache &other);
+    LunaSynthesisCache &operator=(const LunaSynthesisCache &other);
+
+    // These functions expect the mutex to be held.
+    void insertMemory(const std::string &key,
+                      const std::shared_ptr<const std::string> &audio);
+    void evict();
+
+    std::string diskPath(const std::string &key) const;
+    std::shared_ptr<const std::string> readDisk(const std::string &key);
+    void writeDisk(const std::string &key, const std::string &audio,
+                   unsigned int tmpID);
+};
+
+#endif // LUNA_SYNTHESIS_CACHE_H
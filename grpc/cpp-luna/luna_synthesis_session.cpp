@@ -0,0 +1,70 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_synthesis_session.h"
+
+LunaSynthesisSession::LunaSynthesisSession(
+    const LunaOrderedReader::Launcher &launcher, unsigned int maxParallel,
+    size_t minChars, size_t maxChars)
+    : mSegmenter(minChars, maxChars), mFinished(false),
+      mReader(new LunaOrderedReader(launcher, maxParallel)),
+      mStream(mReader, nullptr)
+{
+    std::shared_ptr<LunaOrderedReader> reader = mReader;
+    mStream.setCanceller([reader]() { reader->cancel(); });
+}
+
+LunaSynthesisSession::~LunaSynthesisSession() { mStream.cancel(); }
+
+void LunaSynthesisSession::appendText(const std::string &text)
+{
+    // Segments are added under the lock so that they reach the reader in
+    // the order the text was appended.
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFinished || mStream.cancelled())
+    {
+        return;
+    }
+
+    mSegmenter.append(text);
+    std::string segment;
+    while (mSegmenter.next(segment))
+    {
+        mReader->addSegment(segment);
+    }
+}
+
+void LunaSynthesisSession::finish()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFinished)
+    {
+        return;
+    }
+    mFinished = true;
+
+    std::string segment;
+    while (mSegmenter.flush(segment))
+    {
+        mReader->addSegment(segment);
+    }
+    mReader->finishSegments();
+}
+
+void LunaSynthesisSession::cancel() { mStream.cancel(); }
+
+LunaSynthesizerStream &LunaSynthesisSession::stream() { return mStream; }
+
+LunaSynthesisSession::LunaSynthesisSession(const LunaSynthesisSession &)
+    : mStream(nullptr, nullptr)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy session objects.
+}
+
+LunaSynthesisSession &
+LunaSynthesisSession::operator=(const LunaSynthesisSession &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy session objects.
+    return *this;
+}
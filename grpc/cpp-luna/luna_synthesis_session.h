@@ -0,0 +1,68 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_SYNTHESIS_SESSION_H
+#define LUNA_SYNTHESIS_SESSION_H
+
+#include "luna_ordered_reader.h"
+#include "luna_synthesizer_stream.h"
+#include "luna_text_segmenter.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+//! LunaSynthesisSession synthesizes text that arrives a piece at a time,
+//! such as the tokens of a language model's reply. The text is cut into
+//! speakable segments by a LunaTextSegmenter as it arrives, and each
+//! segment is synthesized as soon as it is complete, so the next segment
+//! is already synthesizing while the audio for the current one is read.
+//! The audio for all the segments is read back as one continuous stream.
+//!
+//! Text is usually appended from one thread while the audio is read
+//! from another. Sessions are created by LunaClient::startSession() or
+//! LunaClientPool::startSession().
+class LunaSynthesisSession
+{
+public:
+    //! Create a session that starts each segment with the given launcher,
+    //! with at most maxParallel segments synthesizing or holding unread
+    //! audio at once. Segments are cut as described for
+    //! LunaTextSegmenter.
+    LunaSynthesisSession(const LunaOrderedReader::Launcher &launcher,
+                         unsigned int maxParallel, size_t minChars = 16,
+                         size_t maxChars = 250);
+
+    //! Cancels the session if it is still running.
+    ~LunaSynthesisSession();
+
+    //! Add text to the end of the session. Any segments it completes are
+    //! started right away. Text appended after finish() or cancel() is
+    //! ignored.
+    void appendText(const std::string &text);
+
+    //! Signal that no more text will be added. The remaining text is
+    //! synthesized, and the stream ends once its audio has been read.
+    void finish();
+
+    //! Stop the session. The running requests are cancelled and the
+    //! stream ends. Safe to call from any thread.
+    void cancel();
+
+    //! The stream of audio for the session. Read it with receiveAudio(),
+    //! then close() it to check whether synthesis succeeded.
+    LunaSynthesizerStream &stream();
+
+private:
+    std::mutex mMutex;
+    LunaTextSegmenter mSegmenter;
+    bool mFinished;
+
+    std::shared_ptr<LunaOrderedReader> mReader;
+    LunaSynthesizerStream mStream;
+
+    // Disable copy construction and assignments.
+    LunaSynthesisSession(const LunaSynthesisSession &other);
+    LunaSynthesisSession &operator=(const LunaSynthesisSession &other);
+};
+
+#endif // LUNA_SYNTHESIS_SESSION_H
@@ -5,33 +5,164 @@
 #include "luna_exception.h"
 
 LunaSynthesizerStream::LunaSynthesizerStream(
-    const LunaReader &reader, const std::shared_ptr<grpc::ClientContext> &ctx)
-    : mReader(reader), mCtx(ctx)
+    const LunaReader &reader, const std::shared_ptr<grpc::ClientContext> &ctx,
+    const std::shared_ptr<LunaRequestTracker> &tracker)
+    : mReader(reader), mCtx(ctx), mTracker(tracker),
+      mResponse(new cobaltspeech::luna::SynthesizeResponse),
+      mControl(new Control), mFirstChunkTimeout(0), mIdleTimeout(0)
 {
+    if (ctx)
+    {
+        mControl->canceller = [ctx]() { ctx->TryCancel(); };
+    }
 }
 
 LunaSynthesizerStream::~LunaSynthesizerStream() {}
 
 bool LunaSynthesizerStream::receiveAudio(ByteVector &audio)
 {
-    cobaltspeech::luna::SynthesizeResponse response;
-    bool streamOpen = mReader->Read(&response);
+    LunaTraceSpan span(mTracer.get(), "receiveAudio", mTraceId);
+    bool streamOpen = this->readNext();
     if (!streamOpen)
     {
         audio.clear();
         return false;
     }
 
-    audio.assign(response.audio().begin(), response.audio().end());
+    const std::string &samples = mResponse->audio();
+    audio.assign(samples.begin(), samples.end());
+    if (mTracker)
+    {
+        mTracker->addBytes(audio.size());
+    }
+    span.setBytes(audio.size());
+
+    return true;
+}
+
+bool LunaSynthesizerStream::receiveAudio(std::string &audio)
+{
+    LunaTraceSpan span(mTracer.get(), "receiveAudio", mTraceId);
+    bool streamOpen = this->readNext();
+    if (!streamOpen)
+    {
+        audio.clear();
+        return false;
+    }
+
+    mResponse->mutable_audio()->swap(audio);
+    if (mTracker)
+    {
+        mTracker->addBytes(audio.size());
+    }
+    span.setBytes(audio.size());
 
     return true;
 }
 
 void LunaSynthesizerStream::close()
 {
+    LunaTraceSpan span(mTracer.get(), "close", mTraceId);
     grpc::Status status = mReader->Finish();
-    if (!status.ok())
+    if (mControl->timedOut)
+    {
+        status = grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                              "timed out waiting for audio from the server");
+    }
+
+    span.setStatus(status.error_code());
+    if (mTracker)
+    {
+        mTracker->finish(status.ok());
+    }
+
+    // The caller asked for the stream to stop, so that is not an error
+    if (!status.ok() && !(mControl->cancelled && !mControl->timedOut))
     {
         throw LunaException(status);
     }
 }
+
+void LunaSynthesizerStream::setTracer(const std::shared_ptr<LunaTracer> &tracer,
+                                      const std::string &traceId)
+{
+    mTracer = tracer;
+    mTraceId = traceId;
+}
+
+void LunaSynthesizerStream::cancel()
+{
+    if (!mControl->cancelled.exchange(true) && mControl->canceller)
+    {
+        mControl->canceller();
+    }
+}
+
+bool LunaSynthesizerStream::cancelled() const { return mControl->cancelled; }
+
+void LunaSynthesizerStream::setCanceller(
+    const std::function<void()> &canceller)
+{
+    mControl->canceller = canceller;
+}
+
+void LunaSynthesizerStream::setTimeouts(
+    const std::shared_ptr<LunaStreamWatchdog> &watchdog,
+    std::chrono::milliseconds firstChunk, std::chrono::milliseconds idle)
+{
+    mWatchdog = watchdog;
+    mFirstChunkTimeout = firstChunk;
+    mIdleTimeout = idle;
+}
+
+bool LunaSynthesizerStream::readNext()
+{
+    if (mControl->cancelled)
+    {
+        return false;
+    }
+
+    std::chrono::milliseconds timeout =
+        mControl->receivedAudio ? mIdleTimeout : mFirstChunkTimeout;
+    uint64_t alarm = 0;
+    std::shared_ptr<std::atomic<bool>> settled;
+    if (mWatchdog && timeout.count() > 0)
+    {
+        // Whichever of the read and the alarm settles this first decides
+        // whether the read timed out
+        std::shared_ptr<Control> control = mControl;
+        settled = std::make_shared<std::atomic<bool>>(false);
+        alarm = mWatchdog->arm(
+            LunaStreamWatchdog::Clock::now() + timeout, [control, settled]() {
+                if (settled->exchange(true))
+                {
+                    return;
+                }
+
+                // A cancellation the caller already started is not a
+                // timeout
+                if (!control->cancelled.exchange(true))
+                {
+                    control->timedOut = true;
+                    if (control->canceller)
+                    {
+                        control->canceller();
+                    }
+                }
+            });
+    }
+
+    bool streamOpen = mReader->Read(mResponse.get());
+    if (alarm != 0 && !mWatchdog->disarm(alarm))
+    {
+        // The alarm went off as the read returned. If it has not timed
+        // the read out yet, this stops it from doing so.
+        settled->exchange(true);
+    }
+
+    if (streamOpen)
+    {
+        mControl->receivedAudio = true;
+    }
+    return streamOpen;
+}
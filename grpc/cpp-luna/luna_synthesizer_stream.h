@@ -4,8 +4,15 @@
 #define LUNA_SYNTHESIZER_STREAM_H
 
 #include "luna.grpc.pb.h"
+#include "luna_channel_stats.h"
+#include "luna_stream_watchdog.h"
+#include "luna_tracer.h"
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <string>
 
 using ByteVector = std::vector<char>;
 
@@ -22,9 +29,12 @@ public:
 
     //! Create a new synthesizer stream. Most users of this class should
     //! not need to call this constructor. Instead, they should use
-    //! LunaClient::synthesizeStream().
-    LunaSynthesizerStream(const LunaReader &reader,
-                          const std::shared_ptr<grpc::ClientContext> &ctx);
+    //! LunaClient::synthesizeStream(). If a tracker is given, the
+    //! stream reports received bytes and its final status to it.
+    LunaSynthesizerStream(
+        const LunaReader &reader,
+        const std::shared_ptr<grpc::ClientContext> &ctx,
+        const std::shared_ptr<LunaRequestTracker> &tracker = nullptr);
 
     ~LunaSynthesizerStream();
 
@@ -33,13 +43,88 @@ public:
     //! samples to receive.
     bool receiveAudio(ByteVector &audio);
 
+    //! Receive audio samples without copying them. The samples are
+    //! swapped out of the received message into the given string, and
+    //! the string's previous buffer is reused for the next message. When
+    //! the same string is passed to every call, receiving audio needs no
+    //! copies and, once the buffers have grown, no allocations.
+    //! Returns false when synthesis is complete.
+    bool receiveAudio(std::string &audio);
+
     //! Close the synthesis stream. This should be done after all the
-    //! samples have been received (i.e., recieveAudio() returned false).
+    //! samples have been received (i.e., recieveAudio() returned false),
+    //! or after the stream was cancelled. Throws a LunaException if
+    //! synthesis failed or timed out, but not if the stream was
+    //! cancelled with cancel().
     void close();
 
+    //! Stop the stream, e.g. because the listener hung up or barged in.
+    //! The request is cancelled so the server stops synthesizing, and
+    //! receiveAudio() returns false from then on, including a call
+    //! that is blocked in another thread. This may be called from any
+    //! thread, at any time, and more than once.
+    void cancel();
+
+    //! Returns true if the stream has been cancelled, either with
+    //! cancel() or because it timed out.
+    bool cancelled() const;
+
+    //! Set the function cancel() uses to stop the underlying request.
+    //! Streams created with a context cancel the context; streams built
+    //! on other readers may set their own. Must be set before the stream
+    //! is shared with other threads.
+    void setCanceller(const std::function<void()> &canceller);
+
+    //! Cancel the stream if the first chunk of audio has not arrived
+    //! within firstChunk, or if a later chunk has not arrived within idle
+    //! of the previous one. This lets long utterances run without a large
+    //! overall deadline while still cutting off a stalled stream quickly.
+    //! A zero timeout is not enforced. The deadlines are kept by the
+    //! given watchdog. A stream that timed out fails with
+    //! DEADLINE_EXCEEDED when it is closed.
+    void setTimeouts(const std::shared_ptr<LunaStreamWatchdog> &watchdog,
+                     std::chrono::milliseconds firstChunk,
+                     std::chrono::milliseconds idle);
+
+    //! Record a span for each call to receiveAudio() and close() to the
+    //! given tracer, tagged with the given trace ID.
+    void setTracer(const std::shared_ptr<LunaTracer> &tracer,
+                   const std::string &traceId);
+
 private:
+    // Cancellation state, shared by copies of the stream and with the
+    // watchdog.
+    struct Control
+    {
+        std::atomic<bool> cancelled;
+        std::atomic<bool> timedOut;
+        std::atomic<bool> receivedAudio;
+        std::function<void()> canceller;
+
+        Control() : cancelled(false), timedOut(false), receivedAudio(false)
+        {
+        }
+    };
+
     LunaReader mReader;
     std::shared_ptr<grpc::ClientContext> mCtx;
+    std::shared_ptr<LunaRequestTracker> mTracker;
+
+    // The response message is reused across reads so its buffer can be
+    // recycled. It is shared so that copies of the stream stay cheap.
+    std::shared_ptr<cobaltspeech::luna::SynthesizeResponse> mResponse;
+
+    std::shared_ptr<LunaTracer> mTracer;
+    std::string mTraceId;
+
+    std::shared_ptr<Control> mControl;
+    std::shared_ptr<LunaStreamWatchdog> mWatchdog;
+    std::chrono::milliseconds mFirstChunkTimeout;
+    std::chrono::milliseconds mIdleTimeout;
+
+    // Read the next message into mResponse, under the watchdog if
+    // timeouts are set.
+    bool readNext();
 };
 
 #endif // LUNA_SYNTHESIZER_STREAM_H
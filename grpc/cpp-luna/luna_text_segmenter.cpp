@@ -0,0 +1,194 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_text_segmenter.h"
+
+#include <cctype>
+
+namespace
+{
+bool isSpace(char c) { return std::isspace(static_cast<unsigned char>(c)); }
+
+bool isSentenceEnd(char c) { return c == '.' || c == '!' || c == '?'; }
+
+bool isClauseEnd(char c) { return c == ',' || c == ';' || c == ':'; }
+
+// Characters that may follow the end of a sentence and still belong
+// to it, such as closing quotes and brackets.
+bool isCloser(char c) { return c == '"' || c == '\'' || c == ')' || c == ']'; }
+} // namespace
+
+LunaTextSegmenter::LunaTextSegmenter(size_t minChars, size_t maxChars)
+    : mMinChars(minChars), mMaxChars(maxChars < 1 ? 1 : maxChars)
+{
+}
+
+LunaTextSegmenter::~LunaTextSegmenter() {}
+
+std::vector<std::string> LunaTextSegmenter::split(const std::string &text,
+                                                  size_t minChars,
+                                                  size_t maxChars)
+{
+    LunaTextSegmenter segmenter(minChars, maxChars);
+    segmenter.append(text);
+
+    std::vector<std::string> segments;
+    std::string segment;
+    while (segmenter.flush(segment))
+    {
+        segments.push_back(segment);
+    }
+
+    return segments;
+}
+
+void LunaTextSegmenter::append(const std::string &text) { mText += text; }
+
+bool LunaTextSegmenter::next(std::string &segment)
+{
+    while (true)
+    {
+        size_t cut = this->findCut(false);
+        if (cut == 0)
+        {
+            return false;
+        }
+
+        // Segments that are only whitespace are dropped
+        if (this->take(cut, segment))
+        {
+            return true;
+        }
+    }
+}
+
+bool LunaTextSegmenter::flush(std::string &segment)
+{
+    while (!mText.empty())
+    {
+        size_t cut = this->findCut(true);
+        if (cut == 0)
+        {
+            cut = mText.size();
+        }
+
+        if (this->take(cut, segment))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t LunaTextSegmenter::pending() const { return mText.size(); }
+
+size_t LunaTextSegmenter::findCut(bool final) const
+{
+    size_t limit = mText.size() < mMaxChars ? mText.size() : mMaxChars;
+    for (size_t i = 0; i < limit; i++)
+    {
+        char c = mText[i];
+        size_t end = 0;
+        if (c == '\n')
+        {
+            end = i + 1;
+        }
+        else if (isSentenceEnd(c))
+        {
+            // Include trailing punctuation and closing quotes/brackets
+            end = i + 1;
+            while (end < mText.size() &&
+                   (isSentenceEnd(mText[end]) || isCloser(mText[end])))
+            {
+                end++;
+            }
+
+            // The sentence only ends if whitespace follows; otherwise it
+            // could be a number ("3.14") or we haven't seen enough text.
+            if (end == mText.size())
+            {
+                if (!final)
+                {
+                    return 0;
+                }
+            }
+            else if (!isSpace(mText[end]))
+            {
+                i = end - 1;
+                continue;
+            }
+        }
+
+        if (end == 0)
+        {
+            continue;
+        }
+
+        if (end >= mMinChars || end == mText.size())
+        {
+            return end;
+        }
+
+        // Too short to stand alone; keep looking for the next boundary
+        i = end - 1;
+    }
+
+    // No boundary within the limit. If we have a full segment's worth of
+    // text (or no more is coming), split it at the best place we can.
+    if (mText.size() >= mMaxChars)
+    {
+        return this->findSplit();
+    }
+
+    return final ? mText.size() : 0;
+}
+
+size_t LunaTextSegmenter::findSplit() const
+{
+    // Prefer a clause boundary, then any whitespace, in the back half of
+    // the allowed length.
+    size_t half = mMaxChars / 2;
+    for (size_t i = mMaxChars; i > half; i--)
+    {
+        if (isClauseEnd(mText[i - 1]) && isSpace(mText[i]))
+        {
+            return i;
+        }
+    }
+
+    for (size_t i = mMaxChars; i > half; i--)
+    {
+        if (isSpace(mText[i - 1]))
+        {
+            return i;
+        }
+    }
+
+    // No good place to split. Cut at the limit, backing up so that we
+    // don't cut in the middle of a UTF-8 sequence.
+    size_t cut = mMaxChars;
+    while (cut > 1 && (static_cast<unsigned char>(mText[cut]) & 0xC0) == 0x80)
+    {
+        cut--;
+    }
+
+    return cut;
+}
+
+bool LunaTextSegmenter::take(size_t cut, std::string &segment)
+{
+    size_t begin = 0;
+    size_t end = cut;
+    while (begin < end && isSpace(mText[begin]))
+    {
+        begin++;
+    }
+    while (end > begin && isSpace(mText[end - 1]))
+    {
+        end--;
+    }
+
+    segment.assign(mText, begin, end - begin);
+    mText.erase(0, cut);
+    return !segment.empty();
+}
@@ -0,0 +1,54 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_TEXT_SEGMENTER_H
+#define LUNA_TEXT_SEGMENTER_H
+
+#include <string>
+#include <vector>
+
+//! LunaTextSegmenter splits text into segments that can be synthesized
+//! independently. Segments end at sentence boundaries where possible.
+//! Sentences shorter than the minimum length are joined with the
+//! following one (which also keeps abbreviations like "Dr." from being
+//! split off), and sentences longer than the maximum length are split at
+//! clause boundaries or, failing that, between words.
+//!
+//! Text may be appended in pieces; complete segments become available
+//! as soon as the text following them shows where they end.
+class LunaTextSegmenter
+{
+public:
+    LunaTextSegmenter(size_t minChars = 16, size_t maxChars = 250);
+    ~LunaTextSegmenter();
+
+    //! Split a complete text into segments.
+    static std::vector<std::string> split(const std::string &text,
+                                          size_t minChars = 16,
+                                          size_t maxChars = 250);
+
+    //! Add more text to the end of the pending text.
+    void append(const std::string &text);
+
+    //! Get the next complete segment. Returns false if the pending text
+    //! does not yet contain a complete segment.
+    bool next(std::string &segment);
+
+    //! Get the next segment, treating the end of the pending text as the
+    //! end of the input. Returns false once all text has been returned.
+    bool flush(std::string &segment);
+
+    //! Returns the number of bytes of text waiting to be segmented.
+    size_t pending() const;
+
+private:
+    std::string mText;
+    size_t mMinChars;
+    size_t mMaxChars;
+
+    // Find the end of the next segment. Returns 0 if there is none yet.
+    size_t findCut(bool final) const;
+    size_t findSplit() const;
+    bool take(size_t cut, std::string &segment);
+};
+
+#endif // LUNA_TEXT_SEGMENTER_H
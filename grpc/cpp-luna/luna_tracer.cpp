@@ -0,0 +1,285 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_tracer.h"
+
+#include "luna_exception.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+
+namespace
+{
+
+// The trace ID of the innermost LunaTraceScope on this thread.
+thread_local std::string currentTraceId;
+
+// Returns a small, stable number for the calling thread. Trace viewers
+// group spans into rows by this number.
+uint32_t threadNumber()
+{
+    static std::atomic<uint32_t> next(1);
+    thread_local uint32_t number = next++;
+    return number;
+}
+
+void writeJSONString(std::ostream &out, const std::string &s)
+{
+    out << '"';
+    for (char c : s)
+    {
+        switch (c)
+        {
+        case '"':
+            out << "\\\"";
+            break;
+        case '\\':
+            out << "\\\\";
+            break;
+        case '\n':
+            out << "\\n";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out << buf;
+            }
+            else
+            {
+                out << c;
+            }
+        }
+    }
+    out << '"';
+}
+
+} // namespace
+
+const char *const LunaTraceScope::kMetadataKey = "luna-trace-id";
+
+LunaTraceScope::LunaTraceScope(const std::string &traceId)
+    : mPrevious(currentTraceId)
+{
+    currentTraceId = traceId;
+}
+
+LunaTraceScope::~LunaTraceScope() { currentTraceId.swap(mPrevious); }
+
+const std::string &LunaTraceScope::current() { return currentTraceId; }
+
+void LunaTraceScope::addMetadata(grpc::ClientContext &ctx)
+{
+    if (!currentTraceId.empty())
+    {
+        ctx.AddMetadata(kMetadataKey, currentTraceId);
+    }
+}
+
+LunaTraceScope::LunaTraceScope(const LunaTraceScope &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy scope objects.
+}
+
+LunaTraceScope &LunaTraceScope::operator=(const LunaTraceScope &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy scope objects.
+    return *this;
+}
+
+LunaTracer::LunaTracer(const std::string &path, size_t maxBufferedEvents)
+    : mStart(std::chrono::steady_clock::now()), mFile(path),
+      mMaxBuffered(std::max<size_t>(maxBufferedEvents, 1)), mFirstEvent(true),
+      mPid(getpid()), mRecorded(0), mWritten(0), mFlushRequested(false),
+      mStopping(false), mDropped(0)
+{
+    if (!mFile)
+    {
+        throw LunaException("could not open trace file " + path);
+    }
+
+    mFile << "[";
+    mBuffer.reserve(mMaxBuffered);
+    mThread = std::thread(&LunaTracer::run, this);
+}
+
+LunaTracer::~LunaTracer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCV.notify_all();
+    mThread.join();
+
+    mFile << "\n]\n";
+}
+
+uint64_t LunaTracer::now() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - mStart)
+        .count();
+}
+
+void LunaTracer::record(LunaTraceEvent &&event)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mBuffer.size() >= mMaxBuffered)
+    {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    mBuffer.push_back(std::move(event));
+    mRecorded++;
+
+    // Wake the writer once the buffer is half full. Otherwise it picks
+    // the spans up on its next periodic pass.
+    if (mBuffer.size() == mMaxBuffered / 2 + 1)
+    {
+        lock.unlock();
+        mCV.notify_one();
+    }
+}
+
+uint64_t LunaTracer::dropped() const
+{
+    return mDropped.load(std::memory_order_relaxed);
+}
+
+void LunaTracer::flush()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    uint64_t target = mRecorded;
+    mFlushRequested = true;
+    mCV.notify_one();
+    mFlushedCV.wait(lock, [this, target]() { return mWritten >= target; });
+}
+
+void LunaTracer::run()
+{
+    std::vector<LunaTraceEvent> pending;
+    pending.reserve(mMaxBuffered);
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true)
+    {
+        mCV.wait_for(lock, std::chrono::milliseconds(200), [this]() {
+            return mStopping || mFlushRequested ||
+                   mBuffer.size() > mMaxBuffered / 2;
+        });
+
+        // Swap the buffers so that callers can keep recording while
+        // this batch is formatted and written.
+        pending.swap(mBuffer);
+        mFlushRequested = false;
+        bool stopping = mStopping;
+        lock.unlock();
+
+        this->write(pending);
+        size_t written = pending.size();
+        pending.clear();
+
+        lock.lock();
+        mWritten += written;
+        mFlushedCV.notify_all();
+        if (stopping && mBuffer.empty())
+        {
+            break;
+        }
+    }
+}
+
+void LunaTracer::write(const std::vector<LunaTraceEvent> &events)
+{
+    for (const LunaTraceEvent &e : events)
+    {
+        mFile << (mFirstEvent ? "\n" : ",\n");
+        mFirstEvent = false;
+
+        mFile << "{\"name\":\"" << e.name
+              << "\",\"cat\":\"luna\",\"ph\":\"X\",\"ts\":" << e.startMicros
+              << ",\"dur\":" << e.durationMicros << ",\"pid\":" << mPid
+              << ",\"tid\":" << e.thread << ",\"args\":{\"trace_id\":";
+        writeJSONString(mFile, e.traceId);
+        if (e.bytes >= 0)
+        {
+            mFile << ",\"bytes\":" << e.bytes;
+        }
+        if (e.status >= 0)
+        {
+            mFile << ",\"status\":" << e.status;
+        }
+        if (!e.detail.empty())
+        {
+            mFile << ",\"detail\":";
+            writeJSONString(mFile, e.detail);
+        }
+        mFile << "}}";
+    }
+    mFile.flush();
+}
+
+LunaTracer::LunaTracer(const LunaTracer &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy tracer objects.
+}
+
+LunaTracer &LunaTracer::operator=(const LunaTracer &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy tracer objects.
+    return *this;
+}
+
+LunaTraceSpan::LunaTraceSpan(LunaTracer *tracer, const char *name,
+                             const std::string &traceId)
+    : mTracer(tracer)
+{
+    if (mTracer)
+    {
+        mEvent.name = name;
+        mEvent.traceId = traceId;
+        mEvent.startMicros = mTracer->now();
+        mEvent.thread = threadNumber();
+    }
+}
+
+LunaTraceSpan::~LunaTraceSpan()
+{
+    if (mTracer)
+    {
+        mEvent.durationMicros = mTracer->now() - mEvent.startMicros;
+        mTracer->record(std::move(mEvent));
+    }
+}
+
+void LunaTraceSpan::setBytes(int64_t bytes) { mEvent.bytes = bytes; }
+
+void LunaTraceSpan::setStatus(int status) { mEvent.status = status; }
+
+void LunaTraceSpan::setDetail(const std::string &detail)
+{
+    if (mTracer)
+    {
+        mEvent.detail = detail;
+    }
+}
+
+LunaTraceSpan::LunaTraceSpan(const LunaTraceSpan &)
+{
+    // Do nothing. This copy constructor is intentionally private
+    // and does nothing because we don't want to copy span objects.
+}
+
+LunaTraceSpan &LunaTraceSpan::operator=(const LunaTraceSpan &)
+{
+    // Do nothing. The assignment operator is intentionally private
+    // and does nothing because we don't want to copy span objects.
+    return *this;
+}
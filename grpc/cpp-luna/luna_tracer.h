@@ -0,0 +1,152 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_TRACER_H
+#define LUNA_TRACER_H
+
+#include <grpcpp/client_context.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//! LunaTraceScope sets the trace ID for requests made on the current
+//! thread while the scope exists. The ID is sent to the server as
+//! gRPC metadata (see kMetadataKey) and is attached to the spans the
+//! client records, so a single slow request can be followed through
+//! the client and the server. Scopes may be nested; the previous ID is
+//! restored when a scope ends.
+class LunaTraceScope
+{
+public:
+    //! The metadata key used to send the trace ID to the server.
+    static const char *const kMetadataKey;
+
+    explicit LunaTraceScope(const std::string &traceId);
+    ~LunaTraceScope();
+
+    //! Returns the trace ID for the current thread, or an empty string
+    //! if there is none.
+    static const std::string &current();
+
+    //! Add the current trace ID, if any, to the context's metadata.
+    static void addMetadata(grpc::ClientContext &ctx);
+
+private:
+    std::string mPrevious;
+
+    // Disable copy construction and assignments.
+    LunaTraceScope(const LunaTraceScope &other);
+    LunaTraceScope &operator=(const LunaTraceScope &other);
+};
+
+//! LunaTraceEvent is a single completed span.
+struct LunaTraceEvent
+{
+    //! The name of the span (a string literal).
+    const char *name = "";
+
+    //! The trace ID the span belongs to.
+    std::string traceId;
+
+    //! Start time and duration, in microseconds since the tracer
+    //! was created.
+    uint64_t startMicros = 0;
+    uint64_t durationMicros = 0;
+
+    //! A small integer identifying the thread that recorded the span.
+    uint32_t thread = 0;
+
+    //! Optional details. Negative numbers and empty strings are left
+    //! out of the trace.
+    int64_t bytes = -1;
+    int status = -1;
+    std::string detail;
+};
+
+//! LunaTracer writes spans to a file in the Chrome trace-event JSON
+//! format, which can be opened in chrome://tracing or Perfetto.
+//! Recording a span only appends it to an in-memory buffer; a
+//! background thread formats and writes the buffered spans. If the
+//! writer falls behind and the buffer fills up, new spans are dropped
+//! rather than blocking the caller.
+class LunaTracer
+{
+public:
+    //! Create a tracer that writes to the file at the given path,
+    //! buffering up to maxBufferedEvents spans.
+    LunaTracer(const std::string &path, size_t maxBufferedEvents = 8192);
+
+    //! Writes any buffered spans and completes the file.
+    ~LunaTracer();
+
+    //! Returns the current time on the tracer's clock, in microseconds.
+    uint64_t now() const;
+
+    //! Buffer a completed span for writing.
+    void record(LunaTraceEvent &&event);
+
+    //! Returns the number of spans dropped because the buffer was full.
+    uint64_t dropped() const;
+
+    //! Write all buffered spans to the file.
+    void flush();
+
+private:
+    std::chrono::steady_clock::time_point mStart;
+    std::ofstream mFile;
+    size_t mMaxBuffered;
+    bool mFirstEvent;
+    int mPid;
+
+    std::mutex mMutex;
+    std::condition_variable mCV;
+    std::condition_variable mFlushedCV;
+    std::vector<LunaTraceEvent> mBuffer;
+    uint64_t mRecorded;
+    uint64_t mWritten;
+    bool mFlushRequested;
+    bool mStopping;
+    std::atomic<uint64_t> mDropped;
+    std::thread mThread;
+
+    // Disable copy construction and assignments.
+    LunaTracer(const LunaTracer &other);
+    LunaTracer &operator=(const LunaTracer &other);
+
+    void run();
+    void write(const std::vector<LunaTraceEvent> &events);
+};
+
+//! LunaTraceSpan records a span covering its own lifetime. If it is
+//! created without a tracer it does nothing, so untraced requests pay
+//! only for a null check.
+class LunaTraceSpan
+{
+public:
+    LunaTraceSpan(LunaTracer *tracer, const char *name,
+                  const std::string &traceId);
+
+    //! Records the span.
+    ~LunaTraceSpan();
+
+    void setBytes(int64_t bytes);
+    void setStatus(int status);
+    void setDetail(const std::string &detail);
+
+private:
+    LunaTracer *mTracer;
+    LunaTraceEvent mEvent;
+
+    // Disable copy construction and assignments.
+    LunaTraceSpan(const LunaTraceSpan &other);
+    LunaTraceSpan &operator=(const LunaTraceSpan &other);
+};
+
+#endif // LUNA_TRACER_H
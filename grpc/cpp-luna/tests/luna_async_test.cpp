@@ -0,0 +1,136 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_client.h"
+#include "luna_mock_server.h"
+#include "luna_test.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+
+namespace
+{
+
+using std::chrono::milliseconds;
+
+// Streams the mock server produces in real time, long enough that they
+// are still running when they are cancelled.
+LunaMockConfig slowConfig()
+{
+    LunaMockConfig config;
+    config.speed = 1.0;
+    return config;
+}
+
+void testCancelStream()
+{
+    LunaMockServer server(slowConfig());
+    LunaClient client(server.address(), false);
+
+    std::promise<void> firstChunk;
+    std::atomic<bool> gotChunk(false);
+    std::promise<grpc::Status> finished;
+    LunaAsyncHandle handle = client.synthesizeStreamAsync(
+        lunaTestConfig(), std::string(1000, 'a'),
+        [&firstChunk, &gotChunk](std::string &) {
+            if (!gotChunk.exchange(true))
+            {
+                firstChunk.set_value();
+            }
+        },
+        [&finished](const grpc::Status &status) {
+            finished.set_value(status);
+        });
+
+    std::future<void> started = firstChunk.get_future();
+    LUNA_CHECK(started.wait_for(milliseconds(5000)) ==
+               std::future_status::ready);
+    handle.cancel();
+
+    std::future<grpc::Status> result = finished.get_future();
+    LUNA_CHECK(result.wait_for(milliseconds(2000)) ==
+               std::future_status::ready);
+    LUNA_CHECK(result.get().error_code() == grpc::StatusCode::CANCELLED);
+    LUNA_CHECK(lunaWaitFor(
+        [&server]() { return server.stats().cancellations == 1; },
+        milliseconds(2000)));
+}
+
+void testCancelBatch()
+{
+    LunaMockConfig config;
+    config.firstChunkDelayMs = 5000;
+    LunaMockServer server(config);
+    LunaClient client(server.address(), false);
+
+    std::promise<grpc::Status> finished;
+    LunaAsyncHandle handle = client.synthesizeAsync(
+        lunaTestConfig(), "hello",
+        [&finished](const grpc::Status &status, std::string &) {
+            finished.set_value(status);
+        });
+    handle.cancel();
+
+    std::future<grpc::Status> result = finished.get_future();
+    LUNA_CHECK(result.wait_for(milliseconds(2000)) ==
+               std::future_status::ready);
+    LUNA_CHECK(result.get().error_code() == grpc::StatusCode::CANCELLED);
+}
+
+void testCancelAfterFinish()
+{
+    LunaMockServer server;
+    LunaClient client(server.address(), false);
+
+    std::promise<grpc::Status> finished;
+    LunaAsyncHandle handle = client.synthesizeStreamAsync(
+        lunaTestConfig(), "hello", [](std::string &) {},
+        [&finished](const grpc::Status &status) {
+            finished.set_value(status);
+        });
+
+    LUNA_CHECK(finished.get_future().get().ok());
+    handle.cancel();
+    LUNA_CHECK(server.stats().cancellations == 0);
+}
+
+void testDestroyClientCancels()
+{
+    LunaMockServer server(slowConfig());
+    std::atomic<int> finished(0);
+    std::atomic<bool> cancelled(false);
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    {
+        LunaClient client(server.address(), false);
+        client.synthesizeStreamAsync(
+            lunaTestConfig(), std::string(1000, 'a'), [](std::string &) {},
+            [&finished, &cancelled](const grpc::Status &status) {
+                cancelled = status.error_code() == grpc::StatusCode::CANCELLED;
+                finished++;
+            });
+        client.synthesizeAsync(
+            lunaTestConfig(), std::string(1000, 'a'),
+            [&finished](const grpc::Status &, std::string &) { finished++; });
+    }
+
+    // The destructor waits for the callbacks instead of the server
+    LUNA_CHECK(finished == 2);
+    LUNA_CHECK(cancelled);
+    LUNA_CHECK(std::chrono::steady_clock::now() - start < milliseconds(5000));
+}
+
+} // namespace
+
+int main()
+{
+    const LunaTestCase tests[] = {
+        {"cancel stream", testCancelStream},
+        {"cancel batch", testCancelBatch},
+        {"cancel after finish", testCancelAfterFinish},
+        {"destroy client cancels", testDestroyClientCancels},
+    };
+    return lunaRunTests(tests, sizeof(tests) / sizeof(tests[0]));
+}
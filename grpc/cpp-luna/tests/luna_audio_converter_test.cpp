@@ -0,0 +1,219 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_audio_converter.h"
+#include "luna_test.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// Lengths that exercise the vector loops and the scalar tails of both
+// the SSE2 (4 samples) and AVX2 (8 samples) kernels.
+const size_t kCounts[] = {0, 1, 3, 4, 7, 8, 9, 15, 16, 17, 1000, 1027};
+
+// The instruction sets to compare with the scalar reference. Those the
+// CPU does not support fall back to a lesser one, which is harmless.
+const LunaAudioConverter::Isa kVectorIsas[] = {LunaAudioConverter::SSE2,
+                                               LunaAudioConverter::AVX2};
+
+// Float samples covering the full range, values that round to even, and
+// values that must saturate.
+std::vector<float> floatSamples(size_t count)
+{
+    const float special[] = {0.0f,
+                             -0.0f,
+                             1.0f,
+                             -1.0f,
+                             1.5f,
+                             -1.5f,
+                             0.5f / 32768.0f,
+                             -0.5f / 32768.0f,
+                             1.5f / 32768.0f,
+                             32767.5f / 32768.0f,
+                             100.0f,
+                             -100.0f};
+    const size_t numSpecial = sizeof(special) / sizeof(special[0]);
+
+    std::vector<float> samples(count);
+    uint32_t state = 12345;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % 5 == 0)
+        {
+            samples[i] = special[(i / 5) % numSpecial];
+            continue;
+        }
+        state = state * 1664525u + 1013904223u;
+        samples[i] = (static_cast<float>(state >> 8) / 8388608.0f) - 1.0f;
+    }
+    return samples;
+}
+
+std::vector<int16_t> int16Samples(size_t count)
+{
+    std::vector<int16_t> samples(count);
+    uint32_t state = 54321;
+    for (size_t i = 0; i < count; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        samples[i] = static_cast<int16_t>(state >> 16);
+    }
+    if (count > 0)
+    {
+        samples[0] = -32768;
+    }
+    if (count > 1)
+    {
+        samples[1] = 32767;
+    }
+    return samples;
+}
+
+bool sameBits(const std::vector<float> &a, const std::vector<float> &b)
+{
+    return a.size() == b.size() &&
+           (a.empty() ||
+            std::memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0);
+}
+
+void testFloatToInt16()
+{
+    for (LunaAudioConverter::Isa isa : kVectorIsas)
+    {
+        for (size_t count : kCounts)
+        {
+            std::vector<float> in = floatSamples(count);
+            std::vector<int16_t> expected(count), actual(count);
+            LunaAudioConverter(LunaAudioConverter::SCALAR)
+                .floatToInt16(in.data(), expected.data(), count, false);
+            LunaAudioConverter(isa).floatToInt16(in.data(), actual.data(),
+                                                 count, false);
+            LUNA_CHECK(actual == expected);
+        }
+    }
+}
+
+void testFloatToInt16Dither()
+{
+    // The dither sequences differ between kernels, but stay within the
+    // +/- 1 LSB of triangular dither of the undithered result
+    for (LunaAudioConverter::Isa isa : kVectorIsas)
+    {
+        for (size_t count : kCounts)
+        {
+            std::vector<float> in = floatSamples(count);
+            std::vector<int16_t> plain(count), dithered(count);
+            LunaAudioConverter(LunaAudioConverter::SCALAR)
+                .floatToInt16(in.data(), plain.data(), count, false);
+            LunaAudioConverter(isa).floatToInt16(in.data(), dithered.data(),
+                                                 count, true);
+            for (size_t i = 0; i < count; i++)
+            {
+                LUNA_CHECK(std::abs(dithered[i] - plain[i]) <= 2);
+            }
+        }
+    }
+}
+
+void testInt16ToFloat()
+{
+    for (LunaAudioConverter::Isa isa : kVectorIsas)
+    {
+        for (size_t count : kCounts)
+        {
+            std::vector<int16_t> in = int16Samples(count);
+            std::vector<float> expected(count), actual(count);
+            LunaAudioConverter(LunaAudioConverter::SCALAR)
+                .int16ToFloat(in.data(), expected.data(), count);
+            LunaAudioConverter(isa).int16ToFloat(in.data(), actual.data(),
+                                                 count);
+            LUNA_CHECK(sameBits(actual, expected));
+        }
+    }
+}
+
+void testGain()
+{
+    const float gains[] = {0.0f, 0.5f, 1.0f, 3.7f, -2.0f};
+    for (LunaAudioConverter::Isa isa : kVectorIsas)
+    {
+        for (size_t count : kCounts)
+        {
+            for (float gain : gains)
+            {
+                std::vector<float> expected = floatSamples(count);
+                std::vector<float> actual = expected;
+                LunaAudioConverter(LunaAudioConverter::SCALAR)
+                    .applyGain(expected.data(), count, gain);
+                LunaAudioConverter(isa).applyGain(actual.data(), count, gain);
+                LUNA_CHECK(sameBits(actual, expected));
+
+                std::vector<int16_t> expected16 = int16Samples(count);
+                std::vector<int16_t> actual16 = expected16;
+                LunaAudioConverter(LunaAudioConverter::SCALAR)
+                    .applyGain(expected16.data(), count, gain);
+                LunaAudioConverter(isa).applyGain(actual16.data(), count,
+                                                  gain);
+                LUNA_CHECK(actual16 == expected16);
+            }
+        }
+    }
+}
+
+void testPeak()
+{
+    for (LunaAudioConverter::Isa isa : kVectorIsas)
+    {
+        for (size_t count : kCounts)
+        {
+            std::vector<float> samples = floatSamples(count);
+            float expected = LunaAudioConverter(LunaAudioConverter::SCALAR)
+                                 .peak(samples.data(), count);
+            float actual = LunaAudioConverter(isa).peak(samples.data(), count);
+            LUNA_CHECK(actual == expected);
+        }
+    }
+}
+
+void testInPlace()
+{
+    // The string conversions run the kernels with overlapping input and
+    // output
+    for (LunaAudioConverter::Isa isa : kVectorIsas)
+    {
+        for (size_t count : kCounts)
+        {
+            std::vector<int16_t> samples = int16Samples(count);
+            std::string audio(reinterpret_cast<const char *>(samples.data()),
+                              count * sizeof(int16_t));
+            std::string original = audio;
+
+            LunaAudioConverter converter(isa);
+            converter.int16ToFloat(audio);
+            LUNA_CHECK(audio.size() == count * sizeof(float));
+            converter.floatToInt16(audio, false);
+            LUNA_CHECK(audio == original);
+        }
+    }
+}
+
+} // namespace
+
+int main()
+{
+    const LunaTestCase tests[] = {
+        {"float to int16", testFloatToInt16},
+        {"float to int16 with dither", testFloatToInt16Dither},
+        {"int16 to float", testInt16ToFloat},
+        {"gain", testGain},
+        {"peak", testPeak},
+        {"in place", testInPlace},
+    };
+    return lunaRunTests(tests, sizeof(tests) / sizeof(tests[0]));
+}
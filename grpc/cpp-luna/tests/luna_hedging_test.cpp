@@ -0,0 +1,188 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_client.h"
+#include "luna_client_pool.h"
+#include "luna_mock_server.h"
+#include "luna_single_flight.h"
+#include "luna_test.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using std::chrono::milliseconds;
+using Clock = std::chrono::steady_clock;
+
+// A server whose responses are too slow for any request to wait for.
+LunaMockConfig stalledConfig()
+{
+    LunaMockConfig config;
+    config.speed = 1000.0;
+    config.firstChunkDelayMs = 3000;
+    return config;
+}
+
+LunaMockConfig fastConfig()
+{
+    LunaMockConfig config;
+    config.speed = 1000.0;
+    return config;
+}
+
+// Hedge after a short, fixed delay, with budget for every request.
+LunaHedgingPolicy eagerPolicy()
+{
+    LunaHedgingPolicy policy;
+    policy.initialDelay = milliseconds(30);
+    policy.minDelay = policy.initialDelay;
+    policy.budgetBurst = 100.0;
+    return policy;
+}
+
+std::string referenceAudio(const std::string &text)
+{
+    LunaMockServer server(fastConfig());
+    LunaClient client(server.address(), false);
+    std::string audio;
+    client.synthesize(lunaTestConfig(), text, audio);
+    return audio;
+}
+
+std::string readAll(LunaSynthesizerStream &stream)
+{
+    std::string audio, chunk;
+    while (stream.receiveAudio(chunk))
+    {
+        audio.append(chunk);
+    }
+    stream.close();
+    return audio;
+}
+
+void testHedgeWinsOverStalledReplica()
+{
+    LunaMockServer stalled(stalledConfig());
+    LunaMockServer fast(fastConfig());
+    LunaClientPool pool(
+        std::vector<std::string>{stalled.address(), fast.address()}, false, 1,
+        LunaClientPool::ROUND_ROBIN);
+    pool.setHedgingPolicy(eagerPolicy());
+
+    const std::string text = "hello world";
+    const std::string reference = referenceAudio(text);
+
+    // Round robin sends every other request to the stalled replica
+    // first, and none of them waits for it
+    for (int i = 0; i < 4; i++)
+    {
+        Clock::time_point start = Clock::now();
+        std::string audio;
+        pool.synthesize(lunaTestConfig(), text, audio);
+        LUNA_CHECK(audio == reference);
+        LUNA_CHECK(Clock::now() - start < milliseconds(1500));
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        Clock::time_point start = Clock::now();
+        LunaSynthesizerStream stream =
+            pool.synthesizeStream(lunaTestConfig(), text);
+        LUNA_CHECK(readAll(stream) == reference);
+        LUNA_CHECK(Clock::now() - start < milliseconds(1500));
+    }
+
+    LunaHedgingStats stats = pool.hedgingStats();
+    LUNA_CHECK(stats.requests == 8);
+    LUNA_CHECK(stats.hedges == 4);
+    LUNA_CHECK(stats.hedgesWon == 4);
+}
+
+void testNoHedgeWithoutBudget()
+{
+    LunaMockConfig config = fastConfig();
+    config.firstChunkDelayMs = 200;
+    LunaMockServer server(config);
+    LunaClientPool pool(server.address(), false, 2);
+
+    LunaHedgingPolicy policy = eagerPolicy();
+    policy.budgetBurst = 0.0;
+    policy.budgetRatio = 0.0;
+    pool.setHedgingPolicy(policy);
+
+    std::string audio;
+    pool.synthesize(lunaTestConfig(), "hello", audio);
+    LUNA_CHECK(audio == referenceAudio("hello"));
+
+    LunaHedgingStats stats = pool.hedgingStats();
+    LUNA_CHECK(stats.hedges == 0);
+    LUNA_CHECK(stats.budgetExhausted == 1);
+    LUNA_CHECK(server.stats().synthesizeCalls == 1);
+}
+
+void testHedgeSkipsSingleFlight()
+{
+    // With a shared single-flight, the hedge must still send its own call
+    // rather than join the one it is hedging.
+    LunaMockConfig config = fastConfig();
+    config.firstChunkDelayMs = 300;
+    LunaMockServer server(config);
+    LunaClientPool pool(server.address(), false, 2);
+    pool.setSingleFlight(std::make_shared<LunaSingleFlight>());
+    pool.setHedgingPolicy(eagerPolicy());
+
+    LunaSynthesizerStream stream =
+        pool.synthesizeStream(lunaTestConfig(), "hello there");
+    LUNA_CHECK(readAll(stream) == referenceAudio("hello there"));
+    LUNA_CHECK(server.stats().streamCalls == 2);
+
+    std::string audio;
+    pool.synthesize(lunaTestConfig(), "general kenobi", audio);
+    LUNA_CHECK(audio == referenceAudio("general kenobi"));
+    LUNA_CHECK(server.stats().synthesizeCalls == 2);
+}
+
+void testCancelHedgedStream()
+{
+    LunaMockServer first(stalledConfig());
+    LunaMockServer second(stalledConfig());
+    LunaClientPool pool(
+        std::vector<std::string>{first.address(), second.address()}, false, 1,
+        LunaClientPool::ROUND_ROBIN);
+    pool.setHedgingPolicy(eagerPolicy());
+
+    LunaSynthesizerStream stream =
+        pool.synthesizeStream(lunaTestConfig(), "hello");
+    std::thread canceller([&stream]() {
+        std::this_thread::sleep_for(milliseconds(100));
+        stream.cancel();
+    });
+
+    Clock::time_point start = Clock::now();
+    std::string chunk;
+    while (stream.receiveAudio(chunk))
+    {
+    }
+    canceller.join();
+    LUNA_CHECK(Clock::now() - start < milliseconds(1500));
+    LUNA_CHECK(stream.cancelled());
+
+    // A cancelled stream closes without an error
+    stream.close();
+}
+
+} // namespace
+
+int main()
+{
+    const LunaTestCase tests[] = {
+        {"hedge wins over stalled replica", testHedgeWinsOverStalledReplica},
+        {"no hedge without budget", testNoHedgeWithoutBudget},
+        {"hedge skips single-flight", testHedgeSkipsSingleFlight},
+        {"cancel hedged stream", testCancelHedgedStream},
+    };
+    return lunaRunTests(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,169 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_client.h"
+#include "luna_mock_server.h"
+#include "luna_ordered_reader.h"
+#include "luna_test.h"
+#include "luna_text_segmenter.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using std::chrono::milliseconds;
+using Clock = std::chrono::steady_clock;
+
+LunaMockConfig serverConfig()
+{
+    LunaMockConfig config;
+    config.speed = 50.0;
+    return config;
+}
+
+// The audio of each segment synthesized on its own, one after another.
+std::string serialAudio(LunaClient &client,
+                        const std::vector<std::string> &segments)
+{
+    std::string audio;
+    for (const std::string &segment : segments)
+    {
+        std::string part;
+        client.synthesize(lunaTestConfig(), segment, part);
+        audio.append(part);
+    }
+    return audio;
+}
+
+std::string readAll(LunaOrderedReader &reader)
+{
+    std::string audio;
+    cobaltspeech::luna::SynthesizeResponse response;
+    while (reader.Read(&response))
+    {
+        audio.append(response.audio());
+    }
+    return audio;
+}
+
+void testOutOfOrderCompletion()
+{
+    LunaMockServer server(serverConfig());
+    LunaClient client(server.address(), false);
+
+    // The later segments are shorter, so they finish first
+    std::vector<std::string> segments;
+    segments.push_back(std::string(120, 'a'));
+    segments.push_back(std::string(60, 'b'));
+    segments.push_back(std::string(20, 'c'));
+    segments.push_back(std::string(5, 'd'));
+
+    LunaOrderedReader reader(
+        [&client](const std::string &text, const LunaAudioCallback &onAudio,
+                  const LunaFinishCallback &onFinish) {
+            return client.synthesizeStreamAsync(lunaTestConfig(), text,
+                                                onAudio, onFinish);
+        },
+        4);
+    for (const std::string &segment : segments)
+    {
+        reader.addSegment(segment);
+    }
+    reader.finishSegments();
+
+    LUNA_CHECK(readAll(reader) == serialAudio(client, segments));
+    LUNA_CHECK(reader.Finish().ok());
+}
+
+void testParallelStreamMatchesSerial()
+{
+    LunaMockServer server(serverConfig());
+    LunaClient client(server.address(), false);
+
+    std::string text;
+    for (int i = 0; i < 8; i++)
+    {
+        text += "Sentence number " + std::to_string(i) + " is here. ";
+    }
+
+    LunaSynthesizerStream stream =
+        client.synthesizeStreamParallel(lunaTestConfig(), text, 3);
+    std::string audio, chunk;
+    while (stream.receiveAudio(chunk))
+    {
+        audio.append(chunk);
+    }
+    stream.close();
+
+    LUNA_CHECK(audio == serialAudio(client, LunaTextSegmenter::split(text)));
+}
+
+void testFailureStopsStream()
+{
+    LunaMockConfig config;
+    config.speed = 1.0;
+    LunaMockServer server(config);
+    LunaClient client(server.address(), false);
+
+    cobaltspeech::luna::SynthesizerConfig unknown = lunaTestConfig();
+    unknown.set_voice_id("unknown");
+
+    // The first segment fails while the slow ones after it are running
+    LunaOrderedReader reader(
+        [&client, &unknown](const std::string &text,
+                            const LunaAudioCallback &onAudio,
+                            const LunaFinishCallback &onFinish) {
+            return client.synthesizeStreamAsync(
+                text == "fail" ? unknown : lunaTestConfig(), text, onAudio,
+                onFinish);
+        },
+        3);
+    reader.addSegment("fail");
+    reader.addSegment(std::string(300, 'b'));
+    reader.addSegment(std::string(300, 'c'));
+    reader.finishSegments();
+
+    Clock::time_point start = Clock::now();
+    readAll(reader);
+    LUNA_CHECK(reader.Finish().error_code() == grpc::StatusCode::NOT_FOUND);
+    LUNA_CHECK(Clock::now() - start < milliseconds(2000));
+}
+
+void testCancel()
+{
+    LunaMockConfig config;
+    config.speed = 1.0;
+    LunaMockServer server(config);
+    LunaClient client(server.address(), false);
+
+    LunaOrderedReader reader(
+        [&client](const std::string &text, const LunaAudioCallback &onAudio,
+                  const LunaFinishCallback &onFinish) {
+            return client.synthesizeStreamAsync(lunaTestConfig(), text,
+                                                onAudio, onFinish);
+        },
+        2);
+    reader.addSegment(std::string(300, 'a'));
+    reader.addSegment(std::string(300, 'b'));
+
+    cobaltspeech::luna::SynthesizeResponse response;
+    LUNA_CHECK(reader.Read(&response));
+    reader.cancel();
+    LUNA_CHECK(!reader.Read(&response));
+    LUNA_CHECK(reader.Finish().error_code() == grpc::StatusCode::CANCELLED);
+}
+
+} // namespace
+
+int main()
+{
+    const LunaTestCase tests[] = {
+        {"out of order completion", testOutOfOrderCompletion},
+        {"parallel stream matches serial", testParallelStreamMatchesSerial},
+        {"failure stops stream", testFailureStopsStream},
+        {"cancel", testCancel},
+    };
+    return lunaRunTests(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,188 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#include "luna_client.h"
+#include "luna_exception.h"
+#include "luna_mock_server.h"
+#include "luna_single_flight.h"
+#include "luna_test.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using std::chrono::milliseconds;
+
+// Streams last long enough for the other requests to join them.
+LunaMockConfig serverConfig()
+{
+    LunaMockConfig config;
+    config.speed = 10.0;
+    return config;
+}
+
+std::string referenceAudio(LunaMockServer &server, const std::string &text)
+{
+    LunaClient client(server.address(), false);
+    std::string audio;
+    client.synthesize(lunaTestConfig(), text, audio);
+    return audio;
+}
+
+void testConcurrentStreamsShareCall()
+{
+    LunaMockServer server(serverConfig());
+    const std::string text(100, 'a');
+    const std::string reference = referenceAudio(server, text);
+
+    std::shared_ptr<LunaSingleFlight> flights =
+        std::make_shared<LunaSingleFlight>();
+    LunaClient client(server.address(), false);
+    client.setSingleFlight(flights);
+    LunaMockStats before = server.stats();
+
+    // Later streams join while the first is running, and replay the
+    // chunks they missed
+    std::atomic<int> good(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++)
+    {
+        threads.emplace_back([&client, &text, &reference, &good, i]() {
+            std::this_thread::sleep_for(milliseconds(i * 20));
+            LunaSynthesizerStream stream =
+                client.synthesizeStream(lunaTestConfig(), text);
+            std::string audio, chunk;
+            while (stream.receiveAudio(chunk))
+            {
+                audio.append(chunk);
+            }
+            stream.close();
+            if (audio == reference)
+            {
+                good++;
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    LUNA_CHECK(good == 8);
+    LUNA_CHECK(server.stats().streamCalls - before.streamCalls == 1);
+    LUNA_CHECK(flights->stats().flights == 1);
+    LUNA_CHECK(flights->stats().joined == 7);
+    LUNA_CHECK(flights->stats().inFlight == 0);
+}
+
+void testLeavingSubscriberKeepsCall()
+{
+    LunaMockServer server(serverConfig());
+    const std::string text(100, 'b');
+    const std::string reference = referenceAudio(server, text);
+
+    LunaClient client(server.address(), false);
+    client.setSingleFlight(std::make_shared<LunaSingleFlight>());
+
+    std::promise<std::string> kept;
+    std::shared_ptr<std::string> audio = std::make_shared<std::string>();
+    client.synthesizeStreamAsync(
+        lunaTestConfig(), text,
+        [audio](std::string &chunk) { audio->append(chunk); },
+        [audio, &kept](const grpc::Status &status) {
+            kept.set_value(status.ok() ? *audio : "failed");
+        });
+
+    std::promise<grpc::Status> left;
+    LunaAsyncHandle handle = client.synthesizeStreamAsync(
+        lunaTestConfig(), text, [](std::string &) {},
+        [&left](const grpc::Status &status) { left.set_value(status); });
+    handle.cancel();
+
+    LUNA_CHECK(left.get_future().get().error_code() ==
+               grpc::StatusCode::CANCELLED);
+    LUNA_CHECK(kept.get_future().get() == reference);
+}
+
+void testLastSubscriberCancelsCall()
+{
+    LunaMockConfig config;
+    config.speed = 1.0;
+    LunaMockServer server(config);
+
+    std::shared_ptr<LunaSingleFlight> flights =
+        std::make_shared<LunaSingleFlight>();
+    LunaClient client(server.address(), false);
+    client.setSingleFlight(flights);
+
+    LunaSynthesizerStream stream =
+        client.synthesizeStream(lunaTestConfig(), std::string(400, 'c'));
+    std::string chunk;
+    LUNA_CHECK(stream.receiveAudio(chunk));
+    stream.cancel();
+    stream.close();
+
+    LUNA_CHECK(lunaWaitFor(
+        [&flights]() { return flights->stats().inFlight == 0; },
+        milliseconds(2000)));
+    LUNA_CHECK(flights->stats().abandoned == 1);
+    LUNA_CHECK(lunaWaitFor(
+        [&server]() { return server.stats().cancellations == 1; },
+        milliseconds(2000)));
+}
+
+void testErrorIsShared()
+{
+    LunaMockConfig config = serverConfig();
+    config.firstChunkDelayMs = 200;
+    LunaMockServer server(config);
+
+    LunaClient client(server.address(), false);
+    client.setSingleFlight(std::make_shared<LunaSingleFlight>());
+
+    cobaltspeech::luna::SynthesizerConfig unknown = lunaTestConfig();
+    unknown.set_voice_id("unknown");
+
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+    {
+        threads.emplace_back([&client, &unknown, &failed]() {
+            try
+            {
+                std::string audio;
+                client.synthesize(unknown, "hello", audio);
+            }
+            catch (const LunaException &)
+            {
+                failed++;
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    LUNA_CHECK(failed == 4);
+    LUNA_CHECK(server.stats().synthesizeCalls < 4);
+}
+
+} // namespace
+
+int main()
+{
+    const LunaTestCase tests[] = {
+        {"concurrent streams share call", testConcurrentStreamsShareCall},
+        {"leaving subscriber keeps call", testLeavingSubscriberKeepsCall},
+        {"last subscriber cancels call", testLastSubscriberCancelsCall},
+        {"error is shared", testErrorIsShared},
+    };
+    return lunaRunTests(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,95 @@
+// Copyright (2021) Cobalt Speech and Language, Inc.
+
+#ifndef LUNA_TEST_H
+#define LUNA_TEST_H
+
+#include "luna.pb.h"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+//! LunaTestFailure is thrown by LUNA_CHECK when a check fails.
+class LunaTestFailure : public std::runtime_error
+{
+public:
+    LunaTestFailure(const char *file, int line, const char *expr)
+        : std::runtime_error(std::string(file) + ":" + std::to_string(line) +
+                             ": check failed: " + expr)
+    {
+    }
+};
+
+//! Fail the current test if the condition is false. Unlike assert(), the
+//! check is made in release builds too.
+#define LUNA_CHECK(cond)                                                       \
+    do                                                                         \
+    {                                                                          \
+        if (!(cond))                                                           \
+        {                                                                      \
+            throw LunaTestFailure(__FILE__, __LINE__, #cond);                  \
+        }                                                                      \
+    } while (0)
+
+//! LunaTestCase is one named test in a test executable.
+struct LunaTestCase
+{
+    const char *name;
+    void (*run)();
+};
+
+//! Run each test, reporting the ones that fail. Returns the exit code of
+//! the test executable.
+inline int lunaRunTests(const LunaTestCase *tests, size_t count)
+{
+    int failed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        try
+        {
+            tests[i].run();
+            std::cout << "PASS " << tests[i].name << std::endl;
+        }
+        catch (const std::exception &err)
+        {
+            std::cout << "FAIL " << tests[i].name << ": " << err.what()
+                      << std::endl;
+            failed++;
+        }
+    }
+
+    return failed == 0 ? 0 : 1;
+}
+
+//! Wait up to the given time for the condition to become true. Returns
+//! the last value of the condition.
+inline bool lunaWaitFor(const std::function<bool()> &cond,
+                        std::chrono::milliseconds timeout)
+{
+    std::chrono::steady_clock::time_point end =
+        std::chrono::steady_clock::now() + timeout;
+    while (!cond())
+    {
+        if (std::chrono::steady_clock::now() >= end)
+        {
+            return cond();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+//! Returns a config for the mock server's voice.
+inline cobaltspeech::luna::SynthesizerConfig lunaTestConfig()
+{
+    cobaltspeech::luna::SynthesizerConfig config;
+    config.set_voice_id("mock");
+    config.set_n_samples(800);
+    return config;
+}
+
+#endif // LUNA_TEST_H